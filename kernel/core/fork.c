@@ -0,0 +1,603 @@
+/*
+ * MicroKernel Process Creation
+ *
+ * fork, and the dedicated slab caches for task_struct and mm_struct and
+ * per-CPU cache of recently freed kernel stacks behind it, so that
+ * creating and tearing down a process does not go through the generic
+ * kmalloc path. The child's address space is a copy-on-write copy of
+ * the parent's: no page is copied until one side writes to it.
+ */
+
+#include "../include/sched.h"
+#include "../include/hugetlb.h"
+#include "../include/vmacache.h"
+#include "../include/mm.h"
+#include "../include/slab.h"
+#include "../include/types.h"
+#include "../include/list.h"
+#include "../include/spinlock.h"
+
+/* External declarations */
+extern int printk(const char *fmt, ...);
+extern u64 get_jiffies_64(void);
+
+/* Object caches */
+static struct kmem_cache *task_struct_cachep;
+static struct kmem_cache *mm_cachep;
+
+/*
+ * Per-CPU cache of freed kernel stacks. A stack is an order-2 buddy
+ * block; keeping a couple around skips the page allocator entirely
+ * for back-to-back exit/fork.
+ */
+struct stack_cache {
+    void *stacks[NR_CACHED_STACKS];
+    int nr;
+
+    /* Statistics */
+    unsigned long hits;
+    unsigned long misses;
+};
+
+static struct stack_cache cached_stacks[NR_CPUS];
+
+#define PID_MAX     32768
+
+static pid_t next_pid = 2;
+
+static pid_t alloc_pid(void)
+{
+    pid_t pid = __sync_fetch_and_add(&next_pid, 1);
+
+    if (pid >= PID_MAX) {
+        next_pid = 2;
+        pid = __sync_fetch_and_add(&next_pid, 1);
+    }
+
+    return pid;
+}
+
+/*
+ * mm_struct constructor. An mm that has been torn down has no VMAs and
+ * unlocked locks, so these fields stay valid across free/alloc and are
+ * set up only once per slab object.
+ */
+static void mm_struct_ctor(void *object)
+{
+    struct mm_struct *mm = object;
+
+    memset(mm, 0, sizeof(*mm));
+    mt_init(&mm->mm_mt);
+    spin_lock_init(&mm->page_table_lock);
+    spin_lock_init(&mm->mmap_lock);
+}
+
+/*
+ * Bring a task_struct to its initial state
+ */
+static void task_struct_init(struct task_struct *tsk)
+{
+    memset(tsk, 0, sizeof(*tsk));
+
+    tsk->state = TASK_RUNNING;
+    tsk->exit_signal = SIGCHLD;
+
+    tsk->prio = DEFAULT_PRIO;
+    tsk->static_prio = DEFAULT_PRIO;
+    tsk->normal_prio = DEFAULT_PRIO;
+    tsk->policy = SCHED_NORMAL;
+
+    INIT_LIST_HEAD(&tsk->children);
+    INIT_LIST_HEAD(&tsk->sibling);
+    INIT_LIST_HEAD(&tsk->tasks);
+    INIT_LIST_HEAD(&tsk->run_list);
+    INIT_LIST_HEAD(&tsk->se.group_node);
+    INIT_LIST_HEAD(&tsk->rt.run_list);
+    INIT_LIST_HEAD(&tsk->pending.list);
+
+    tsk->group_leader = tsk;
+}
+
+/*
+ * Allocate a kernel stack, preferring this CPU's recently freed ones
+ */
+void *alloc_thread_stack(void)
+{
+    struct stack_cache *sc;
+    unsigned long flags;
+    void *stack = NULL;
+
+    flags = local_irq_save();
+
+    sc = &cached_stacks[smp_processor_id()];
+    if (sc->nr > 0) {
+        stack = sc->stacks[--sc->nr];
+        sc->hits++;
+    } else {
+        sc->misses++;
+    }
+
+    local_irq_restore(flags);
+
+    if (stack == NULL)
+        stack = (void *)__get_free_pages(GFP_KERNEL, THREAD_SIZE_ORDER);
+
+    return stack;
+}
+
+void free_thread_stack(void *stack)
+{
+    struct stack_cache *sc;
+    unsigned long flags;
+
+    if (stack == NULL)
+        return;
+
+    flags = local_irq_save();
+
+    sc = &cached_stacks[smp_processor_id()];
+    if (sc->nr < NR_CACHED_STACKS) {
+        sc->stacks[sc->nr++] = stack;
+        local_irq_restore(flags);
+        return;
+    }
+
+    local_irq_restore(flags);
+
+    free_pages_virt((unsigned long)stack, THREAD_SIZE_ORDER);
+}
+
+/*
+ * Allocate a fresh task with its kernel stack
+ */
+struct task_struct *alloc_task_struct(void)
+{
+    struct task_struct *tsk;
+
+    if (task_struct_cachep == NULL)
+        return NULL;
+
+    tsk = kmem_cache_alloc(task_struct_cachep, GFP_KERNEL);
+    if (tsk == NULL)
+        return NULL;
+
+    /* Recycled objects still carry the previous task's state */
+    task_struct_init(tsk);
+
+    tsk->stack = alloc_thread_stack();
+    if (tsk->stack == NULL) {
+        kmem_cache_free(task_struct_cachep, tsk);
+        return NULL;
+    }
+
+    tsk->pid = alloc_pid();
+    tsk->tgid = tsk->pid;
+
+    return tsk;
+}
+
+void free_task_struct(struct task_struct *tsk)
+{
+    if (tsk == NULL)
+        return;
+
+    free_thread_stack(tsk->stack);
+    kmem_cache_free(task_struct_cachep, tsk);
+}
+
+/*
+ * Duplicate a task for fork. The copy overwrites the whole object, so
+ * the recycled slab object is never zeroed.
+ */
+struct task_struct *dup_task_struct(struct task_struct *orig)
+{
+    struct task_struct *tsk;
+    void *stack;
+
+    if (task_struct_cachep == NULL)
+        return NULL;
+
+    tsk = kmem_cache_alloc(task_struct_cachep, GFP_KERNEL);
+    if (tsk == NULL)
+        return NULL;
+
+    stack = alloc_thread_stack();
+    if (stack == NULL) {
+        kmem_cache_free(task_struct_cachep, tsk);
+        return NULL;
+    }
+
+    *tsk = *orig;
+    tsk->stack = stack;
+
+    tsk->pid = alloc_pid();
+    tsk->tgid = tsk->pid;
+    tsk->state = TASK_RUNNING;
+    tsk->exit_state = 0;
+    tsk->exit_code = 0;
+
+    INIT_LIST_HEAD(&tsk->children);
+    INIT_LIST_HEAD(&tsk->sibling);
+    INIT_LIST_HEAD(&tsk->tasks);
+    INIT_LIST_HEAD(&tsk->run_list);
+    INIT_LIST_HEAD(&tsk->se.group_node);
+    INIT_LIST_HEAD(&tsk->rt.run_list);
+    INIT_LIST_HEAD(&tsk->pending.list);
+    tsk->se.on_rq = 0;
+    tsk->rt.on_rq = 0;
+    tsk->rt.on_list = 0;
+
+    tsk->utime = 0;
+    tsk->stime = 0;
+    tsk->start_time = get_jiffies_64();
+    tsk->real_start_time = tsk->start_time;
+
+    tsk->min_flt = 0;
+    tsk->maj_flt = 0;
+    tsk->nvcsw = 0;
+    tsk->nivcsw = 0;
+
+    tsk->se.exec_start = 0;
+    tsk->se.sum_exec_runtime = 0;
+    tsk->se.prev_sum_exec_runtime = 0;
+    tsk->se.nr_migrations = 0;
+
+    return tsk;
+}
+
+/*
+ * Allocate an empty address space
+ */
+struct mm_struct *mm_alloc(void)
+{
+    struct mm_struct *mm;
+
+    if (mm_cachep == NULL)
+        return NULL;
+
+    mm = kmem_cache_alloc(mm_cachep, GFP_KERNEL);
+    if (mm == NULL)
+        return NULL;
+
+    mm->mm_users = 1;
+    mm->mm_count = 1;
+    mm->pgd = 0;
+    mm->task_size = USER_VIRTUAL_END;
+    mm->mmap_base = ALIGN_DOWN(USER_VIRTUAL_END / 3, PAGE_SIZE);
+    mm->highest_vm_end = 0;
+
+    return mm;
+}
+
+void mm_free(struct mm_struct *mm)
+{
+    if (mm == NULL)
+        return;
+
+    exit_mmap(mm);
+
+    mm->map_count = 0;
+    mm->total_vm = 0;
+    mm->locked_vm = 0;
+    mm->pinned_vm = 0;
+    mm->def_flags = 0;
+    mm->data_vm = 0;
+    mm->exec_vm = 0;
+    mm->stack_vm = 0;
+    mm->start_brk = 0;
+    mm->brk = 0;
+
+    kmem_cache_free(mm_cachep, mm);
+}
+
+void mmput(struct mm_struct *mm)
+{
+    if (mm && --mm->mm_users == 0)
+        mm_free(mm);
+}
+
+/*
+ * Copy of an address space for a forked child. Locked memory is not
+ * inherited.
+ */
+static struct mm_struct *dup_mm(struct mm_struct *oldmm)
+{
+    struct mm_struct *mm;
+
+    mm = mm_alloc();
+    if (mm == NULL)
+        return NULL;
+
+    mm->mmap_base = oldmm->mmap_base;
+    mm->task_size = oldmm->task_size;
+    mm->total_vm = oldmm->total_vm;
+    mm->pinned_vm = oldmm->pinned_vm;
+    mm->data_vm = oldmm->data_vm;
+    mm->exec_vm = oldmm->exec_vm;
+    mm->stack_vm = oldmm->stack_vm;
+    mm->start_code = oldmm->start_code;
+    mm->end_code = oldmm->end_code;
+    mm->start_data = oldmm->start_data;
+    mm->end_data = oldmm->end_data;
+    mm->start_brk = oldmm->start_brk;
+    mm->brk = oldmm->brk;
+    mm->start_stack = oldmm->start_stack;
+    mm->arg_start = oldmm->arg_start;
+    mm->arg_end = oldmm->arg_end;
+    mm->env_start = oldmm->env_start;
+    mm->env_end = oldmm->env_end;
+
+    if (dup_mmap(mm, oldmm) < 0) {
+        mm_free(mm);
+        return NULL;
+    }
+
+    return mm;
+}
+
+static int copy_mm(unsigned long clone_flags, struct task_struct *tsk)
+{
+    struct mm_struct *oldmm = current->mm, *mm;
+
+    tsk->mm = NULL;
+    tsk->active_mm = NULL;
+
+    /* The copied cache points into the parent's VMAs */
+    vmacache_flush(tsk);
+
+    /* Kernel threads have no address space of their own */
+    if (oldmm == NULL)
+        return 0;
+
+    if (clone_flags & CLONE_VM) {
+        oldmm->mm_users++;
+        mm = oldmm;
+    } else {
+        mm = dup_mm(oldmm);
+        if (mm == NULL)
+            return -ENOMEM;
+    }
+
+    tsk->mm = mm;
+    tsk->active_mm = mm;
+    return 0;
+}
+
+/*
+ * New task copied from current, not yet runnable
+ */
+static struct task_struct *copy_process(unsigned long clone_flags)
+{
+    struct task_struct *p;
+
+    p = dup_task_struct(current);
+    if (p == NULL)
+        return NULL;
+
+    if (copy_mm(clone_flags, p) < 0) {
+        free_task_struct(p);
+        return NULL;
+    }
+
+    p->exit_signal = clone_flags & CSIGNAL;
+    p->real_parent = current;
+    p->parent = current;
+    p->ppid = current->pid;
+    list_add_tail(&p->sibling, &current->children);
+
+    return p;
+}
+
+/* Undo copy_process for a child that never ran */
+static void release_task(struct task_struct *p)
+{
+    list_del(&p->sibling);
+    mmput(p->mm);
+    free_task_struct(p);
+}
+
+long do_fork(unsigned long clone_flags, unsigned long stack_start,
+             unsigned long stack_size, int __user *parent_tidptr,
+             int __user *child_tidptr)
+{
+    struct task_struct *p;
+
+    (void)stack_start;
+    (void)stack_size;
+
+    if (current == NULL)
+        return -EINVAL;
+
+    p = copy_process(clone_flags);
+    if (p == NULL)
+        return -ENOMEM;
+
+    if ((clone_flags & CLONE_PARENT_SETTID) && parent_tidptr)
+        copy_to_user(parent_tidptr, &p->pid, sizeof(p->pid));
+    if ((clone_flags & CLONE_CHILD_SETTID) && child_tidptr)
+        copy_to_user(child_tidptr, &p->pid, sizeof(p->pid));
+
+    sched_fork(p);
+    wake_up_new_task(p);
+
+    return p->pid;
+}
+
+/*
+ * Create the process caches
+ */
+void fork_init(void)
+{
+    task_struct_cachep = kmem_cache_create("task_struct",
+                                           sizeof(struct task_struct), 0,
+                                           SLAB_HWCACHE_ALIGN, NULL);
+
+    mm_cachep = kmem_cache_create("mm_struct", sizeof(struct mm_struct), 0,
+                                  SLAB_HWCACHE_ALIGN, mm_struct_ctor);
+
+    if (task_struct_cachep == NULL || mm_cachep == NULL) {
+        printk("Warning: process caches not created (no memory)\n");
+        return;
+    }
+
+    printk("Process caches initialized (task_struct %lu, mm_struct %lu bytes)\n",
+           (unsigned long)sizeof(struct task_struct),
+           (unsigned long)sizeof(struct mm_struct));
+}
+
+/*
+ * Fork/exit microbenchmark: create and tear down a task, kernel stack
+ * and mm the way fork and exit do, first through the caches and then
+ * through plain kmalloc for comparison.
+ */
+void bench_fork_exit(unsigned long iterations)
+{
+    struct task_struct *parent = current;
+    struct task_struct *tsk;
+    struct mm_struct *mm;
+    struct stack_cache *sc = &cached_stacks[smp_processor_id()];
+    unsigned long hits = sc->hits, misses = sc->misses;
+    unsigned long i, done;
+    u64 start, cached, plain;
+    void *stack;
+
+    if (parent == NULL || iterations == 0)
+        return;
+
+    start = rdtsc();
+    for (done = 0; done < iterations; done++) {
+        tsk = dup_task_struct(parent);
+        if (tsk == NULL)
+            break;
+
+        mm = mm_alloc();
+        if (mm == NULL) {
+            free_task_struct(tsk);
+            break;
+        }
+
+        tsk->mm = mm;
+        tsk->active_mm = mm;
+
+        mm_free(tsk->mm);
+        free_task_struct(tsk);
+    }
+    cached = rdtsc() - start;
+
+    if (done < iterations) {
+        printk("fork-exit: allocation failed after %lu iterations\n", done);
+        return;
+    }
+
+    start = rdtsc();
+    for (i = 0; i < iterations; i++) {
+        tsk = kzalloc(sizeof(*tsk), GFP_KERNEL);
+        stack = kmalloc(THREAD_SIZE, GFP_KERNEL);
+        mm = kzalloc(sizeof(*mm), GFP_KERNEL);
+
+        if (tsk && stack && mm) {
+            *tsk = *parent;
+            tsk->stack = stack;
+            tsk->mm = mm;
+        }
+
+        kfree(mm);
+        kfree(stack);
+        kfree(tsk);
+    }
+    plain = rdtsc() - start;
+
+    printk("fork-exit: %lu iterations\n", iterations);
+    printk("  object caches: %lu cycles/iter (stack cache %lu hits, %lu misses)\n",
+           (unsigned long)(cached / iterations),
+           sc->hits - hits, sc->misses - misses);
+    printk("  kmalloc:       %lu cycles/iter\n",
+           (unsigned long)(plain / iterations));
+}
+
+/*
+ * fork+exec benchmark
+ *
+ * The parent maps and writes mb MB, then forks a child that execs right
+ * away, which is what most forks are for. exec is modelled as swapping
+ * in an empty mm; the parent then writes its memory again, finding
+ * every page write-protected by the fork but its own again. For
+ * comparison the child writes everything instead of exec'ing: the
+ * copying an eager fork would do up front.
+ */
+#define FORK_EXEC_ITERATIONS    16
+
+void bench_fork_exec(unsigned long mb)
+{
+    struct task_struct *parent = current, *child;
+    unsigned long len = mb << 20, pages = len >> PAGE_SHIFT;
+    unsigned long copied, reused, c0, r0, i;
+    int saved_thp = transparent_hugepage;
+    u64 start, fork = 0, exec = 0, rewrite = 0, copy;
+    struct mm_struct *mm;
+    long addr;
+
+    if (parent == NULL || parent->mm == NULL) {
+        printk("bench forkexec: no address space\n");
+        return;
+    }
+
+    /* 4KB pages, so that each write fault is one page */
+    transparent_hugepage = THP_NEVER;
+
+    addr = vm_mmap(parent->mm, 0, len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS);
+    if (addr < 0) {
+        printk("bench forkexec: mmap failed (%ld)\n", addr);
+        goto out;
+    }
+    touch_user_range(parent, addr, len, true);
+
+    cow_stats(&c0, &r0);
+    for (i = 0; i < FORK_EXEC_ITERATIONS; i++) {
+        start = rdtsc();
+        child = copy_process(SIGCHLD);
+        fork += rdtsc() - start;
+        if (child == NULL) {
+            printk("bench forkexec: fork failed\n");
+            goto unmap;
+        }
+
+        start = rdtsc();
+        mm = mm_alloc();
+        mmput(child->mm);
+        child->mm = mm;
+        child->active_mm = mm;
+        vmacache_flush(child);
+        exec += rdtsc() - start;
+
+        release_task(child);
+
+        rewrite += touch_user_range(parent, addr, len, true);
+    }
+    cow_stats(&copied, &reused);
+
+    printk("fork+exec with %lu MB written, %d iterations:\n",
+           mb, FORK_EXEC_ITERATIONS);
+    printk("  fork %lu us, exec %lu us\n",
+           (unsigned long)tsc_to_us(fork / FORK_EXEC_ITERATIONS),
+           (unsigned long)tsc_to_us(exec / FORK_EXEC_ITERATIONS));
+    printk("  parent rewrite: %lu cycles/page, %lu copied, %lu reused\n",
+           (unsigned long)(rewrite / (pages * FORK_EXEC_ITERATIONS)),
+           copied - c0, reused - r0);
+
+    child = copy_process(SIGCHLD);
+    if (child) {
+        cow_stats(&c0, &r0);
+        copy = touch_user_range(child, addr, len, true);
+        cow_stats(&copied, &reused);
+        printk("  child writes all instead: %lu us, %lu copied\n",
+               (unsigned long)tsc_to_us(copy), copied - c0);
+        release_task(child);
+    }
+
+unmap:
+    vm_munmap(parent->mm, addr, len);
+out:
+    transparent_hugepage = saved_thp;
+}
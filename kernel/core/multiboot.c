@@ -0,0 +1,289 @@
+/*
+ * MicroKernel Boot Information Parsing
+ *
+ * Reads the memory map and command line handed over by a Multiboot1
+ * (QEMU -kernel) or Multiboot2 (GRUB2) loader, registers usable RAM
+ * with memblock and reserves the memory the kernel already occupies.
+ */
+
+#include "../include/multiboot.h"
+#include "../include/memblock.h"
+#include "../include/mm.h"
+#include "../include/types.h"
+
+/* External declarations */
+extern int printk(const char *fmt, ...);
+extern size_t strlen(const char *s);
+
+/* Kernel image bounds from the linker script (physical addresses) */
+extern char __kernel_start[];
+extern char __kernel_end[];
+
+/* Low memory: real-mode IVT, BIOS data, EBDA, VGA and option ROMs */
+#define LOW_MEMORY_END      0x100000UL
+
+char boot_command_line[COMMAND_LINE_SIZE];
+
+static const char *memory_type_name(u32 type)
+{
+    switch (type) {
+    case MULTIBOOT_MEMORY_AVAILABLE:
+        return "usable";
+    case MULTIBOOT_MEMORY_ACPI:
+        return "ACPI data";
+    case MULTIBOOT_MEMORY_NVS:
+        return "ACPI NVS";
+    case MULTIBOOT_MEMORY_BADRAM:
+        return "unusable";
+    default:
+        return "reserved";
+    }
+}
+
+static void add_memory_region(u64 addr, u64 len, u32 type)
+{
+    if (len == 0)
+        return;
+
+    printk("  [mem 0x%lx-0x%lx] %s\n", (unsigned long)addr,
+           (unsigned long)(addr + len - 1), memory_type_name(type));
+
+    if (type == MULTIBOOT_MEMORY_AVAILABLE)
+        memblock_add(addr, len);
+}
+
+static void copy_command_line(const char *src)
+{
+    size_t i;
+
+    for (i = 0; i < COMMAND_LINE_SIZE - 1 && src[i]; i++)
+        boot_command_line[i] = src[i];
+    boot_command_line[i] = '\0';
+}
+
+/*
+ * Boot loader structures live in low memory, which boot.S maps
+ */
+static const void *boot_ptr(unsigned long phys)
+{
+    if (phys == 0 || phys >= BOOT_DIRECT_MAP_SIZE)
+        return NULL;
+
+    return __va(phys);
+}
+
+static int parse_multiboot1(const struct multiboot_info *mbi)
+{
+    unsigned long addr, end;
+    const struct multiboot_mmap_entry *entry;
+    const char *cmdline;
+
+    if ((mbi->flags & MULTIBOOT_INFO_CMDLINE) &&
+        (cmdline = boot_ptr(mbi->cmdline)) != NULL)
+        copy_command_line(cmdline);
+
+    if (mbi->flags & MULTIBOOT_INFO_MEM_MAP) {
+        addr = mbi->mmap_addr;
+        end = addr + mbi->mmap_length;
+
+        while (addr < end) {
+            entry = boot_ptr(addr);
+            if (entry == NULL)
+                break;
+            add_memory_region(entry->addr, entry->len, entry->type);
+            addr += entry->size + sizeof(entry->size);
+        }
+        return 0;
+    }
+
+    if (mbi->flags & MULTIBOOT_INFO_MEMORY) {
+        add_memory_region(0, (u64)mbi->mem_lower << 10,
+                          MULTIBOOT_MEMORY_AVAILABLE);
+        add_memory_region(LOW_MEMORY_END, (u64)mbi->mem_upper << 10,
+                          MULTIBOOT_MEMORY_AVAILABLE);
+        return 0;
+    }
+
+    return -EINVAL;
+}
+
+static int parse_multiboot2(const struct multiboot2_info *mbi)
+{
+    const struct multiboot2_tag *tag;
+    const struct multiboot2_tag_mmap *mmap;
+    const struct multiboot2_tag_basic_meminfo *meminfo = NULL;
+    const struct multiboot2_mmap_entry *entry;
+    const char *p, *end;
+    int have_mmap = 0;
+
+    p = (const char *)(mbi + 1);
+    end = (const char *)mbi + mbi->total_size;
+
+    while (p + sizeof(*tag) <= end) {
+        tag = (const struct multiboot2_tag *)p;
+        if (tag->type == MULTIBOOT2_TAG_END)
+            break;
+
+        switch (tag->type) {
+        case MULTIBOOT2_TAG_CMDLINE:
+            copy_command_line(((const struct multiboot2_tag_string *)tag)->string);
+            break;
+
+        case MULTIBOOT2_TAG_BASIC_MEMINFO:
+            meminfo = (const struct multiboot2_tag_basic_meminfo *)tag;
+            break;
+
+        case MULTIBOOT2_TAG_MMAP:
+            mmap = (const struct multiboot2_tag_mmap *)tag;
+            if (mmap->entry_size < sizeof(*entry))
+                break;
+
+            for (entry = mmap->entries;
+                 (const char *)entry + mmap->entry_size <= p + tag->size;
+                 entry = (const void *)((const char *)entry + mmap->entry_size))
+                add_memory_region(entry->addr, entry->len, entry->type);
+            have_mmap = 1;
+            break;
+        }
+
+        p += ALIGN_UP(tag->size, 8);
+    }
+
+    if (have_mmap)
+        return 0;
+
+    if (meminfo) {
+        add_memory_region(0, (u64)meminfo->mem_lower << 10,
+                          MULTIBOOT_MEMORY_AVAILABLE);
+        add_memory_region(LOW_MEMORY_END, (u64)meminfo->mem_upper << 10,
+                          MULTIBOOT_MEMORY_AVAILABLE);
+        return 0;
+    }
+
+    return -EINVAL;
+}
+
+/*
+ * Parse the boot loader handoff
+ */
+void multiboot_init(u32 magic, unsigned long info)
+{
+    const void *mbi = boot_ptr(info);
+    const char *opt;
+    unsigned long limit;
+    int ret = -EINVAL;
+
+    printk("Boot memory map:\n");
+
+    if (mbi == NULL)
+        printk("  no boot information (magic 0x%lx)\n", (unsigned long)magic);
+    else if (magic == MULTIBOOT2_BOOTLOADER_MAGIC)
+        ret = parse_multiboot2(mbi);
+    else if (magic == MULTIBOOT_BOOTLOADER_MAGIC)
+        ret = parse_multiboot1(mbi);
+    else
+        printk("  unknown boot loader magic 0x%lx\n", (unsigned long)magic);
+
+    if (ret < 0) {
+        printk("  no memory map, running without page allocator\n");
+        return;
+    }
+
+    if (boot_command_line[0])
+        printk("Command line: %s\n", boot_command_line);
+
+    opt = cmdline_get_option("mem");
+    if (opt) {
+        limit = memparse(opt, NULL);
+        if (limit) {
+            memblock_enforce_memory_limit(limit);
+            printk("Memory limited to %lu MB by mem=\n", limit >> 20);
+        }
+    }
+
+    /* Memory already in use */
+    memblock_reserve(0, LOW_MEMORY_END);
+    memblock_reserve((phys_addr_t)__kernel_start,
+                     (phys_addr_t)(__kernel_end - __kernel_start));
+
+    printk("Memory: %lu MB usable in %lu regions\n",
+           (unsigned long)(memblock_phys_mem_size() >> 20),
+           memblock.memory.cnt);
+}
+
+/*
+ * Kernel command line
+ */
+const char *cmdline_get_option(const char *name)
+{
+    const char *p = boot_command_line;
+    size_t len = strlen(name);
+    size_t i;
+
+    while (*p) {
+        while (*p == ' ')
+            p++;
+
+        for (i = 0; i < len && p[i] == name[i]; i++)
+            ;
+
+        if (i == len) {
+            if (p[len] == '=')
+                return p + len + 1;
+            if (p[len] == ' ' || p[len] == '\0')
+                return p + len;
+        }
+
+        while (*p && *p != ' ')
+            p++;
+    }
+
+    return NULL;
+}
+
+unsigned long memparse(const char *str, const char **endp)
+{
+    unsigned long val = 0;
+    unsigned int base = 10;
+    int digit;
+
+    if (str[0] == '0' && (str[1] == 'x' || str[1] == 'X')) {
+        base = 16;
+        str += 2;
+    }
+
+    for (;;) {
+        if (*str >= '0' && *str <= '9')
+            digit = *str - '0';
+        else if (base == 16 && *str >= 'a' && *str <= 'f')
+            digit = *str - 'a' + 10;
+        else if (base == 16 && *str >= 'A' && *str <= 'F')
+            digit = *str - 'A' + 10;
+        else
+            break;
+
+        val = val * base + digit;
+        str++;
+    }
+
+    switch (*str) {
+    case 'T': case 't':
+        val <<= 10;
+        /* fall through */
+    case 'G': case 'g':
+        val <<= 10;
+        /* fall through */
+    case 'M': case 'm':
+        val <<= 10;
+        /* fall through */
+    case 'K': case 'k':
+        val <<= 10;
+        str++;
+        break;
+    }
+
+    if (endp)
+        *endp = str;
+
+    return val;
+}
@@ -0,0 +1,59 @@
+/*
+ * MicroKernel Read-Copy Update
+ *
+ * See rcupdate.h. Callbacks are queued in order and all run at the next
+ * quiescent state; a callback may queue more, which wait for the one
+ * after.
+ */
+
+#include "../include/rcupdate.h"
+#include "../include/types.h"
+
+/* External declarations */
+extern void panic(const char *fmt, ...);
+
+/* Queue length at which call_rcu runs the callbacks itself */
+#define RCU_QLEN_FLUSH  256
+
+unsigned int rcu_read_lock_nesting;
+
+static struct rcu_head *rcu_cblist;
+static struct rcu_head **rcu_cbtail = &rcu_cblist;
+static unsigned long rcu_qlen;
+
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head))
+{
+    head->func = func;
+    head->next = NULL;
+    *rcu_cbtail = head;
+    rcu_cbtail = &head->next;
+
+    if (++rcu_qlen >= RCU_QLEN_FLUSH && rcu_read_lock_nesting == 0)
+        rcu_qs();
+}
+
+void rcu_qs(void)
+{
+    struct rcu_head *list, *next;
+
+    if (rcu_read_lock_nesting != 0 || rcu_cblist == NULL)
+        return;
+
+    list = rcu_cblist;
+    rcu_cblist = NULL;
+    rcu_cbtail = &rcu_cblist;
+    rcu_qlen = 0;
+
+    while (list) {
+        next = list->next;
+        list->func(list);
+        list = next;
+    }
+}
+
+void synchronize_rcu(void)
+{
+    if (rcu_read_lock_nesting != 0)
+        panic("synchronize_rcu inside an RCU read-side section");
+    rcu_qs();
+}
@@ -0,0 +1,96 @@
+#ifndef COMPACTION_H
+#define COMPACTION_H
+
+#include "types.h"
+#include "mm.h"
+
+/*
+ * Memory Compaction for MicroKernel
+ *
+ * Assembles free high-order blocks by migrating movable pages out of
+ * the way. A migrate scanner walks a zone upwards collecting movable
+ * pages, a free scanner walks downwards collecting free pages, and the
+ * contents are moved from one to the other until the scanners meet.
+ */
+
+/* Allocations of this order and above compact before failing */
+#define COMPACT_MIN_ORDER       3
+
+/* Direct compaction skips up to 1 << shift attempts after a failure */
+#define COMPACT_MAX_DEFER_SHIFT 6
+
+/* Pageblocks scanned per idle call by background compaction */
+#define COMPACT_IDLE_PAGEBLOCKS 4
+
+/*
+ * Proactive compaction starts when more than COMPACT_PROACTIVE_HIGH
+ * percent of free memory sits in blocks smaller than a pageblock, and
+ * stops below COMPACT_PROACTIVE_LOW. A pass that moves nothing defers
+ * the next one by COMPACT_PROACTIVE_DEFER_MS.
+ */
+#define COMPACT_PROACTIVE_HIGH      90
+#define COMPACT_PROACTIVE_LOW       80
+#define COMPACT_PROACTIVE_DEFER_MS  1000
+
+/*
+ * Pages that can be migrated are marked with __SetPageMovable by their
+ * owner, which supplies these callbacks:
+ *
+ * isolate_page detaches the page from the owner's structures. Until
+ * migrate_page or putback_page, page->link belongs to compaction; the
+ * rest of the page is left alone.
+ * migrate_page copies src to dst and puts dst in its place. On failure
+ * src is handed back with putback_page.
+ *
+ * Anonymous pages cannot be marked, their page field holds the address
+ * they are mapped at. Those on the LRU are moved with anon_movable_ops
+ * (vmscan.c) instead.
+ *
+ * Only order-0 pages are supported.
+ */
+struct movable_operations {
+    bool (*isolate_page)(struct page *page);
+    int (*migrate_page)(struct page *dst, struct page *src);
+    void (*putback_page)(struct page *page);
+};
+
+/*
+ * The page keeps an index into a table of the ops in use, in its page
+ * field. There is room for MAX_MOVABLE_OPS sets; past that, pages are
+ * left unmarked and never moved.
+ */
+#define MAX_MOVABLE_OPS     16
+
+void __SetPageMovable(struct page *page, const struct movable_operations *ops);
+void __ClearPageMovable(struct page *page);
+const struct movable_operations *page_movable_ops(struct page *page);
+
+extern const struct movable_operations anon_movable_ops;
+
+enum compact_result {
+    COMPACT_CONTINUE,       /* Budget used up, scanners saved */
+    COMPACT_COMPLETE,       /* Scanners met */
+    COMPACT_SUCCESS,        /* A block of the wanted order is free */
+};
+
+/* Direct compaction for a failed allocation; true if it freed a block */
+bool try_to_compact_pages(gfp_t gfp_mask, unsigned int order);
+
+/* Ask background compaction to produce a block of this order */
+void wakeup_kcompactd(struct zone *zone, unsigned int order);
+
+/* One step of background compaction, from the idle loop */
+int compact_idle_work(void);
+
+/* Compact every zone completely; returns pages migrated */
+unsigned long compact_node(void);
+
+/* Percentage of free memory in blocks smaller than a pageblock */
+unsigned int fragmentation_score(struct zone *zone);
+
+void show_compaction_stats(void);
+
+/* High-order allocation success before and after compaction */
+void bench_compaction(unsigned long nr_pages);
+
+#endif /* COMPACTION_H */
@@ -14,7 +14,7 @@
 
 #define CONFIG_MMU    1
 #define CONFIG_HIGHMEM    1
-#define CONFIG_SWAP    0
+#define CONFIG_SWAP    1
 #define CONFIG_SLAB    1
 #define CONFIG_SLUB    0
 #define CONFIG_SLOB    0
@@ -100,6 +100,8 @@
 #define CONFIG_ZLIB_DEFLATE  0
 #define CONFIG_LZO_COMPRESS  0
 #define CONFIG_LZO_DECOMPRESS  0
+#define CONFIG_LZ4_COMPRESS  1
+#define CONFIG_LZ4_DECOMPRESS  1
 
 #define CONFIG_BASE_FALL  1
 #define CONFIG_EMBEDDED    0
@@ -187,7 +189,6 @@
 
 #define MAX_NUMNODES    1
 #define MAX_NR_ZONES    4
-#define NR_LRU_LISTS    5
 #define MIGRATE_TYPES    6
 #define MIGRATE_PCPTYPES  3
 #define PID_MAX      32768
@@ -0,0 +1,60 @@
+#ifndef HUGETLB_H
+#define HUGETLB_H
+
+#include "types.h"
+#include "mm.h"
+#include "pgtable.h"
+
+/*
+ * Huge Pages for MicroKernel
+ *
+ * 2MB pages mapped by a single PMD entry, so that one TLB entry covers
+ * what would otherwise take 512. They come from two places:
+ *
+ * - A pool reserved at boot with hugepages=<count or size>, used by
+ *   MAP_HUGETLB mappings. The pool is set aside while memory is still
+ *   unfragmented, so these mappings do not depend on compaction.
+ * - Transparent huge pages: ordinary anonymous mappings that cover an
+ *   aligned 2MB range take an order-9 block from the buddy allocator
+ *   when one is free, and fall back to 4KB pages otherwise.
+ */
+
+#define HPAGE_SHIFT         PMD_SHIFT
+#define HPAGE_SIZE          PMD_SIZE
+#define HPAGE_MASK          PMD_MASK
+#define HUGETLB_PAGE_ORDER  (HPAGE_SHIFT - PAGE_SHIFT)
+#define HPAGE_NR_PAGES      (1UL << HUGETLB_PAGE_ORDER)
+
+/* transparent_hugepage= */
+#define THP_NEVER           0
+#define THP_ALWAYS          1
+
+extern int transparent_hugepage;
+
+/* Reserve the boot-time pool and read the THP policy */
+void hugetlb_init(void);
+
+/* Grow or shrink the pool; returns the new size in pages */
+unsigned long set_max_huge_pages(unsigned long count);
+
+/* Free pool pages, for MAP_HUGETLB admission */
+unsigned long hugetlb_free_pages(void);
+
+/* A zeroed page from the pool, or NULL; and back */
+struct page *alloc_huge_page(void);
+void free_huge_page(struct page *page);
+
+/*
+ * A zeroed transparent huge page from the buddy allocator, or NULL.
+ * It is freed whole, or page by page once its PMD has been split.
+ */
+struct page *alloc_transhuge_page(void);
+void free_transhuge_page(struct page *page);
+void count_thp_split(void);
+
+void show_hugepages(void);
+
+/* TLB reach: random access over 4KB, transparent and pool mappings */
+void bench_hugepages(unsigned long mb);
+
+#endif /* HUGETLB_H */
@@ -0,0 +1,37 @@
+#ifndef LZ4_H
+#define LZ4_H
+
+#include "types.h"
+
+/*
+ * LZ4 Compression for MicroKernel
+ *
+ * The LZ4 block format: runs of literal bytes, each followed by a copy
+ * of at least four bytes from up to 64KB back. Compression is a single
+ * greedy pass that finds matches through a hash table of the positions
+ * of four-byte sequences; decompression is little more than memcpy.
+ * Speed over ratio, for compressing pages on the way to swap.
+ */
+
+/* Largest input, so that positions fit the 16-bit hash table */
+#define LZ4_MAX_INPUT_SIZE  65535
+
+#define LZ4_HASH_LOG        12
+#define LZ4_MEM_COMPRESS    ((1 << LZ4_HASH_LOG) * sizeof(u16))
+
+/*
+ * Compress len bytes of src into at most max bytes of dst, using the
+ * LZ4_MEM_COMPRESS bytes of wrkmem. Returns the compressed size, or 0
+ * if it does not fit in max.
+ */
+int lz4_compress(const void *src, size_t len, void *dst, size_t max,
+                 void *wrkmem);
+
+/*
+ * Decompress len bytes of src into at most max bytes of dst. Returns
+ * the decompressed size, or -EINVAL if src is not a valid block or its
+ * contents do not fit.
+ */
+int lz4_decompress(const void *src, size_t len, void *dst, size_t max);
+
+#endif /* LZ4_H */
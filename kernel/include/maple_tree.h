@@ -0,0 +1,147 @@
+#ifndef MAPLE_TREE_H
+#define MAPLE_TREE_H
+
+#include "types.h"
+#include "rcupdate.h"
+
+/*
+ * Maple Trees for MicroKernel
+ *
+ * A B-tree of non-overlapping ranges [index, last], each mapping to an
+ * entry, after the Linux maple tree. Nodes are arrays, four cache lines
+ * each: leaves hold up to MAPLE_LEAF_SLOTS ranges, and internal nodes
+ * up to MAPLE_ARANGE_SLOTS children with the range each child covers
+ * and the largest gap between ranges inside it, so that free space is
+ * found without visiting every range.
+ *
+ * Readers need only rcu_read_lock. Writers never change a node readers
+ * can reach: a write copies the nodes it changes up to the root, and
+ * the copies are published together when the write is committed. The
+ * nodes they replace are freed after a grace period. A reader sees the
+ * tree as it was before a write or after it, never in between.
+ *
+ * A write is one change, or several between mt_write_begin and
+ * mt_write_commit that must all happen or none: a change that fails
+ * leaves the tree as it was, and mt_write_abort drops those before it.
+ * Writers must be serialized by the caller.
+ */
+
+#define MAPLE_LEAF_SLOTS    9
+#define MAPLE_ARANGE_SLOTS  7
+
+/* Enough for more ranges than any address space may have */
+#define MAPLE_HEIGHT_MAX    16
+
+enum maple_type {
+    maple_leaf_64,
+    maple_arange_64,
+};
+
+struct maple_node {
+    unsigned char type;
+    unsigned char end;              /* Slots in use */
+    unsigned char flags;
+    struct rcu_head rcu;
+    union {
+        struct {
+            unsigned long index[MAPLE_LEAF_SLOTS];
+            unsigned long last[MAPLE_LEAF_SLOTS];
+            void *slot[MAPLE_LEAF_SLOTS];
+        } leaf;
+        struct {
+            unsigned long index[MAPLE_ARANGE_SLOTS];    /* First in child */
+            unsigned long last[MAPLE_ARANGE_SLOTS];     /* Last in child */
+            unsigned long gap[MAPLE_ARANGE_SLOTS];      /* Largest inside */
+            struct maple_node *slot[MAPLE_ARANGE_SLOTS];
+        } ar;
+    };
+};
+
+struct maple_tree {
+    struct maple_node *ma_root;     /* Published, NULL when empty */
+
+    /* Write in progress */
+    bool ma_writing;
+    struct maple_node *ma_work;     /* Root with the changes so far */
+    struct rcu_head *ma_old;        /* Published nodes they replace */
+    struct maple_node *ma_spare;    /* Freed nodes no reader has seen */
+};
+
+#define MTREE_INIT { .ma_root = NULL, .ma_writing = false, .ma_work = NULL, \
+                     .ma_old = NULL, .ma_spare = NULL }
+
+static inline void mt_init(struct maple_tree *mt)
+{
+    mt->ma_root = NULL;
+    mt->ma_writing = false;
+    mt->ma_work = NULL;
+    mt->ma_old = NULL;
+    mt->ma_spare = NULL;
+}
+
+static inline bool mtree_empty(const struct maple_tree *mt)
+{
+    return mt->ma_root == NULL;
+}
+
+/* Create the node cache */
+void maple_tree_init(void);
+
+/*
+ * Lookups, on the published tree. The entries they return stay valid
+ * while the caller is in an RCU read-side section, or excludes writers.
+ */
+
+/* Entry whose range contains index, or NULL */
+void *mtree_load(struct maple_tree *mt, unsigned long index);
+
+/*
+ * First entry whose range ends at or after *index and starts no later
+ * than max. *index is moved past it, for the next call.
+ */
+void *mt_find(struct maple_tree *mt, unsigned long *index, unsigned long max);
+
+/* Last entry whose range starts at or before index, or NULL */
+void *mt_prev(struct maple_tree *mt, unsigned long index);
+
+#define mt_for_each(mt, entry, index, max) \
+    for (entry = mt_find(mt, &(index), max); entry; \
+         entry = mt_find(mt, &(index), max))
+
+/*
+ * Lowest free range of size, aligned to align, within [min, max].
+ * Returns 0 and its start in *index, or -EBUSY.
+ */
+int mt_empty_area(struct maple_tree *mt, unsigned long min, unsigned long max,
+                  unsigned long size, unsigned long align,
+                  unsigned long *index);
+
+/*
+ * Changes. On their own each is a write; inside mt_write_begin and
+ * mt_write_commit, they are published together.
+ */
+void mt_write_begin(struct maple_tree *mt);
+void mt_write_commit(struct maple_tree *mt);
+void mt_write_abort(struct maple_tree *mt);
+
+/*
+ * Add entry over [index, last]; -EEXIST if any of it is taken. last may
+ * not be ULONG_MAX.
+ */
+int mtree_insert_range(struct maple_tree *mt, unsigned long index,
+                       unsigned long last, void *entry);
+
+/* Remove the entry whose range contains index and return it */
+void *mtree_erase(struct maple_tree *mt, unsigned long index);
+
+/*
+ * Move the range of the entry containing index to [new_index, new_last],
+ * which may overlap no other range
+ */
+int mtree_adjust(struct maple_tree *mt, unsigned long index,
+                 unsigned long new_index, unsigned long new_last);
+
+/* Free every node; the entries are the caller's */
+void mtree_destroy(struct maple_tree *mt);
+
+#endif /* MAPLE_TREE_H */
@@ -0,0 +1,70 @@
+#ifndef MEMBLOCK_H
+#define MEMBLOCK_H
+
+#include "types.h"
+
+/*
+ * Early Boot Memory Allocator for MicroKernel
+ *
+ * Records the physical RAM ranges reported by the boot loader and the
+ * ranges already in use (kernel image, low memory, early allocations).
+ * It serves the few allocations needed before the buddy allocator
+ * exists, such as mem_map, and then hands every free range to buddy.
+ */
+
+#define MEMBLOCK_MAX_REGIONS    128
+
+/*
+ * Memory mapped by boot.S; early allocations come from below it until
+ * init_mem_mapping has mapped the rest
+ */
+#define BOOT_DIRECT_MAP_SIZE    (1UL << 30)
+
+struct memblock_region {
+    phys_addr_t base;
+    phys_addr_t size;
+};
+
+struct memblock_type {
+    unsigned long cnt;
+    phys_addr_t total_size;
+    struct memblock_region regions[MEMBLOCK_MAX_REGIONS];
+    const char *name;
+};
+
+struct memblock {
+    phys_addr_t current_limit;      /* Highest address memblock_alloc uses */
+    unsigned long unmapped_pages;   /* Free RAM above current_limit */
+    struct memblock_type memory;
+    struct memblock_type reserved;
+};
+
+extern struct memblock memblock;
+
+/* Register RAM and mark ranges in use */
+int memblock_add(phys_addr_t base, phys_addr_t size);
+int memblock_reserve(phys_addr_t base, phys_addr_t size);
+
+/* Drop all RAM above limit (mem= on the command line) */
+void memblock_enforce_memory_limit(phys_addr_t limit);
+
+/* Allocate zeroed, physically contiguous memory; returns 0 on failure */
+phys_addr_t memblock_phys_alloc(phys_addr_t size, phys_addr_t align);
+void *memblock_alloc(phys_addr_t size, phys_addr_t align);
+
+/* As memblock_alloc, but the caller initializes the contents */
+void *memblock_alloc_raw(phys_addr_t size, phys_addr_t align);
+
+/* Extent of RAM */
+phys_addr_t memblock_start_of_DRAM(void);
+phys_addr_t memblock_end_of_DRAM(void);
+phys_addr_t memblock_phys_mem_size(void);
+
+/* Hand the unreserved ranges in a pfn window to the buddy allocator */
+unsigned long memblock_free_pfn_range(unsigned long start_pfn,
+                                      unsigned long end_pfn);
+
+/* Print the memory and reserved region tables */
+void memblock_dump(void);
+
+#endif /* MEMBLOCK_H */
@@ -4,6 +4,8 @@
 #include "types.h"
 #include "list.h"
 #include "spinlock.h"
+#include "string.h"
+#include "rcupdate.h"
 
 /*
  * Memory Management Header for MicroKernel
@@ -25,14 +27,32 @@
 #define MAX_ORDER           11
 #define MAX_ORDER_NR_PAGES  (1 << (MAX_ORDER - 1))
 
+/*
+ * Physical memory is described in sections. Only sections with RAM in
+ * them have struct pages, and those are initialized a section at a
+ * time; only the first sections are set up during boot.
+ */
+#define SECTION_SIZE_BITS       27      /* 128MB */
+#define PFN_SECTION_SHIFT       (SECTION_SIZE_BITS - PAGE_SHIFT)
+#define PAGES_PER_SECTION       (1UL << PFN_SECTION_SHIFT)
+#define DEFERRED_EAGER_SECTIONS 2
+
 /* Number of zones */
 #define MAX_NR_ZONES        3
 
+/* Number of CPUs with their own page caches */
+#ifndef NR_CPUS
+#define NR_CPUS             8
+#endif
+
 /* Zone types */
 #define ZONE_DMA            0
 #define ZONE_NORMAL         1
 #define ZONE_HIGHMEM        2
 
+/* ZONE_DMA covers the frames ISA-style DMA can reach */
+#define MAX_DMA_PFN         ((16UL << 20) >> PAGE_SHIFT)
+
 /* GFP flags (Get Free Pages) */
 #define GFP_KERNEL          0x01
 #define GFP_ATOMIC          0x02
@@ -40,7 +60,46 @@
 #define GFP_DMA             0x08
 #define GFP_HIGHMEM         0x10
 #define GFP_ZERO            0x20
-#define GFP_NOWAIT          0x40
+#define GFP_NOWAIT          0x40    /* No direct compaction on failure */
+#define GFP_COLD            0x80
+#define GFP_MOVABLE         0x100   /* Can be migrated or reclaimed at will */
+#define GFP_RECLAIMABLE     0x200   /* Freed under memory pressure */
+#define GFP_MEMALLOC        0x400   /* Reclaim's own: ignores watermarks */
+
+/*
+ * Migrate types. Free memory is grouped by pageblock according to how
+ * easily the pages allocated from it can be moved, so that long-lived
+ * kernel allocations do not end up scattered across every high-order
+ * block.
+ */
+#define MIGRATE_UNMOVABLE   0
+#define MIGRATE_MOVABLE     1
+#define MIGRATE_RECLAIMABLE 2
+#define MIGRATE_PCPTYPES    3       /* Types with per-CPU lists */
+#define MIGRATE_TYPES       3
+
+/* A pageblock holds free memory of one migrate type: 2MB, a huge page */
+#define pageblock_order     9
+#define pageblock_nr_pages  (1UL << pageblock_order)
+
+/* Preferred zone; lower zones are used when it is exhausted */
+static inline int gfp_zone(gfp_t gfp_mask)
+{
+    if (gfp_mask & GFP_DMA)
+        return ZONE_DMA;
+    if (gfp_mask & GFP_HIGHMEM)
+        return ZONE_HIGHMEM;
+    return ZONE_NORMAL;
+}
+
+static inline int gfp_migratetype(gfp_t gfp_mask)
+{
+    if (gfp_mask & GFP_MOVABLE)
+        return MIGRATE_MOVABLE;
+    if (gfp_mask & GFP_RECLAIMABLE)
+        return MIGRATE_RECLAIMABLE;
+    return MIGRATE_UNMOVABLE;
+}
 
 /* Page flags */
 #define PG_locked           0
@@ -54,6 +113,16 @@
 #define PG_private          8
 #define PG_buddy            9
 #define PG_compound         10
+#define PG_movable          11      /* Page field holds its movable ops */
+#define PG_unevictable      12      /* In a VMA reclaim may not take it from */
+
+/*
+ * The flags word above the PG_ bits holds a value whose meaning depends
+ * on what the page is used for; see struct page
+ */
+#define PAGE_FIELD_SHIFT    16
+
+struct kmem_cache;
 
 /* Atomic type */
 typedef struct {
@@ -97,6 +166,11 @@ static inline s32 atomic_inc_return(atomic_t *v)
     return __sync_add_and_fetch(&v->counter, 1);
 }
 
+static inline s32 atomic_dec_return(atomic_t *v)
+{
+    return __sync_sub_and_fetch(&v->counter, 1);
+}
+
 /* Bit operations */
 static inline int test_bit(int nr, const volatile unsigned long *addr)
 {
@@ -127,28 +201,83 @@ static inline int test_and_clear_bit(int nr, volatile unsigned long *addr)
     return old;
 }
 
+/*
+ * A link in a list of pages by frame number: half a list_head, for
+ * pages that need the other half of the union in struct page as well
+ */
+#define PFN_LIST_END        0xffffffffU
+
+struct pfn_link {
+    u32 next;
+    u32 prev;
+};
+
+struct pfn_list {
+    u32 first;
+    u32 last;
+};
+
 /*
  * Page structure - represents a physical page frame
+ *
+ * 32 bytes, so that two share a cache line and none straddles one: a
+ * buddy pair of single pages is one line. Apart from flags and
+ * _refcount, the fields overlap according to what the page is used for:
+ *
+ *   free (buddy, per-CPU and zero pool lists): buddy_list or lru, with
+ *     order and migratetype in place of the map count
+ *   anonymous: link on the LRU lists, mapping is the owner mm, and the
+ *     page field its address >> PAGE_SHIFT (see swap.h)
+ *   slab: link on the partial list, freelist, the object counts in
+ *     place of the map count, and the page field the cache's id
+ *   movable (compaction.h): lru while isolated, the page field the
+ *     owner's movable ops
+ *   anything else its owner keeps on a list: lru, or private
  */
 struct page {
-    unsigned long flags;            /* Page flags */
-    atomic_t _refcount;             /* Reference count */
-    atomic_t _mapcount;             /* Map count */
+    unsigned long flags;            /* PG_ bits, and the page field */
     
     union {
+        struct list_head lru;       /* On a list of its owner's */
+        struct list_head buddy_list; /* Buddy or per-CPU free list */
         struct {
-            struct list_head lru;   /* LRU list */
-            void *mapping;          /* Address space */
-            unsigned long index;    /* Page index */
-        };
-        struct {
-            struct list_head buddy_list; /* Buddy allocator list */
-            unsigned int order;          /* Page order */
+            struct pfn_link link;   /* LRU or slab partial list */
+            union {
+                void *mapping;      /* Owner of an anonymous page */
+                void *freelist;     /* First free object of a slab */
+                unsigned long private;
+            };
         };
     };
     
-    unsigned long private;          /* Private data */
-};
+    atomic_t _refcount;             /* Reference count */
+    
+    union {
+        atomic_t _mapcount;         /* Mapped pages */
+        struct {                    /* Free pages */
+            u8 order;
+            u8 migratetype;         /* Free or per-CPU list type */
+        };
+        struct {                    /* Slab object counts */
+            u16 inuse;
+            u16 objects : 15;
+            u16 frozen : 1;
+        };
+    };
+} __attribute__((aligned(32)));
+
+_Static_assert(sizeof(struct page) == 32, "struct page must be 32 bytes");
+
+static inline unsigned long page_field(const struct page *page)
+{
+    return page->flags >> PAGE_FIELD_SHIFT;
+}
+
+static inline void set_page_field(struct page *page, unsigned long val)
+{
+    page->flags = (page->flags & ((1UL << PAGE_FIELD_SHIFT) - 1)) |
+                  (val << PAGE_FIELD_SHIFT);
+}
 
 /* Page flag operations */
 #define PageLocked(page)        test_bit(PG_locked, &(page)->flags)
@@ -167,6 +296,30 @@ struct page {
 #define SetPageBuddy(page)      set_bit(PG_buddy, &(page)->flags)
 #define ClearPageBuddy(page)    clear_bit(PG_buddy, &(page)->flags)
 
+#define PageSlab(page)          test_bit(PG_slab, &(page)->flags)
+#define SetPageSlab(page)       set_bit(PG_slab, &(page)->flags)
+#define ClearPageSlab(page)     clear_bit(PG_slab, &(page)->flags)
+
+#define PageMovable(page)       test_bit(PG_movable, &(page)->flags)
+#define SetPageMovable(page)    set_bit(PG_movable, &(page)->flags)
+#define ClearPageMovable(page)  clear_bit(PG_movable, &(page)->flags)
+
+#define PageCompound(page)      test_bit(PG_compound, &(page)->flags)
+#define SetPageCompound(page)   set_bit(PG_compound, &(page)->flags)
+#define ClearPageCompound(page) clear_bit(PG_compound, &(page)->flags)
+
+#define PageLRU(page)           test_bit(PG_lru, &(page)->flags)
+#define SetPageLRU(page)        set_bit(PG_lru, &(page)->flags)
+#define ClearPageLRU(page)      clear_bit(PG_lru, &(page)->flags)
+
+#define PageActive(page)        test_bit(PG_active, &(page)->flags)
+#define SetPageActive(page)     set_bit(PG_active, &(page)->flags)
+#define ClearPageActive(page)   clear_bit(PG_active, &(page)->flags)
+
+#define PageUnevictable(page)   test_bit(PG_unevictable, &(page)->flags)
+#define SetPageUnevictable(page) set_bit(PG_unevictable, &(page)->flags)
+#define ClearPageUnevictable(page) clear_bit(PG_unevictable, &(page)->flags)
+
 /* Page reference counting */
 static inline void get_page(struct page *page)
 {
@@ -183,30 +336,141 @@ static inline int page_count(struct page *page)
     return atomic_read(&page->_refcount);
 }
 
+/* Page table entries mapping the page; _mapcount starts at -1 */
+static inline int page_mapcount(struct page *page)
+{
+    return atomic_read(&page->_mapcount) + 1;
+}
+
 /*
  * Free area structure for buddy allocator
  */
 struct free_area {
-    struct list_head free_list;     /* List of free pages */
-    unsigned long nr_free;          /* Number of free pages */
+    struct list_head free_list[MIGRATE_TYPES];
+    unsigned long nr_free;          /* Number of free blocks */
+    unsigned long nr_free_type[MIGRATE_TYPES]; /* ... on each list */
+    unsigned long nr_split;         /* Blocks split to serve smaller orders */
+    unsigned long nr_merge;         /* Blocks merged into a higher order */
+};
+
+/*
+ * Per-CPU page cache
+ *
+ * Low-order pages are handed out from per-CPU lists without taking
+ * zone->lock. There is one list per order and migrate type. Lists are
+ * refilled from and drained to the zone free lists in batches. Hot
+ * pages sit at the head, cold pages at the tail.
+ */
+#define PCP_NR_ORDERS       4       /* orders 0..3 are cached */
+#define PCP_DEFAULT_HIGH    192     /* drain when count reaches this */
+#define PCP_DEFAULT_LOW     64      /* drain down to this */
+#define PCP_DEFAULT_BATCH   32      /* pages moved per refill */
+#define NR_PCP_LISTS        (PCP_NR_ORDERS * MIGRATE_PCPTYPES)
+
+static inline int pcp_list_index(unsigned int order, int migratetype)
+{
+    return order * MIGRATE_PCPTYPES + migratetype;
+}
+
+struct per_cpu_pages {
+    int count;                      /* Pages on all lists */
+    int high;                       /* High watermark */
+    int low;                        /* Low watermark */
+    int batch;                      /* Refill chunk size in pages */
+    struct list_head lists[NR_PCP_LISTS];
+
+    /* Statistics */
+    unsigned long alloc_hit;        /* Served from the lists */
+    unsigned long alloc_miss;       /* Needed a refill first */
+    unsigned long nr_free;          /* Frees absorbed by the lists */
+    unsigned long nr_refill;        /* Batches pulled from the zone */
+    unsigned long nr_drain;         /* Batches pushed to the zone */
+};
+
+/*
+ * Pre-zeroed page pool
+ *
+ * Order-0 pages cleared in the background from the idle loop, so that
+ * GFP_ZERO allocations do not pay for clearing on their critical path.
+ */
+#define ZERO_POOL_DEFAULT   512     /* target size in pages */
+#define ZERO_POOL_BATCH     16      /* pages cleared per idle call */
+
+struct zero_pool {
+    spinlock_t lock;
+    struct list_head pages;         /* Linked through page->lru */
+    unsigned long nr;               /* Pages in the pool */
+    unsigned long target;           /* Refill up to this many */
+
+    /* Statistics */
+    unsigned long hits;             /* GFP_ZERO served from the pool */
+    unsigned long misses;           /* GFP_ZERO cleared inline */
+    unsigned long zeroed;           /* Pages cleared in the background */
+};
+
+/*
+ * Per migrate type statistics
+ */
+struct migrate_stats {
+    unsigned long nr_pageblocks;    /* Pageblocks of this type */
+    unsigned long nr_alloc;         /* Successful allocations */
+    unsigned long nr_fail;          /* Failed allocations */
+    unsigned long nr_fallback;      /* Blocks taken from another type */
+    unsigned long nr_steal;         /* Pageblocks converted to this type */
+};
+
+/*
+ * Zone watermarks, in free pages. Allocations dip below low only after
+ * waking kswapd, which frees memory until the zone is above high again;
+ * below min only reclaim itself allocates, and GFP_ATOMIC goes halfway.
+ */
+enum zone_watermarks {
+    WMARK_MIN,
+    WMARK_LOW,
+    WMARK_HIGH,
+    NR_WMARK
 };
 
+#define min_wmark_pages(z)  ((z)->watermark[WMARK_MIN])
+#define low_wmark_pages(z)  ((z)->watermark[WMARK_LOW])
+#define high_wmark_pages(z) ((z)->watermark[WMARK_HIGH])
+
 /*
  * Memory zone structure
  */
 struct zone {
-    spinlock_t lock;                /* Zone lock */
+    spinlock_t lock;                /* Free lists and their counters */
     
     unsigned long zone_start_pfn;   /* Start page frame number */
-    unsigned long spanned_pages;    /* Total pages in zone */
+    unsigned long spanned_pages;    /* Pages from start to last frame */
     unsigned long present_pages;    /* Present pages */
     unsigned long managed_pages;    /* Managed pages */
     
     const char *name;               /* Zone name */
     int zone_type;                  /* Zone type */
     
+    unsigned long watermark[NR_WMARK];
+    
     /* Buddy allocator */
     struct free_area free_area[MAX_ORDER];
+    unsigned long free_area_map[MIGRATE_TYPES]; /* Bit n: order n non-empty */
+    struct migrate_stats migrate_stats[MIGRATE_TYPES];
+    
+    /* Per-CPU page caches */
+    struct per_cpu_pages pageset[NR_CPUS];
+    
+    /* Pre-zeroed pages */
+    struct zero_pool zero_pool;
+    
+    /* Compaction */
+    unsigned long compact_cached_migrate_pfn; /* Background scanners */
+    unsigned long compact_cached_free_pfn;
+    unsigned long compact_pass_migrated;      /* Moved in this pass */
+    unsigned int compact_considered;          /* Attempts since deferral */
+    unsigned int compact_defer_shift;         /* Skip 1 << shift attempts */
+    int compact_order_failed;                 /* Lowest order that failed */
+    int kcompactd_max_order;                  /* Background target, or 0 */
+    u64 compact_proactive_defer;              /* No proactive run before */
     
     /* Statistics */
     unsigned long nr_free_pages;    /* Free page count */
@@ -214,6 +478,24 @@ struct zone {
     unsigned long nr_free;          /* Free count */
 };
 
+/*
+ * LRU lists of anonymous pages, for reclaim (vmscan.c). New pages go on
+ * the inactive list; pages found referenced there move to the active
+ * list, and reclaim takes from the tail of the inactive one.
+ */
+enum lru_list {
+    LRU_INACTIVE_ANON,
+    LRU_ACTIVE_ANON,
+    LRU_UNEVICTABLE,                /* In VM_LOCKED or VM_SHARED VMAs */
+    NR_LRU_LISTS
+};
+
+struct lruvec {
+    spinlock_t lock;
+    struct pfn_list lists[NR_LRU_LISTS];
+    unsigned long nr_pages[NR_LRU_LISTS];
+};
+
 /*
  * Memory node structure (simplified, single node)
  */
@@ -228,17 +510,59 @@ struct pglist_data {
     int node_id;
     
     struct page *node_mem_map;      /* Page array */
+
+    struct lruvec lruvec;           /* Anonymous pages, for reclaim */
 };
 
+static inline unsigned long zone_end_pfn(const struct zone *zone)
+{
+    return zone->zone_start_pfn + zone->spanned_pages;
+}
+
 /* Global memory node */
 extern struct pglist_data node_data;
 #define NODE_DATA(nid)  (&node_data)
 
-/* Page frame number conversion */
-extern struct page *mem_map;
-extern unsigned long mem_map_size;
+/*
+ * Sparse memory model
+ *
+ * mem_map is a virtual array at VMEMMAP_START with one struct page per
+ * frame, so that pfn and page convert by an addition. Only the parts
+ * describing present sections are backed by memory (sparse.c): a hole
+ * in the physical address space, like the one below 4GB for PCI, costs
+ * nothing. pfn_valid says whether a frame has a struct page; code that
+ * walks frames across section boundaries checks it once per section.
+ */
+#define VMEMMAP_START       0xFFFFEA0000000000UL
+#define mem_map             ((struct page *)VMEMMAP_START)
+
+#define SECTION_MARKED_PRESENT  0x01    /* RAM somewhere in the section */
+#define SECTION_HAS_MEM_MAP     0x02    /* Its struct pages are mapped */
+
+struct mem_section {
+    u8 flags;
+};
+
+extern struct mem_section *mem_section;
+extern unsigned long nr_mem_sections;
+extern unsigned long mem_map_size;      /* Bytes of struct pages mapped */
+extern unsigned long max_pfn;           /* One past the last RAM frame */
 extern phys_addr_t phys_base;
 
+#define pfn_to_section_nr(pfn)  ((pfn) >> PFN_SECTION_SHIFT)
+#define section_nr_to_pfn(nr)   ((nr) << PFN_SECTION_SHIFT)
+
+static inline bool valid_section_nr(unsigned long nr)
+{
+    return nr < nr_mem_sections &&
+           (mem_section[nr].flags & SECTION_HAS_MEM_MAP);
+}
+
+static inline bool pfn_valid(unsigned long pfn)
+{
+    return valid_section_nr(pfn_to_section_nr(pfn));
+}
+
 #define page_to_pfn(page)   ((unsigned long)((page) - mem_map))
 #define pfn_to_page(pfn)    (mem_map + (pfn))
 
@@ -248,12 +572,109 @@ extern phys_addr_t phys_base;
 #define virt_to_page(addr)  phys_to_page(__pa(addr))
 #define page_to_virt(page)  __va(page_to_phys(page))
 
+/* Lists of pages through page->link */
+static inline void init_pfn_list(struct pfn_list *list)
+{
+    list->first = PFN_LIST_END;
+    list->last = PFN_LIST_END;
+}
+
+static inline bool pfn_list_empty(const struct pfn_list *list)
+{
+    return list->first == PFN_LIST_END;
+}
+
+static inline struct page *pfn_list_page(u32 pfn)
+{
+    return pfn == PFN_LIST_END ? NULL : pfn_to_page(pfn);
+}
+
+#define pfn_list_first(list)    pfn_list_page((list)->first)
+#define pfn_list_last(list)     pfn_list_page((list)->last)
+#define pfn_list_next(page)     pfn_list_page((page)->link.next)
+#define pfn_list_prev(page)     pfn_list_page((page)->link.prev)
+
+static inline void pfn_list_add(struct pfn_list *list, struct page *page)
+{
+    u32 pfn = page_to_pfn(page);
+    
+    page->link.next = list->first;
+    page->link.prev = PFN_LIST_END;
+    if (list->first == PFN_LIST_END)
+        list->last = pfn;
+    else
+        pfn_to_page(list->first)->link.prev = pfn;
+    list->first = pfn;
+}
+
+static inline void pfn_list_add_tail(struct pfn_list *list, struct page *page)
+{
+    u32 pfn = page_to_pfn(page);
+    
+    page->link.next = PFN_LIST_END;
+    page->link.prev = list->last;
+    if (list->last == PFN_LIST_END)
+        list->first = pfn;
+    else
+        pfn_to_page(list->last)->link.next = pfn;
+    list->last = pfn;
+}
+
+static inline void pfn_list_del(struct pfn_list *list, struct page *page)
+{
+    if (page->link.prev == PFN_LIST_END)
+        list->first = page->link.next;
+    else
+        pfn_to_page(page->link.prev)->link.next = page->link.next;
+    
+    if (page->link.next == PFN_LIST_END)
+        list->last = page->link.prev;
+    else
+        pfn_to_page(page->link.next)->link.prev = page->link.prev;
+}
+
 /* Physical/Virtual address conversion */
 #define __pa(x)     ((phys_addr_t)(x) - KERNEL_VIRTUAL_BASE)
 #define __va(x)     ((void *)((phys_addr_t)(x) + KERNEL_VIRTUAL_BASE))
 
 #define KERNEL_VIRTUAL_BASE 0xFFFF800000000000UL
 
+/*
+ * Zone a frame belongs to. Zone boundaries are aligned to MAX_ORDER
+ * blocks, so a buddy pair never spans two zones.
+ */
+static inline int pfn_zonenum(unsigned long pfn)
+{
+    return pfn < MAX_DMA_PFN ? ZONE_DMA : ZONE_NORMAL;
+}
+
+static inline struct zone *page_zone(const struct page *page)
+{
+    return &node_data.zones[pfn_zonenum(page_to_pfn(page))];
+}
+
+/* Migrate type of each pageblock, indexed by pfn >> pageblock_order */
+extern unsigned char *pageblock_types;
+
+static inline int get_pageblock_migratetype(unsigned long pfn)
+{
+    return pageblock_types[pfn >> pageblock_order];
+}
+
+/* Lowest order >= @order with a free block of any type, or MAX_ORDER */
+static inline unsigned int zone_first_free_order(const struct zone *zone,
+                                                 unsigned int order)
+{
+    unsigned long map = 0;
+    int mt;
+    
+    for (mt = 0; mt < MIGRATE_TYPES; mt++)
+        map |= zone->free_area_map[mt];
+    map &= ~0UL << order;
+    
+    return map ? __ffs(map) : MAX_ORDER;
+}
+
 /*
  * Buddy allocator functions
  */
@@ -286,6 +707,44 @@ unsigned long get_zeroed_page(gfp_t gfp_mask);
 /* Free pages by virtual address */
 void free_pages_virt(unsigned long addr, unsigned int order);
 
+/*
+ * Bulk order-0 allocation and free: one pass over the per-CPU lists and
+ * one zone->lock hold for the lot. The array variant fills NULL slots.
+ */
+unsigned long __alloc_pages_bulk(gfp_t gfp_mask, unsigned long nr_pages,
+                                 struct list_head *list,
+                                 struct page **page_array);
+
+static inline unsigned long alloc_pages_bulk(gfp_t gfp_mask,
+                                             unsigned long nr_pages,
+                                             struct page **page_array)
+{
+    return __alloc_pages_bulk(gfp_mask, nr_pages, NULL, page_array);
+}
+
+static inline unsigned long alloc_pages_bulk_list(gfp_t gfp_mask,
+                                                  unsigned long nr_pages,
+                                                  struct list_head *list)
+{
+    return __alloc_pages_bulk(gfp_mask, nr_pages, list, NULL);
+}
+
+void free_pages_bulk(struct page **pages, unsigned long nr_pages);
+void free_pages_bulk_list(struct list_head *list);
+
+/* Smallest order whose block holds size bytes */
+static inline unsigned int get_order(size_t size)
+{
+    unsigned int order = 0;
+    
+    size = (size - 1) >> PAGE_SHIFT;
+    while (size) {
+        order++;
+        size >>= 1;
+    }
+    return order;
+}
+
 static inline unsigned long __get_free_page(gfp_t gfp_mask)
 {
     return __get_free_pages(gfp_mask, 0);
@@ -302,67 +761,117 @@ static inline void free_page_virt(unsigned long addr)
 void mm_init(void);
 void mem_init(void);
 
+/*
+ * Mark the sections memblock has RAM in and map their part of mem_map,
+ * before the buddy allocator exists. Returns the sections mapped.
+ */
+unsigned long sparse_init(void);
+
 /* Add memory to the buddy allocator */
 void free_area_init(unsigned long start_pfn, unsigned long end_pfn);
 
 /* Memory statistics */
 unsigned long nr_free_pages(void);
 void show_mem(void);
+void show_buddyinfo(void);
+void show_pagetypeinfo(void);
+void show_deferred_init(void);
+
+/* Whether zone stays above a watermark after an allocation of order */
+bool zone_watermark_ok(struct zone *zone, unsigned int order, int wmark,
+                       gfp_t gfp_mask);
+
+/* Background memory work for the idle loop */
+int mm_idle_work(void);
+
+/* Per-CPU page caches */
+void drain_local_pages(void);
+void drain_all_pages(void);
+int pcp_set_watermarks(int high, int low, int batch);
+void show_pcp_stats(void);
+
+/* Benchmarks: fill the buddy lists first */
+void mm_bench_prepare(void);
+
+/* High-order allocation success after mixed-mobility churn */
+void bench_fragmentation(unsigned long nr_pages);
+
+/* Looped versus bulk order-0 allocation and free */
+void bench_page_bulk(unsigned long iterations);
+
+/* mem_map size, a scan of it, and a loop of merging frees */
+void bench_page_struct(unsigned long nr_pages);
 
 /*
- * Simple kmalloc/kfree (slab allocator placeholder)
+ * Free page isolation for compaction: take the free pages of a pfn range
+ * off the free lists as order-0 pages, and give unused ones back
+ */
+unsigned long isolate_freepages_block(struct zone *zone, unsigned long start_pfn,
+                                      unsigned long end_pfn,
+                                      struct list_head *list,
+                                      unsigned long max);
+void release_freepages(struct zone *zone, struct list_head *list);
+
+/* Pre-zeroed page pool */
+int zero_pool_set_target(unsigned long pages);
+void show_zero_pool(void);
+
+/*
+ * General-purpose kernel allocation (backed by the slab allocator)
  */
 void *kmalloc(size_t size, gfp_t flags);
 void kfree(void *ptr);
 void *kzalloc(size_t size, gfp_t flags);
 void *kcalloc(size_t n, size_t size, gfp_t flags);
 void *krealloc(void *ptr, size_t new_size, gfp_t flags);
+size_t ksize(const void *ptr);
 
-/* Memory copying */
-static inline void *memset(void *s, int c, size_t n)
+/* Clear one page */
+static inline void clear_page(void *page)
 {
-    unsigned char *p = s;
-    while (n--)
-        *p++ = (unsigned char)c;
-    return s;
-}
-
-static inline void *memcpy(void *dest, const void *src, size_t n)
-{
-    unsigned char *d = dest;
-    const unsigned char *s = src;
-    while (n--)
-        *d++ = *s++;
-    return dest;
+    unsigned long cnt = PAGE_SIZE / 8;
+    
+    __asm__ __volatile__("rep stosq"
+                         : "+D"(page), "+c"(cnt)
+                         : "a"(0UL)
+                         : "memory");
 }
 
-static inline void *memmove(void *dest, const void *src, size_t n)
+/* Copy one page */
+static inline void copy_page(void *to, const void *from)
 {
-    unsigned char *d = dest;
-    const unsigned char *s = src;
+    unsigned long cnt = PAGE_SIZE / 8;
     
-    if (d < s) {
-        while (n--)
-            *d++ = *s++;
-    } else {
-        d += n;
-        s += n;
-        while (n--)
-            *--d = *--s;
-    }
-    return dest;
+    __asm__ __volatile__("rep movsq"
+                         : "+D"(to), "+S"(from), "+c"(cnt)
+                         :
+                         : "memory");
 }
 
-static inline int memcmp(const void *s1, const void *s2, size_t n)
+/*
+ * Clear one page with non-temporal stores, bypassing the cache. Used
+ * for pages that will not be touched soon; needs an sfence before the
+ * page is handed to another CPU.
+ */
+static inline void clear_page_nt(void *page)
 {
-    const unsigned char *p1 = s1, *p2 = s2;
-    while (n--) {
-        if (*p1 != *p2)
-            return *p1 - *p2;
-        p1++;
-        p2++;
+    unsigned long *p = page;
+    unsigned long *end = p + PAGE_SIZE / sizeof(*p);
+    
+    for (; p < end; p += 8) {
+        __asm__ __volatile__(
+            "movnti %1, 0(%0)\n\t"
+            "movnti %1, 8(%0)\n\t"
+            "movnti %1, 16(%0)\n\t"
+            "movnti %1, 24(%0)\n\t"
+            "movnti %1, 32(%0)\n\t"
+            "movnti %1, 40(%0)\n\t"
+            "movnti %1, 48(%0)\n\t"
+            "movnti %1, 56(%0)"
+            :
+            : "r"(p), "r"(0UL)
+            : "memory");
     }
-    return 0;
 }
 
 /*
@@ -373,14 +882,14 @@ struct vm_area_struct {
     unsigned long vm_start;         /* Start address */
     unsigned long vm_end;           /* End address */
     
-    struct vm_area_struct *vm_next; /* Next VMA */
-    struct vm_area_struct *vm_prev; /* Previous VMA */
-    
     unsigned long vm_flags;         /* Flags */
     unsigned long vm_pgoff;         /* Page offset */
     
-    struct rb_node vm_rb;           /* Red-black tree node */
-    struct list_head vm_list;       /* List node */
+    /* Faults without mmap_lock (mmap_lock.h) */
+    spinlock_t vm_lock;             /* Held by such a fault */
+    int vm_lock_seq;                /* mm_lock_seq when write-locked */
+    bool detached;                  /* Out of the tree */
+    struct rcu_head vm_rcu;         /* Freed after a grace period */
 };
 
 /* VMA flags */
@@ -393,12 +902,132 @@ struct vm_area_struct {
 #define VM_PFNMAP       0x00000400
 #define VM_LOCKED       0x00002000
 #define VM_IO           0x00004000
+#define VM_SEQ_READ     0x00008000  /* madvise: fault around */
+#define VM_RAND_READ    0x00010000  /* madvise: no fault around */
 #define VM_DONTEXPAND   0x00040000
 #define VM_ACCOUNT      0x00100000
 #define VM_NORESERVE    0x00200000
 #define VM_HUGETLB      0x00400000
 #define VM_STACK        0x00800000
 
+#define VM_ACCESS_FLAGS (VM_READ | VM_WRITE | VM_EXEC)
+
+/* mmap protection and flags */
+#define PROT_NONE       0x0
+#define PROT_READ       0x1
+#define PROT_WRITE      0x2
+#define PROT_EXEC       0x4
+
+#define MAP_SHARED      0x01
+#define MAP_PRIVATE     0x02
+#define MAP_FIXED       0x10
+#define MAP_ANONYMOUS   0x20
+#define MAP_LOCKED      0x2000      /* As if mlocked */
+#define MAP_POPULATE    0x8000      /* Fault everything in now */
+#define MAP_HUGETLB     0x40000     /* Back with pool huge pages */
+
+/* mremap flags */
+#define MREMAP_MAYMOVE  1
+#define MREMAP_FIXED    2
+
+/* madvise advice */
+#define MADV_NORMAL     0
+#define MADV_RANDOM     1
+#define MADV_SEQUENTIAL 2
+#define MADV_WILLNEED   3
+#define MADV_DONTNEED   4
+
+/* mlockall flags */
+#define MCL_CURRENT     1
+#define MCL_FUTURE      2
+
+/*
+ * Address space management. VMAs are indexed by address in the maple
+ * tree mm->mm_mt, which page faults read under RCU. Anonymous memory gets
+ * its pages from the page fault handler, on first touch, unless it is
+ * populated up front: pool huge pages, MAP_POPULATE, MADV_WILLNEED and
+ * locked memory. Population fills a page table at a time from bulk
+ * allocations.
+ */
+void mmap_init(void);
+
+/* First VMA ending above addr, or NULL */
+struct vm_area_struct *find_vma(struct mm_struct *mm, unsigned long addr);
+
+/* VMA after vma, or NULL */
+struct vm_area_struct *vma_next(struct mm_struct *mm,
+                                struct vm_area_struct *vma);
+
+#define for_each_vma(mm, vma) \
+    for (vma = find_vma(mm, 0); vma; vma = vma_next(mm, vma))
+
+/* Map anonymous memory in mm; returns the address or -errno */
+long vm_mmap(struct mm_struct *mm, unsigned long addr, unsigned long len,
+             unsigned long prot, unsigned long flags);
+int vm_munmap(struct mm_struct *mm, unsigned long addr, unsigned long len);
+
+/*
+ * Grow or shrink a mapping, in place if there is room, or by moving its
+ * page table entries; returns the new address or -errno
+ */
+long vm_mremap(struct mm_struct *mm, unsigned long addr, unsigned long old_len,
+               unsigned long new_len, unsigned long flags,
+               unsigned long new_addr);
+int vm_mprotect(struct mm_struct *mm, unsigned long start, unsigned long len,
+                unsigned long prot);
+int vm_madvise(struct mm_struct *mm, unsigned long start, unsigned long len,
+               int advice);
+
+/* Keep memory resident: locked ranges are faulted in and stay in */
+int vm_mlock(struct mm_struct *mm, unsigned long start, unsigned long len);
+int vm_munlock(struct mm_struct *mm, unsigned long start, unsigned long len);
+int vm_mlockall(struct mm_struct *mm, int flags);
+int vm_munlockall(struct mm_struct *mm);
+
+/* Fault in every page mapped in [start, start + len) */
+int mm_populate(struct mm_struct *mm, unsigned long start, unsigned long len);
+
+/* Copy the VMAs of oldmm into the empty mm, sharing private pages COW */
+int dup_mmap(struct mm_struct *mm, struct mm_struct *oldmm);
+
+/* handle_mm_fault flags */
+#define FAULT_FLAG_WRITE    0x01
+#define FAULT_FLAG_USER     0x02
+
+/* handle_mm_fault result */
+#define VM_FAULT_OOM        0x01
+#define VM_FAULT_SIGSEGV    0x02
+#define VM_FAULT_MAJOR      0x04    /* Had to wait for the page */
+#define VM_FAULT_ERROR      (VM_FAULT_OOM | VM_FAULT_SIGSEGV)
+
+/*
+ * Make addr present in the page tables of the VMA's mm, writable if
+ * FAULT_FLAG_WRITE; the caller has checked the VMA allows the access
+ */
+int handle_mm_fault(struct vm_area_struct *vma, unsigned long addr,
+                    unsigned int flags);
+
+struct task_struct;
+
+/*
+ * Touch every page of [addr, addr + len) as tsk, in its address space,
+ * taking the faults the CPU would raise; for benchmarks. Returns cycles.
+ */
+u64 touch_user_range(struct task_struct *tsk, unsigned long addr,
+                     unsigned long len, bool write);
+
+/* Fault-in cost against eager population */
+void bench_page_faults(unsigned long mb);
+
+/* find_vma through the VMA cache against the tree lookup */
+void bench_vma_lookup(unsigned long nr);
+
+/* Growing a buffer to max_mb with mremap against mmap, copy and munmap */
+void bench_mremap(unsigned long max_mb);
+
+/* Unmap everything and free the page tables */
+void exit_mmap(struct mm_struct *mm);
+
 /*
  * Sysinfo structure (for sys_sysinfo)
  */
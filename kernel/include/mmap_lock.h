@@ -0,0 +1,77 @@
+#ifndef MMAP_LOCK_H
+#define MMAP_LOCK_H
+
+#include "types.h"
+#include "sched.h"
+#include "mm.h"
+#include "spinlock.h"
+
+/*
+ * Address Space Locking
+ *
+ * mmap_lock serializes changes to the VMAs of an mm. Page faults can do
+ * without it: they find their VMA in the maple tree under RCU and lock
+ * only that VMA's vm_lock, so faults need not wait for an mmap or
+ * munmap elsewhere in the address space.
+ *
+ * A writer write-locks each VMA before changing it, by waiting for the
+ * fault holding vm_lock and stamping the VMA with mm_lock_seq. Faults
+ * that find a stamped VMA back off and take mmap_lock instead. Dropping
+ * mmap_lock bumps mm_lock_seq, which unlocks all of them at once.
+ */
+
+static inline void mmap_write_lock(struct mm_struct *mm)
+{
+    spin_lock(&mm->mmap_lock);
+}
+
+static inline void mmap_write_unlock(struct mm_struct *mm)
+{
+    mm->mm_lock_seq++;
+    spin_unlock(&mm->mmap_lock);
+}
+
+/* With mmap_lock held; a VMA stays write-locked until it is dropped */
+static inline void vma_start_write(struct vm_area_struct *vma)
+{
+    int mm_lock_seq = vma->vm_mm->mm_lock_seq;
+
+    if (vma->vm_lock_seq == mm_lock_seq)
+        return;
+
+    spin_lock(&vma->vm_lock);
+    vma->vm_lock_seq = mm_lock_seq;
+    spin_unlock(&vma->vm_lock);
+}
+
+/* Without mmap_lock: false if the VMA is being changed */
+static inline bool vma_start_read(struct vm_area_struct *vma)
+{
+    struct mm_struct *mm = vma->vm_mm;
+
+    if (READ_ONCE(vma->vm_lock_seq) == READ_ONCE(mm->mm_lock_seq))
+        return false;
+    if (!spin_trylock(&vma->vm_lock))
+        return false;
+
+    /* A writer may have stamped it before we got the lock */
+    if (vma->vm_lock_seq == READ_ONCE(mm->mm_lock_seq)) {
+        spin_unlock(&vma->vm_lock);
+        return false;
+    }
+    return true;
+}
+
+static inline void vma_end_read(struct vm_area_struct *vma)
+{
+    spin_unlock(&vma->vm_lock);
+}
+
+/*
+ * VMA containing address, read-locked, or NULL if the fault must take
+ * mmap_lock and look again
+ */
+struct vm_area_struct *lock_vma_under_rcu(struct mm_struct *mm,
+                                          unsigned long address);
+
+#endif /* MMAP_LOCK_H */
@@ -0,0 +1,114 @@
+#ifndef MULTIBOOT_H
+#define MULTIBOOT_H
+
+#include "types.h"
+
+/*
+ * Multiboot Boot Information for MicroKernel
+ * Multiboot1 (QEMU -kernel) and Multiboot2 (GRUB2) handoff structures
+ */
+
+/* Values found in %eax at kernel entry */
+#define MULTIBOOT_BOOTLOADER_MAGIC      0x2BADB002
+#define MULTIBOOT2_BOOTLOADER_MAGIC     0x36d76289
+
+/* Multiboot1 info flags */
+#define MULTIBOOT_INFO_MEMORY           0x00000001
+#define MULTIBOOT_INFO_CMDLINE          0x00000004
+#define MULTIBOOT_INFO_MEM_MAP          0x00000040
+
+/* Multiboot2 tag types */
+#define MULTIBOOT2_TAG_END              0
+#define MULTIBOOT2_TAG_CMDLINE          1
+#define MULTIBOOT2_TAG_BASIC_MEMINFO    4
+#define MULTIBOOT2_TAG_MMAP             6
+
+/* Memory map entry types (shared by both protocols, e820 numbering) */
+#define MULTIBOOT_MEMORY_AVAILABLE      1
+#define MULTIBOOT_MEMORY_RESERVED       2
+#define MULTIBOOT_MEMORY_ACPI           3
+#define MULTIBOOT_MEMORY_NVS            4
+#define MULTIBOOT_MEMORY_BADRAM         5
+
+/*
+ * Multiboot1 information structure
+ */
+struct multiboot_info {
+    u32 flags;
+    u32 mem_lower;                  /* KB below 1MB */
+    u32 mem_upper;                  /* KB above 1MB */
+    u32 boot_device;
+    u32 cmdline;                    /* Physical address of string */
+    u32 mods_count;
+    u32 mods_addr;
+    u32 syms[4];
+    u32 mmap_length;                /* Bytes of memory map */
+    u32 mmap_addr;                  /* Physical address of memory map */
+} __packed;
+
+/* Multiboot1 map entries are prefixed by their own size */
+struct multiboot_mmap_entry {
+    u32 size;                       /* Entry size, excluding this field */
+    u64 addr;
+    u64 len;
+    u32 type;
+} __packed;
+
+/*
+ * Multiboot2 information: a fixed header followed by 8-byte aligned tags
+ */
+struct multiboot2_info {
+    u32 total_size;
+    u32 reserved;
+};
+
+struct multiboot2_tag {
+    u32 type;
+    u32 size;
+};
+
+struct multiboot2_tag_string {
+    u32 type;
+    u32 size;
+    char string[];
+};
+
+struct multiboot2_tag_basic_meminfo {
+    u32 type;
+    u32 size;
+    u32 mem_lower;
+    u32 mem_upper;
+};
+
+struct multiboot2_mmap_entry {
+    u64 addr;
+    u64 len;
+    u32 type;
+    u32 zero;
+};
+
+struct multiboot2_tag_mmap {
+    u32 type;
+    u32 size;
+    u32 entry_size;
+    u32 entry_version;
+    struct multiboot2_mmap_entry entries[];
+};
+
+/*
+ * Kernel command line
+ */
+#define COMMAND_LINE_SIZE   256
+
+extern char boot_command_line[COMMAND_LINE_SIZE];
+
+/* Parse the boot loader handoff into memblock and boot_command_line */
+void multiboot_init(u32 magic, unsigned long info);
+
+/* Value of "name=value" on the command line, or NULL if absent */
+const char *cmdline_get_option(const char *name);
+
+/* Parse a size with an optional K/M/G suffix */
+unsigned long memparse(const char *str, const char **endp);
+
+#endif /* MULTIBOOT_H */
@@ -0,0 +1,311 @@
+#ifndef PGTABLE_H
+#define PGTABLE_H
+
+#include "types.h"
+#include "mm.h"
+
+/*
+ * x86_64 Page Tables
+ *
+ * Four levels of 512 entries: PGD (PML4), PUD (PDPT), PMD (page
+ * directory) and PTE. A PMD entry with _PAGE_PSE set maps a 2MB page
+ * directly and has no PTE table below it.
+ */
+
+typedef u64 pgd_t;
+typedef u64 pud_t;
+typedef u64 pmd_t;
+typedef u64 pte_t;
+
+#define PTRS_PER_TABLE  512
+
+#define PGDIR_SHIFT     39
+#define PUD_SHIFT       30
+#define PMD_SHIFT       21
+
+#define PGDIR_SIZE      (1UL << PGDIR_SHIFT)
+#define PUD_SIZE        (1UL << PUD_SHIFT)
+#define PMD_SIZE        (1UL << PMD_SHIFT)
+#define PMD_MASK        (~(PMD_SIZE - 1))
+
+#define pgd_index(addr) (((addr) >> PGDIR_SHIFT) & (PTRS_PER_TABLE - 1))
+#define pud_index(addr) (((addr) >> PUD_SHIFT) & (PTRS_PER_TABLE - 1))
+#define pmd_index(addr) (((addr) >> PMD_SHIFT) & (PTRS_PER_TABLE - 1))
+#define pte_index(addr) (((addr) >> PAGE_SHIFT) & (PTRS_PER_TABLE - 1))
+
+/* Entry bits */
+#define _PAGE_PRESENT   0x001UL
+#define _PAGE_RW        0x002UL
+#define _PAGE_USER      0x004UL
+#define _PAGE_PWT       0x008UL
+#define _PAGE_PCD       0x010UL
+#define _PAGE_ACCESSED  0x020UL
+#define _PAGE_DIRTY     0x040UL
+#define _PAGE_PSE       0x080UL     /* 2MB page in a PMD entry */
+#define _PAGE_GLOBAL    0x100UL
+
+/*
+ * Not present to the CPU, but still mapping its page: user memory under
+ * PROT_NONE. User entries are never global, so the bit is free for it.
+ */
+#define _PAGE_PROTNONE  _PAGE_GLOBAL
+
+/*
+ * Nothing mapped, but the page is in swap: the rest of the entry says
+ * where (swap.h). Software bit, ignored by the CPU.
+ */
+#define _PAGE_SWP       0x200UL
+
+#define PTE_PFN_MASK    0x000FFFFFFFFFF000UL
+
+/* Bits of a user leaf entry that follow the VMA's protection */
+#define _PAGE_PROT_MASK (_PAGE_PRESENT | _PAGE_RW | _PAGE_USER | _PAGE_PROTNONE)
+
+/*
+ * Tables under a user address are writable and user-accessible, the
+ * leaf entries decide. Kernel entries in a PGD never have _PAGE_USER.
+ */
+#define _PAGE_TABLE     (_PAGE_PRESENT | _PAGE_RW | _PAGE_USER)
+#define _KERNPG_TABLE   (_PAGE_PRESENT | _PAGE_RW)
+
+/*
+ * Kernel mappings that come and go (vmalloc). Not global, so that a
+ * CR3 reload flushes them.
+ */
+#define PAGE_KERNEL     (_PAGE_PRESENT | _PAGE_RW)
+
+/* 1GB or 2MB pages of the direct map */
+#define PAGE_KERNEL_LARGE (_PAGE_PRESENT | _PAGE_RW | _PAGE_ACCESSED | \
+                           _PAGE_DIRTY | _PAGE_PSE)
+
+static inline bool entry_present(u64 entry)
+{
+    return (entry & _PAGE_PRESENT) != 0;
+}
+
+/* A user leaf entry with a page behind it, accessible or not */
+static inline bool entry_mapped(u64 entry)
+{
+    return (entry & (_PAGE_PRESENT | _PAGE_PROTNONE)) != 0;
+}
+
+/* Never used, or unmapped since */
+static inline bool pte_none(pte_t entry)
+{
+    return entry == 0;
+}
+
+static inline bool is_swap_pte(pte_t entry)
+{
+    return !entry_mapped(entry) && (entry & _PAGE_SWP);
+}
+
+static inline bool pmd_huge(pmd_t pmd)
+{
+    return (pmd & _PAGE_PSE) && entry_mapped(pmd);
+}
+
+/* A PUD entry with _PAGE_PSE maps 1GB */
+static inline bool pud_huge(pud_t pud)
+{
+    return (pud & (_PAGE_PRESENT | _PAGE_PSE)) == (_PAGE_PRESENT | _PAGE_PSE);
+}
+
+static inline unsigned long entry_pfn(u64 entry)
+{
+    return (entry & PTE_PFN_MASK) >> PAGE_SHIFT;
+}
+
+static inline struct page *entry_page(u64 entry)
+{
+    return pfn_to_page(entry_pfn(entry));
+}
+
+/* The table an upper-level entry points to */
+static inline void *entry_table(u64 entry)
+{
+    return __va(entry & PTE_PFN_MASK);
+}
+
+static inline u64 mk_entry(struct page *page, u64 prot)
+{
+    return (u64)page_to_phys(page) | prot;
+}
+
+/*
+ * CR3 and TLB
+ */
+static inline phys_addr_t read_cr3(void)
+{
+    phys_addr_t cr3;
+
+    __asm__ __volatile__("mov %%cr3, %0" : "=r"(cr3));
+    return cr3;
+}
+
+static inline void write_cr3(phys_addr_t cr3)
+{
+    __asm__ __volatile__("mov %0, %%cr3" : : "r"(cr3) : "memory");
+}
+
+#define X86_CR4_PGE     (1UL << 7)      /* Global pages */
+
+static inline unsigned long read_cr4(void)
+{
+    unsigned long cr4;
+
+    __asm__ __volatile__("mov %%cr4, %0" : "=r"(cr4));
+    return cr4;
+}
+
+static inline void write_cr4(unsigned long cr4)
+{
+    __asm__ __volatile__("mov %0, %%cr4" : : "r"(cr4) : "memory");
+}
+
+static inline void flush_tlb_one(unsigned long addr)
+{
+    __asm__ __volatile__("invlpg (%0)" : : "r"(addr) : "memory");
+}
+
+/* Drop every non-global translation */
+static inline void flush_tlb_local(void)
+{
+    write_cr3(read_cr3());
+}
+
+/* Above this many pages a range flush reloads CR3 instead */
+#define TLB_FLUSH_ALL_THRESHOLD 32
+
+/* Page fault error code */
+#define X86_PF_PROT     0x01    /* Present entry, access not allowed */
+#define X86_PF_WRITE    0x02
+#define X86_PF_USER     0x04    /* From user mode */
+#define X86_PF_RSVD     0x08    /* Reserved bit set in an entry */
+#define X86_PF_INSTR    0x10    /* Instruction fetch */
+
+/*
+ * Leaf protection bits for a VMA. There is no NX: the boot code does
+ * not enable EFER.NXE, so bit 63 would be reserved.
+ */
+static inline u64 vm_get_page_prot(unsigned long vm_flags)
+{
+    u64 prot = _PAGE_PRESENT | _PAGE_USER;
+
+    if (!(vm_flags & VM_ACCESS_FLAGS))
+        return _PAGE_PROTNONE;
+    if (vm_flags & VM_WRITE)
+        prot |= _PAGE_RW;
+    return prot;
+}
+
+struct mm_struct;
+
+/*
+ * Replace the boot page tables with a direct map of all RAM; runs
+ * before the buddy allocator, once memblock knows the memory map
+ */
+void init_mem_mapping(void);
+
+/* Record the kernel's PGD; user PGDs share its entries */
+void pgtable_init(void);
+
+/* Entry for addr in the kernel's PGD */
+pgd_t *pgd_offset_k(unsigned long addr);
+
+/* Top-level table of an address space, with the kernel entries */
+int pgd_alloc(struct mm_struct *mm);
+
+/* Free the PGD and every user page table below it */
+void pgd_free(struct mm_struct *mm);
+
+/*
+ * Entry for addr at the PMD or PTE level, or NULL if a table on the way
+ * is missing and alloc is false (or allocation failed). walk_pte also
+ * returns NULL when the PMD maps a huge page.
+ */
+pmd_t *walk_pmd(struct mm_struct *mm, unsigned long addr, bool alloc);
+pte_t *walk_pte(struct mm_struct *mm, unsigned long addr, bool alloc);
+
+/* Flush [start, end) of mm from the TLB if it is the loaded one */
+void flush_tlb_mm_range(struct mm_struct *mm, unsigned long start,
+                        unsigned long end);
+
+struct vm_area_struct;
+
+/*
+ * Changes to the page tables of one mm, gathered so that the TLB is
+ * flushed once for all of them: entries are cleared or write-protected
+ * first, and the pages they mapped are freed only after the flush.
+ */
+struct mmu_gather {
+    struct mm_struct *mm;
+    unsigned long start;            /* Range to flush, empty if start >= end */
+    unsigned long end;
+    struct list_head pages;         /* 4KB pages and page tables, via lru */
+    struct list_head thp;           /* Transparent huge pages */
+    struct list_head huge;          /* Pool huge pages */
+};
+
+void tlb_gather_mmu(struct mmu_gather *tlb, struct mm_struct *mm);
+
+/* Flush the gathered range and free the gathered pages */
+void tlb_finish_mmu(struct mmu_gather *tlb);
+
+/* Zero-filled page mapped read-only by read faults on private memory */
+extern struct page *zero_page;
+
+static inline bool is_zero_entry(u64 entry)
+{
+    return entry_pfn(entry) == page_to_pfn(zero_page);
+}
+
+/*
+ * Fault in [start, end) of a VMA as if each page had been touched:
+ * written if the VMA is writable, read otherwise
+ */
+int populate_vma_range(struct vm_area_struct *vma, unsigned long start,
+                       unsigned long end);
+
+/*
+ * Remap the transparent huge page around an unaligned addr with PTEs,
+ * so that a range boundary can fall inside it
+ */
+int split_huge_pmd_address(struct vm_area_struct *vma, unsigned long addr);
+
+/*
+ * Move the entries of [old_addr, old_addr + len) to new_addr, unmapped,
+ * in the same mm, for mremap. Returns the bytes moved.
+ */
+unsigned long move_page_tables(struct vm_area_struct *vma,
+                               unsigned long old_addr, unsigned long new_addr,
+                               unsigned long len);
+
+/* Unmap [start, end) of a VMA; the pages are freed by tlb_finish_mmu */
+void zap_page_range(struct mmu_gather *tlb, struct vm_area_struct *vma,
+                    unsigned long start, unsigned long end);
+
+/*
+ * Apply the VMA's current protection to [start, end). Write access is
+ * taken away at once; it is given back to the pages of a shared mapping
+ * and to private pages mapped once, the others get it from a write
+ * fault.
+ */
+void change_protection(struct mmu_gather *tlb, struct vm_area_struct *vma,
+                       unsigned long start, unsigned long end);
+
+/*
+ * Copy the entries of a VMA to its copy in a child at fork; private
+ * pages become copy-on-write. Write-protected parent entries are added
+ * to tlb for flushing.
+ */
+int copy_page_range(struct mmu_gather *tlb, struct vm_area_struct *dst_vma,
+                    struct vm_area_struct *src_vma);
+
+/* Copy-on-write faults that copied the page and that reused it */
+void cow_stats(unsigned long *copied, unsigned long *reused);
+
+/* Faults that brought a page back from swap, and the cycles they took */
+void swapin_stats(unsigned long *faults, u64 *cycles);
+
+#endif /* PGTABLE_H */
@@ -0,0 +1,56 @@
+#ifndef RBTREE_H
+#define RBTREE_H
+
+#include "types.h"
+#include "list.h"
+
+/*
+ * Red-Black Trees for MicroKernel
+ *
+ * Intrusive trees with the Linux interface: callers walk down to the
+ * insertion point themselves, link the node with rb_link_node and then
+ * rebalance with rb_insert_color. The parent pointer and the color
+ * share __rb_parent_color (nodes are at least 4-byte aligned).
+ */
+
+#define RB_RED          0
+#define RB_BLACK        1
+
+#define rb_parent(r)    ((struct rb_node *)((r)->__rb_parent_color & ~3UL))
+#define rb_color(r)     ((r)->__rb_parent_color & 1)
+#define rb_is_red(r)    (rb_color(r) == RB_RED)
+#define rb_is_black(r)  (rb_color(r) == RB_BLACK)
+
+#define rb_entry(ptr, type, member) container_of(ptr, type, member)
+
+#define rb_entry_safe(ptr, type, member) ({                 \
+    typeof(ptr) ____ptr = (ptr);                            \
+    ____ptr ? rb_entry(____ptr, type, member) : NULL;       \
+})
+
+#define RB_EMPTY_ROOT(root)  ((root)->rb_node == NULL)
+
+/* A node not in any tree points to itself */
+#define RB_EMPTY_NODE(node)  ((node)->__rb_parent_color == (unsigned long)(node))
+#define RB_CLEAR_NODE(node)  ((node)->__rb_parent_color = (unsigned long)(node))
+
+static inline void rb_link_node(struct rb_node *node, struct rb_node *parent,
+                                struct rb_node **rb_link)
+{
+    node->__rb_parent_color = (unsigned long)parent;    /* Red */
+    node->rb_left = NULL;
+    node->rb_right = NULL;
+    *rb_link = node;
+}
+
+/* Rebalance after rb_link_node */
+void rb_insert_color(struct rb_node *node, struct rb_root *root);
+void rb_erase(struct rb_node *node, struct rb_root *root);
+
+/* In-order traversal; NULL past either end */
+struct rb_node *rb_first(const struct rb_root *root);
+struct rb_node *rb_last(const struct rb_root *root);
+struct rb_node *rb_next(const struct rb_node *node);
+struct rb_node *rb_prev(const struct rb_node *node);
+
+#endif /* RBTREE_H */
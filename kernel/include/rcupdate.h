@@ -0,0 +1,64 @@
+#ifndef RCUPDATE_H
+#define RCUPDATE_H
+
+#include "types.h"
+
+/*
+ * Read-Copy Update for MicroKernel
+ *
+ * Readers walk a structure without locks between rcu_read_lock and
+ * rcu_read_unlock. Writers never change what a reader may be looking
+ * at: they publish a new version with rcu_assign_pointer and hand the
+ * old one to call_rcu, which frees it once every reader that could
+ * have seen it is done.
+ *
+ * Only one CPU runs and the kernel is not preemptive, so this is the
+ * uniprocessor scheme: readers cannot sleep, and any point outside a
+ * read-side section is a quiescent state. Callbacks run from the idle
+ * loop, from synchronize_rcu, and from call_rcu once enough of them
+ * are waiting.
+ */
+
+struct rcu_head {
+    struct rcu_head *next;
+    void (*func)(struct rcu_head *head);
+};
+
+extern unsigned int rcu_read_lock_nesting;
+
+#define rcu_barrier_compiler()  __asm__ __volatile__("" : : : "memory")
+
+static inline void rcu_read_lock(void)
+{
+    rcu_read_lock_nesting++;
+    rcu_barrier_compiler();
+}
+
+static inline void rcu_read_unlock(void)
+{
+    rcu_barrier_compiler();
+    rcu_read_lock_nesting--;
+}
+
+/*
+ * Publish v at p: everything written to v before is visible to a reader
+ * that finds it. x86 does not reorder stores, so ordering the compiler
+ * is enough.
+ */
+#define rcu_assign_pointer(p, v) do {                       \
+    rcu_barrier_compiler();                                 \
+    *(typeof(p) volatile *)&(p) = (v);                      \
+} while (0)
+
+#define rcu_dereference(p)  (*(typeof(p) volatile *)&(p))
+
+/* Call func(head) after a grace period */
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head));
+
+/* Wait for a grace period, running the callbacks that were waiting */
+void synchronize_rcu(void);
+
+/* The CPU is outside any read-side section: run waiting callbacks */
+void rcu_qs(void);
+
+#endif /* RCUPDATE_H */
@@ -4,6 +4,7 @@
 #include "types.h"
 #include "list.h"
 #include "spinlock.h"
+#include "maple_tree.h"
 
 /*
  * Task states
@@ -20,6 +21,13 @@
 #define TASK_PARKED             0x0100
 #define TASK_NEW                0x0200
 
+/*
+ * Kernel stack size
+ */
+#define THREAD_SIZE_ORDER       2
+#define THREAD_SIZE             (4096UL << THREAD_SIZE_ORDER)
+#define NR_CACHED_STACKS        2       /* Freed stacks kept per CPU */
+
 /*
  * Scheduling priorities
  */
@@ -68,6 +76,7 @@
 /*
  * Clone flags
  */
+#define CSIGNAL                 0x000000ff  /* Exit signal */
 #define CLONE_VM                0x00000100
 #define CLONE_FS                0x00000200
 #define CLONE_FILES             0x00000400
@@ -248,19 +257,36 @@ struct files_struct {
     struct file *fd_array[32];
 };
 
+/*
+ * Per-task cache of the VMAs its last lookups found, in its own mm. It
+ * is valid while seqnum matches the mm's vmacache_seqnum.
+ */
+#define VMACACHE_BITS   2
+#define VMACACHE_SIZE   (1U << VMACACHE_BITS)
+#define VMACACHE_MASK   (VMACACHE_SIZE - 1)
+
+struct vm_area_struct;
+
+struct vmacache {
+    u64 seqnum;
+    struct vm_area_struct *vmas[VMACACHE_SIZE];
+};
+
 /*
  * Memory management structure
  */
 struct mm_struct {
-    struct list_head mmap_list;
-    struct rb_root mm_rb;
+    struct maple_tree mm_mt;        /* VMAs by address */
+    u64 vmacache_seqnum;            /* Bumped when a VMA is unlinked */
     u32 map_count;
     spinlock_t page_table_lock;
     spinlock_t mmap_lock;
+    int mm_lock_seq;                /* Bumped as mmap_lock is dropped */
 
     unsigned long mmap_base;
     unsigned long task_size;
     unsigned long highest_vm_end;
+    unsigned long def_flags;        /* Given to new VMAs: MCL_FUTURE */
 
     phys_addr_t pgd;
 
@@ -268,8 +294,8 @@ struct mm_struct {
     u32 mm_count;
 
     unsigned long total_vm;
-    unsigned long locked_vm;
-    unsigned long pinned_vm;
+    unsigned long locked_vm;        /* Pages in VM_LOCKED VMAs */
+    unsigned long pinned_vm;        /* Pool huge pages, which never move */
     unsigned long data_vm;
     unsigned long exec_vm;
     unsigned long stack_vm;
@@ -380,6 +406,7 @@ struct task_struct {
     /* Memory management */
     struct mm_struct *mm;
     struct mm_struct *active_mm;
+    struct vmacache vmacache;
 
     /* Filesystem */
     struct fs_struct *fs;
@@ -489,11 +516,32 @@ long do_brk(unsigned long brk);
 long do_mmap(unsigned long addr, unsigned long len, unsigned long prot,
              unsigned long flags, unsigned long fd, unsigned long offset);
 long do_munmap(unsigned long addr, size_t len);
+long do_mremap(unsigned long addr, size_t old_len, size_t new_len,
+               unsigned long flags, unsigned long new_addr);
+long do_mprotect(unsigned long start, size_t len, unsigned long prot);
+long do_madvise(unsigned long start, size_t len, int advice);
+long do_mlock(unsigned long start, size_t len);
+long do_munlock(unsigned long start, size_t len);
+long do_mlockall(int flags);
+long do_munlockall(void);
+
+/* Page fault entry, from the exception handler */
+void do_page_fault(unsigned long address, unsigned long error_code);
 
 /* Memory management */
 struct mm_struct *mm_alloc(void);
 void mm_free(struct mm_struct *mm);
 
+/* Drop a user of an mm shared with CLONE_VM; the last one frees it */
+void mmput(struct mm_struct *mm);
+
+/* Task, mm and kernel stack caches */
+void fork_init(void);
+void *alloc_thread_stack(void);
+void free_thread_stack(void *stack);
+void bench_fork_exit(unsigned long iterations);
+void bench_fork_exec(unsigned long mb);
+
 /* Context switch (assembly) */
 extern void switch_to(struct task_struct *prev, struct task_struct *next);
 extern void ret_from_fork(void);
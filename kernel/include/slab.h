@@ -0,0 +1,104 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include "types.h"
+#include "list.h"
+#include "spinlock.h"
+#include "mm.h"
+
+/*
+ * Slab Allocator Header for MicroKernel
+ * SLUB-style object caches backed by buddy pages
+ */
+
+/* Cache creation flags */
+#define SLAB_HWCACHE_ALIGN      0x01    /* Align objects to cache lines */
+#define SLAB_PANIC              0x02    /* Panic if creation fails */
+#define SLAB_RECLAIM_ACCOUNT    0x04    /* Shrinkable: use reclaimable pages */
+
+#define L1_CACHE_BYTES          64
+
+/* kmalloc size classes */
+#define KMALLOC_MIN_SIZE        8
+#define KMALLOC_SHIFT_HIGH      13
+#define KMALLOC_MAX_CACHE_SIZE  (1UL << KMALLOC_SHIFT_HIGH)
+
+/* Slab sizing */
+#define SLAB_MAX_ORDER          3       /* Largest slab is 8 pages */
+#define SLAB_MIN_OBJECTS        4       /* Preferred objects per slab */
+#define SLAB_MIN_PARTIAL        5       /* Empty slabs kept per cache */
+
+/* Caches that can exist at once; a slab page finds its own by id */
+#define SLAB_MAX_CACHES         256
+
+/*
+ * Per-CPU slab state
+ *
+ * Each CPU owns one slab ("frozen": off the partial list) and a private
+ * freelist of its objects, so the common alloc/free needs no lock.
+ */
+struct kmem_cache_cpu {
+    void *freelist;                 /* Next free object */
+    struct page *page;              /* Slab being allocated from */
+
+    /* Statistics */
+    unsigned long alloc_fast;       /* Served from freelist */
+    unsigned long alloc_slow;       /* Needed a new or partial slab */
+    unsigned long free_fast;        /* Freed to own slab */
+    unsigned long free_slow;        /* Freed to another slab */
+};
+
+/*
+ * Object cache
+ */
+struct kmem_cache {
+    const char *name;
+    unsigned int object_size;       /* Size requested by the caller */
+    unsigned int size;              /* Object stride in the slab */
+    unsigned int align;             /* Object alignment */
+    unsigned int offset;            /* Free pointer offset in object */
+    unsigned int order;             /* Slab page order */
+    unsigned int objects;           /* Objects per slab */
+    unsigned long flags;
+    void (*ctor)(void *);           /* Object constructor */
+    unsigned int id;                /* In its slab pages' page field */
+
+    spinlock_t lock;                /* Protects partial list */
+    struct pfn_list partial;        /* Slabs with free objects */
+    unsigned long nr_partial;
+    unsigned long min_partial;      /* Empty slabs to keep around */
+    unsigned long nr_slabs;         /* Slabs owned by this cache */
+
+    struct list_head list;          /* Global cache list */
+
+    struct kmem_cache_cpu cpu_slab[NR_CPUS];
+};
+
+/* Initialize the slab allocator and kmalloc caches */
+void kmem_cache_init(void);
+
+/* Create and destroy object caches */
+struct kmem_cache *kmem_cache_create(const char *name, unsigned int size,
+                                     unsigned int align, unsigned long flags,
+                                     void (*ctor)(void *));
+void kmem_cache_destroy(struct kmem_cache *s);
+
+/* Allocate and free objects */
+void *kmem_cache_alloc(struct kmem_cache *s, gfp_t flags);
+void kmem_cache_free(struct kmem_cache *s, void *obj);
+
+static inline void *kmem_cache_zalloc(struct kmem_cache *s, gfp_t flags)
+{
+    return kmem_cache_alloc(s, flags | GFP_ZERO);
+}
+
+/* Release empty slabs back to the page allocator */
+unsigned long kmem_cache_shrink(struct kmem_cache *s);
+
+/* The same for every cache, for reclaim; returns the pages freed */
+unsigned long kmem_cache_shrink_all(void);
+
+/* Cache statistics */
+void show_slabinfo(void);
+
+#endif /* SLAB_H */
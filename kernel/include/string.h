@@ -0,0 +1,25 @@
+#ifndef STRING_H
+#define STRING_H
+
+#include "types.h"
+
+/*
+ * Kernel String Library for MicroKernel
+ * Memory block operations with per-CPU implementation selection
+ */
+
+/* Blocks at least this large are written with non-temporal stores */
+#define MEM_NT_THRESHOLD    4096
+
+/* Select the implementations for this CPU; call once at boot */
+void string_init(void);
+
+void *memset(void *s, int c, size_t n);
+void *memcpy(void *dest, const void *src, size_t n);
+void *memmove(void *dest, const void *src, size_t n);
+int memcmp(const void *s1, const void *s2, size_t n);
+
+/* Copy/set throughput per size class */
+void bench_mem(unsigned long iterations);
+
+#endif /* STRING_H */
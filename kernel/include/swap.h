@@ -0,0 +1,161 @@
+#ifndef SWAP_H
+#define SWAP_H
+
+#include "types.h"
+#include "mm.h"
+#include "pgtable.h"
+
+/*
+ * Swap for MicroKernel
+ *
+ * There is no swap device: swapped-out pages are compressed into RAM
+ * (zswap.c). Anonymous pages sit on LRU lists, and when memory runs
+ * low, reclaim (vmscan.c) takes the coldest, stores each compressed
+ * and replaces the entry mapping it with a swap entry. A fault on that
+ * entry decompresses the page into a new one.
+ *
+ * Reclaim runs in the background, as kswapd, once a zone falls below
+ * its low watermark, and directly in an allocation that finds nothing
+ * free above min.
+ *
+ * Reclaim, and compaction moving a page, need the entry mapping it.
+ * Without reverse mapping, a page mapped once keeps its mm in
+ * page->mapping and its address in the page field of its flags. Pages shared since fork have no owner
+ * and stay resident until a write gives each side its own.
+ */
+
+/* Where a swapped-out page is; opaque outside zswap.c */
+typedef struct {
+    unsigned long val;
+} swp_entry_t;
+
+#define SWP_OFFSET_SHIFT    PAGE_SHIFT
+
+static inline pte_t swp_entry_to_pte(swp_entry_t entry)
+{
+    return (entry.val << SWP_OFFSET_SHIFT) | _PAGE_SWP;
+}
+
+static inline swp_entry_t pte_to_swp_entry(pte_t pte)
+{
+    swp_entry_t entry = { pte >> SWP_OFFSET_SHIFT };
+
+    return entry;
+}
+
+static inline void page_set_owner(struct page *page, struct mm_struct *mm,
+                                  unsigned long addr)
+{
+    page->mapping = mm;
+    set_page_field(page, addr >> PAGE_SHIFT);
+}
+
+static inline struct mm_struct *page_owner(struct page *page)
+{
+    return page->mapping;
+}
+
+static inline unsigned long page_owner_address(struct page *page)
+{
+    return page_field(page) << PAGE_SHIFT;
+}
+
+/* Pages reclaim isolates from a list at a time */
+#define SWAP_CLUSTER_MAX    32
+
+/* Reclaim looks at 1 / (1 << priority) of the lists, down to all of them */
+#define DEF_PRIORITY        12
+
+/* Pages compressing to more than this, with a header, are not stored */
+#define ZSWAP_MAX_OBJECT    ALIGN_DOWN(2 * PAGE_SIZE / 3, 8)
+
+/*
+ * LRU
+ *
+ * A new anonymous page mapped by vma goes on the inactive list, or the
+ * unevictable one if vma may not lose it. Pages are taken off before
+ * they are freed.
+ */
+void lru_cache_add(struct page *page, struct vm_area_struct *vma);
+void lru_cache_del(struct page *page);
+
+/* vma lost VM_LOCKED: its pages over [start, end) may be reclaimed again */
+void munlock_vma_pages_range(struct vm_area_struct *vma, unsigned long start,
+                             unsigned long end);
+
+/*
+ * Swap out anonymous pages until nr_pages are free, or every page has
+ * been looked at twice. Returns the pages freed. try_to_free_pages is
+ * direct reclaim, by an allocation that has to wait for it, and counts
+ * as a stall; shrink_all_memory is on request.
+ */
+unsigned long try_to_free_pages(unsigned long nr_pages);
+unsigned long shrink_all_memory(unsigned long nr_pages);
+
+/*
+ * Background reclaim. An allocation that takes zone below its low
+ * watermark wakes kswapd, which runs from the idle loop until the zone
+ * is back above high, or until it can free nothing more.
+ */
+void wakeup_kswapd(struct zone *zone);
+int kswapd_idle_work(void);
+
+/*
+ * Compressed store
+ *
+ * zswap_store compresses page and returns where it went in entry:
+ * -E2BIG if it does not compress well enough, -ENOMEM if there is no
+ * memory to put it in. zswap_load decompresses into page. Each entry
+ * starts with one reference, for the swap entry it goes in; fork takes
+ * more with swap_duplicate, and swap_free drops one.
+ */
+int zswap_store(struct page *page, swp_entry_t *entry);
+int zswap_load(swp_entry_t entry, struct page *page);
+void swap_duplicate(swp_entry_t entry);
+void swap_free(swp_entry_t entry);
+
+void zswap_init(void);
+
+struct zswap_stats {
+    unsigned long stored_pages;     /* Pages in the store */
+    unsigned long compressed_bytes; /* Their compressed size */
+    unsigned long pool_pages;       /* Memory holding them */
+    unsigned long stores;
+    unsigned long loads;
+    unsigned long rejects;          /* Compressed too badly */
+    unsigned long alloc_fails;
+    u64 store_cycles;
+    u64 load_cycles;
+};
+
+void zswap_get_stats(struct zswap_stats *stats);
+
+struct reclaim_stats {
+    unsigned long runs;
+    unsigned long scanned;
+    unsigned long reclaimed;
+    unsigned long activated;
+    unsigned long deactivated;
+    unsigned long culled;           /* Found unevictable */
+    u64 cycles;
+    unsigned long allocstall;       /* Direct reclaim runs */
+    unsigned long direct_reclaimed;
+    u64 stall_cycles;
+    unsigned long kswapd_wake;
+    unsigned long kswapd_steps;
+    unsigned long kswapd_reclaimed; /* From the LRU lists */
+    unsigned long kswapd_slab;      /* Empty slabs, in pages */
+};
+
+void reclaim_get_stats(struct reclaim_stats *stats);
+
+void swap_init(void);
+void show_swap_stats(void);
+
+/* Swap out and fault back mb of anonymous memory */
+void bench_swap(unsigned long mb);
+
+/* Fault in mb of anonymous memory with and without kswapd keeping up */
+void bench_reclaim(unsigned long mb);
+
+#endif /* SWAP_H */
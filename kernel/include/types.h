@@ -54,6 +54,7 @@ typedef enum {
 #define EAGAIN      11
 #define EINTR       4
 #define EIO         5
+#define E2BIG       7
 #define EPERM       1
 #define ESRCH       3
 #define ECHILD      10
@@ -78,6 +79,7 @@ typedef enum {
 #define ENETUNREACH 101
 #define ETIMEDOUT   110
 
+#define SIGSEGV     11
 #define SIGCHLD     17
 
 /* PAGE_SIZE, PAGE_SHIFT, PAGE_MASK are defined in mm.h */
@@ -87,6 +89,7 @@ typedef enum {
 #define IS_ALIGNED(x, align) (((x) & ((align) - 1)) == 0)
 
 #define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
+#define ULONG_MAX (~0UL)
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 #define CLAMP(x, lo, hi) (MIN(hi, MAX(lo, x)))
@@ -96,10 +99,51 @@ typedef enum {
 #define CLEAR_BIT(x, n) ((x) &= ~BIT(n))
 #define TEST_BIT(x, n) (((x) & BIT(n)) != 0)
 
+/* One access, which the compiler may not split, merge or repeat */
+#define READ_ONCE(x) (*(const volatile typeof(x) *)&(x))
+#define WRITE_ONCE(x, v) (*(volatile typeof(x) *)&(x) = (v))
+
+/* Index of the lowest set bit; x must be non-zero */
+static inline unsigned long __ffs(unsigned long x)
+{
+    return (unsigned long)__builtin_ctzl(x);
+}
+
+/* Index of the highest set bit; x must be non-zero */
+static inline unsigned long __fls(unsigned long x)
+{
+    return 63UL - (unsigned long)__builtin_clzl(x);
+}
+
 #define mb()  __asm__ __volatile__("mfence" ::: "memory")
 #define rmb() __asm__ __volatile__("lfence" ::: "memory")
 #define wmb() __asm__ __volatile__("sfence" ::: "memory")
 
+/* CPU timestamp counter, for timing boot phases and benchmarks */
+static inline u64 rdtsc(void)
+{
+    u32 lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((u64)hi << 32) | lo;
+}
+
+/* CPU identification */
+static inline void cpuid(u32 leaf, u32 subleaf,
+                         u32 *eax, u32 *ebx, u32 *ecx, u32 *edx)
+{
+    __asm__ __volatile__("cpuid"
+                         : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+                         : "a"(leaf), "c"(subleaf));
+}
+
+/* TSC frequency, calibrated during boot (0 until then) */
+extern unsigned long tsc_khz;
+
+static inline u64 tsc_to_us(u64 cycles)
+{
+    return tsc_khz ? (cycles * 1000) / tsc_khz : 0;
+}
+
 #define __packed __attribute__((packed))
 #define __aligned(x) __attribute__((aligned(x)))
 #define __section(x) __attribute__((section(x)))
@@ -119,6 +163,8 @@ typedef enum {
 #define KERNEL_VIRTUAL_BASE 0xFFFF800000000000UL
 #define USER_VIRTUAL_BASE   0x0000000000000000UL
 #define USER_VIRTUAL_END    0x0000800000000000UL
+#define VMALLOC_START       0xFFFF880000000000UL
+#define VMALLOC_END         0xFFFFC80000000000UL
 
 #define __pa(x) ((phys_addr_t)(x) - KERNEL_VIRTUAL_BASE)
 #define __va(x) ((void *)((phys_addr_t)(x) + KERNEL_VIRTUAL_BASE))
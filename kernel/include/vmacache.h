@@ -0,0 +1,41 @@
+#ifndef VMACACHE_H
+#define VMACACHE_H
+
+#include "types.h"
+#include "sched.h"
+#include "mm.h"
+
+/*
+ * VMA Lookup Cache
+ *
+ * Faults come in runs over the same few mappings, so each task keeps
+ * the last VMAs find_vma returned for its mm, slotted by page number.
+ * A lookup that one of them contains skips the tree walk.
+ *
+ * Unlinking a VMA bumps the mm's sequence number, and a task whose
+ * cache is behind empties it before its next lookup. A VMA that only
+ * shrinks or grows stays valid: a hit is checked against its bounds.
+ */
+
+#define VMACACHE_HASH(addr) (((addr) >> PAGE_SHIFT) & VMACACHE_MASK)
+
+static inline void vmacache_flush(struct task_struct *tsk)
+{
+    memset(tsk->vmacache.vmas, 0, sizeof(tsk->vmacache.vmas));
+}
+
+static inline void vmacache_invalidate(struct mm_struct *mm)
+{
+    mm->vmacache_seqnum++;
+}
+
+/* Remember that a lookup of addr found vma */
+void vmacache_update(unsigned long addr, struct vm_area_struct *vma);
+
+/* Cached VMA of the current task containing addr, or NULL */
+struct vm_area_struct *vmacache_find(struct mm_struct *mm, unsigned long addr);
+
+/* Lookups that tried the cache, and those it answered */
+void vmacache_stats(unsigned long *calls, unsigned long *hits);
+
+#endif /* VMACACHE_H */
@@ -0,0 +1,55 @@
+#ifndef VMALLOC_H
+#define VMALLOC_H
+
+#include "types.h"
+#include "mm.h"
+
+/*
+ * Virtually Contiguous Kernel Memory for MicroKernel
+ *
+ * vmalloc maps order-0 pages next to each other in the VMALLOC_START..
+ * VMALLOC_END range, so large buffers do not depend on finding a free
+ * high-order block. Each area is followed by an unmapped guard page.
+ *
+ * Free address ranges are indexed twice, by address to merge neighbours
+ * and by size for a best-fit search. vfree unmaps and frees the pages
+ * at once but flushes the TLB lazily: freed ranges wait on a purge list
+ * and go back to the free index together, after one flush, once
+ * VMAP_LAZY_MAX_PAGES have piled up or the range runs out.
+ */
+
+#define VMAP_GUARD_SIZE         PAGE_SIZE
+
+/* Freed pages of address space that may wait for a TLB flush */
+#define VMAP_LAZY_MAX_PAGES     ((32UL << 20) >> PAGE_SHIFT)
+
+static inline bool is_vmalloc_addr(const void *addr)
+{
+    unsigned long a = (unsigned long)addr;
+
+    return a >= VMALLOC_START && a < VMALLOC_END;
+}
+
+/* Set up the kernel page tables and the free range; after pgtable_init */
+void vmalloc_init(void);
+
+void *vmalloc(unsigned long size);
+void *vzalloc(unsigned long size);
+void vfree(const void *addr);
+
+/* Page behind a vmalloc address, or NULL */
+struct page *vmalloc_to_page(const void *addr);
+
+/*
+ * kmalloc when a physically contiguous block is easy to get, vmalloc
+ * otherwise. Free with kvfree.
+ */
+void *kvmalloc(size_t size, gfp_t flags);
+void kvfree(const void *addr);
+
+void show_vmallocinfo(void);
+
+/* vmalloc/vfree cost with lazy and per-free TLB flushing */
+void bench_vmalloc(unsigned long iterations);
+
+#endif /* VMALLOC_H */
@@ -0,0 +1,221 @@
+/*
+ * MicroKernel LZ4
+ *
+ * See lz4.h. A block is a series of sequences: a token byte with the
+ * literal count in its high nibble and the match length less four in
+ * its low one, each continued in bytes of 255 and a remainder once it
+ * reaches 15; the literals; and the two-byte little-endian distance
+ * back to the match. The last sequence is literals only and covers at
+ * least the last five bytes, and no match starts in the last twelve,
+ * which lets decoders copy in whole words.
+ */
+
+#include "../include/lz4.h"
+#include "../include/string.h"
+#include "../include/types.h"
+
+#define MINMATCH        4
+#define MFLIMIT         12      /* No match starts in the last 12 bytes */
+#define LASTLITERALS    5       /* ... or reaches the last 5 */
+#define ML_BITS         4
+#define ML_MASK         ((1U << ML_BITS) - 1)
+#define RUN_MASK        ML_MASK
+#define MAX_DISTANCE    65535
+
+/* Every 1 << SKIP_TRIGGER misses in a row, the search steps further */
+#define SKIP_TRIGGER    6
+
+typedef u32 __attribute__((may_alias, aligned(1))) u32_unaligned;
+typedef u64 __attribute__((may_alias, aligned(1))) u64_unaligned;
+
+static inline u32 read32(const u8 *p)
+{
+    return *(const u32_unaligned *)p;
+}
+
+static inline u32 lz4_hash(u32 seq)
+{
+    return (seq * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+/* The part of a length past its nibble */
+static inline u8 *write_length(u8 *op, size_t len)
+{
+    for (; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = (u8)len;
+    return op;
+}
+
+/* Most bytes a sequence can take */
+static inline size_t sequence_bound(size_t litlen, size_t mlen)
+{
+    return 1 + litlen / 255 + 1 + litlen + 2 + mlen / 255 + 1;
+}
+
+int lz4_compress(const void *source, size_t len, void *dest, size_t max,
+                 void *wrkmem)
+{
+    const u8 *src = source, *ip = src, *anchor = src, *ref;
+    const u8 *iend = src + len, *mflimit, *matchlimit;
+    u8 *dst = dest, *op = dst, *oend = dst + max, *token;
+    u16 *table = wrkmem;
+    size_t litlen, mlen, distance;
+    unsigned int misses = 0;
+    u32 seq, h;
+
+    if (len > LZ4_MAX_INPUT_SIZE)
+        return 0;
+    if (len < MFLIMIT + 1)
+        goto last_literals;
+
+    mflimit = iend - MFLIMIT;
+    matchlimit = iend - LASTLITERALS;
+
+    /* An empty slot points at the start, which the compare rules out */
+    memset(table, 0, LZ4_MEM_COMPRESS);
+
+    while (ip <= mflimit) {
+        seq = read32(ip);
+        h = lz4_hash(seq);
+        ref = src + table[h];
+        table[h] = (u16)(ip - src);
+
+        if (ref >= ip || ip - ref > MAX_DISTANCE || read32(ref) != seq) {
+            ip += 1 + (misses++ >> SKIP_TRIGGER);
+            continue;
+        }
+        misses = 0;
+
+        /* Take the match back over equal literals, then as far as it goes */
+        while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+            ip--;
+            ref--;
+        }
+        mlen = MINMATCH;
+        while (ip + mlen < matchlimit && ip[mlen] == ref[mlen])
+            mlen++;
+
+        litlen = ip - anchor;
+        if (sequence_bound(litlen, mlen) > (size_t)(oend - op))
+            return 0;
+
+        token = op++;
+        if (litlen >= RUN_MASK) {
+            *token = RUN_MASK << ML_BITS;
+            op = write_length(op, litlen - RUN_MASK);
+        } else {
+            *token = litlen << ML_BITS;
+        }
+        memcpy(op, anchor, litlen);
+        op += litlen;
+
+        distance = ip - ref;
+        *op++ = (u8)distance;
+        *op++ = (u8)(distance >> 8);
+
+        if (mlen - MINMATCH >= ML_MASK) {
+            *token |= ML_MASK;
+            op = write_length(op, mlen - MINMATCH - ML_MASK);
+        } else {
+            *token |= mlen - MINMATCH;
+        }
+
+        ip += mlen;
+        anchor = ip;
+
+        /* Matches often continue from just before where this one ended */
+        if (ip <= mflimit)
+            table[lz4_hash(read32(ip - 2))] = (u16)(ip - 2 - src);
+    }
+
+last_literals:
+    litlen = iend - anchor;
+    if (1 + litlen / 255 + 1 + litlen > (size_t)(oend - op))
+        return 0;
+
+    token = op++;
+    if (litlen >= RUN_MASK) {
+        *token = RUN_MASK << ML_BITS;
+        op = write_length(op, litlen - RUN_MASK);
+    } else {
+        *token = litlen << ML_BITS;
+    }
+    memcpy(op, anchor, litlen);
+    op += litlen;
+
+    return op - dst;
+}
+
+int lz4_decompress(const void *source, size_t len, void *dest, size_t max)
+{
+    const u8 *ip = source, *iend = ip + len, *ref;
+    u8 *dst = dest, *op = dst, *oend = dst + max;
+    size_t litlen, mlen, distance;
+    unsigned int token;
+    u8 b;
+
+    for (;;) {
+        if (ip >= iend)
+            return -EINVAL;
+
+        token = *ip++;
+        litlen = token >> ML_BITS;
+        if (litlen == RUN_MASK) {
+            do {
+                if (ip >= iend)
+                    return -EINVAL;
+                b = *ip++;
+                litlen += b;
+            } while (b == 255);
+        }
+
+        if (litlen > (size_t)(iend - ip) || litlen > (size_t)(oend - op))
+            return -EINVAL;
+
+        /* Short runs as two words, when both buffers have room past them */
+        if (litlen <= 16 && iend - ip >= 16 && oend - op >= 16) {
+            ((u64_unaligned *)op)[0] = ((const u64_unaligned *)ip)[0];
+            ((u64_unaligned *)op)[1] = ((const u64_unaligned *)ip)[1];
+        } else {
+            memcpy(op, ip, litlen);
+        }
+        ip += litlen;
+        op += litlen;
+
+        /* Only the last sequence ends after its literals */
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return -EINVAL;
+        distance = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (distance == 0 || distance > (size_t)(op - dst))
+            return -EINVAL;
+
+        mlen = token & ML_MASK;
+        if (mlen == ML_MASK) {
+            do {
+                if (ip >= iend)
+                    return -EINVAL;
+                b = *ip++;
+                mlen += b;
+            } while (b == 255);
+        }
+        mlen += MINMATCH;
+        if (mlen > (size_t)(oend - op))
+            return -EINVAL;
+
+        /* Overlapping copies repeat the bytes before them */
+        ref = op - distance;
+        if (distance >= 8) {
+            for (; mlen >= 8; mlen -= 8, op += 8, ref += 8)
+                *(u64_unaligned *)op = *(const u64_unaligned *)ref;
+        }
+        while (mlen--)
+            *op++ = *ref++;
+    }
+
+    return op - dst;
+}
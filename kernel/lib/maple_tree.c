@@ -0,0 +1,746 @@
+/*
+ * MicroKernel Maple Trees
+ *
+ * See maple_tree.h. A change walks down to its leaf, recording the
+ * path, and builds the new leaf; each node on the path is then rebuilt
+ * from its old slots with the one or two nodes that replace the child
+ * below. A node that outgrows its slots is split in two; one left less
+ * than half full is merged with a neighbour, or shares its slots with
+ * it. Nodes built by the write in progress are marked MT_NODE_NEW: no
+ * reader can have seen them, so those a later change replaces are
+ * reused at once instead of waiting for a grace period.
+ */
+
+#include "../include/maple_tree.h"
+#include "../include/slab.h"
+#include "../include/types.h"
+
+/* External declarations */
+extern int printk(const char *fmt, ...);
+
+#define MT_NODE_NEW         0x01    /* Built by the write in progress */
+
+#define MAPLE_LEAF_MIN      (MAPLE_LEAF_SLOTS / 2)
+#define MAPLE_ARANGE_MIN    (MAPLE_ARANGE_SLOTS / 2)
+
+/* Slots of two nodes being merged, or of one being split */
+#define MAPLE_BIG_SLOTS     (2 * MAPLE_LEAF_SLOTS)
+
+/* Nodes one change can build or replace: a few per level */
+#define MT_WRITE_NODES      (4 * MAPLE_HEIGHT_MAX + 2)
+
+static struct kmem_cache *maple_node_cache;
+
+void maple_tree_init(void)
+{
+    maple_node_cache = kmem_cache_create("maple_node",
+                                         sizeof(struct maple_node), 0,
+                                         SLAB_HWCACHE_ALIGN, NULL);
+    if (maple_node_cache == NULL)
+        printk("Warning: maple_node cache not created (no memory)\n");
+}
+
+static inline bool mt_is_leaf(const struct maple_node *node)
+{
+    return node->type == maple_leaf_64;
+}
+
+static inline unsigned int mt_min_slots(const struct maple_node *node)
+{
+    return mt_is_leaf(node) ? MAPLE_LEAF_MIN : MAPLE_ARANGE_MIN;
+}
+
+/* Lowest free range of size in [start, end] within [min, max] */
+static bool mt_gap_fits(unsigned long start, unsigned long end,
+                        unsigned long min, unsigned long max,
+                        unsigned long size, unsigned long align,
+                        unsigned long *index)
+{
+    unsigned long addr;
+
+    start = MAX(start, min);
+    end = MIN(end, max);
+    if (start > end)
+        return false;
+
+    addr = ALIGN_UP(start, align);
+    if (addr < start || addr > end || end - addr < size - 1)
+        return false;
+
+    *index = addr;
+    return true;
+}
+
+/* Range, and largest gap inside, of everything under node */
+static void mt_node_summary(const struct maple_node *node, unsigned long *index,
+                            unsigned long *last, unsigned long *gap)
+{
+    unsigned long g = 0;
+    unsigned int i;
+
+    if (mt_is_leaf(node)) {
+        for (i = 1; i < node->end; i++)
+            g = MAX(g, node->leaf.index[i] - node->leaf.last[i - 1] - 1);
+        *index = node->leaf.index[0];
+        *last = node->leaf.last[node->end - 1];
+    } else {
+        g = node->ar.gap[0];
+        for (i = 1; i < node->end; i++) {
+            g = MAX(g, node->ar.gap[i]);
+            g = MAX(g, node->ar.index[i] - node->ar.last[i - 1] - 1);
+        }
+        *index = node->ar.index[0];
+        *last = node->ar.last[node->end - 1];
+    }
+    *gap = g;
+}
+
+/*
+ * Lookups
+ */
+
+void *mtree_load(struct maple_tree *mt, unsigned long index)
+{
+    struct maple_node *node;
+    void *entry = NULL;
+    unsigned int i;
+
+    rcu_read_lock();
+
+    node = rcu_dereference(mt->ma_root);
+    if (node == NULL)
+        goto out;
+
+    while (!mt_is_leaf(node)) {
+        for (i = 0; i < node->end && node->ar.last[i] < index; i++)
+            ;
+        if (i == node->end || node->ar.index[i] > index)
+            goto out;
+        node = rcu_dereference(node->ar.slot[i]);
+    }
+
+    for (i = 0; i < node->end && node->leaf.last[i] < index; i++)
+        ;
+    if (i < node->end && node->leaf.index[i] <= index)
+        entry = node->leaf.slot[i];
+
+out:
+    rcu_read_unlock();
+    return entry;
+}
+
+void *mt_find(struct maple_tree *mt, unsigned long *index, unsigned long max)
+{
+    struct maple_node *node;
+    void *entry = NULL;
+    unsigned int i;
+
+    rcu_read_lock();
+
+    node = rcu_dereference(mt->ma_root);
+    if (node == NULL || *index > max)
+        goto out;
+
+    /* The first child ending at or after index has what we want */
+    while (!mt_is_leaf(node)) {
+        for (i = 0; i < node->end && node->ar.last[i] < *index; i++)
+            ;
+        if (i == node->end)
+            goto out;
+        node = rcu_dereference(node->ar.slot[i]);
+    }
+
+    for (i = 0; i < node->end && node->leaf.last[i] < *index; i++)
+        ;
+    if (i < node->end && node->leaf.index[i] <= max) {
+        entry = node->leaf.slot[i];
+        *index = node->leaf.last[i] + 1;
+    }
+
+out:
+    rcu_read_unlock();
+    return entry;
+}
+
+void *mt_prev(struct maple_tree *mt, unsigned long index)
+{
+    struct maple_node *node;
+    void *entry = NULL;
+    unsigned int i;
+
+    rcu_read_lock();
+
+    node = rcu_dereference(mt->ma_root);
+    if (node == NULL)
+        goto out;
+
+    while (!mt_is_leaf(node)) {
+        for (i = node->end; i > 0 && node->ar.index[i - 1] > index; i--)
+            ;
+        if (i == 0)
+            goto out;
+        node = rcu_dereference(node->ar.slot[i - 1]);
+    }
+
+    for (i = node->end; i > 0 && node->leaf.index[i - 1] > index; i--)
+        ;
+    if (i > 0)
+        entry = node->leaf.slot[i - 1];
+
+out:
+    rcu_read_unlock();
+    return entry;
+}
+
+/* Search the node whose free space runs over [lo, hi] */
+static int mt_search_gap(struct maple_node *node, unsigned long lo,
+                         unsigned long hi, unsigned long min, unsigned long max,
+                         unsigned long size, unsigned long align,
+                         unsigned long *index)
+{
+    unsigned long start = lo, first, last;
+    unsigned int i;
+
+    for (i = 0; i < node->end; i++) {
+        if (mt_is_leaf(node)) {
+            first = node->leaf.index[i];
+            last = node->leaf.last[i];
+        } else {
+            first = node->ar.index[i];
+            last = node->ar.last[i];
+        }
+
+        /* The free range before this slot */
+        if (first > start &&
+            mt_gap_fits(start, first - 1, min, max, size, align, index))
+            return 0;
+
+        /* And those inside it */
+        if (!mt_is_leaf(node) && node->ar.gap[i] >= size && last >= min &&
+            mt_search_gap(rcu_dereference(node->ar.slot[i]), first, last,
+                          min, max, size, align, index) == 0)
+            return 0;
+
+        start = last + 1;
+        if (start > max)
+            return -EBUSY;
+    }
+
+    if (start <= hi && mt_gap_fits(start, hi, min, max, size, align, index))
+        return 0;
+    return -EBUSY;
+}
+
+int mt_empty_area(struct maple_tree *mt, unsigned long min, unsigned long max,
+                  unsigned long size, unsigned long align,
+                  unsigned long *index)
+{
+    struct maple_node *root;
+    int ret;
+
+    if (size == 0 || min > max)
+        return -EINVAL;
+
+    rcu_read_lock();
+    root = rcu_dereference(mt->ma_root);
+    if (root == NULL)
+        ret = mt_gap_fits(0, ULONG_MAX, min, max, size, align, index) ?
+              0 : -EBUSY;
+    else
+        ret = mt_search_gap(root, 0, ULONG_MAX, min, max, size, align, index);
+    rcu_read_unlock();
+
+    return ret;
+}
+
+/*
+ * Writes
+ */
+
+/* Slots being rearranged, of either node type */
+struct ma_big {
+    unsigned int end;
+    unsigned long index[MAPLE_BIG_SLOTS];
+    unsigned long last[MAPLE_BIG_SLOTS];
+    unsigned long gap[MAPLE_BIG_SLOTS];
+    void *slot[MAPLE_BIG_SLOTS];
+};
+
+/* One change */
+struct ma_write {
+    struct maple_tree *mt;
+    struct maple_node *path[MAPLE_HEIGHT_MAX];  /* From the root down */
+    unsigned char offset[MAPLE_HEIGHT_MAX];     /* Slot taken in each */
+    unsigned int depth;                         /* Internal nodes */
+
+    /* Built by this change, freed if it fails */
+    struct maple_node *alloc[MT_WRITE_NODES];
+    unsigned int nr_alloc;
+
+    /* Replaced by this change, freed if it succeeds */
+    struct maple_node *dead[MT_WRITE_NODES];
+    unsigned int nr_dead;
+};
+
+static struct maple_node *mt_alloc_node(struct ma_write *mw,
+                                        enum maple_type type)
+{
+    struct maple_tree *mt = mw->mt;
+    struct maple_node *node = mt->ma_spare;
+
+    if (node)
+        mt->ma_spare = node->ar.slot[0];
+    else if (maple_node_cache)
+        node = kmem_cache_alloc(maple_node_cache, GFP_KERNEL);
+    if (node == NULL)
+        return NULL;
+
+    node->type = type;
+    node->end = 0;
+    node->flags = MT_NODE_NEW;
+    mw->alloc[mw->nr_alloc++] = node;
+    return node;
+}
+
+static void mt_spare_node(struct maple_tree *mt, struct maple_node *node)
+{
+    node->ar.slot[0] = mt->ma_spare;
+    mt->ma_spare = node;
+}
+
+static void mt_free_spare(struct maple_tree *mt)
+{
+    struct maple_node *node;
+
+    while ((node = mt->ma_spare) != NULL) {
+        mt->ma_spare = node->ar.slot[0];
+        kmem_cache_free(maple_node_cache, node);
+    }
+}
+
+static void mt_free_rcu(struct rcu_head *head)
+{
+    kmem_cache_free(maple_node_cache,
+                    container_of(head, struct maple_node, rcu));
+}
+
+static void big_append(struct ma_big *big, struct maple_node *node)
+{
+    unsigned int i, n;
+
+    for (i = 0; i < node->end; i++) {
+        n = big->end++;
+        if (mt_is_leaf(node)) {
+            big->index[n] = node->leaf.index[i];
+            big->last[n] = node->leaf.last[i];
+            big->gap[n] = 0;
+            big->slot[n] = node->leaf.slot[i];
+        } else {
+            big->index[n] = node->ar.index[i];
+            big->last[n] = node->ar.last[i];
+            big->gap[n] = node->ar.gap[i];
+            big->slot[n] = node->ar.slot[i];
+        }
+    }
+}
+
+static void big_remove(struct ma_big *big, unsigned int pos)
+{
+    unsigned int i;
+
+    for (i = pos; i + 1 < big->end; i++) {
+        big->index[i] = big->index[i + 1];
+        big->last[i] = big->last[i + 1];
+        big->gap[i] = big->gap[i + 1];
+        big->slot[i] = big->slot[i + 1];
+    }
+    big->end--;
+}
+
+static void big_insert(struct ma_big *big, unsigned int pos,
+                       unsigned long index, unsigned long last,
+                       unsigned long gap, void *slot)
+{
+    unsigned int i;
+
+    for (i = big->end; i > pos; i--) {
+        big->index[i] = big->index[i - 1];
+        big->last[i] = big->last[i - 1];
+        big->gap[i] = big->gap[i - 1];
+        big->slot[i] = big->slot[i - 1];
+    }
+    big->index[pos] = index;
+    big->last[pos] = last;
+    big->gap[pos] = gap;
+    big->slot[pos] = slot;
+    big->end++;
+}
+
+static void big_insert_child(struct ma_big *big, unsigned int pos,
+                             struct maple_node *child)
+{
+    unsigned long index = 0, last = 0, gap = 0;
+
+    /* An empty leaf only ever replaces the root's one child */
+    if (child->end)
+        mt_node_summary(child, &index, &last, &gap);
+    big_insert(big, pos, index, last, gap, child);
+}
+
+static void mt_fill_node(struct maple_node *node, struct ma_big *big,
+                         unsigned int from, unsigned int count)
+{
+    unsigned int i;
+
+    for (i = 0; i < count; i++) {
+        if (mt_is_leaf(node)) {
+            node->leaf.index[i] = big->index[from + i];
+            node->leaf.last[i] = big->last[from + i];
+            node->leaf.slot[i] = big->slot[from + i];
+        } else {
+            node->ar.index[i] = big->index[from + i];
+            node->ar.last[i] = big->last[from + i];
+            node->ar.gap[i] = big->gap[from + i];
+            node->ar.slot[i] = big->slot[from + i];
+        }
+    }
+    node->end = count;
+}
+
+/* Nodes of type for the slots in big: one, or two if they do not fit */
+static int mt_build(struct ma_write *mw, enum maple_type type,
+                    struct ma_big *big, struct maple_node **res)
+{
+    unsigned int slots = type == maple_leaf_64 ? MAPLE_LEAF_SLOTS :
+                                                 MAPLE_ARANGE_SLOTS;
+    unsigned int left;
+
+    res[0] = mt_alloc_node(mw, type);
+    if (res[0] == NULL)
+        return -ENOMEM;
+
+    if (big->end <= slots) {
+        mt_fill_node(res[0], big, 0, big->end);
+        return 1;
+    }
+
+    res[1] = mt_alloc_node(mw, type);
+    if (res[1] == NULL)
+        return -ENOMEM;
+
+    left = big->end / 2;
+    mt_fill_node(res[0], big, 0, left);
+    mt_fill_node(res[1], big, left, big->end - left);
+    return 2;
+}
+
+enum mt_op {
+    MT_INSERT,
+    MT_ERASE,
+    MT_ADJUST,
+};
+
+/* Apply op to the leaf's slots; bounds are those of the leaves around */
+static int mt_leaf_op(struct ma_big *big, enum mt_op op, unsigned long key,
+                      unsigned long index, unsigned long last, void **entry,
+                      bool has_prev, unsigned long prev_last,
+                      bool has_next, unsigned long next_index)
+{
+    unsigned int pos;
+
+    /* Slots starting at or before key */
+    for (pos = 0; pos < big->end && big->index[pos] <= key; pos++)
+        ;
+
+    if (op == MT_INSERT) {
+        if ((pos > 0 && big->last[pos - 1] >= index) ||
+            (pos == 0 && has_prev && prev_last >= index) ||
+            (pos < big->end && big->index[pos] <= last) ||
+            (pos == big->end && has_next && next_index <= last))
+            return -EEXIST;
+        big_insert(big, pos, index, last, 0, *entry);
+        return 0;
+    }
+
+    if (pos == 0 || big->last[pos - 1] < key)
+        return -ENOENT;
+    pos--;
+
+    if (op == MT_ERASE) {
+        *entry = big->slot[pos];
+        big_remove(big, pos);
+        return 0;
+    }
+
+    if ((pos > 0 && big->last[pos - 1] >= index) ||
+        (pos == 0 && has_prev && prev_last >= index) ||
+        (pos + 1 < big->end && big->index[pos + 1] <= last) ||
+        (pos + 1 == big->end && has_next && next_index <= last))
+        return -EEXIST;
+    big->index[pos] = index;
+    big->last[pos] = last;
+    return 0;
+}
+
+static int mt_write_op(struct maple_tree *mt, enum mt_op op, unsigned long key,
+                       unsigned long index, unsigned long last, void **entry)
+{
+    struct ma_write mw;
+    struct ma_big big, pair;
+    struct maple_node *node, *res[2], *merged[2], *root;
+    unsigned long prev_last = 0, next_index = 0;
+    bool has_prev = false, has_next = false;
+    unsigned int i, off, lo;
+    int nr, m, d, ret;
+
+    mw.mt = mt;
+    mw.depth = 0;
+    mw.nr_alloc = 0;
+    mw.nr_dead = 0;
+
+    node = mt->ma_work;
+    if (node == NULL) {
+        if (op != MT_INSERT)
+            return -ENOENT;
+        big.end = 0;
+        big_insert(&big, 0, index, last, 0, *entry);
+        if (mt_build(&mw, maple_leaf_64, &big, res) < 0)
+            return -ENOMEM;
+        mt->ma_work = res[0];
+        return 0;
+    }
+
+    /* Down to the leaf, by the first index of each child */
+    while (!mt_is_leaf(node)) {
+        for (i = 1; i < node->end && node->ar.index[i] <= key; i++)
+            ;
+        i--;
+        if (i > 0) {
+            prev_last = has_prev ? MAX(prev_last, node->ar.last[i - 1]) :
+                                   node->ar.last[i - 1];
+            has_prev = true;
+        }
+        if (i + 1 < node->end) {
+            next_index = has_next ? MIN(next_index, node->ar.index[i + 1]) :
+                                    node->ar.index[i + 1];
+            has_next = true;
+        }
+        mw.path[mw.depth] = node;
+        mw.offset[mw.depth++] = i;
+        node = node->ar.slot[i];
+    }
+
+    big.end = 0;
+    big_append(&big, node);
+    ret = mt_leaf_op(&big, op, key, index, last, entry, has_prev, prev_last,
+                     has_next, next_index);
+    if (ret < 0)
+        return ret;
+
+    nr = mt_build(&mw, maple_leaf_64, &big, res);
+    if (nr < 0)
+        goto nomem;
+    mw.dead[mw.nr_dead++] = node;
+
+    /* Back up, rebuilding each node around what replaced its child */
+    for (d = mw.depth - 1; d >= 0; d--) {
+        node = mw.path[d];
+        off = mw.offset[d];
+
+        big.end = 0;
+        big_append(&big, node);
+        big_remove(&big, off);
+        for (i = 0; i < (unsigned int)nr; i++)
+            big_insert_child(&big, off + i, res[i]);
+
+        if (nr == 1 && res[0]->end < mt_min_slots(res[0]) && big.end > 1) {
+            lo = off + 1 < big.end ? off : off - 1;
+            pair.end = 0;
+            big_append(&pair, big.slot[lo]);
+            big_append(&pair, big.slot[lo + 1]);
+            m = mt_build(&mw, res[0]->type, &pair, merged);
+            if (m < 0)
+                goto nomem;
+            mw.dead[mw.nr_dead++] = big.slot[lo];
+            mw.dead[mw.nr_dead++] = big.slot[lo + 1];
+            big_remove(&big, lo);
+            big_remove(&big, lo);
+            big_insert_child(&big, lo, merged[0]);
+            if (m == 2)
+                big_insert_child(&big, lo + 1, merged[1]);
+        }
+
+        nr = mt_build(&mw, maple_arange_64, &big, res);
+        if (nr < 0)
+            goto nomem;
+        mw.dead[mw.nr_dead++] = node;
+    }
+
+    if (nr == 2) {
+        if (mw.depth + 1 >= MAPLE_HEIGHT_MAX)
+            goto nomem;
+        big.end = 0;
+        big_insert_child(&big, 0, res[0]);
+        big_insert_child(&big, 1, res[1]);
+        if (mt_build(&mw, maple_arange_64, &big, res) < 0)
+            goto nomem;
+    }
+
+    /* A root with one child gives way to it */
+    root = res[0];
+    while (!mt_is_leaf(root) && root->end == 1) {
+        mw.dead[mw.nr_dead++] = root;
+        root = root->ar.slot[0];
+    }
+    if (mt_is_leaf(root) && root->end == 0) {
+        mw.dead[mw.nr_dead++] = root;
+        root = NULL;
+    }
+
+    mt->ma_work = root;
+
+    for (i = 0; i < mw.nr_dead; i++) {
+        node = mw.dead[i];
+        if (node->flags & MT_NODE_NEW) {
+            mt_spare_node(mt, node);
+        } else {
+            node->rcu.next = mt->ma_old;
+            mt->ma_old = &node->rcu;
+        }
+    }
+    return 0;
+
+nomem:
+    for (i = 0; i < mw.nr_alloc; i++)
+        mt_spare_node(mt, mw.alloc[i]);
+    return -ENOMEM;
+}
+
+void mt_write_begin(struct maple_tree *mt)
+{
+    mt->ma_writing = true;
+    mt->ma_work = mt->ma_root;
+    mt->ma_old = NULL;
+}
+
+/* Clear MT_NODE_NEW under node, which readers are about to reach */
+static void mt_publish_nodes(struct maple_node *node)
+{
+    unsigned int i;
+
+    if (node == NULL || !(node->flags & MT_NODE_NEW))
+        return;
+
+    node->flags &= ~MT_NODE_NEW;
+    if (!mt_is_leaf(node))
+        for (i = 0; i < node->end; i++)
+            mt_publish_nodes(node->ar.slot[i]);
+}
+
+void mt_write_commit(struct maple_tree *mt)
+{
+    struct rcu_head *head, *next;
+
+    mt_publish_nodes(mt->ma_work);
+    rcu_assign_pointer(mt->ma_root, mt->ma_work);
+
+    for (head = mt->ma_old; head; head = next) {
+        next = head->next;
+        call_rcu(head, mt_free_rcu);
+    }
+
+    mt->ma_old = NULL;
+    mt->ma_work = NULL;
+    mt->ma_writing = false;
+    mt_free_spare(mt);
+}
+
+static void mt_free_new_nodes(struct maple_node *node)
+{
+    unsigned int i;
+
+    if (node == NULL || !(node->flags & MT_NODE_NEW))
+        return;
+
+    if (!mt_is_leaf(node))
+        for (i = 0; i < node->end; i++)
+            mt_free_new_nodes(node->ar.slot[i]);
+    kmem_cache_free(maple_node_cache, node);
+}
+
+void mt_write_abort(struct maple_tree *mt)
+{
+    mt_free_new_nodes(mt->ma_work);
+
+    mt->ma_old = NULL;
+    mt->ma_work = NULL;
+    mt->ma_writing = false;
+    mt_free_spare(mt);
+}
+
+/* One change, as a write of its own unless one is in progress */
+static int mt_write(struct maple_tree *mt, enum mt_op op, unsigned long key,
+                    unsigned long index, unsigned long last, void **entry)
+{
+    bool own = !mt->ma_writing;
+    int ret;
+
+    if (own)
+        mt_write_begin(mt);
+
+    ret = mt_write_op(mt, op, key, index, last, entry);
+
+    if (own) {
+        if (ret < 0)
+            mt_write_abort(mt);
+        else
+            mt_write_commit(mt);
+    }
+    return ret;
+}
+
+int mtree_insert_range(struct maple_tree *mt, unsigned long index,
+                       unsigned long last, void *entry)
+{
+    if (index > last || last == ULONG_MAX || entry == NULL)
+        return -EINVAL;
+
+    return mt_write(mt, MT_INSERT, index, index, last, &entry);
+}
+
+void *mtree_erase(struct maple_tree *mt, unsigned long index)
+{
+    void *entry = NULL;
+
+    if (mt_write(mt, MT_ERASE, index, 0, 0, &entry) < 0)
+        return NULL;
+    return entry;
+}
+
+int mtree_adjust(struct maple_tree *mt, unsigned long index,
+                 unsigned long new_index, unsigned long new_last)
+{
+    if (new_index > new_last || new_last == ULONG_MAX)
+        return -EINVAL;
+
+    return mt_write(mt, MT_ADJUST, index, new_index, new_last, NULL);
+}
+
+static void mt_destroy_walk(struct maple_node *node)
+{
+    unsigned int i;
+
+    if (!mt_is_leaf(node))
+        for (i = 0; i < node->end; i++)
+            mt_destroy_walk(node->ar.slot[i]);
+    call_rcu(&node->rcu, mt_free_rcu);
+}
+
+void mtree_destroy(struct maple_tree *mt)
+{
+    struct maple_node *root = mt->ma_root;
+
+    rcu_assign_pointer(mt->ma_root, NULL);
+    if (root)
+        mt_destroy_walk(root);
+}
@@ -0,0 +1,299 @@
+/*
+ * MicroKernel Red-Black Trees
+ *
+ * Rebalancing and traversal for the trees in rbtree.h. Missing
+ * children are NULL and count as black; erase keeps track of the parent
+ * of the removed position since the node taking it may be NULL.
+ */
+
+#include "../include/rbtree.h"
+#include "../include/types.h"
+
+static inline void rb_set_parent(struct rb_node *node, struct rb_node *parent)
+{
+    node->__rb_parent_color = rb_color(node) | (unsigned long)parent;
+}
+
+static inline void rb_set_color(struct rb_node *node, int color)
+{
+    node->__rb_parent_color = (node->__rb_parent_color & ~1UL) | color;
+}
+
+static inline void rb_set_red(struct rb_node *node)
+{
+    node->__rb_parent_color &= ~1UL;
+}
+
+static inline void rb_set_black(struct rb_node *node)
+{
+    node->__rb_parent_color |= RB_BLACK;
+}
+
+/* Point whatever pointed at old (parent or root) at new */
+static inline void rb_change_child(struct rb_node *old, struct rb_node *new,
+                                   struct rb_node *parent,
+                                   struct rb_root *root)
+{
+    if (parent == NULL)
+        root->rb_node = new;
+    else if (parent->rb_left == old)
+        parent->rb_left = new;
+    else
+        parent->rb_right = new;
+}
+
+static void rb_rotate_left(struct rb_node *node, struct rb_root *root)
+{
+    struct rb_node *right = node->rb_right;
+    struct rb_node *parent = rb_parent(node);
+
+    node->rb_right = right->rb_left;
+    if (node->rb_right)
+        rb_set_parent(node->rb_right, node);
+
+    right->rb_left = node;
+    rb_set_parent(right, parent);
+    rb_change_child(node, right, parent, root);
+    rb_set_parent(node, right);
+}
+
+static void rb_rotate_right(struct rb_node *node, struct rb_root *root)
+{
+    struct rb_node *left = node->rb_left;
+    struct rb_node *parent = rb_parent(node);
+
+    node->rb_left = left->rb_right;
+    if (node->rb_left)
+        rb_set_parent(node->rb_left, node);
+
+    left->rb_right = node;
+    rb_set_parent(left, parent);
+    rb_change_child(node, left, parent, root);
+    rb_set_parent(node, left);
+}
+
+void rb_insert_color(struct rb_node *node, struct rb_root *root)
+{
+    struct rb_node *parent, *gparent, *uncle, *tmp;
+
+    while ((parent = rb_parent(node)) != NULL && rb_is_red(parent)) {
+        gparent = rb_parent(parent);
+
+        if (parent == gparent->rb_left) {
+            uncle = gparent->rb_right;
+            if (uncle && rb_is_red(uncle)) {
+                rb_set_black(uncle);
+                rb_set_black(parent);
+                rb_set_red(gparent);
+                node = gparent;
+                continue;
+            }
+
+            if (parent->rb_right == node) {
+                rb_rotate_left(parent, root);
+                tmp = parent;
+                parent = node;
+                node = tmp;
+            }
+
+            rb_set_black(parent);
+            rb_set_red(gparent);
+            rb_rotate_right(gparent, root);
+        } else {
+            uncle = gparent->rb_left;
+            if (uncle && rb_is_red(uncle)) {
+                rb_set_black(uncle);
+                rb_set_black(parent);
+                rb_set_red(gparent);
+                node = gparent;
+                continue;
+            }
+
+            if (parent->rb_left == node) {
+                rb_rotate_right(parent, root);
+                tmp = parent;
+                parent = node;
+                node = tmp;
+            }
+
+            rb_set_black(parent);
+            rb_set_red(gparent);
+            rb_rotate_left(gparent, root);
+        }
+    }
+
+    rb_set_black(root->rb_node);
+}
+
+/*
+ * A black node was removed from under parent: node (possibly NULL) is
+ * one black short
+ */
+static void rb_erase_color(struct rb_node *node, struct rb_node *parent,
+                           struct rb_root *root)
+{
+    struct rb_node *other;
+
+    while ((node == NULL || rb_is_black(node)) && node != root->rb_node) {
+        if (parent->rb_left == node) {
+            other = parent->rb_right;
+            if (rb_is_red(other)) {
+                rb_set_black(other);
+                rb_set_red(parent);
+                rb_rotate_left(parent, root);
+                other = parent->rb_right;
+            }
+
+            if ((other->rb_left == NULL || rb_is_black(other->rb_left)) &&
+                (other->rb_right == NULL || rb_is_black(other->rb_right))) {
+                rb_set_red(other);
+                node = parent;
+                parent = rb_parent(node);
+                continue;
+            }
+
+            if (other->rb_right == NULL || rb_is_black(other->rb_right)) {
+                rb_set_black(other->rb_left);
+                rb_set_red(other);
+                rb_rotate_right(other, root);
+                other = parent->rb_right;
+            }
+
+            rb_set_color(other, rb_color(parent));
+            rb_set_black(parent);
+            rb_set_black(other->rb_right);
+            rb_rotate_left(parent, root);
+        } else {
+            other = parent->rb_left;
+            if (rb_is_red(other)) {
+                rb_set_black(other);
+                rb_set_red(parent);
+                rb_rotate_right(parent, root);
+                other = parent->rb_left;
+            }
+
+            if ((other->rb_left == NULL || rb_is_black(other->rb_left)) &&
+                (other->rb_right == NULL || rb_is_black(other->rb_right))) {
+                rb_set_red(other);
+                node = parent;
+                parent = rb_parent(node);
+                continue;
+            }
+
+            if (other->rb_left == NULL || rb_is_black(other->rb_left)) {
+                rb_set_black(other->rb_right);
+                rb_set_red(other);
+                rb_rotate_left(other, root);
+                other = parent->rb_left;
+            }
+
+            rb_set_color(other, rb_color(parent));
+            rb_set_black(parent);
+            rb_set_black(other->rb_left);
+            rb_rotate_right(parent, root);
+        }
+
+        node = root->rb_node;
+        break;
+    }
+
+    if (node)
+        rb_set_black(node);
+}
+
+void rb_erase(struct rb_node *node, struct rb_root *root)
+{
+    struct rb_node *child, *parent, *next;
+    int color;
+
+    if (node->rb_left == NULL || node->rb_right == NULL) {
+        child = node->rb_left ? node->rb_left : node->rb_right;
+        parent = rb_parent(node);
+        color = rb_color(node);
+
+        if (child)
+            rb_set_parent(child, parent);
+        rb_change_child(node, child, parent, root);
+    } else {
+        /* Two children: the successor takes the node's place */
+        next = node->rb_right;
+        while (next->rb_left)
+            next = next->rb_left;
+
+        child = next->rb_right;
+        parent = rb_parent(next);
+        color = rb_color(next);
+
+        if (parent == node) {
+            parent = next;
+        } else {
+            if (child)
+                rb_set_parent(child, parent);
+            parent->rb_left = child;
+            next->rb_right = node->rb_right;
+            rb_set_parent(node->rb_right, next);
+        }
+
+        rb_change_child(node, next, rb_parent(node), root);
+        next->__rb_parent_color = node->__rb_parent_color;
+        next->rb_left = node->rb_left;
+        rb_set_parent(node->rb_left, next);
+    }
+
+    if (color == RB_BLACK)
+        rb_erase_color(child, parent, root);
+}
+
+struct rb_node *rb_first(const struct rb_root *root)
+{
+    struct rb_node *node = root->rb_node;
+
+    if (node == NULL)
+        return NULL;
+    while (node->rb_left)
+        node = node->rb_left;
+    return node;
+}
+
+struct rb_node *rb_last(const struct rb_root *root)
+{
+    struct rb_node *node = root->rb_node;
+
+    if (node == NULL)
+        return NULL;
+    while (node->rb_right)
+        node = node->rb_right;
+    return node;
+}
+
+struct rb_node *rb_next(const struct rb_node *node)
+{
+    struct rb_node *parent;
+
+    if (node->rb_right) {
+        node = node->rb_right;
+        while (node->rb_left)
+            node = node->rb_left;
+        return (struct rb_node *)node;
+    }
+
+    while ((parent = rb_parent(node)) != NULL && node == parent->rb_right)
+        node = parent;
+    return parent;
+}
+
+struct rb_node *rb_prev(const struct rb_node *node)
+{
+    struct rb_node *parent;
+
+    if (node->rb_left) {
+        node = node->rb_left;
+        while (node->rb_right)
+            node = node->rb_right;
+        return (struct rb_node *)node;
+    }
+
+    while ((parent = rb_parent(node)) != NULL && node == parent->rb_left)
+        node = parent;
+    return parent;
+}
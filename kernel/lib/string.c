@@ -0,0 +1,423 @@
+/*
+ * MicroKernel String Library
+ *
+ * memcpy/memset/memmove/memcmp. Small and medium blocks are handled a
+ * word at a time, or with rep movsb/stosb on CPUs with fast string
+ * microcode (ERMS, FSRM). Blocks of MEM_NT_THRESHOLD bytes and more
+ * are written with non-temporal stores so they do not flush the cache.
+ * string_init picks the variants once at boot.
+ */
+
+#include "../include/string.h"
+#include "../include/types.h"
+#include "../include/mm.h"
+
+/* External declarations */
+extern int printk(const char *fmt, ...);
+
+/*
+ * Keep GCC from turning the fallback loops below back into calls to
+ * memcpy/memset
+ */
+#pragma GCC optimize("no-tree-loop-distribute-patterns")
+
+typedef u64 __attribute__((__may_alias__, __aligned__(1))) unaligned_u64;
+
+/* CPUID.(EAX=7,ECX=0) feature bits */
+#define X86_FEATURE_ERMS    (1U << 9)       /* EBX: enhanced rep movsb/stosb */
+#define X86_FEATURE_FSRM    (1U << 4)       /* EDX: fast short rep movsb */
+
+/* Below this, rep movsb/stosb startup costs more than a word loop */
+#define ERMS_THRESHOLD      256
+
+#define BYTE_PATTERN(c)     ((u64)(unsigned char)(c) * 0x0101010101010101ULL)
+
+static inline void movnti(void *dst, u64 val)
+{
+    __asm__ __volatile__("movnti %1, %0" : "=m"(*(u64 *)dst) : "r"(val));
+}
+
+/*
+ * memcpy variants
+ */
+static void *memcpy_bytes(void *dest, const void *src, size_t n)
+{
+    unsigned char *d = dest;
+    const unsigned char *s = src;
+
+    while (n--)
+        *d++ = *s++;
+    return dest;
+}
+
+static void *memcpy_words(void *dest, const void *src, size_t n)
+{
+    unsigned char *d = dest;
+    const unsigned char *s = src;
+    u64 a, b, c, e;
+
+    while (n >= 32) {
+        a = ((const unaligned_u64 *)s)[0];
+        b = ((const unaligned_u64 *)s)[1];
+        c = ((const unaligned_u64 *)s)[2];
+        e = ((const unaligned_u64 *)s)[3];
+        ((unaligned_u64 *)d)[0] = a;
+        ((unaligned_u64 *)d)[1] = b;
+        ((unaligned_u64 *)d)[2] = c;
+        ((unaligned_u64 *)d)[3] = e;
+        d += 32;
+        s += 32;
+        n -= 32;
+    }
+
+    while (n >= 8) {
+        *(unaligned_u64 *)d = *(const unaligned_u64 *)s;
+        d += 8;
+        s += 8;
+        n -= 8;
+    }
+
+    while (n--)
+        *d++ = *s++;
+    return dest;
+}
+
+static void *memcpy_movsb(void *dest, const void *src, size_t n)
+{
+    void *ret = dest;
+
+    __asm__ __volatile__("rep movsb"
+                         : "+D"(dest), "+S"(src), "+c"(n)
+                         :
+                         : "memory");
+    return ret;
+}
+
+static void *memcpy_erms(void *dest, const void *src, size_t n)
+{
+    if (n < ERMS_THRESHOLD)
+        return memcpy_words(dest, src, n);
+    return memcpy_movsb(dest, src, n);
+}
+
+static void *memcpy_nt(void *dest, const void *src, size_t n)
+{
+    unsigned char *d = dest;
+    const unsigned char *s = src;
+    size_t head = -(unsigned long)d & 7;
+
+    /* Align the destination for movnti */
+    n -= head;
+    while (head--)
+        *d++ = *s++;
+
+    while (n >= 32) {
+        movnti(d, ((const unaligned_u64 *)s)[0]);
+        movnti(d + 8, ((const unaligned_u64 *)s)[1]);
+        movnti(d + 16, ((const unaligned_u64 *)s)[2]);
+        movnti(d + 24, ((const unaligned_u64 *)s)[3]);
+        d += 32;
+        s += 32;
+        n -= 32;
+    }
+
+    while (n >= 8) {
+        movnti(d, *(const unaligned_u64 *)s);
+        d += 8;
+        s += 8;
+        n -= 8;
+    }
+
+    /* Order the weakly-ordered stores before anything that follows */
+    wmb();
+
+    while (n--)
+        *d++ = *s++;
+    return dest;
+}
+
+/*
+ * memset variants
+ */
+static void *memset_bytes(void *s, int c, size_t n)
+{
+    unsigned char *p = s;
+
+    while (n--)
+        *p++ = (unsigned char)c;
+    return s;
+}
+
+static void *memset_words(void *s, int c, size_t n)
+{
+    unsigned char *p = s;
+    u64 v = BYTE_PATTERN(c);
+
+    while (n >= 32) {
+        ((unaligned_u64 *)p)[0] = v;
+        ((unaligned_u64 *)p)[1] = v;
+        ((unaligned_u64 *)p)[2] = v;
+        ((unaligned_u64 *)p)[3] = v;
+        p += 32;
+        n -= 32;
+    }
+
+    while (n >= 8) {
+        *(unaligned_u64 *)p = v;
+        p += 8;
+        n -= 8;
+    }
+
+    while (n--)
+        *p++ = (unsigned char)c;
+    return s;
+}
+
+static void *memset_stosb(void *s, int c, size_t n)
+{
+    void *ret = s;
+
+    __asm__ __volatile__("rep stosb"
+                         : "+D"(s), "+c"(n)
+                         : "a"(c)
+                         : "memory");
+    return ret;
+}
+
+static void *memset_erms(void *s, int c, size_t n)
+{
+    if (n < ERMS_THRESHOLD)
+        return memset_words(s, c, n);
+    return memset_stosb(s, c, n);
+}
+
+static void *memset_nt(void *s, int c, size_t n)
+{
+    unsigned char *p = s;
+    u64 v = BYTE_PATTERN(c);
+    size_t head = -(unsigned long)p & 7;
+
+    n -= head;
+    while (head--)
+        *p++ = (unsigned char)c;
+
+    while (n >= 32) {
+        movnti(p, v);
+        movnti(p + 8, v);
+        movnti(p + 16, v);
+        movnti(p + 24, v);
+        p += 32;
+        n -= 32;
+    }
+
+    while (n >= 8) {
+        movnti(p, v);
+        p += 8;
+        n -= 8;
+    }
+
+    wmb();
+
+    while (n--)
+        *p++ = (unsigned char)c;
+    return s;
+}
+
+/*
+ * Selected at boot by string_init. The word loops are safe on any
+ * x86_64 CPU, so they are also what runs before that.
+ */
+static void *(*memcpy_fn)(void *, const void *, size_t) = memcpy_words;
+static void *(*memset_fn)(void *, int, size_t) = memset_words;
+static const char *memcpy_name = "words";
+static const char *memset_name = "words";
+
+void *memcpy(void *dest, const void *src, size_t n)
+{
+    if (n >= MEM_NT_THRESHOLD)
+        return memcpy_nt(dest, src, n);
+    return memcpy_fn(dest, src, n);
+}
+
+void *memset(void *s, int c, size_t n)
+{
+    if (n >= MEM_NT_THRESHOLD)
+        return memset_nt(s, c, n);
+    return memset_fn(s, c, n);
+}
+
+void *memmove(void *dest, const void *src, size_t n)
+{
+    unsigned char *d = dest;
+    const unsigned char *s = src;
+
+    /* Disjoint: any memcpy will do */
+    if (d + n <= s || s + n <= d)
+        return memcpy(dest, src, n);
+
+    /*
+     * Overlapping with the destination below the source: a forward
+     * word copy loads each word before the store that could clobber it
+     */
+    if (d < s)
+        return memcpy_words(dest, src, n);
+
+    /* Destination above the source: copy backwards */
+    d += n;
+    s += n;
+
+    while (n >= 8) {
+        d -= 8;
+        s -= 8;
+        n -= 8;
+        *(unaligned_u64 *)d = *(const unaligned_u64 *)s;
+    }
+
+    while (n--)
+        *--d = *--s;
+    return dest;
+}
+
+int memcmp(const void *s1, const void *s2, size_t n)
+{
+    const unsigned char *p1 = s1, *p2 = s2;
+
+    /* Skip equal words, then find the differing byte */
+    while (n >= 8 &&
+           *(const unaligned_u64 *)p1 == *(const unaligned_u64 *)p2) {
+        p1 += 8;
+        p2 += 8;
+        n -= 8;
+    }
+
+    while (n--) {
+        if (*p1 != *p2)
+            return *p1 - *p2;
+        p1++;
+        p2++;
+    }
+    return 0;
+}
+
+/*
+ * Pick the variants for this CPU
+ */
+void string_init(void)
+{
+    u32 eax, ebx, ecx, edx;
+    bool erms = false, fsrm = false;
+
+    cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+    if (eax >= 7) {
+        cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+        erms = (ebx & X86_FEATURE_ERMS) != 0;
+        fsrm = (edx & X86_FEATURE_FSRM) != 0;
+    }
+
+    if (fsrm) {
+        /* Fast at every size, short copies included */
+        memcpy_fn = memcpy_movsb;
+        memcpy_name = "rep movsb (FSRM)";
+    } else if (erms) {
+        memcpy_fn = memcpy_erms;
+        memcpy_name = "rep movsb (ERMS)";
+    }
+
+    if (erms) {
+        memset_fn = memset_erms;
+        memset_name = "rep stosb (ERMS)";
+    }
+
+    printk("String ops: memcpy %s, memset %s, non-temporal from %lu bytes\n",
+           memcpy_name, memset_name, (unsigned long)MEM_NT_THRESHOLD);
+}
+
+/*
+ * Throughput microbenchmark
+ */
+struct mem_variant {
+    const char *name;
+    void *(*copy)(void *, const void *, size_t);
+    void *(*set)(void *, int, size_t);
+};
+
+static const size_t bench_sizes[] = { 16, 64, 256, 1024, 4096, 65536 };
+
+#define BENCH_BUF_ORDER     4               /* 64KB buffers */
+
+/* Print bytes/cycle with two decimals */
+static void print_rate(unsigned long bytes, u64 cycles)
+{
+    unsigned long r = cycles ? (bytes * 100) / cycles : 0;
+
+    printk(" %lu.%lu%lu", r / 100, (r / 10) % 10, r % 10);
+}
+
+static void bench_variants(const char *op, const struct mem_variant *v,
+                           int nr, void *dst, void *src,
+                           unsigned long iterations)
+{
+    unsigned long loops, i;
+    size_t size;
+    u64 start;
+    int j, k;
+
+    printk("%s (bytes/cycle):\n  size:", op);
+    for (k = 0; k < nr; k++)
+        printk(" %s", v[k].name);
+    printk("\n");
+
+    for (j = 0; j < (int)ARRAY_SIZE(bench_sizes); j++) {
+        size = bench_sizes[j];
+        loops = iterations * MAX(1UL, 4096 / size);
+
+        printk("  %lu:", (unsigned long)size);
+        for (k = 0; k < nr; k++) {
+            start = rdtsc();
+            for (i = 0; i < loops; i++) {
+                if (v[k].copy)
+                    v[k].copy(dst, src, size);
+                else
+                    v[k].set(dst, (int)i, size);
+            }
+            print_rate(loops * size, rdtsc() - start);
+        }
+        printk("\n");
+    }
+}
+
+void bench_mem(unsigned long iterations)
+{
+    struct mem_variant copy[] = {
+        { "bytes", memcpy_bytes, NULL },
+        { "words", memcpy_words, NULL },
+        { "movsb", memcpy_movsb, NULL },
+        { "nt",    memcpy_nt,    NULL },
+        { "memcpy", memcpy,      NULL },
+    };
+    struct mem_variant set[] = {
+        { "bytes", NULL, memset_bytes },
+        { "words", NULL, memset_words },
+        { "stosb", NULL, memset_stosb },
+        { "nt",    NULL, memset_nt },
+        { "memset", NULL, memset },
+    };
+    void *src, *dst;
+
+    src = (void *)__get_free_pages(GFP_KERNEL, BENCH_BUF_ORDER);
+    dst = (void *)__get_free_pages(GFP_KERNEL, BENCH_BUF_ORDER);
+    if (src == NULL || dst == NULL) {
+        printk("bench mem: cannot allocate buffers\n");
+        goto out;
+    }
+
+    printk("memcpy: %s, memset: %s\n", memcpy_name, memset_name);
+    bench_variants("memcpy", copy, ARRAY_SIZE(copy), dst, src, iterations);
+    bench_variants("memset", set, ARRAY_SIZE(set), dst, NULL, iterations);
+
+out:
+    if (src)
+        free_pages_virt((unsigned long)src, BENCH_BUF_ORDER);
+    if (dst)
+        free_pages_virt((unsigned long)dst, BENCH_BUF_ORDER);
+}
@@ -9,29 +9,107 @@
 #include "../include/types.h"
 #include "../include/list.h"
 #include "../include/spinlock.h"
+#include "../include/slab.h"
+#include "../include/memblock.h"
+#include "../include/multiboot.h"
+#include "../include/compaction.h"
+#include "../include/hugetlb.h"
+#include "../include/vmalloc.h"
+#include "../include/swap.h"
 
 /* External declarations */
 extern int printk(const char *fmt, ...);
 
 /* Global memory state */
 struct pglist_data node_data;
-struct page *mem_map = NULL;
-unsigned long mem_map_size = 0;
+unsigned long max_pfn = 0;
 phys_addr_t phys_base = 0;
 
 /* Statistics */
-static unsigned long total_pages = 0;
-static unsigned long free_page_count = 0;
 static unsigned long alloc_count = 0;
 static unsigned long free_count = 0;
 
-/* Zone lock */
-static spinlock_t buddy_lock = SPIN_LOCK_INIT;
+/*
+ * Normal allocations fall back into ZONE_DMA only while it keeps
+ * 1/DMA_RESERVE_RATIO of the memory above it free for GFP_DMA
+ */
+#define DMA_RESERVE_RATIO   256
+
+/*
+ * Free memory kept in reserve, split across zones by size. By default
+ * it grows with the square root of memory, within these bounds.
+ */
+#define MIN_FREE_KBYTES_MIN     128
+#define MIN_FREE_KBYTES_MAX     262144
+
+/* A min_free_kbytes= of more than memory / this would starve the zones */
+#define MIN_FREE_KBYTES_RATIO   4
+
+/* Gap between the watermarks, in ten-thousandths of a zone, at least */
+#define WATERMARK_SCALE_FACTOR  10
+
+static unsigned long min_free_kbytes;
+static unsigned long user_min_free_kbytes;  /* From the command line */
+
+/* Migrate type of each pageblock, indexed by pfn >> pageblock_order */
+unsigned char *pageblock_types;
+
+static const char * const migratetype_names[MIGRATE_TYPES] = {
+    "Unmovable",
+    "Movable",
+    "Reclaimable",
+};
+
+/* Pages on the buddy free lists of all zones */
+static unsigned long nr_buddy_free_pages(void)
+{
+    unsigned long count = 0;
+    int i;
+    
+    for (i = 0; i < MAX_NR_ZONES; i++)
+        count += node_data.zones[i].nr_free_pages;
+    
+    return count;
+}
+
+static unsigned long totalram_pages(void)
+{
+    unsigned long count = 0;
+    int i;
+    
+    for (i = 0; i < MAX_NR_ZONES; i++)
+        count += node_data.zones[i].managed_pages;
+    
+    return count;
+}
+
+/*
+ * Whether an allocation for zone classzone may fall back into a lower
+ * zone: the lower zone keeps a share of the memory above it free for
+ * its own users. Unlocked, like the order bitmap peek.
+ */
+static bool zone_fallback_ok(struct zone *zone, int classzone)
+{
+    unsigned long reserve = 0;
+    int i;
+    
+    for (i = zone->zone_type + 1; i <= classzone; i++)
+        reserve += node_data.zones[i].managed_pages;
+    
+    return zone->nr_free_pages > reserve / DMA_RESERVE_RATIO;
+}
+
+/* Per-CPU page cache tunables */
+static int pcp_high = PCP_DEFAULT_HIGH;
+static int pcp_low = PCP_DEFAULT_LOW;
+static int pcp_batch = PCP_DEFAULT_BATCH;
 
 /* Forward declarations */
+static int deferred_init_section(void);
+static void zero_pool_init(struct zero_pool *zp);
 static void __free_one_page(struct page *page, unsigned long pfn,
-                           struct zone *zone, unsigned int order);
-static struct page *__rmqueue_smallest(struct zone *zone, unsigned int order);
+                           struct zone *zone, unsigned int order,
+                           int migratetype);
 
 /*
  * Find the buddy page for a given page
@@ -61,30 +139,54 @@ static inline int page_is_buddy(struct page *page, struct page *buddy,
 }
 
 /*
- * Remove a page from the free list
+ * Retag a pageblock
+ */
+static void set_pageblock_migratetype(struct zone *zone, unsigned long pfn,
+                                      int migratetype)
+{
+    unsigned char *type = &pageblock_types[pfn >> pageblock_order];
+    
+    zone->migrate_stats[*type].nr_pageblocks--;
+    zone->migrate_stats[migratetype].nr_pageblocks++;
+    *type = migratetype;
+}
+
+/*
+ * Remove a page from the free list it sits on
  */
 static inline void del_page_from_free_list(struct page *page,
                                            struct zone *zone,
                                            unsigned int order)
 {
+    struct free_area *area = &zone->free_area[order];
+    int mt = page->migratetype;
+    
     list_del(&page->buddy_list);
     ClearPageBuddy(page);
     page->order = 0;
-    zone->free_area[order].nr_free--;
+    area->nr_free--;
+    if (--area->nr_free_type[mt] == 0)
+        zone->free_area_map[mt] &= ~BIT(order);
     zone->nr_free_pages -= (1UL << order);
 }
 
 /*
- * Add a page to the free list
+ * Add a page to the free list of a migrate type
  */
 static inline void add_page_to_free_list(struct page *page,
                                          struct zone *zone,
-                                         unsigned int order)
+                                         unsigned int order,
+                                         int migratetype)
 {
-    list_add(&page->buddy_list, &zone->free_area[order].free_list);
+    struct free_area *area = &zone->free_area[order];
+    
+    list_add(&page->buddy_list, &area->free_list[migratetype]);
     SetPageBuddy(page);
     page->order = order;
-    zone->free_area[order].nr_free++;
+    page->migratetype = migratetype;
+    area->nr_free++;
+    if (area->nr_free_type[migratetype]++ == 0)
+        zone->free_area_map[migratetype] |= BIT(order);
     zone->nr_free_pages += (1UL << order);
 }
 
@@ -92,54 +194,195 @@ static inline void add_page_to_free_list(struct page *page,
  * Split a high-order page into lower-order pages
  */
 static void expand(struct zone *zone, struct page *page,
-                  int low, int high, struct free_area *area)
+                  int low, int high, struct free_area *area,
+                  int migratetype)
 {
     unsigned long size = 1 << high;
     
     while (high > low) {
+        area->nr_split++;
         high--;
         size >>= 1;
         area--;
         
         /* Add the buddy half to the free list */
-        add_page_to_free_list(&page[size], zone, high);
+        add_page_to_free_list(&page[size], zone, high, migratetype);
     }
 }
 
 /*
- * Remove a page from the free list and prepare it for allocation
+ * Take the smallest block that fits from one migrate type's lists
  */
-static struct page *__rmqueue_smallest(struct zone *zone, unsigned int order)
+static struct page *__rmqueue_smallest(struct zone *zone, unsigned int order,
+                                       int migratetype)
 {
     unsigned int current_order;
+    unsigned long map;
     struct free_area *area;
     struct page *page;
     
     /* Find the smallest available order that fits */
-    for (current_order = order; current_order < MAX_ORDER; current_order++) {
-        area = &zone->free_area[current_order];
+    map = zone->free_area_map[migratetype] & (~0UL << order);
+    if (map == 0)
+        return NULL;
+    
+    current_order = __ffs(map);
+    area = &zone->free_area[current_order];
+    
+    /* Get the first page from the free list */
+    page = list_first_entry(&area->free_list[migratetype],
+                            struct page, buddy_list);
+    del_page_from_free_list(page, zone, current_order);
+    
+    /* Split if necessary */
+    expand(zone, page, order, current_order, area, migratetype);
+    
+    return page;
+}
+
+/*
+ * Order in which other types are raided when a type runs out
+ */
+static const int fallbacks[MIGRATE_TYPES][MIGRATE_TYPES - 1] = {
+    [MIGRATE_UNMOVABLE]   = { MIGRATE_RECLAIMABLE, MIGRATE_MOVABLE },
+    [MIGRATE_MOVABLE]     = { MIGRATE_RECLAIMABLE, MIGRATE_UNMOVABLE },
+    [MIGRATE_RECLAIMABLE] = { MIGRATE_UNMOVABLE,   MIGRATE_MOVABLE },
+};
+
+/*
+ * Move every free block in the pageblock containing pfn to the lists
+ * of a new type. Returns the number of pages moved.
+ */
+static unsigned long move_freepages_block(struct zone *zone, unsigned long pfn,
+                                          int migratetype)
+{
+    unsigned long start = pfn & ~(pageblock_nr_pages - 1);
+    unsigned long end = start + pageblock_nr_pages;
+    unsigned long moved = 0;
+    unsigned int order;
+    struct page *page;
+    
+    for (pfn = start; pfn < end; ) {
+        page = pfn_to_page(pfn);
         
-        if (list_empty(&area->free_list))
+        if (!PageBuddy(page)) {
+            pfn++;
             continue;
+        }
         
-        /* Get the first page from the free list */
-        page = list_first_entry(&area->free_list, struct page, buddy_list);
-        del_page_from_free_list(page, zone, current_order);
-        
-        /* Split if necessary */
-        expand(zone, page, order, current_order, area);
+        order = page->order;
+        del_page_from_free_list(page, zone, order);
+        add_page_to_free_list(page, zone, order, migratetype);
         
-        return page;
+        moved += 1UL << order;
+        pfn += 1UL << order;
+    }
+    
+    return moved;
+}
+
+/*
+ * Unmovable and reclaimable allocations always take over the free
+ * memory of a pageblock they fall back into, so that they keep to as
+ * few pageblocks as possible. Movable ones only do so for large blocks,
+ * since they can be moved out again later.
+ */
+static bool can_steal_fallback(unsigned int order, int start_mt)
+{
+    if (order >= pageblock_order / 2)
+        return true;
+    
+    return start_mt == MIGRATE_UNMOVABLE || start_mt == MIGRATE_RECLAIMABLE;
+}
+
+/*
+ * Claim a fallback block's pageblock for start_mt: move its free pages
+ * over, and convert the pageblock if at least half of it was free
+ */
+static void steal_suitable_fallback(struct zone *zone, struct page *page,
+                                    unsigned int order, int start_mt)
+{
+    unsigned long pfn = page_to_pfn(page);
+    unsigned long i, moved;
+    
+    /* The block covers whole pageblocks: take all of them */
+    if (order >= pageblock_order) {
+        for (i = 0; i < (1UL << order); i += pageblock_nr_pages)
+            set_pageblock_migratetype(zone, pfn + i, start_mt);
+        zone->migrate_stats[start_mt].nr_steal += 1UL << (order - pageblock_order);
+        return;
+    }
+    
+    moved = move_freepages_block(zone, pfn, start_mt);
+    if (moved >= pageblock_nr_pages / 2) {
+        set_pageblock_migratetype(zone, pfn, start_mt);
+        zone->migrate_stats[start_mt].nr_steal++;
+    }
+}
+
+/*
+ * Take a block from another migrate type's lists. The largest block
+ * available is used, so that one steal serves many later allocations
+ * and mixes types in as few pageblocks as possible.
+ */
+static struct page *__rmqueue_fallback(struct zone *zone, unsigned int order,
+                                       int start_mt)
+{
+    unsigned int current_order = 0;
+    unsigned long map;
+    struct free_area *area;
+    struct page *page;
+    int i, mt, fallback_mt = -1;
+    
+    for (i = 0; i < MIGRATE_TYPES - 1; i++) {
+        mt = fallbacks[start_mt][i];
+        map = zone->free_area_map[mt] & (~0UL << order);
+        if (map && (fallback_mt < 0 || __fls(map) > current_order)) {
+            current_order = __fls(map);
+            fallback_mt = mt;
+        }
     }
     
-    return NULL;
+    if (fallback_mt < 0)
+        return NULL;
+    
+    area = &zone->free_area[current_order];
+    page = list_first_entry(&area->free_list[fallback_mt],
+                            struct page, buddy_list);
+    
+    if (can_steal_fallback(current_order, start_mt))
+        steal_suitable_fallback(zone, page, current_order, start_mt);
+    
+    zone->migrate_stats[start_mt].nr_fallback++;
+    
+    del_page_from_free_list(page, zone, current_order);
+    expand(zone, page, order, current_order, area, start_mt);
+    
+    return page;
+}
+
+/*
+ * Take a block for a migrate type, falling back to the other types
+ */
+static struct page *__rmqueue(struct zone *zone, unsigned int order,
+                              int migratetype)
+{
+    struct page *page;
+    
+    page = __rmqueue_smallest(zone, order, migratetype);
+    if (page == NULL)
+        page = __rmqueue_fallback(zone, order, migratetype);
+    
+    return page;
 }
 
 /*
- * Free a page and merge with buddies if possible
+ * Free a page and merge with buddies if possible. Buddies merge
+ * whatever list they are on; the result goes to migratetype's list.
  */
 static void __free_one_page(struct page *page, unsigned long pfn,
-                           struct zone *zone, unsigned int order)
+                           struct zone *zone, unsigned int order,
+                           int migratetype)
 {
     unsigned long buddy_pfn;
     struct page *buddy;
@@ -154,6 +397,7 @@ static void __free_one_page(struct page *page, unsigned long pfn,
         
         /* Remove buddy from the free list */
         del_page_from_free_list(buddy, zone, order);
+        zone->free_area[order].nr_merge++;
         
         /* Combine with buddy */
         if (buddy_pfn < pfn) {
@@ -165,7 +409,7 @@ static void __free_one_page(struct page *page, unsigned long pfn,
     }
     
     /* Add combined page to free list */
-    add_page_to_free_list(page, zone, order);
+    add_page_to_free_list(page, zone, order, migratetype);
 }
 
 /*
@@ -176,21 +420,274 @@ static void prep_new_page(struct page *page, unsigned int order, gfp_t gfp_flags
     unsigned long nr_pages = 1UL << order;
     unsigned long i;
     
-    /* Clear page flags */
+    /* Clear page flags; only the head page holds a reference */
     for (i = 0; i < nr_pages; i++) {
         page[i].flags = 0;
-        atomic_set(&page[i]._refcount, 1);
+        atomic_set(&page[i]._refcount, i == 0);
         atomic_set(&page[i]._mapcount, -1);
-        page[i].mapping = NULL;
-        page[i].index = 0;
         page[i].private = 0;
     }
     
     /* Zero the pages if requested */
     if (gfp_flags & GFP_ZERO) {
-        void *addr = page_to_virt(page);
-        memset(addr, 0, nr_pages * PAGE_SIZE);
+        char *addr = page_to_virt(page);
+        for (i = 0; i < nr_pages; i++)
+            clear_page(addr + i * PAGE_SIZE);
+    }
+}
+
+/*
+ * Initialize a per-CPU page cache
+ */
+static void pcp_init(struct per_cpu_pages *pcp)
+{
+    int i;
+    
+    pcp->count = 0;
+    pcp->high = pcp_high;
+    pcp->low = pcp_low;
+    pcp->batch = pcp_batch;
+    
+    for (i = 0; i < NR_PCP_LISTS; i++)
+        INIT_LIST_HEAD(&pcp->lists[i]);
+    
+    pcp->alloc_hit = 0;
+    pcp->alloc_miss = 0;
+    pcp->nr_free = 0;
+    pcp->nr_refill = 0;
+    pcp->nr_drain = 0;
+}
+
+/*
+ * Move up to count blocks of the given order and type from the zone
+ * onto a per-CPU list. Called with local interrupts disabled.
+ */
+static int rmqueue_bulk(struct zone *zone, unsigned int order,
+                        int migratetype, int count, struct list_head *list)
+{
+    struct page *page;
+    int i;
+    
+    spin_lock(&zone->lock);
+    
+    for (i = 0; i < count; i++) {
+        page = __rmqueue(zone, order, migratetype);
+        if (page == NULL)
+            break;
+        
+        /* Fallback blocks are cached under the type they serve */
+        page->migratetype = migratetype;
+        list_add_tail(&page->buddy_list, list);
+    }
+    
+    spin_unlock(&zone->lock);
+    
+    return i;
+}
+
+/*
+ * Return up to count pages from a per-CPU cache to the zone, coldest
+ * first, cycling through the lists. Called with local interrupts
+ * disabled.
+ */
+static void free_pcppages_bulk(struct zone *zone, int count,
+                               struct per_cpu_pages *pcp)
+{
+    struct list_head *list;
+    struct page *page;
+    unsigned int order;
+    int idx = 0;
+    int empty = 0;
+    
+    spin_lock(&zone->lock);
+    
+    while (count > 0 && pcp->count > 0 && empty < NR_PCP_LISTS) {
+        list = &pcp->lists[idx];
+        order = idx / MIGRATE_PCPTYPES;
+        
+        if (list_empty(list)) {
+            empty++;
+        } else {
+            empty = 0;
+            page = list_last_entry(list, struct page, buddy_list);
+            list_del(&page->buddy_list);
+            
+            __free_one_page(page, page_to_pfn(page), zone, order,
+                            page->migratetype);
+            
+            pcp->count -= 1 << order;
+            count -= 1 << order;
+        }
+        
+        if (++idx == NR_PCP_LISTS)
+            idx = 0;
+    }
+    
+    pcp->nr_drain++;
+    
+    spin_unlock(&zone->lock);
+}
+
+/*
+ * Allocate a low-order block from this CPU's page cache
+ */
+static struct page *rmqueue_pcplist(struct zone *zone, unsigned int order,
+                                    gfp_t gfp_flags)
+{
+    struct per_cpu_pages *pcp;
+    struct list_head *list;
+    struct page *page;
+    unsigned long flags;
+    int migratetype = gfp_migratetype(gfp_flags);
+    int batch;
+    
+    flags = local_irq_save();
+    
+    pcp = &zone->pageset[smp_processor_id()];
+    list = &pcp->lists[pcp_list_index(order, migratetype)];
+    
+    if (list_empty(list)) {
+        batch = pcp->batch >> order;
+        if (batch == 0)
+            batch = 1;
+        
+        batch = rmqueue_bulk(zone, order, migratetype, batch, list);
+        if (batch == 0) {
+            local_irq_restore(flags);
+            return NULL;
+        }
+        
+        pcp->count += batch << order;
+        pcp->nr_refill++;
+        pcp->alloc_miss++;
+    } else {
+        pcp->alloc_hit++;
+    }
+    
+    if (gfp_flags & GFP_COLD)
+        page = list_last_entry(list, struct page, buddy_list);
+    else
+        page = list_first_entry(list, struct page, buddy_list);
+    
+    list_del(&page->buddy_list);
+    pcp->count -= 1 << order;
+    
+    local_irq_restore(flags);
+    
+    return page;
+}
+
+/*
+ * Put a low-order block on a per-CPU list, the one of its pageblock's
+ * migrate type. Called with local interrupts disabled.
+ */
+static inline void pcp_add_page(struct per_cpu_pages *pcp, struct page *page,
+                                unsigned int order, int migratetype, int cold)
+{
+    struct list_head *list = &pcp->lists[pcp_list_index(order, migratetype)];
+    
+    page->migratetype = migratetype;
+    
+    if (cold)
+        list_add_tail(&page->buddy_list, list);
+    else
+        list_add(&page->buddy_list, list);
+    
+    pcp->count += 1 << order;
+    pcp->nr_free++;
+}
+
+/*
+ * Free a low-order block into this CPU's page cache
+ */
+static void free_pcp_page(struct zone *zone, struct page *page,
+                          unsigned int order, int migratetype, int cold)
+{
+    struct per_cpu_pages *pcp;
+    unsigned long flags;
+    
+    flags = local_irq_save();
+    
+    pcp = &zone->pageset[smp_processor_id()];
+    pcp_add_page(pcp, page, order, migratetype, cold);
+    
+    if (pcp->count >= pcp->high)
+        free_pcppages_bulk(zone, pcp->count - pcp->low, pcp);
+    
+    local_irq_restore(flags);
+}
+
+/*
+ * Drain one CPU's page caches in every zone back to the free lists
+ */
+static void drain_pages(unsigned int cpu)
+{
+    struct per_cpu_pages *pcp;
+    unsigned long flags;
+    int i;
+    
+    flags = local_irq_save();
+    
+    for (i = 0; i < MAX_NR_ZONES; i++) {
+        pcp = &node_data.zones[i].pageset[cpu];
+        if (pcp->count)
+            free_pcppages_bulk(&node_data.zones[i], pcp->count, pcp);
+    }
+    
+    local_irq_restore(flags);
+}
+
+void drain_local_pages(void)
+{
+    drain_pages(smp_processor_id());
+}
+
+/*
+ * Drain the page caches of all CPUs. Only the boot CPU runs today, so
+ * remote caches are drained directly rather than by IPI.
+ */
+void drain_all_pages(void)
+{
+    unsigned int cpu;
+    
+    for (cpu = 0; cpu < NR_CPUS; cpu++)
+        drain_pages(cpu);
+}
+
+/*
+ * Change the per-CPU cache watermarks and batch size
+ */
+int pcp_set_watermarks(int high, int low, int batch)
+{
+    struct per_cpu_pages *pcp;
+    unsigned long flags;
+    int i, cpu;
+    
+    if (batch <= 0 || low < 0 || high <= low || batch > high)
+        return -EINVAL;
+    
+    pcp_high = high;
+    pcp_low = low;
+    pcp_batch = batch;
+    
+    flags = local_irq_save();
+    
+    for (i = 0; i < MAX_NR_ZONES; i++) {
+        for (cpu = 0; cpu < NR_CPUS; cpu++) {
+            pcp = &node_data.zones[i].pageset[cpu];
+            pcp->high = high;
+            pcp->low = low;
+            pcp->batch = batch;
+            
+            if (pcp->count >= high)
+                free_pcppages_bulk(&node_data.zones[i],
+                                   pcp->count - low, pcp);
+        }
     }
+    
+    local_irq_restore(flags);
+    
+    return 0;
 }
 
 /*
@@ -201,8 +698,6 @@ void buddy_init(void)
     int i;
     struct zone *zone;
     
-    spin_lock_init(&buddy_lock);
-    
     /* Initialize node data */
     node_data.nr_zones = 0;
     node_data.node_id = 0;
@@ -223,12 +718,34 @@ void buddy_init(void)
         zone->nr_alloc = 0;
         zone->nr_free = 0;
         zone->zone_type = i;
+        memset(zone->watermark, 0, sizeof(zone->watermark));
         
         /* Initialize free areas */
         for (int j = 0; j < MAX_ORDER; j++) {
-            INIT_LIST_HEAD(&zone->free_area[j].free_list);
+            for (int mt = 0; mt < MIGRATE_TYPES; mt++) {
+                INIT_LIST_HEAD(&zone->free_area[j].free_list[mt]);
+                zone->free_area[j].nr_free_type[mt] = 0;
+            }
             zone->free_area[j].nr_free = 0;
+            zone->free_area[j].nr_split = 0;
+            zone->free_area[j].nr_merge = 0;
         }
+        memset(zone->free_area_map, 0, sizeof(zone->free_area_map));
+        memset(zone->migrate_stats, 0, sizeof(zone->migrate_stats));
+        
+        zone->compact_cached_migrate_pfn = 0;
+        zone->compact_cached_free_pfn = 0;
+        zone->compact_pass_migrated = 0;
+        zone->compact_considered = 0;
+        zone->compact_defer_shift = 0;
+        zone->compact_order_failed = 0;
+        zone->kcompactd_max_order = 0;
+        zone->compact_proactive_defer = 0;
+        
+        for (int cpu = 0; cpu < NR_CPUS; cpu++)
+            pcp_init(&zone->pageset[cpu]);
+        
+        zero_pool_init(&zone->zero_pool);
         
         switch (i) {
         case ZONE_DMA:
@@ -250,54 +767,39 @@ void buddy_init(void)
 }
 
 /*
- * Initialize a memory region and add it to the buddy allocator
+ * Add a range of one zone to its free lists
  */
-void free_area_init(unsigned long start_pfn, unsigned long end_pfn)
+static void zone_free_range(struct zone *zone, unsigned long start_pfn,
+                            unsigned long end_pfn)
 {
-    unsigned long pfn;
+    unsigned long pfn, zone_end;
     unsigned long nr_pages = end_pfn - start_pfn;
-    struct zone *zone = &node_data.zones[ZONE_NORMAL];
+    unsigned int order;
     struct page *page;
     unsigned long flags;
     
-    if (nr_pages == 0)
-        return;
-    
-    /* Allocate page array if needed */
-    if (mem_map == NULL) {
-        /* For now, we assume mem_map is statically allocated or 
-         * allocated by early boot code */
-        printk("Warning: mem_map not initialized\n");
-        return;
-    }
-    
-    spin_lock_irqsave(&buddy_lock, &flags);
+    spin_lock_irqsave(&zone->lock, &flags);
     
     /* Update zone information */
-    if (zone->zone_start_pfn == 0 || start_pfn < zone->zone_start_pfn)
+    if (zone->spanned_pages == 0) {
         zone->zone_start_pfn = start_pfn;
+        zone_end = end_pfn;
+    } else {
+        zone_end = MAX(zone_end_pfn(zone), end_pfn);
+        zone->zone_start_pfn = MIN(zone->zone_start_pfn, start_pfn);
+    }
     
-    zone->spanned_pages += nr_pages;
+    zone->spanned_pages = zone_end - zone->zone_start_pfn;
     zone->present_pages += nr_pages;
     zone->managed_pages += nr_pages;
     
-    /* Update node information */
-    if (node_data.node_start_pfn == 0 || start_pfn < node_data.node_start_pfn)
-        node_data.node_start_pfn = start_pfn;
-    
-    node_data.node_spanned_pages += nr_pages;
-    node_data.node_present_pages += nr_pages;
-    node_data.nr_zones = ZONE_NORMAL + 1;
-    
     /* Initialize pages and add to free list */
     for (pfn = start_pfn; pfn < end_pfn; ) {
         page = pfn_to_page(pfn);
         
         /* Find the largest order that fits */
-        unsigned int order = MAX_ORDER - 1;
+        order = MAX_ORDER - 1;
         while (order > 0) {
-            unsigned long buddy_pfn = pfn ^ (1 << order);
-            
             /* Check alignment and bounds */
             if ((pfn & ((1 << order) - 1)) != 0)
                 order--;
@@ -313,67 +815,688 @@ void free_area_init(unsigned long start_pfn, unsigned long end_pfn)
         atomic_set(&page->_mapcount, -1);
         
         /* Add to free list */
-        add_page_to_free_list(page, zone, order);
-        
-        total_pages += (1UL << order);
-        free_page_count += (1UL << order);
+        add_page_to_free_list(page, zone, order,
+                              get_pageblock_migratetype(pfn));
         
         pfn += (1UL << order);
     }
     
-    spin_unlock_irqrestore(&buddy_lock, flags);
-    
-    printk("Added %lu pages to buddy allocator (PFN %lu - %lu)\n",
-           nr_pages, start_pfn, end_pfn);
+    spin_unlock_irqrestore(&zone->lock, flags);
 }
 
 /*
- * Allocate pages from the buddy allocator
+ * Initialize a memory region and add it to the buddy allocator,
+ * split at the zone boundaries
  */
-struct page *alloc_pages(gfp_t gfp_mask, unsigned int order)
+void free_area_init(unsigned long start_pfn, unsigned long end_pfn)
 {
-    struct zone *zone;
-    struct page *page = NULL;
-    unsigned long flags;
-    int zone_type;
-    
-    if (order >= MAX_ORDER)
-        return NULL;
+    unsigned long split;
+    int zid;
     
-    /* Select zone based on GFP flags */
-    if (gfp_mask & GFP_DMA)
-        zone_type = ZONE_DMA;
-    else if (gfp_mask & GFP_HIGHMEM)
-        zone_type = ZONE_HIGHMEM;
-    else
-        zone_type = ZONE_NORMAL;
+    if (start_pfn >= end_pfn)
+        return;
     
-    spin_lock_irqsave(&buddy_lock, &flags);
+    if (!pfn_valid(start_pfn)) {
+        printk("Warning: no mem_map for pfn 0x%lx\n", start_pfn);
+        return;
+    }
     
+    /* Update node information */
+    if (node_data.node_present_pages == 0 || start_pfn < node_data.node_start_pfn)
+        node_data.node_start_pfn = start_pfn;
+    
+    node_data.node_spanned_pages += end_pfn - start_pfn;
+    node_data.node_present_pages += end_pfn - start_pfn;
+    
+    while (start_pfn < end_pfn) {
+        zid = pfn_zonenum(start_pfn);
+        split = end_pfn;
+        if (zid == ZONE_DMA)
+            split = MIN(end_pfn, MAX_DMA_PFN);
+        
+        zone_free_range(&node_data.zones[zid], start_pfn, split);
+        node_data.nr_zones = MAX(node_data.nr_zones, zid + 1);
+        
+        start_pfn = split;
+    }
+}
+
+/*
+ * Take a block of the given order from a zone
+ */
+static struct page *rmqueue(struct zone *zone, unsigned int order,
+                            gfp_t gfp_mask)
+{
+    struct page *page;
+    unsigned long flags;
+    
+    if (order < PCP_NR_ORDERS)
+        return rmqueue_pcplist(zone, order, gfp_mask);
+    
+    spin_lock_irqsave(&zone->lock, &flags);
+    page = __rmqueue(zone, order, gfp_migratetype(gfp_mask));
+    spin_unlock_irqrestore(&zone->lock, flags);
+    
+    return page;
+}
+
+/*
+ * Pre-zeroed page pool
+ */
+static void zero_pool_init(struct zero_pool *zp)
+{
+    spin_lock_init(&zp->lock);
+    INIT_LIST_HEAD(&zp->pages);
+    zp->nr = 0;
+    zp->target = ZERO_POOL_DEFAULT;
+    zp->hits = 0;
+    zp->misses = 0;
+    zp->zeroed = 0;
+}
+
+static struct page *zero_pool_get(struct zone *zone)
+{
+    struct zero_pool *zp = &zone->zero_pool;
+    struct page *page = NULL;
+    unsigned long flags;
+    
+    if (zp->nr == 0)
+        return NULL;
+    
+    spin_lock_irqsave(&zp->lock, &flags);
+    
+    if (!list_empty(&zp->pages)) {
+        page = list_first_entry(&zp->pages, struct page, lru);
+        list_del(&page->lru);
+        zp->nr--;
+        zp->hits++;
+    }
+    
+    spin_unlock_irqrestore(&zp->lock, flags);
+    
+    return page;
+}
+
+/*
+ * Give pooled pages back to the free lists, down to keep pages
+ */
+static void zero_pool_shrink(struct zone *zone, unsigned long keep)
+{
+    struct zero_pool *zp = &zone->zero_pool;
+    struct list_head list;
+    struct page *page, *tmp;
+    unsigned long flags;
+    
+    INIT_LIST_HEAD(&list);
+    
+    spin_lock_irqsave(&zp->lock, &flags);
+    while (zp->nr > keep) {
+        page = list_last_entry(&zp->pages, struct page, lru);
+        list_move(&page->lru, &list);
+        zp->nr--;
+    }
+    spin_unlock_irqrestore(&zp->lock, flags);
+    
+    if (list_empty(&list))
+        return;
+    
+    spin_lock_irqsave(&zone->lock, &flags);
+    list_for_each_entry_safe(page, tmp, &list, lru) {
+        list_del(&page->lru);
+        __free_one_page(page, page_to_pfn(page), zone, 0,
+                        get_pageblock_migratetype(page_to_pfn(page)));
+    }
+    spin_unlock_irqrestore(&zone->lock, flags);
+}
+
+static void zero_pool_drain_all(void)
+{
+    int i;
+    
+    for (i = 0; i < MAX_NR_ZONES; i++)
+        zero_pool_shrink(&node_data.zones[i], 0);
+}
+
+/*
+ * Clear a batch of cold pages towards the pool target. Non-temporal
+ * stores keep the zeroes out of the cache; the pages are cold anyway.
+ * They are taken as unmovable: a movable GFP_ZERO user landing in an
+ * unmovable pageblock is harmless, the other way round is not.
+ */
+static int zero_pool_refill(struct zone *zone)
+{
+    struct zero_pool *zp = &zone->zero_pool;
+    struct list_head list;
+    struct page *page, *tmp;
+    unsigned long flags;
+    int n;
+    
+    if (zp->nr >= zp->target)
+        return 0;
+    
+    /* Leave the memory to real allocations when the zone runs low */
+    if (zone->nr_free_pages < zone->managed_pages / 8)
+        return 0;
+    
+    /* One batch straight from the free lists, under one lock hold */
+    INIT_LIST_HEAD(&list);
+    flags = local_irq_save();
+    n = rmqueue_bulk(zone, 0, MIGRATE_UNMOVABLE,
+                     MIN(ZERO_POOL_BATCH, zp->target - zp->nr), &list);
+    local_irq_restore(flags);
+    
+    if (n == 0)
+        return 0;
+    
+    list_for_each_entry(page, &list, buddy_list)
+        clear_page_nt(page_to_virt(page));
+    wmb();
+    
+    spin_lock_irqsave(&zp->lock, &flags);
+    list_for_each_entry_safe(page, tmp, &list, buddy_list) {
+        list_del(&page->buddy_list);
+        list_add_tail(&page->lru, &zp->pages);
+    }
+    zp->nr += n;
+    zp->zeroed += n;
+    spin_unlock_irqrestore(&zp->lock, flags);
+    
+    return n;
+}
+
+int zero_pool_set_target(unsigned long pages)
+{
+    int i;
+    
+    if (pages > totalram_pages() / 4)
+        return -EINVAL;
+    
+    for (i = 0; i < MAX_NR_ZONES; i++) {
+        node_data.zones[i].zero_pool.target = pages;
+        zero_pool_shrink(&node_data.zones[i], pages);
+    }
+    
+    return 0;
+}
+
+static unsigned long nr_zero_pool_pages(void)
+{
+    unsigned long count = 0;
+    int i;
+    
+    for (i = 0; i < MAX_NR_ZONES; i++)
+        count += node_data.zones[i].zero_pool.nr;
+    
+    return count;
+}
+
+static unsigned long int_sqrt(unsigned long x)
+{
+    unsigned long r = 0, bit = 1UL << 62;
+    
+    while (bit > x)
+        bit >>= 2;
+    while (bit) {
+        if (x >= r + bit) {
+            x -= r + bit;
+            r = (r >> 1) + bit;
+        } else {
+            r >>= 1;
+        }
+        bit >>= 2;
+    }
+    return r;
+}
+
+/*
+ * Split min_free_kbytes across the zones by size: that share is each
+ * zone's min watermark, and low and high sit a quarter of it apart
+ * above, or WATERMARK_SCALE_FACTOR of the zone if that is more. Run
+ * again as deferred memory arrives.
+ */
+static void setup_per_zone_wmarks(void)
+{
+    unsigned long managed = totalram_pages();
+    unsigned long pages_min, min, gap;
+    struct zone *zone;
+    int i;
+    
+    if (managed == 0)
+        return;
+    
+    if (user_min_free_kbytes) {
+        /* Until deferred memory arrives there is less to reserve from */
+        min_free_kbytes = MIN(user_min_free_kbytes,
+                              (managed << (PAGE_SHIFT - 10)) /
+                              MIN_FREE_KBYTES_RATIO);
+    } else {
+        min_free_kbytes = int_sqrt((managed << (PAGE_SHIFT - 10)) * 16);
+        min_free_kbytes = CLAMP(min_free_kbytes, MIN_FREE_KBYTES_MIN,
+                                MIN_FREE_KBYTES_MAX);
+    }
+    pages_min = min_free_kbytes >> (PAGE_SHIFT - 10);
+    
+    for (i = 0; i < MAX_NR_ZONES; i++) {
+        zone = &node_data.zones[i];
+        
+        min = pages_min * zone->managed_pages / managed;
+        gap = MAX(min / 4,
+                  zone->managed_pages * WATERMARK_SCALE_FACTOR / 10000);
+        
+        zone->watermark[WMARK_MIN] = min;
+        zone->watermark[WMARK_LOW] = min + gap;
+        zone->watermark[WMARK_HIGH] = min + 2 * gap;
+    }
+}
+
+/*
+ * min_free_kbytes=<KB>, or a size with a K/M/G suffix, at most a
+ * MIN_FREE_KBYTES_RATIO'th of memory
+ */
+static void parse_min_free_kbytes(const char *opt)
+{
+    unsigned long kb, limit;
+    const char *end;
+    
+    kb = memparse(opt, &end);
+    if (end > opt) {
+        switch (end[-1]) {
+        case 'K': case 'k': case 'M': case 'm':
+        case 'G': case 'g': case 'T': case 't':
+            kb >>= 10;
+            break;
+        }
+    }
+    
+    limit = (memblock_phys_mem_size() >> 10) / MIN_FREE_KBYTES_RATIO;
+    if (kb > limit) {
+        printk("min_free_kbytes: %lu KB is too much, using %lu KB\n",
+               kb, limit);
+        kb = limit;
+    }
+    
+    user_min_free_kbytes = kb;
+}
+
+bool zone_watermark_ok(struct zone *zone, unsigned int order, int wmark,
+                       gfp_t gfp_mask)
+{
+    unsigned long mark = zone->watermark[wmark];
+    
+    if (gfp_mask & GFP_MEMALLOC)
+        return true;
+    
+    /* Atomic allocations cannot wait for reclaim: half the reserve */
+    if (wmark == WMARK_MIN && (gfp_mask & GFP_ATOMIC))
+        mark -= mark / 2;
+    
+    return zone->nr_free_pages >= mark + (1UL << order);
+}
+
+/*
+ * Allocate pages from the buddy allocator
+ */
+struct page *alloc_pages(gfp_t gfp_mask, unsigned int order)
+{
+    struct zone *zone;
+    struct page *page = NULL;
+    int zone_type = gfp_zone(gfp_mask);
+    int migratetype = gfp_migratetype(gfp_mask);
+    int drained = 0;
+    int compacted = 0;
+    int reclaimed = 0;
+    int prezeroed = 0;
+    int wmark = WMARK_LOW;
+    
+    if (order >= MAX_ORDER)
+        return NULL;
+    
+retry:
     /* Try to allocate from the selected zone */
     for (int i = zone_type; i >= 0; i--) {
         zone = &node_data.zones[i];
         
-        if (zone->nr_free_pages < (1UL << order))
+        if (zone->managed_pages == 0)
+            continue;
+        
+        if (i < zone_type && !zone_fallback_ok(zone, zone_type))
+            continue;
+        
+        /*
+         * Unlocked peek at the order bitmap: skip zones with no block
+         * large enough. Low orders may still be on the per-CPU lists.
+         */
+        if (order >= PCP_NR_ORDERS &&
+            zone_first_free_order(zone, order) >= MAX_ORDER)
+            continue;
+        
+        if (order == 0 && (gfp_mask & GFP_ZERO)) {
+            page = zero_pool_get(zone);
+            if (page) {
+                prezeroed = 1;
+                zone->nr_alloc++;
+                alloc_count++;
+                break;
+            }
+        }
+        
+        if (!zone_watermark_ok(zone, order, wmark, gfp_mask))
             continue;
         
-        page = __rmqueue_smallest(zone, order);
+        page = rmqueue(zone, order, gfp_mask);
         if (page) {
+            if (order == 0 && (gfp_mask & GFP_ZERO))
+                zone->zero_pool.misses++;
             zone->nr_alloc++;
             alloc_count++;
-            free_page_count -= (1UL << order);
             break;
         }
     }
     
-    spin_unlock_irqrestore(&buddy_lock, flags);
+    /* Below the low watermark: have kswapd catch up, and go on to min */
+    if (page == NULL && wmark == WMARK_LOW) {
+        wakeup_kswapd(&node_data.zones[zone_type]);
+        wmark = WMARK_MIN;
+        goto retry;
+    }
+    
+    /* Pages parked in per-CPU caches may be enough to satisfy us */
+    if (page == NULL && !drained) {
+        drain_all_pages();
+        zero_pool_drain_all();
+        drained = 1;
+        goto retry;
+    }
+    
+    /* Memory whose struct pages are not initialized yet */
+    if (page == NULL && deferred_init_section())
+        goto retry;
+    
+    /* Enough memory may be free, just not contiguous */
+    if (page == NULL && order >= COMPACT_MIN_ORDER) {
+        if (!compacted && !(gfp_mask & (GFP_NOWAIT | GFP_ATOMIC))) {
+            compacted = 1;
+            if (try_to_compact_pages(gfp_mask, order))
+                goto retry;
+        }
+        wakeup_kcompactd(&node_data.zones[zone_type], order);
+    }
+    
+    /* Swap out anonymous memory; what it frees lands on per-CPU lists */
+    if (page == NULL && !reclaimed && order < COMPACT_MIN_ORDER &&
+        !(gfp_mask & (GFP_NOWAIT | GFP_ATOMIC))) {
+        reclaimed = 1;
+        if (try_to_free_pages(MAX(SWAP_CLUSTER_MAX, 1UL << order))) {
+            drained = 0;
+            goto retry;
+        }
+    }
+    
+    if (page == NULL) {
+        node_data.zones[zone_type].migrate_stats[migratetype].nr_fail++;
+        return NULL;
+    }
     
-    if (page)
-        prep_new_page(page, order, gfp_mask);
+    zone->migrate_stats[migratetype].nr_alloc++;
+    prep_new_page(page, order, prezeroed ? (gfp_mask & ~GFP_ZERO) : gfp_mask);
     
     return page;
 }
 
+/*
+ * Allocate up to nr_pages order-0 pages in one go: the per-CPU list is
+ * visited once with interrupts disabled, and whatever it lacks comes
+ * from the zone in a single zone->lock hold. Pages are added to list
+ * (linked through page->lru), or stored in the NULL slots of
+ * page_array. Returns the number of pages on the list or populated
+ * array slots. Only when nothing could be taken this way does it fall
+ * back to alloc_pages for one page, which may drain, compact and wait
+ * for deferred memory.
+ */
+unsigned long __alloc_pages_bulk(gfp_t gfp_mask, unsigned long nr_pages,
+                                 struct list_head *list,
+                                 struct page **page_array)
+{
+    struct zone *zone = NULL;
+    struct per_cpu_pages *pcp;
+    struct list_head *pcp_list;
+    struct list_head pages;
+    struct page *page, *tmp;
+    unsigned long nr_populated = 0, nr_new = 0, want = nr_pages, idx;
+    unsigned long flags, nr_hit = 0;
+    int zone_type = gfp_zone(gfp_mask);
+    int migratetype = gfp_migratetype(gfp_mask);
+    bool prepared = false, refilled = false;
+    int i, got;
+    
+    if (page_array) {
+        for (idx = 0; idx < nr_pages; idx++)
+            if (page_array[idx])
+                nr_populated++;
+        want = nr_pages - nr_populated;
+    }
+    
+    if (want == 0)
+        return nr_populated;
+    
+    for (i = zone_type; i >= 0; i--) {
+        if (node_data.zones[i].managed_pages == 0)
+            continue;
+        if (i < zone_type && !zone_fallback_ok(&node_data.zones[i], zone_type))
+            continue;
+        zone = &node_data.zones[i];
+        break;
+    }
+    if (zone == NULL)
+        return nr_populated;
+    
+    INIT_LIST_HEAD(&pages);
+    
+    /* Near the low watermark, alloc_pages decides one page at a time */
+    if (zone->nr_free_pages < low_wmark_pages(zone) + want)
+        goto fallback;
+    
+    flags = local_irq_save();
+    
+    pcp = &zone->pageset[smp_processor_id()];
+    pcp_list = &pcp->lists[pcp_list_index(0, migratetype)];
+    
+    while (nr_new < want) {
+        if (list_empty(pcp_list)) {
+            /* Everything still missing, in one trip to the zone */
+            got = rmqueue_bulk(zone, 0, migratetype,
+                               MAX(want - nr_new, (unsigned long)pcp->batch),
+                               pcp_list);
+            if (got == 0)
+                break;
+            pcp->count += got;
+            pcp->nr_refill++;
+            refilled = true;
+        }
+        
+        page = list_first_entry(pcp_list, struct page, buddy_list);
+        list_del(&page->buddy_list);
+        pcp->count--;
+        list_add_tail(&page->lru, &pages);
+        nr_new++;
+        /* Only pages the list held before the refill count as hits */
+        if (!refilled)
+            nr_hit++;
+    }
+    
+    /* A large refill may have overshot */
+    if (pcp->count >= pcp->high)
+        free_pcppages_bulk(zone, pcp->count - pcp->low, pcp);
+    
+    pcp->alloc_hit += nr_hit;
+    pcp->alloc_miss += nr_new - nr_hit;
+    
+    local_irq_restore(flags);
+    
+fallback:
+    if (nr_new == 0) {
+        page = alloc_pages(gfp_mask, 0);
+        if (page == NULL)
+            return nr_populated;
+        list_add_tail(&page->lru, &pages);
+        prepared = true;
+    } else {
+        zone->nr_alloc += nr_new;
+        zone->migrate_stats[migratetype].nr_alloc += nr_new;
+        alloc_count += nr_new;
+    }
+    
+    idx = 0;
+    list_for_each_entry_safe(page, tmp, &pages, lru) {
+        list_del(&page->lru);
+        if (!prepared)
+            prep_new_page(page, 0, gfp_mask);
+        
+        if (page_array) {
+            while (page_array[idx])
+                idx++;
+            page_array[idx] = page;
+        } else {
+            list_add_tail(&page->lru, list);
+        }
+        nr_populated++;
+    }
+    
+    return nr_populated;
+}
+
+/*
+ * Bulk free: order-0 pages go onto this CPU's lists of their zones with
+ * interrupts disabled once, and the lists are trimmed to their low
+ * watermark at the end, one zone->lock hold per zone
+ */
+static void free_pages_bulk_one(struct page *page, unsigned int cpu)
+{
+    struct zone *zone = page_zone(page);
+    
+    atomic_set(&page->_refcount, 0);
+    pcp_add_page(&zone->pageset[cpu], page, 0,
+                 get_pageblock_migratetype(page_to_pfn(page)), 0);
+    zone->nr_free++;
+    free_count++;
+}
+
+static void free_pages_bulk_trim(unsigned int cpu)
+{
+    struct per_cpu_pages *pcp;
+    int i;
+    
+    for (i = 0; i < MAX_NR_ZONES; i++) {
+        pcp = &node_data.zones[i].pageset[cpu];
+        if (pcp->count >= pcp->high)
+            free_pcppages_bulk(&node_data.zones[i], pcp->count - pcp->low, pcp);
+    }
+}
+
+/* NULL entries are skipped */
+void free_pages_bulk(struct page **pages, unsigned long nr_pages)
+{
+    unsigned long flags, i;
+    unsigned int cpu;
+    
+    flags = local_irq_save();
+    cpu = smp_processor_id();
+    
+    for (i = 0; i < nr_pages; i++)
+        if (pages[i])
+            free_pages_bulk_one(pages[i], cpu);
+    
+    free_pages_bulk_trim(cpu);
+    
+    local_irq_restore(flags);
+}
+
+/* Pages linked through page->lru; the list is left empty */
+void free_pages_bulk_list(struct list_head *list)
+{
+    struct page *page, *tmp;
+    unsigned long flags;
+    unsigned int cpu;
+    
+    flags = local_irq_save();
+    cpu = smp_processor_id();
+    
+    list_for_each_entry_safe(page, tmp, list, lru) {
+        list_del(&page->lru);
+        free_pages_bulk_one(page, cpu);
+    }
+    
+    free_pages_bulk_trim(cpu);
+    
+    local_irq_restore(flags);
+}
+
+/*
+ * Take the free pages in [start_pfn, end_pfn) off the free lists, split
+ * into order-0 pages, until max pages are isolated. Blocks of a whole
+ * pageblock or more are left alone: they are what compaction is trying
+ * to create.
+ */
+unsigned long isolate_freepages_block(struct zone *zone, unsigned long start_pfn,
+                                      unsigned long end_pfn,
+                                      struct list_head *list,
+                                      unsigned long max)
+{
+    unsigned long pfn, i, nr = 0;
+    unsigned int order;
+    struct page *page;
+    unsigned long flags;
+    
+    spin_lock_irqsave(&zone->lock, &flags);
+    
+    for (pfn = start_pfn; pfn < end_pfn && nr < max; ) {
+        page = pfn_to_page(pfn);
+        
+        if (!PageBuddy(page)) {
+            pfn++;
+            continue;
+        }
+        
+        order = page->order;
+        if (order >= pageblock_order)
+            break;
+        
+        del_page_from_free_list(page, zone, order);
+        for (i = 0; i < (1UL << order); i++) {
+            page[i].flags = 0;
+            atomic_set(&page[i]._refcount, 0);
+            list_add_tail(&page[i].lru, list);
+        }
+        
+        nr += 1UL << order;
+        pfn += 1UL << order;
+    }
+    
+    spin_unlock_irqrestore(&zone->lock, flags);
+    
+    return nr;
+}
+
+/*
+ * Return isolated free pages to the free lists
+ */
+void release_freepages(struct zone *zone, struct list_head *list)
+{
+    struct page *page, *tmp;
+    unsigned long pfn;
+    unsigned long flags;
+    
+    spin_lock_irqsave(&zone->lock, &flags);
+    
+    list_for_each_entry_safe(page, tmp, list, lru) {
+        list_del(&page->lru);
+        pfn = page_to_pfn(page);
+        __free_one_page(page, pfn, zone, 0, get_pageblock_migratetype(pfn));
+    }
+    
+    spin_unlock_irqrestore(&zone->lock, flags);
+}
+
 /*
  * Free pages back to the buddy allocator
  */
@@ -382,6 +1505,7 @@ void free_pages(struct page *page, unsigned int order)
     unsigned long pfn;
     struct zone *zone;
     unsigned long flags;
+    int migratetype;
     
     if (page == NULL)
         return;
@@ -390,21 +1514,23 @@ void free_pages(struct page *page, unsigned int order)
         return;
     
     pfn = page_to_pfn(page);
-    zone = &node_data.zones[ZONE_NORMAL];
-    
-    spin_lock_irqsave(&buddy_lock, &flags);
+    zone = page_zone(page);
+    migratetype = get_pageblock_migratetype(pfn);
     
     /* Clear reference count */
     atomic_set(&page->_refcount, 0);
     
-    /* Return to free list */
-    __free_one_page(page, pfn, zone, order);
-    
     zone->nr_free++;
     free_count++;
-    free_page_count += (1UL << order);
     
-    spin_unlock_irqrestore(&buddy_lock, flags);
+    if (order < PCP_NR_ORDERS) {
+        free_pcp_page(zone, page, order, migratetype, 0);
+        return;
+    }
+    
+    spin_lock_irqsave(&zone->lock, &flags);
+    __free_one_page(page, pfn, zone, order, migratetype);
+    spin_unlock_irqrestore(&zone->lock, flags);
 }
 
 /*
@@ -442,12 +1568,27 @@ void free_pages_virt(unsigned long addr, unsigned int order)
     free_pages(page, order);
 }
 
+/*
+ * Count pages parked in per-CPU caches
+ */
+static unsigned long nr_pcp_pages(void)
+{
+    unsigned long count = 0;
+    int i, cpu;
+    
+    for (i = 0; i < MAX_NR_ZONES; i++)
+        for (cpu = 0; cpu < NR_CPUS; cpu++)
+            count += node_data.zones[i].pageset[cpu].count;
+    
+    return count;
+}
+
 /*
  * Return total number of free pages
  */
 unsigned long nr_free_pages(void)
 {
-    return free_page_count;
+    return nr_buddy_free_pages() + nr_pcp_pages() + nr_zero_pool_pages();
 }
 
 /*
@@ -455,8 +1596,8 @@ unsigned long nr_free_pages(void)
  */
 void si_meminfo(struct sysinfo *info)
 {
-    info->totalram = total_pages;
-    info->freeram = free_page_count;
+    info->totalram = totalram_pages();
+    info->freeram = nr_free_pages();
     info->sharedram = 0;
     info->bufferram = 0;
     info->totalhigh = 0;
@@ -465,11 +1606,15 @@ void si_meminfo(struct sysinfo *info)
 }
 
 /*
- * Fill in swap info (no swap support yet)
+ * Fill in swap info. Swap is compressed into memory, so it has no size
+ * of its own: report what has been swapped out as used.
  */
 void si_swapinfo(struct sysinfo *info)
 {
-    info->totalswap = 0;
+    struct zswap_stats stats;
+
+    zswap_get_stats(&stats);
+    info->totalswap = stats.stored_pages;
     info->freeswap = 0;
 }
 
@@ -483,9 +1628,11 @@ void show_mem(void)
     
     printk("Memory Statistics:\n");
     printk("  Total pages: %lu (%lu KB)\n", 
-           total_pages, (total_pages * PAGE_SIZE) / 1024);
+           totalram_pages(), (totalram_pages() * PAGE_SIZE) / 1024);
     printk("  Free pages:  %lu (%lu KB)\n", 
-           free_page_count, (free_page_count * PAGE_SIZE) / 1024);
+           nr_free_pages(), (nr_free_pages() * PAGE_SIZE) / 1024);
+    printk("  Per-CPU:     %lu pages cached\n", nr_pcp_pages());
+    printk("  Zeroed:      %lu pages pooled\n", nr_zero_pool_pages());
     printk("  Allocations: %lu\n", alloc_count);
     printk("  Frees:       %lu\n", free_count);
     
@@ -501,6 +1648,9 @@ void show_mem(void)
         printk("    Spanned pages: %lu\n", zone->spanned_pages);
         printk("    Present pages: %lu\n", zone->present_pages);
         printk("    Free pages:    %lu\n", zone->nr_free_pages);
+        printk("    Watermarks:    min %lu, low %lu, high %lu\n",
+               min_wmark_pages(zone), low_wmark_pages(zone),
+               high_wmark_pages(zone));
         
         printk("    Free areas:\n");
         for (j = 0; j < MAX_ORDER; j++) {
@@ -514,95 +1664,625 @@ void show_mem(void)
 }
 
 /*
- * Memory initialization
+ * Show per-order free block counts and fragmentation
+ *
+ * "Unusable" is the share of free memory sitting in blocks too small
+ * to serve an allocation of that order. Everything is derived from the
+ * per-order counters, so no free list is walked.
  */
-void mm_init(void)
+void show_buddyinfo(void)
 {
-    buddy_init();
-    printk("Memory management initialized\n");
+    struct free_area *area;
+    struct zone *zone;
+    unsigned long free, suitable;
+    unsigned long flags;
+    int i, j;
+    
+    for (i = 0; i < MAX_NR_ZONES; i++) {
+        zone = &node_data.zones[i];
+        
+        if (zone->present_pages == 0)
+            continue;
+        
+        spin_lock_irqsave(&zone->lock, &flags);
+        
+        free = zone->nr_free_pages;
+        printk("Zone %s: %lu free pages, order map 0x%x\n", zone->name, free,
+               zone->free_area_map[MIGRATE_UNMOVABLE] |
+               zone->free_area_map[MIGRATE_MOVABLE] |
+               zone->free_area_map[MIGRATE_RECLAIMABLE]);
+        
+        suitable = free;
+        for (j = 0; j < MAX_ORDER; j++) {
+            area = &zone->free_area[j];
+            
+            printk("  Order %ld: %lu free, %lu splits, %lu merges, "
+                   "unusable %lu%%\n",
+                   (long)j, area->nr_free, area->nr_split, area->nr_merge,
+                   free ? ((free - suitable) * 100) / free : 0);
+            
+            /* Blocks of this order are too small for the next one */
+            suitable -= area->nr_free << j;
+        }
+        
+        spin_unlock_irqrestore(&zone->lock, flags);
+    }
 }
 
-void mem_init(void)
+/*
+ * Show free blocks and allocation statistics per migrate type
+ */
+void show_pagetypeinfo(void)
 {
-    /* Called after all memory regions are added */
-    printk("Memory initialization complete\n");
-    printk("  Total: %lu pages (%lu MB)\n", 
-           total_pages, (total_pages * PAGE_SIZE) / (1024 * 1024));
-    printk("  Free:  %lu pages (%lu MB)\n",
-           free_page_count, (free_page_count * PAGE_SIZE) / (1024 * 1024));
+    struct migrate_stats *st;
+    struct zone *zone;
+    unsigned long flags;
+    int i, j, mt;
+    
+    printk("Pageblock order %ld (%lu KB)\n",
+           (long)pageblock_order, (pageblock_nr_pages * PAGE_SIZE) >> 10);
+    
+    for (i = 0; i < MAX_NR_ZONES; i++) {
+        zone = &node_data.zones[i];
+        
+        if (zone->present_pages == 0)
+            continue;
+        
+        spin_lock_irqsave(&zone->lock, &flags);
+        
+        printk("Zone %s free blocks, order 0..%ld:\n",
+               zone->name, (long)(MAX_ORDER - 1));
+        for (mt = 0; mt < MIGRATE_TYPES; mt++) {
+            printk("  %s:", migratetype_names[mt]);
+            for (j = 0; j < MAX_ORDER; j++)
+                printk(" %lu", zone->free_area[j].nr_free_type[mt]);
+            printk("\n");
+        }
+        
+        for (mt = 0; mt < MIGRATE_TYPES; mt++) {
+            st = &zone->migrate_stats[mt];
+            printk("  %s: %lu pageblocks, %lu allocs, %lu failed, "
+                   "%lu fallbacks, %lu stolen\n",
+                   migratetype_names[mt], st->nr_pageblocks, st->nr_alloc,
+                   st->nr_fail, st->nr_fallback, st->nr_steal);
+        }
+        
+        spin_unlock_irqrestore(&zone->lock, flags);
+    }
 }
 
 /*
- * Simple kmalloc implementation (placeholder)
- * In a real kernel, this would use a slab allocator
+ * Put all of memory in the buddy lists, with nothing held back in
+ * caches, so that benchmarks measure every free page
  */
-void *kmalloc(size_t size, gfp_t flags)
+void mm_bench_prepare(void)
 {
-    unsigned int order;
-    struct page *page;
+    while (deferred_init_section())
+        ;
+    zero_pool_drain_all();
+    drain_all_pages();
+}
+
+/*
+ * Fragmentation benchmark
+ *
+ * Fill memory with order-0 pages, one unmovable for every
+ * FRAG_UNMOVABLE_RATIO - 1 movable ones, free the movable pages and
+ * count how many pageblock-sized blocks can then be allocated. Without
+ * grouping by mobility every pageblock would hold an unmovable page.
+ * nr_pages of 0 churns three quarters of free memory.
+ */
+#define FRAG_UNMOVABLE_RATIO    16
+
+static void migrate_event_totals(struct zone *zone, unsigned long *fallbacks,
+                                 unsigned long *steals)
+{
+    int mt;
     
-    if (size == 0)
-        return NULL;
+    *fallbacks = *steals = 0;
+    for (mt = 0; mt < MIGRATE_TYPES; mt++) {
+        *fallbacks += zone->migrate_stats[mt].nr_fallback;
+        *steals += zone->migrate_stats[mt].nr_steal;
+    }
+}
+
+void bench_fragmentation(unsigned long nr_pages)
+{
+    struct zone *zone = &node_data.zones[ZONE_NORMAL];
+    struct list_head movable, unmovable, high;
+    unsigned long fallbacks, steals, fallbacks_end, steals_end;
+    unsigned long possible, got = 0;
+    unsigned long i, nr_unmovable = 0;
+    struct page *page, *tmp;
+    gfp_t gfp;
+    u64 start;
     
-    /* Round up to page size and find order */
-    size = ALIGN_UP(size, PAGE_SIZE);
-    order = 0;
-    while ((PAGE_SIZE << order) < size && order < MAX_ORDER)
-        order++;
+    INIT_LIST_HEAD(&movable);
+    INIT_LIST_HEAD(&unmovable);
+    INIT_LIST_HEAD(&high);
     
-    if (order >= MAX_ORDER)
-        return NULL;
+    mm_bench_prepare();
     
-    page = alloc_pages(flags, order);
-    if (page == NULL)
-        return NULL;
+    if (nr_pages == 0)
+        nr_pages = (zone->nr_free_pages / 4) * 3;
+    
+    migrate_event_totals(zone, &fallbacks, &steals);
+    start = rdtsc();
+    
+    /* Churn: interleaved allocations, linked through page->lru */
+    for (i = 0; i < nr_pages; i++) {
+        gfp = GFP_KERNEL;
+        if (i % FRAG_UNMOVABLE_RATIO)
+            gfp |= GFP_MOVABLE;
+        
+        page = alloc_pages(gfp, 0);
+        if (page == NULL)
+            break;
+        
+        if (gfp & GFP_MOVABLE) {
+            list_add(&page->lru, &movable);
+        } else {
+            list_add(&page->lru, &unmovable);
+            nr_unmovable++;
+        }
+    }
+    nr_pages = i;
+    
+    free_pages_bulk_list(&movable);
+    drain_all_pages();
+    
+    /* How much of the free memory can still be had in large blocks? */
+    possible = zone->nr_free_pages >> pageblock_order;
+    while ((page = alloc_pages(GFP_KERNEL | GFP_MOVABLE,
+                               pageblock_order)) != NULL) {
+        list_add(&page->lru, &high);
+        if (page_zone(page) == zone)
+            got++;
+    }
     
-    return page_to_virt(page);
+    list_for_each_entry_safe(page, tmp, &high, lru) {
+        list_del(&page->lru);
+        free_pages(page, pageblock_order);
+    }
+    free_pages_bulk_list(&unmovable);
+    
+    migrate_event_totals(zone, &fallbacks_end, &steals_end);
+    
+    printk("Churned %lu pages (%lu unmovable) in %lu us\n",
+           nr_pages, nr_unmovable, (unsigned long)tsc_to_us(rdtsc() - start));
+    printk("  Order-%ld after churn: %lu of %lu blocks (%lu%%)\n",
+           (long)pageblock_order, got, possible,
+           possible ? (got * 100) / possible : 0);
+    printk("  Fallbacks: %lu, pageblocks stolen: %lu\n",
+           fallbacks_end - fallbacks, steals_end - steals);
 }
 
-void kfree(void *ptr)
+/*
+ * Bulk allocation benchmark: cycles per page for an allocate-then-free
+ * round trip of a batch, looped one page at a time and in bulk
+ */
+static const unsigned long bulk_bench_sizes[] = { 8, 32, 128, 512 };
+
+#define BULK_BENCH_MAX      512     /* pointers fit in one page */
+
+void bench_page_bulk(unsigned long iterations)
 {
-    struct page *page;
+    struct page **pages;
+    unsigned long size, it, i, n;
+    u64 start, loop, bulk;
+    int j;
     
-    if (ptr == NULL)
+    pages = (struct page **)get_zeroed_page(GFP_KERNEL);
+    if (pages == NULL) {
+        printk("bench bulk: cannot allocate page array\n");
         return;
+    }
+    
+    printk("Order-0 alloc+free (cycles/page):\n");
+    
+    for (j = 0; j < (int)ARRAY_SIZE(bulk_bench_sizes); j++) {
+        size = bulk_bench_sizes[j];
+        n = 0;
+        
+        start = rdtsc();
+        for (it = 0; it < iterations; it++) {
+            for (i = 0; i < size; i++)
+                pages[i] = alloc_page(GFP_KERNEL);
+            for (i = 0; i < size; i++)
+                if (pages[i])
+                    free_page(pages[i]);
+        }
+        loop = rdtsc() - start;
+        
+        start = rdtsc();
+        for (it = 0; it < iterations; it++) {
+            memset(pages, 0, size * sizeof(*pages));
+            n += alloc_pages_bulk(GFP_KERNEL, size, pages);
+            free_pages_bulk(pages, size);
+        }
+        bulk = rdtsc() - start;
+        
+        if (n != size * iterations)
+            printk("  %lu pages: bulk allocation came up short\n", size);
+        
+        printk("  %lu pages: loop %lu, bulk %lu\n", size,
+               (unsigned long)(loop / (size * iterations)),
+               (unsigned long)(bulk / (size * iterations)));
+    }
+    
+    free_page_virt((unsigned long)pages);
+}
+
+/*
+ * struct page benchmark: what mem_map costs, and the loops that walk
+ * it. The scan reads the flags of every page of the zone, as the
+ * compaction scanners do; the merge loop frees order-0 pages whose
+ * buddies are already free, so that every free merges up the orders.
+ * nr_pages of 0 takes half of free memory.
+ */
+#define PAGE_STRUCT_OLD_SIZE    56      /* Before the unions */
+
+static unsigned long zone_merges(struct zone *zone)
+{
+    unsigned long n = 0;
+    int order;
+    
+    for (order = 0; order < MAX_ORDER; order++)
+        n += zone->free_area[order].nr_merge;
+    return n;
+}
+
+void bench_page_struct(unsigned long nr_pages)
+{
+    struct zone *zone = &node_data.zones[ZONE_NORMAL];
+    struct list_head odd, even;
+    unsigned long pfn, nr_buddy = 0, nr_scanned = 0, merges, i, size, old;
+    struct page *page;
+    u64 start, scan, merge;
     
-    page = virt_to_page(ptr);
+    INIT_LIST_HEAD(&odd);
+    INIT_LIST_HEAD(&even);
     
-    /* For simple implementation, assume single page */
-    free_pages(page, 0);
+    mm_bench_prepare();
+    
+    size = sizeof(struct page);
+    printk("struct page: %lu bytes (%lu to a cache line), was %lu\n",
+           size, 64 / size, (unsigned long)PAGE_STRUCT_OLD_SIZE);
+    
+    /* In tenths of a percent of the memory described */
+    size = size * 1000 / PAGE_SIZE;
+    old = PAGE_STRUCT_OLD_SIZE * 1000 / PAGE_SIZE;
+    printk("  mem_map: %lu KB for %lu pages (%lu.%lu%% of RAM), was %lu KB (%lu.%lu%%)\n",
+           mem_map_size >> 10, max_pfn, size / 10, size % 10,
+           (max_pfn * PAGE_STRUCT_OLD_SIZE) >> 10, old / 10, old % 10);
+    
+    start = rdtsc();
+    for (pfn = zone->zone_start_pfn; pfn < zone_end_pfn(zone); pfn++) {
+        if (!pfn_valid(pfn)) {
+            pfn |= PAGES_PER_SECTION - 1;
+            continue;
+        }
+        if (PageBuddy(pfn_to_page(pfn)))
+            nr_buddy++;
+        nr_scanned++;
+    }
+    scan = rdtsc() - start;
+    
+    printk("  Scan of %lu pages (%lu free heads): %lu cycles/page\n",
+           nr_scanned, nr_buddy,
+           (unsigned long)(scan / (nr_scanned ? nr_scanned : 1)));
+    
+    if (nr_pages == 0)
+        nr_pages = zone->nr_free_pages / 2;
+    
+    /* Ascending pfns come out of a fresh block, so buddies alternate */
+    for (i = 0; i < nr_pages; i++) {
+        page = alloc_pages(GFP_KERNEL, 0);
+        if (page == NULL)
+            break;
+        if (page_to_pfn(page) & 1)
+            list_add(&page->lru, &odd);
+        else
+            list_add(&page->lru, &even);
+    }
+    nr_pages = i;
+    
+    free_pages_bulk_list(&odd);
+    drain_all_pages();
+    
+    merges = zone_merges(zone);
+    start = rdtsc();
+    free_pages_bulk_list(&even);
+    drain_all_pages();
+    merge = rdtsc() - start;
+    merges = zone_merges(zone) - merges;
+    
+    printk("  Merge loop: %lu pages freed, %lu merges, %lu cycles/page, %lu cycles/merge\n",
+           nr_pages, merges,
+           (unsigned long)(merge / (nr_pages ? nr_pages : 1)),
+           (unsigned long)(merge / (merges ? merges : 1)));
 }
 
-void *kzalloc(size_t size, gfp_t flags)
+/*
+ * Show pre-zeroed page pool statistics
+ */
+void show_zero_pool(void)
 {
-    return kmalloc(size, flags | GFP_ZERO);
+    struct zero_pool *zp;
+    struct zone *zone;
+    unsigned long total;
+    int i;
+    
+    for (i = 0; i < MAX_NR_ZONES; i++) {
+        zone = &node_data.zones[i];
+        zp = &zone->zero_pool;
+        
+        if (zone->present_pages == 0)
+            continue;
+        
+        total = zp->hits + zp->misses;
+        printk("Zone %s zero pool: %lu / %lu pages\n",
+               zone->name, zp->nr, zp->target);
+        printk("  Hits:    %lu / %lu (%lu%%)\n",
+               zp->hits, total, total ? (zp->hits * 100) / total : 0);
+        printk("  Zeroed:  %lu pages in the background\n", zp->zeroed);
+    }
 }
 
-void *kcalloc(size_t n, size_t size, gfp_t flags)
+/*
+ * Show per-CPU page cache statistics
+ */
+void show_pcp_stats(void)
 {
-    return kzalloc(n * size, flags);
+    struct per_cpu_pages *pcp;
+    struct zone *zone;
+    unsigned long hit, total;
+    int i, cpu;
+    
+    printk("Per-CPU page caches (high %ld, low %ld, batch %ld):\n",
+           (long)pcp_high, (long)pcp_low, (long)pcp_batch);
+    
+    for (i = 0; i < MAX_NR_ZONES; i++) {
+        zone = &node_data.zones[i];
+        
+        if (zone->present_pages == 0)
+            continue;
+        
+        for (cpu = 0; cpu < NR_CPUS; cpu++) {
+            pcp = &zone->pageset[cpu];
+            hit = pcp->alloc_hit;
+            total = hit + pcp->alloc_miss;
+            
+            if (total == 0 && pcp->nr_free == 0)
+                continue;
+            
+            printk("  Zone %s cpu %ld:\n", zone->name, (long)cpu);
+            printk("    Cached pages: %ld\n", (long)pcp->count);
+            printk("    Alloc hits:   %lu / %lu (%lu%%)\n",
+                   hit, total, total ? (hit * 100) / total : 0);
+            printk("    Frees:        %lu\n", pcp->nr_free);
+            printk("    Refills:      %lu\n", pcp->nr_refill);
+            printk("    Drains:       %lu\n", pcp->nr_drain);
+        }
+    }
 }
 
-void *krealloc(void *ptr, size_t new_size, gfp_t flags)
+/*
+ * Deferred struct page initialization
+ *
+ * Setting up every struct page at boot costs time proportional to RAM.
+ * Only the first DEFERRED_EAGER_SECTIONS sections are initialized in
+ * mm_init; the rest are done one section at a time from the idle loop,
+ * or synchronously when an allocation finds nothing free. A buddy pair
+ * never spans two sections, so merging never looks at a struct page
+ * that has not been set up yet. Sections in holes are skipped.
+ */
+static unsigned long nr_mem_map_pages;     /* Frames mem_map spans */
+static unsigned long deferred_next_pfn;    /* First section not yet claimed */
+static unsigned long deferred_sections;    /* Sections initialized late */
+static u64 deferred_cycles;                /* Time spent on them */
+static spinlock_t deferred_lock = SPIN_LOCK_INIT;
+
+/* Sections with a mem_map in [start_pfn, end_pfn) */
+static unsigned long nr_valid_sections(unsigned long start_pfn,
+                                       unsigned long end_pfn)
 {
-    void *new_ptr;
+    unsigned long pfn, nr = 0;
     
-    if (ptr == NULL)
-        return kmalloc(new_size, flags);
+    for (pfn = start_pfn; pfn < end_pfn; pfn += PAGES_PER_SECTION)
+        if (pfn_valid(pfn))
+            nr++;
+    return nr;
+}
+
+static void init_reserved_pages(unsigned long start_pfn, unsigned long end_pfn)
+{
+    struct zone *zone;
+    struct page *page;
+    unsigned long pfn;
     
-    if (new_size == 0) {
-        kfree(ptr);
-        return NULL;
+    /* Every pageblock starts out movable; kernel allocations steal */
+    for (pfn = start_pfn; pfn < end_pfn; pfn += pageblock_nr_pages) {
+        zone = &node_data.zones[pfn_zonenum(pfn)];
+        pageblock_types[pfn >> pageblock_order] = MIGRATE_MOVABLE;
+        zone->migrate_stats[MIGRATE_MOVABLE].nr_pageblocks++;
     }
     
-    new_ptr = kmalloc(new_size, flags);
-    if (new_ptr == NULL)
-        return NULL;
+    for (pfn = start_pfn; pfn < end_pfn; pfn++) {
+        page = pfn_to_page(pfn);
+        page->flags = 1UL << PG_reserved;
+        atomic_set(&page->_refcount, 1);
+        atomic_set(&page->_mapcount, -1);
+        INIT_LIST_HEAD(&page->lru);
+    }
+}
+
+/*
+ * Initialize the struct pages of one more section and free its memory.
+ * Returns 0 once all of mem_map is initialized.
+ */
+static int deferred_init_section(void)
+{
+    unsigned long start_pfn, end_pfn;
+    unsigned long flags;
+    u64 start;
     
-    /* Copy old data - we don't track size, so copy a page worth */
-    memcpy(new_ptr, ptr, PAGE_SIZE);
-    kfree(ptr);
+    spin_lock_irqsave(&deferred_lock, &flags);
     
-    return new_ptr;
+    start_pfn = deferred_next_pfn;
+    while (start_pfn < nr_mem_map_pages && !pfn_valid(start_pfn))
+        start_pfn += PAGES_PER_SECTION;
+    if (start_pfn >= nr_mem_map_pages) {
+        deferred_next_pfn = start_pfn;
+        spin_unlock_irqrestore(&deferred_lock, flags);
+        return 0;
+    }
+    
+    /* Claim the section so nobody else initializes it */
+    end_pfn = start_pfn + PAGES_PER_SECTION;
+    deferred_next_pfn = end_pfn;
+    
+    spin_unlock_irqrestore(&deferred_lock, flags);
+    
+    start = rdtsc();
+    init_reserved_pages(start_pfn, end_pfn);
+    memblock_free_pfn_range(start_pfn, end_pfn);
+    setup_per_zone_wmarks();
+    
+    spin_lock_irqsave(&deferred_lock, &flags);
+    deferred_cycles += rdtsc() - start;
+    deferred_sections++;
+    spin_unlock_irqrestore(&deferred_lock, flags);
+    
+    return 1;
+}
+
+/*
+ * Map mem_map for the present sections, and allocate the pageblock type
+ * array alongside it. Neither is cleared here: init_reserved_pages sets
+ * up every struct page of a section, reserved, and its pageblocks
+ * before its frames are freed.
+ */
+static int alloc_node_mem_map(void)
+{
+    if (sparse_init() == 0)
+        return -ENOMEM;
+
+    /* Whole sections, so that buddies of the last block have pages */
+    nr_mem_map_pages = section_nr_to_pfn(nr_mem_sections);
+
+    pageblock_types = memblock_alloc_raw(nr_mem_map_pages >> pageblock_order, 0);
+    if (pageblock_types == NULL) {
+        printk("Warning: cannot allocate pageblock types\n");
+        return -ENOMEM;
+    }
+
+    node_data.node_mem_map = mem_map;
+
+    return 0;
+}
+
+/*
+ * Set up the eager part of mem_map and hand its memory to buddy
+ */
+static void page_alloc_init(void)
+{
+    unsigned long eager_pfn, pfn;
+    const char *opt;
+    
+    if (alloc_node_mem_map() < 0)
+        return;
+    
+    eager_pfn = MIN(DEFERRED_EAGER_SECTIONS * PAGES_PER_SECTION,
+                    nr_mem_map_pages);
+    
+    for (pfn = 0; pfn < eager_pfn; pfn += PAGES_PER_SECTION) {
+        if (!pfn_valid(pfn))
+            continue;
+        init_reserved_pages(pfn, pfn + PAGES_PER_SECTION);
+        memblock_free_pfn_range(pfn, pfn + PAGES_PER_SECTION);
+    }
+    deferred_next_pfn = eager_pfn;
+    
+    /* zeropool=<pages> */
+    opt = cmdline_get_option("zeropool");
+    if (opt && zero_pool_set_target(memparse(opt, NULL)) < 0)
+        printk("zeropool: size too large, using %lu pages\n",
+               (unsigned long)ZERO_POOL_DEFAULT);
+    
+    opt = cmdline_get_option("min_free_kbytes");
+    if (opt)
+        parse_min_free_kbytes(opt);
+    setup_per_zone_wmarks();
+    
+    printk("Buddy allocator: %lu pages free, %lu MB of mem_map deferred\n",
+           nr_buddy_free_pages(),
+           (nr_valid_sections(eager_pfn, nr_mem_map_pages) <<
+            SECTION_SIZE_BITS) >> 20);
 }
 
+/*
+ * Background memory work, called from the idle loop. Returns nonzero
+ * if it did anything, so the caller can poll again before halting.
+ */
+int mm_idle_work(void)
+{
+    int i, done = 0;
+    
+    if (deferred_init_section())
+        return 1;
+    
+    if (kswapd_idle_work())
+        return 1;
+    
+    /* DMA memory is too scarce to park in a pool */
+    for (i = ZONE_NORMAL; i < MAX_NR_ZONES; i++)
+        if (node_data.zones[i].managed_pages)
+            done += zero_pool_refill(&node_data.zones[i]);
+    
+    done += compact_idle_work();
+    
+    return done;
+}
+
+void show_deferred_init(void)
+{
+    unsigned long total, done;
+    
+    total = nr_valid_sections(0, nr_mem_map_pages);
+    done = nr_valid_sections(0, deferred_next_pfn);
+    
+    printk("Deferred page init: %lu of %lu sections ready, "
+           "%lu late in %lu us\n",
+           done, total, deferred_sections,
+           (unsigned long)tsc_to_us(deferred_cycles));
+    
+    if (memblock.unmapped_pages)
+        printk("  %lu MB above the boot direct map left unused\n",
+               (memblock.unmapped_pages * PAGE_SIZE) >> 20);
+}
+
+/*
+ * Memory initialization
+ */
+void mm_init(void)
+{
+    buddy_init();
+    page_alloc_init();
+    kmem_cache_init();
+    mmap_init();
+    vmalloc_init();
+    hugetlb_init();
+    swap_init();
+    printk("Memory management initialized\n");
+}
+
+void mem_init(void)
+{
+    /* Called after all memory regions are added */
+    printk("Memory initialization complete\n");
+    printk("  Total: %lu pages (%lu MB)\n", 
+           totalram_pages(), (totalram_pages() * PAGE_SIZE) / (1024 * 1024));
+    printk("  Free:  %lu pages (%lu MB)\n",
+           nr_free_pages(), (nr_free_pages() * PAGE_SIZE) / (1024 * 1024));
+}
@@ -0,0 +1,625 @@
+/*
+ * MicroKernel Memory Compaction
+ *
+ * Frees up contiguous memory by moving movable pages from the bottom of
+ * a zone into free pages at the top. Direct compaction runs when a
+ * costly allocation fails; background compaction runs from the idle
+ * loop a few pageblocks at a time, either towards an order a failed
+ * allocation asked for, or proactively while too much free memory is
+ * scattered in small blocks.
+ */
+
+#include "../include/compaction.h"
+#include "../include/mm.h"
+#include "../include/types.h"
+#include "../include/list.h"
+
+/* External declarations */
+extern int printk(const char *fmt, ...);
+
+struct compact_control {
+    struct zone *zone;
+    int order;                      /* Wanted order, -1 for a full pass */
+    unsigned long migrate_pfn;      /* Next pageblock to empty */
+    unsigned long free_pfn;         /* End of the next pageblock to fill */
+    struct pfn_list migratepages;   /* Isolated movable pages */
+    unsigned long nr_migratepages;
+    struct list_head freepages;     /* Isolated free pages */
+    unsigned long nr_freepages;
+    unsigned long nr_migrated;
+};
+
+/* Statistics */
+static unsigned long compact_stall = 0;
+static unsigned long compact_success = 0;
+static unsigned long compact_fail = 0;
+static unsigned long compact_deferred = 0;
+static unsigned long compact_migrate_scanned = 0;
+static unsigned long compact_free_scanned = 0;
+static unsigned long compact_isolated = 0;
+static unsigned long pgmigrate_success = 0;
+static unsigned long pgmigrate_fail = 0;
+static unsigned long kcompactd_wake = 0;
+static unsigned long kcompactd_steps = 0;
+static unsigned long proactive_passes = 0;
+static u64 compact_cycles = 0;
+
+/* Movable ops by the page field of their pages, from 1 */
+static const struct movable_operations *movable_ops[MAX_MOVABLE_OPS + 1];
+
+void __SetPageMovable(struct page *page, const struct movable_operations *ops)
+{
+    int i;
+
+    for (i = 1; i <= MAX_MOVABLE_OPS; i++) {
+        if (movable_ops[i] == NULL)
+            movable_ops[i] = ops;
+        if (movable_ops[i] == ops)
+            break;
+    }
+    if (i > MAX_MOVABLE_OPS)
+        return;
+
+    set_page_field(page, i);
+    SetPageMovable(page);
+}
+
+void __ClearPageMovable(struct page *page)
+{
+    ClearPageMovable(page);
+    set_page_field(page, 0);
+}
+
+const struct movable_operations *page_movable_ops(struct page *page)
+{
+    return movable_ops[page_field(page)];
+}
+
+/* An isolated page that is not marked movable came off the LRU */
+static const struct movable_operations *isolated_page_ops(struct page *page)
+{
+    return PageMovable(page) ? page_movable_ops(page) : &anon_movable_ops;
+}
+
+/*
+ * Direct compaction backoff: after a failure, skip the next 1 << shift
+ * attempts at that order or above
+ */
+static void defer_compaction(struct zone *zone, int order)
+{
+    zone->compact_considered = 0;
+    if (++zone->compact_defer_shift > COMPACT_MAX_DEFER_SHIFT)
+        zone->compact_defer_shift = COMPACT_MAX_DEFER_SHIFT;
+
+    if (order < zone->compact_order_failed)
+        zone->compact_order_failed = order;
+}
+
+static bool compaction_deferred(struct zone *zone, int order)
+{
+    unsigned int limit = 1U << zone->compact_defer_shift;
+
+    if (order < zone->compact_order_failed)
+        return false;
+
+    if (++zone->compact_considered >= limit) {
+        zone->compact_considered = limit;
+        return false;
+    }
+
+    return true;
+}
+
+static void compaction_defer_reset(struct zone *zone, int order)
+{
+    zone->compact_considered = 0;
+    zone->compact_defer_shift = 0;
+
+    if (order >= zone->compact_order_failed)
+        zone->compact_order_failed = order + 1;
+}
+
+unsigned int fragmentation_score(struct zone *zone)
+{
+    unsigned long free = zone->nr_free_pages;
+    unsigned long large = 0;
+    int order;
+
+    for (order = pageblock_order; order < MAX_ORDER; order++)
+        large += zone->free_area[order].nr_free << order;
+
+    return free ? ((free - large) * 100) / free : 0;
+}
+
+static void compact_control_init(struct compact_control *cc,
+                                 struct zone *zone, int order)
+{
+    cc->zone = zone;
+    cc->order = order;
+    cc->migrate_pfn = ALIGN_DOWN(zone->zone_start_pfn, pageblock_nr_pages);
+    cc->free_pfn = ALIGN_DOWN(zone_end_pfn(zone), pageblock_nr_pages);
+    init_pfn_list(&cc->migratepages);
+    cc->nr_migratepages = 0;
+    INIT_LIST_HEAD(&cc->freepages);
+    cc->nr_freepages = 0;
+    cc->nr_migrated = 0;
+}
+
+static bool compact_finished(struct compact_control *cc)
+{
+    if (cc->order < 0)
+        return false;
+
+    return zone_first_free_order(cc->zone, cc->order) < MAX_ORDER;
+}
+
+/*
+ * Migrate scanner: isolate the movable pages of one movable pageblock
+ */
+static void isolate_migratepages_block(struct compact_control *cc,
+                                       unsigned long start_pfn)
+{
+    unsigned long end_pfn = start_pfn + pageblock_nr_pages;
+    const struct movable_operations *ops;
+    unsigned long pfn;
+    unsigned int order;
+    struct page *page;
+
+    /* Holes in the zone have no struct pages */
+    if (!pfn_valid(start_pfn) ||
+        get_pageblock_migratetype(start_pfn) != MIGRATE_MOVABLE)
+        return;
+
+    for (pfn = start_pfn; pfn < end_pfn; pfn++) {
+        page = pfn_to_page(pfn);
+        compact_migrate_scanned++;
+
+        /* Unlocked peek; a stale order only makes us skip too little */
+        if (PageBuddy(page)) {
+            order = page->order;
+            if (order < MAX_ORDER)
+                pfn += (1UL << order) - 1;
+            continue;
+        }
+
+        if ((!PageMovable(page) && !PageLRU(page)) || page_count(page) != 1)
+            continue;
+
+        ops = isolated_page_ops(page);
+        if (!ops->isolate_page(page))
+            continue;
+
+        pfn_list_add_tail(&cc->migratepages, page);
+        cc->nr_migratepages++;
+        compact_isolated++;
+    }
+}
+
+/*
+ * Free scanner: isolate free pages from the top of the zone until there
+ * is a target for every isolated movable page
+ */
+static void isolate_freepages(struct compact_control *cc)
+{
+    unsigned long block, need;
+
+    while (cc->nr_freepages < cc->nr_migratepages &&
+           cc->free_pfn > cc->migrate_pfn) {
+        block = cc->free_pfn - pageblock_nr_pages;
+        cc->free_pfn = block;
+
+        /* Keep movable pages out of the other types' pageblocks */
+        if (!pfn_valid(block) ||
+            get_pageblock_migratetype(block) != MIGRATE_MOVABLE)
+            continue;
+
+        need = cc->nr_migratepages - cc->nr_freepages;
+        cc->nr_freepages += isolate_freepages_block(cc->zone, block,
+                                                    block + pageblock_nr_pages,
+                                                    &cc->freepages, need);
+        compact_free_scanned += pageblock_nr_pages;
+    }
+}
+
+/*
+ * Move every isolated page into an isolated free page. Pages left
+ * without a target go back to their owners.
+ */
+static void migrate_pages(struct compact_control *cc)
+{
+    const struct movable_operations *ops;
+    struct page *page, *dst;
+    bool movable;
+
+    while (!pfn_list_empty(&cc->migratepages)) {
+        page = pfn_list_first(&cc->migratepages);
+        pfn_list_del(&cc->migratepages, page);
+        cc->nr_migratepages--;
+        movable = PageMovable(page);
+        ops = isolated_page_ops(page);
+
+        if (list_empty(&cc->freepages)) {
+            ops->putback_page(page);
+            pgmigrate_fail++;
+            continue;
+        }
+
+        dst = list_first_entry(&cc->freepages, struct page, lru);
+        list_del(&dst->lru);
+        cc->nr_freepages--;
+
+        atomic_set(&dst->_refcount, 1);
+        atomic_set(&dst->_mapcount, -1);
+        dst->private = 0;
+        if (movable)
+            __SetPageMovable(dst, ops);
+
+        if (ops->migrate_page(dst, page) < 0) {
+            if (movable)
+                __ClearPageMovable(dst);
+            atomic_set(&dst->_refcount, 0);
+            list_add(&dst->lru, &cc->freepages);
+            cc->nr_freepages++;
+
+            ops->putback_page(page);
+            pgmigrate_fail++;
+            continue;
+        }
+
+        if (movable)
+            __ClearPageMovable(page);
+        free_page(page);
+        cc->nr_migrated++;
+        pgmigrate_success++;
+    }
+}
+
+/*
+ * Run the scanners until a block of the wanted order is free, they
+ * meet, or budget pageblocks (0: no limit) have been scanned
+ */
+static enum compact_result compact_zone(struct compact_control *cc,
+                                        unsigned long budget)
+{
+    enum compact_result ret;
+    unsigned long blocks = 0;
+    u64 start = rdtsc();
+
+    for (;;) {
+        if (compact_finished(cc)) {
+            ret = COMPACT_SUCCESS;
+            break;
+        }
+
+        if (cc->migrate_pfn >= cc->free_pfn) {
+            ret = COMPACT_COMPLETE;
+            break;
+        }
+
+        if (budget && blocks == budget) {
+            ret = COMPACT_CONTINUE;
+            break;
+        }
+        blocks++;
+
+        isolate_migratepages_block(cc, cc->migrate_pfn);
+        cc->migrate_pfn += pageblock_nr_pages;
+
+        if (cc->nr_migratepages == 0)
+            continue;
+
+        isolate_freepages(cc);
+        migrate_pages(cc);
+
+        /* The emptied pages sit on the per-CPU lists; merge them */
+        drain_local_pages();
+    }
+
+    release_freepages(cc->zone, &cc->freepages);
+    cc->nr_freepages = 0;
+
+    compact_cycles += rdtsc() - start;
+
+    return ret;
+}
+
+bool try_to_compact_pages(gfp_t gfp_mask, unsigned int order)
+{
+    struct compact_control cc;
+    struct zone *zone;
+    int i;
+
+    for (i = gfp_zone(gfp_mask); i >= 0; i--) {
+        zone = &node_data.zones[i];
+
+        if (zone->managed_pages == 0)
+            continue;
+
+        if (compaction_deferred(zone, order)) {
+            compact_deferred++;
+            continue;
+        }
+
+        compact_stall++;
+        compact_control_init(&cc, zone, order);
+
+        if (compact_zone(&cc, 0) == COMPACT_SUCCESS) {
+            compaction_defer_reset(zone, order);
+            compact_success++;
+            return true;
+        }
+
+        compact_fail++;
+        defer_compaction(zone, order);
+    }
+
+    return false;
+}
+
+void wakeup_kcompactd(struct zone *zone, unsigned int order)
+{
+    if (zone->managed_pages == 0)
+        return;
+
+    if (zone->kcompactd_max_order == 0)
+        kcompactd_wake++;
+    if ((int)order > zone->kcompactd_max_order)
+        zone->kcompactd_max_order = order;
+}
+
+/*
+ * Start proactive compaction above the high threshold and keep a pass
+ * that is under way going down to the low one
+ */
+static bool proactive_compaction_wanted(struct zone *zone)
+{
+    unsigned int score;
+
+    if (rdtsc() < zone->compact_proactive_defer)
+        return false;
+
+    if (zone->nr_free_pages < pageblock_nr_pages)
+        return false;
+
+    score = fragmentation_score(zone);
+    if (zone->compact_cached_free_pfn)
+        return score > COMPACT_PROACTIVE_LOW;
+
+    return score > COMPACT_PROACTIVE_HIGH;
+}
+
+/*
+ * Background compaction. Each call scans a few pageblocks of the first
+ * zone with work to do, resuming where the previous call stopped.
+ */
+int compact_idle_work(void)
+{
+    struct compact_control cc;
+    enum compact_result ret;
+    struct zone *zone;
+    int i, order;
+
+    for (i = 0; i < MAX_NR_ZONES; i++) {
+        zone = &node_data.zones[i];
+
+        if (zone->managed_pages == 0)
+            continue;
+
+        order = zone->kcompactd_max_order;
+        if (order && zone_first_free_order(zone, order) < MAX_ORDER) {
+            zone->kcompactd_max_order = 0;
+            order = 0;
+        }
+
+        if (order == 0) {
+            if (!proactive_compaction_wanted(zone)) {
+                zone->compact_cached_free_pfn = 0;
+                continue;
+            }
+            order = -1;
+        }
+
+        compact_control_init(&cc, zone, order);
+        if (zone->compact_cached_free_pfn) {
+            cc.migrate_pfn = zone->compact_cached_migrate_pfn;
+            cc.free_pfn = zone->compact_cached_free_pfn;
+        }
+
+        ret = compact_zone(&cc, COMPACT_IDLE_PAGEBLOCKS);
+        kcompactd_steps++;
+        zone->compact_pass_migrated += cc.nr_migrated;
+
+        if (ret == COMPACT_CONTINUE || ret == COMPACT_SUCCESS) {
+            zone->compact_cached_migrate_pfn = cc.migrate_pfn;
+            zone->compact_cached_free_pfn = cc.free_pfn;
+        } else {
+            /* A full pass: start over next time, later if it was useless */
+            if (order < 0)
+                proactive_passes++;
+            if (zone->compact_pass_migrated == 0)
+                zone->compact_proactive_defer = rdtsc() +
+                    (u64)COMPACT_PROACTIVE_DEFER_MS *
+                    (tsc_khz ? tsc_khz : 1000000);
+            zone->compact_cached_free_pfn = 0;
+            zone->compact_pass_migrated = 0;
+        }
+
+        if (ret != COMPACT_CONTINUE && order > 0)
+            zone->kcompactd_max_order = 0;
+
+        return 1;
+    }
+
+    return 0;
+}
+
+unsigned long compact_node(void)
+{
+    struct compact_control cc;
+    unsigned long migrated = 0;
+    int i;
+
+    for (i = 0; i < MAX_NR_ZONES; i++) {
+        if (node_data.zones[i].managed_pages == 0)
+            continue;
+
+        compact_control_init(&cc, &node_data.zones[i], -1);
+        compact_zone(&cc, 0);
+        migrated += cc.nr_migrated;
+    }
+
+    return migrated;
+}
+
+void show_compaction_stats(void)
+{
+    struct zone *zone;
+    int i;
+
+    printk("Compaction:\n");
+    printk("  Direct:     %lu stalls, %lu succeeded, %lu failed, "
+           "%lu deferred\n",
+           compact_stall, compact_success, compact_fail, compact_deferred);
+    printk("  Scanned:    %lu migrate, %lu free pages\n",
+           compact_migrate_scanned, compact_free_scanned);
+    printk("  Migrated:   %lu pages, %lu failed, %lu isolated\n",
+           pgmigrate_success, pgmigrate_fail, compact_isolated);
+    printk("  Background: %lu wakeups, %lu steps, %lu proactive passes\n",
+           kcompactd_wake, kcompactd_steps, proactive_passes);
+    printk("  Time:       %lu us\n", (unsigned long)tsc_to_us(compact_cycles));
+
+    for (i = 0; i < MAX_NR_ZONES; i++) {
+        zone = &node_data.zones[i];
+
+        if (zone->present_pages == 0)
+            continue;
+
+        printk("  Zone %s: fragmentation score %lu, defer shift %lu, "
+               "order failed %ld\n",
+               zone->name, (unsigned long)fragmentation_score(zone),
+               (unsigned long)zone->compact_defer_shift,
+               (long)zone->compact_order_failed);
+    }
+}
+
+/*
+ * Compaction benchmark
+ *
+ * The benchmark owns its pages through a list, so migrating one only
+ * means copying it and putting the copy on the list instead.
+ */
+static LIST_HEAD(bench_pages);
+
+static bool bench_isolate_page(struct page *page)
+{
+    list_del(&page->lru);
+    return true;
+}
+
+static int bench_migrate_page(struct page *dst, struct page *src)
+{
+    copy_page(page_to_virt(dst), page_to_virt(src));
+    list_add(&dst->lru, &bench_pages);
+    return 0;
+}
+
+static void bench_putback_page(struct page *page)
+{
+    list_add(&page->lru, &bench_pages);
+}
+
+static const struct movable_operations bench_movable_ops = {
+    .isolate_page = bench_isolate_page,
+    .migrate_page = bench_migrate_page,
+    .putback_page = bench_putback_page,
+};
+
+/* Allocate pageblock-sized blocks until none is left, without compaction */
+static unsigned long count_free_pageblocks(void)
+{
+    LIST_HEAD(blocks);
+    struct page *page, *tmp;
+    unsigned long n = 0;
+
+    while ((page = alloc_pages(GFP_KERNEL | GFP_MOVABLE | GFP_NOWAIT,
+                               pageblock_order)) != NULL) {
+        list_add(&page->lru, &blocks);
+        n++;
+    }
+
+    list_for_each_entry_safe(page, tmp, &blocks, lru) {
+        list_del(&page->lru);
+        free_pages(page, pageblock_order);
+    }
+
+    return n;
+}
+
+/*
+ * Fill memory with movable pages and free every other one, so no free
+ * block is larger than a page, then compact. nr_pages of 0 uses nearly
+ * all free memory.
+ */
+void bench_compaction(unsigned long nr_pages)
+{
+    struct zone *zone = &node_data.zones[ZONE_NORMAL];
+    unsigned long before, after, possible, migrated;
+    unsigned long i = 0, held = 0, bad = 0;
+    LIST_HEAD(odd);
+    struct page *page, *tmp;
+    unsigned long *p;
+    u64 start, cycles;
+
+    mm_bench_prepare();
+
+    if (nr_pages == 0)
+        nr_pages = zone->nr_free_pages - zone->nr_free_pages / 16;
+
+    nr_pages = alloc_pages_bulk_list(GFP_KERNEL | GFP_MOVABLE | GFP_NOWAIT,
+                                     nr_pages, &bench_pages);
+
+    list_for_each_entry_safe(page, tmp, &bench_pages, lru) {
+        if (page_to_pfn(page) & 1) {
+            list_move(&page->lru, &odd);
+            continue;
+        }
+
+        /* A self-checking pattern to verify migration */
+        p = page_to_virt(page);
+        p[0] = i;
+        p[1] = ~i;
+        i++;
+
+        __SetPageMovable(page, &bench_movable_ops);
+    }
+    free_pages_bulk_list(&odd);
+    drain_all_pages();
+
+    possible = zone->nr_free_pages >> pageblock_order;
+    before = count_free_pageblocks();
+
+    start = rdtsc();
+    migrated = compact_node();
+    cycles = rdtsc() - start;
+
+    after = count_free_pageblocks();
+
+    list_for_each_entry(page, &bench_pages, lru) {
+        p = page_to_virt(page);
+        if (p[1] != ~p[0])
+            bad++;
+        held++;
+
+        __ClearPageMovable(page);
+    }
+    free_pages_bulk_list(&bench_pages);
+
+    printk("Fragmented %lu pages, freed every other one\n", nr_pages);
+    printk("  Order-%ld before compaction: %lu of %lu blocks\n",
+           (long)pageblock_order, before, possible);
+    printk("  Compacted: %lu pages migrated in %lu us\n",
+           migrated, (unsigned long)tsc_to_us(cycles));
+    printk("  Order-%ld after compaction:  %lu of %lu blocks\n",
+           (long)pageblock_order, after, possible);
+    printk("  Contents: %lu pages held, %lu corrupted\n", held, bad);
+}
@@ -0,0 +1,269 @@
+/*
+ * MicroKernel Page Faults
+ *
+ * Page faults on user addresses are how anonymous memory gets its pages:
+ * mmap only records the VMA. The fault is checked against the VMA and
+ * handed to handle_mm_fault; anything else is a bad access, which kills
+ * a user task and panics the kernel. The VMA is looked up under RCU and
+ * locked alone; mmap_lock is taken only when that VMA is being changed.
+ */
+
+#include "../include/pgtable.h"
+#include "../include/hugetlb.h"
+#include "../include/vmacache.h"
+#include "../include/mmap_lock.h"
+#include "../include/sched.h"
+#include "../include/mm.h"
+#include "../include/types.h"
+#include "../include/spinlock.h"
+
+/* External declarations */
+extern int printk(const char *fmt, ...);
+extern void panic(const char *fmt, ...);
+
+/* Faults handled under the VMA lock, and with mmap_lock */
+static unsigned long nr_faults_vma_lock;
+static unsigned long nr_faults_mmap_lock;
+
+/* Does the VMA allow the access that faulted? */
+static bool access_error(unsigned long error_code, struct vm_area_struct *vma)
+{
+    if (error_code & X86_PF_WRITE)
+        return !(vma->vm_flags & VM_WRITE);
+
+    /* Read of a present page: the protection says no */
+    if (error_code & X86_PF_PROT)
+        return true;
+
+    /* x86 cannot map a page write-only or execute-only */
+    return !(vma->vm_flags & VM_ACCESS_FLAGS);
+}
+
+static void bad_area(unsigned long address, unsigned long error_code)
+{
+    if (error_code & X86_PF_USER) {
+        printk("%s[%d]: segfault at 0x%lx error 0x%lx\n",
+               current->comm, current->pid, address, error_code);
+        do_exit(SIGSEGV);
+        return;
+    }
+
+    panic("Unable to handle kernel paging request at 0x%lx (error 0x%lx)",
+          address, error_code);
+}
+
+void do_page_fault(unsigned long address, unsigned long error_code)
+{
+    struct task_struct *tsk = current;
+    struct mm_struct *mm = tsk ? tsk->mm : NULL;
+    struct vm_area_struct *vma;
+    unsigned int flags = 0;
+    int fault;
+
+    if (error_code & X86_PF_RSVD)
+        panic("Corrupted page table at 0x%lx (error 0x%lx)",
+              address, error_code);
+
+    /*
+     * The kernel half never faults in, and a user address only means
+     * something in the address space that is loaded
+     */
+    if (address >= USER_VIRTUAL_END || mm == NULL ||
+        mm->pgd != (read_cr3() & PTE_PFN_MASK)) {
+        bad_area(address, error_code);
+        return;
+    }
+
+    if (error_code & X86_PF_WRITE)
+        flags |= FAULT_FLAG_WRITE;
+    if (error_code & X86_PF_USER)
+        flags |= FAULT_FLAG_USER;
+
+    vma = lock_vma_under_rcu(mm, address);
+    if (vma) {
+        if (access_error(error_code, vma)) {
+            vma_end_read(vma);
+            bad_area(address, error_code);
+            return;
+        }
+
+        fault = handle_mm_fault(vma, address, flags);
+        vma_end_read(vma);
+        nr_faults_vma_lock++;
+        goto done;
+    }
+
+    mmap_write_lock(mm);
+
+    vma = find_vma(mm, address);
+    if (vma == NULL || vma->vm_start > address ||
+        access_error(error_code, vma)) {
+        mmap_write_unlock(mm);
+        bad_area(address, error_code);
+        return;
+    }
+
+    fault = handle_mm_fault(vma, address, flags);
+    mmap_write_unlock(mm);
+    nr_faults_mmap_lock++;
+
+done:
+    if (fault & VM_FAULT_ERROR) {
+        if (fault & VM_FAULT_OOM)
+            printk("Out of memory: page fault at 0x%lx\n", address);
+        bad_area(address, error_code);
+        return;
+    }
+
+    if (fault & VM_FAULT_MAJOR)
+        tsk->maj_flt++;
+    else
+        tsk->min_flt++;
+}
+
+/* Would the CPU fault on this access? */
+static bool access_faults(struct mm_struct *mm, unsigned long addr,
+                          bool write)
+{
+    pmd_t *pmd;
+    u64 entry;
+
+    pmd = walk_pmd(mm, addr, false);
+    if (pmd == NULL || !entry_present(*pmd))
+        return true;
+
+    if (pmd_huge(*pmd))
+        entry = *pmd;
+    else
+        entry = ((pte_t *)entry_table(*pmd))[pte_index(addr)];
+
+    return !entry_present(entry) || (write && !(entry & _PAGE_RW));
+}
+
+u64 touch_user_range(struct task_struct *tsk, unsigned long addr,
+                     unsigned long len, bool write)
+{
+    struct task_struct *saved = current;
+    unsigned long error_code = write ? X86_PF_WRITE : 0;
+    volatile unsigned long *p;
+    unsigned long a, flags;
+    phys_addr_t cr3;
+    u64 start, cycles;
+
+    flags = local_irq_save();
+    set_current(tsk);
+    cr3 = read_cr3();
+    write_cr3(tsk->mm->pgd);
+
+    start = rdtsc();
+    for (a = addr; a < addr + len; a += PAGE_SIZE) {
+        if (access_faults(tsk->mm, a, write))
+            do_page_fault(a, error_code);
+        p = (volatile unsigned long *)a;
+        if (write)
+            *p = a;
+        else
+            (void)*p;
+    }
+    cycles = rdtsc() - start;
+
+    write_cr3(cr3);
+    set_current(saved);
+    local_irq_restore(flags);
+
+    return cycles;
+}
+
+/*
+ * Demand paging benchmark
+ *
+ * Map memory into the current address space and touch every page, reads
+ * first and then writes, against faulting around sequential writes and
+ * populating the whole mapping when it is made. 4KB pages throughout,
+ * so that without help each page is one fault.
+ */
+void bench_page_faults(unsigned long mb)
+{
+    int saved_thp = transparent_hugepage;
+    unsigned long len = mb << 20, pages = len >> PAGE_SHIFT;
+    unsigned long flt, free, calls, hits, c0, h0, vl0, ml0;
+    struct mm_struct *mm;
+    u64 start, cycles;
+    long addr;
+
+    if (current == NULL || current->mm == NULL) {
+        printk("bench fault: no address space\n");
+        return;
+    }
+    mm = current->mm;
+    transparent_hugepage = THP_NEVER;
+
+    printk("Demand paging over %lu MB (%lu pages):\n", mb, pages);
+
+    free = nr_free_pages();
+    start = rdtsc();
+    addr = vm_mmap(mm, 0, len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS);
+    cycles = rdtsc() - start;
+    if (addr < 0) {
+        printk("  mmap failed (%ld)\n", addr);
+        goto out;
+    }
+    printk("  mmap: %lu us, %ld pages used\n", (unsigned long)tsc_to_us(cycles),
+           (long)(free - nr_free_pages()));
+
+    vmacache_stats(&c0, &h0);
+    vl0 = nr_faults_vma_lock;
+    ml0 = nr_faults_mmap_lock;
+
+    flt = current->min_flt;
+    cycles = touch_user_range(current, addr, len, false);
+    printk("  read faults: %lu, %lu cycles each, %ld pages used\n",
+           current->min_flt - flt, (unsigned long)(cycles / pages),
+           (long)(free - nr_free_pages()));
+
+    flt = current->min_flt;
+    cycles = touch_user_range(current, addr, len, true);
+    printk("  write faults: %lu, %lu cycles each, %ld pages used\n",
+           current->min_flt - flt, (unsigned long)(cycles / pages),
+           (long)(free - nr_free_pages()));
+
+    vmacache_stats(&calls, &hits);
+    printk("  VMA cache: %lu of %lu lookups hit\n", hits - h0, calls - c0);
+    printk("  %lu faults under the VMA lock, %lu took mmap_lock\n",
+           nr_faults_vma_lock - vl0, nr_faults_mmap_lock - ml0);
+
+    vm_munmap(mm, addr, len);
+
+    /* Sequential access: each fault maps the pages after its own */
+    addr = vm_mmap(mm, 0, len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS);
+    if (addr >= 0 && vm_madvise(mm, addr, len, MADV_SEQUENTIAL) == 0) {
+        flt = current->min_flt;
+        cycles = touch_user_range(current, addr, len, true);
+        printk("  MADV_SEQUENTIAL writes: %lu faults, %lu cycles per page\n",
+               current->min_flt - flt, (unsigned long)(cycles / pages));
+    }
+    if (addr >= 0)
+        vm_munmap(mm, addr, len);
+
+    /* Populated a page table at a time, with no faults after */
+    start = rdtsc();
+    addr = vm_mmap(mm, 0, len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE);
+    cycles = rdtsc() - start;
+    if (addr >= 0) {
+        printk("  MAP_POPULATE: %lu us, %lu cycles per page\n",
+               (unsigned long)tsc_to_us(cycles),
+               (unsigned long)(cycles / pages));
+        flt = current->min_flt;
+        touch_user_range(current, addr, len, true);
+        printk("  writes after it: %lu faults\n", current->min_flt - flt);
+        vm_munmap(mm, addr, len);
+    }
+
+out:
+    transparent_hugepage = saved_thp;
+    printk("  %s: %lu minor, %lu major faults\n",
+           current->comm, current->min_flt, current->maj_flt);
+}
@@ -0,0 +1,305 @@
+/*
+ * MicroKernel Huge Pages
+ *
+ * The pool of 2MB pages behind MAP_HUGETLB, and the allocation side of
+ * transparent huge pages. Installing them in page tables is done by
+ * memory.c.
+ */
+
+#include "../include/hugetlb.h"
+#include "../include/pgtable.h"
+#include "../include/multiboot.h"
+#include "../include/sched.h"
+#include "../include/mm.h"
+#include "../include/types.h"
+#include "../include/list.h"
+#include "../include/spinlock.h"
+
+/* External declarations */
+extern int printk(const char *fmt, ...);
+
+/*
+ * Pool pages stay allocated from the buddy allocator for the life of
+ * the pool, so they are unmovable memory. Transparent huge pages are
+ * user memory and never wait for direct compaction: without a free
+ * block the mapping just uses 4KB pages.
+ */
+#define GFP_HUGETLB_POOL    GFP_KERNEL
+#define GFP_TRANSHUGE       (GFP_USER | GFP_MOVABLE | GFP_ZERO | GFP_NOWAIT)
+
+int transparent_hugepage = THP_ALWAYS;
+
+static struct hstate {
+    spinlock_t lock;
+    struct list_head free_list;     /* Unmapped pool pages, via lru */
+    unsigned long nr_huge_pages;    /* Pool size */
+    unsigned long free_huge_pages;  /* Pool pages not mapped */
+} hstate;
+
+/* Transparent huge page events */
+static unsigned long thp_fault_alloc;
+static unsigned long thp_fault_fallback;
+static unsigned long thp_split;
+static unsigned long nr_anon_thp;       /* Mapped with a PMD right now */
+
+unsigned long set_max_huge_pages(unsigned long count)
+{
+    struct page *page;
+    unsigned long flags;
+
+    while (hstate.nr_huge_pages < count) {
+        page = alloc_pages(GFP_HUGETLB_POOL, HUGETLB_PAGE_ORDER);
+        if (page == NULL)
+            break;
+
+        spin_lock_irqsave(&hstate.lock, &flags);
+        list_add_tail(&page->lru, &hstate.free_list);
+        hstate.nr_huge_pages++;
+        hstate.free_huge_pages++;
+        spin_unlock_irqrestore(&hstate.lock, flags);
+    }
+
+    /* Only unmapped pages can be given back */
+    for (;;) {
+        spin_lock_irqsave(&hstate.lock, &flags);
+        if (hstate.nr_huge_pages <= count || hstate.free_huge_pages == 0) {
+            spin_unlock_irqrestore(&hstate.lock, flags);
+            break;
+        }
+        page = list_first_entry(&hstate.free_list, struct page, lru);
+        list_del(&page->lru);
+        hstate.nr_huge_pages--;
+        hstate.free_huge_pages--;
+        spin_unlock_irqrestore(&hstate.lock, flags);
+
+        free_pages(page, HUGETLB_PAGE_ORDER);
+    }
+
+    return hstate.nr_huge_pages;
+}
+
+unsigned long hugetlb_free_pages(void)
+{
+    return hstate.free_huge_pages;
+}
+
+struct page *alloc_huge_page(void)
+{
+    struct page *page = NULL;
+    unsigned long flags;
+    unsigned long i;
+    char *addr;
+
+    spin_lock_irqsave(&hstate.lock, &flags);
+    if (!list_empty(&hstate.free_list)) {
+        page = list_first_entry(&hstate.free_list, struct page, lru);
+        list_del(&page->lru);
+        hstate.free_huge_pages--;
+    }
+    spin_unlock_irqrestore(&hstate.lock, flags);
+
+    if (page == NULL)
+        return NULL;
+
+    /* The previous user's data must not leak */
+    addr = page_to_virt(page);
+    for (i = 0; i < HPAGE_NR_PAGES; i++)
+        clear_page(addr + i * PAGE_SIZE);
+
+    return page;
+}
+
+void free_huge_page(struct page *page)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&hstate.lock, &flags);
+    list_add(&page->lru, &hstate.free_list);
+    hstate.free_huge_pages++;
+    spin_unlock_irqrestore(&hstate.lock, flags);
+}
+
+struct page *alloc_transhuge_page(void)
+{
+    struct page *page;
+
+    page = alloc_pages(GFP_TRANSHUGE, HUGETLB_PAGE_ORDER);
+    if (page == NULL) {
+        thp_fault_fallback++;
+        return NULL;
+    }
+
+    thp_fault_alloc++;
+    nr_anon_thp++;
+    return page;
+}
+
+void free_transhuge_page(struct page *page)
+{
+    nr_anon_thp--;
+    free_pages(page, HUGETLB_PAGE_ORDER);
+}
+
+/* The pages of a split one are freed one by one */
+void count_thp_split(void)
+{
+    thp_split++;
+    nr_anon_thp--;
+}
+
+/*
+ * hugepages=<n> reserves n pages, hugepages=<size>[KMG] enough pages to
+ * cover size. transparent_hugepage=never keeps ordinary mappings on
+ * 4KB pages.
+ */
+void hugetlb_init(void)
+{
+    const char *opt, *end;
+    unsigned long count, got;
+    char suffix;
+
+    spin_lock_init(&hstate.lock);
+    INIT_LIST_HEAD(&hstate.free_list);
+
+    opt = cmdline_get_option("transparent_hugepage");
+    if (opt && memcmp(opt, "never", 5) == 0)
+        transparent_hugepage = THP_NEVER;
+
+    opt = cmdline_get_option("hugepages");
+    if (opt == NULL)
+        return;
+
+    count = memparse(opt, &end);
+    suffix = end > opt ? end[-1] | 0x20 : 0;
+    if (suffix == 'k' || suffix == 'm' || suffix == 'g' || suffix == 't')
+        count = (count + HPAGE_SIZE - 1) / HPAGE_SIZE;
+
+    got = set_max_huge_pages(count);
+    if (got < count)
+        printk("hugepages: only %lu of %lu pages reserved\n", got, count);
+    else
+        printk("hugepages: %lu pages (%lu MB) reserved\n",
+               got, (got * HPAGE_SIZE) >> 20);
+}
+
+void show_hugepages(void)
+{
+    printk("HugePages_Total: %lu\n", hstate.nr_huge_pages);
+    printk("HugePages_Free:  %lu\n", hstate.free_huge_pages);
+    printk("Hugepagesize:    %lu kB\n", HPAGE_SIZE >> 10);
+    printk("AnonHugePages:   %lu kB\n", (nr_anon_thp * HPAGE_SIZE) >> 10);
+    printk("THP %s: %lu allocated, %lu fell back to 4KB, %lu split\n",
+           transparent_hugepage == THP_ALWAYS ? "always" : "never",
+           thp_fault_alloc, thp_fault_fallback, thp_split);
+}
+
+/*
+ * TLB reach benchmark
+ *
+ * Map the same amount of memory three ways into a scratch address
+ * space, fault all of it in, load it, and read one word from a random
+ * page over and over.
+ * Past a few MB, 4KB mappings miss the TLB on almost every access.
+ */
+#define HUGE_BENCH_ACCESSES     (1UL << 20)
+
+static u64 bench_random_reads(struct mm_struct *mm, unsigned long addr,
+                              unsigned long len)
+{
+    unsigned long mask = (len >> PAGE_SHIFT) - 1;
+    unsigned long x = 88172645463325252UL;
+    unsigned long i, sum = 0;
+    unsigned long flags;
+    phys_addr_t cr3;
+    u64 start, cycles;
+
+    flags = local_irq_save();
+    cr3 = read_cr3();
+    write_cr3(mm->pgd);
+
+    start = rdtsc();
+    for (i = 0; i < HUGE_BENCH_ACCESSES; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        sum += *(volatile unsigned long *)(addr + ((x & mask) << PAGE_SHIFT) +
+                                           ((x >> 40) & (PAGE_SIZE - 8)));
+    }
+    cycles = rdtsc() - start;
+
+    write_cr3(cr3);
+    local_irq_restore(flags);
+
+    (void)sum;
+    return cycles;
+}
+
+void bench_hugepages(unsigned long mb)
+{
+    static const char * const names[] = { "4KB pages", "transparent", "pool" };
+    unsigned long len, flags, thp;
+    int saved_thp = transparent_hugepage;
+    struct mm_struct *mm;
+    u64 start, map, unmap, cycles;
+    long addr;
+    int mode;
+
+    /* Power of two, so a random page is a mask away */
+    len = HPAGE_SIZE;
+    while (len * 2 <= (mb << 20))
+        len *= 2;
+
+    mm = mm_alloc();
+    if (mm == NULL) {
+        printk("bench huge: cannot allocate an mm\n");
+        return;
+    }
+
+    printk("Random reads over %lu MB, %lu accesses:\n",
+           len >> 20, HUGE_BENCH_ACCESSES);
+
+    for (mode = 0; mode < 3; mode++) {
+        flags = MAP_PRIVATE | MAP_ANONYMOUS;
+        transparent_hugepage = mode == 1 ? THP_ALWAYS : THP_NEVER;
+
+        if (mode == 2) {
+            if (hugetlb_free_pages() < len / HPAGE_SIZE) {
+                printk("  %s: skipped, %lu free pool pages (hugepages=)\n",
+                       names[mode], hugetlb_free_pages());
+                continue;
+            }
+            flags |= MAP_HUGETLB;
+        }
+
+        thp = thp_fault_alloc;
+        start = rdtsc();
+        addr = vm_mmap(mm, 0, len, PROT_READ | PROT_WRITE, flags);
+        if (addr < 0) {
+            printk("  %s: mmap failed (%ld)\n", names[mode], addr);
+            continue;
+        }
+        if (mm_populate(mm, addr, len) < 0) {
+            printk("  %s: out of memory\n", names[mode]);
+            vm_munmap(mm, addr, len);
+            continue;
+        }
+        map = rdtsc() - start;
+        thp = thp_fault_alloc - thp;
+
+        cycles = bench_random_reads(mm, addr, len);
+
+        start = rdtsc();
+        vm_munmap(mm, addr, len);
+        unmap = rdtsc() - start;
+
+        printk("  %s: %lu cycles/read, mmap %lu us, munmap %lu us",
+               names[mode], (unsigned long)(cycles / HUGE_BENCH_ACCESSES),
+               (unsigned long)tsc_to_us(map), (unsigned long)tsc_to_us(unmap));
+        if (mode == 1)
+            printk(", %lu of %lu huge", thp, len / HPAGE_SIZE);
+        printk("\n");
+    }
+
+    transparent_hugepage = saved_thp;
+    mm_free(mm);
+}
@@ -0,0 +1,153 @@
+/*
+ * MicroKernel Direct Map
+ *
+ * boot.S maps the first 1GB twice, at 0 and at KERNEL_VIRTUAL_BASE,
+ * which is enough for the boot loader's tables and the first memblock
+ * allocations. init_mem_mapping replaces it with page tables that map
+ * every RAM range at KERNEL_VIRTUAL_BASE, with 1GB pages where the CPU
+ * has them and 2MB pages elsewhere, so that __va works for all memory.
+ *
+ * Of the low mapping only the kernel image is kept: the kernel is
+ * linked at its 1MB load address and runs from there.
+ */
+
+#include "../include/pgtable.h"
+#include "../include/memblock.h"
+#include "../include/mm.h"
+#include "../include/types.h"
+
+/* External declarations */
+extern int printk(const char *fmt, ...);
+extern void panic(const char *fmt, ...);
+extern char __kernel_end[];
+
+#define X86_FEATURE_PGE         (1U << 13)  /* CPUID.1:EDX */
+#define X86_FEATURE_GBPAGES     (1U << 26)  /* CPUID.80000001h:EDX */
+
+static u64 page_global;
+static bool direct_gbpages;
+static unsigned long nr_pages_1g;
+static unsigned long nr_pages_2m;
+
+static void *alloc_low_table(void)
+{
+    void *table;
+
+    /* memblock still hands out only memory the boot tables map */
+    table = memblock_alloc(PAGE_SIZE, PAGE_SIZE);
+    if (table == NULL)
+        panic("init_mem_mapping: no memory for page tables");
+    return table;
+}
+
+static u64 *alloc_next_table(u64 *entry)
+{
+    if (!entry_present(*entry))
+        *entry = __pa(alloc_low_table()) | _KERNPG_TABLE;
+    return entry_table(*entry);
+}
+
+/*
+ * Map physical [start, end), both 2MB aligned, at vbase + start. Ranges
+ * may meet inside a large page already mapped; it is left as it is.
+ */
+static void map_range(pgd_t *pgd, unsigned long vbase, phys_addr_t start,
+                      phys_addr_t end, bool gbpages)
+{
+    u64 prot = PAGE_KERNEL_LARGE | page_global;
+    phys_addr_t addr = start;
+    unsigned long vaddr;
+    pud_t *pud;
+    pmd_t *pmd;
+
+    while (addr < end) {
+        vaddr = vbase + addr;
+        pud = alloc_next_table(&pgd[pgd_index(vaddr)]) + pud_index(vaddr);
+
+        if (pud_huge(*pud)) {
+            addr = ALIGN_DOWN(addr, PUD_SIZE) + PUD_SIZE;
+            continue;
+        }
+
+        if (gbpages && !entry_present(*pud) && IS_ALIGNED(addr, PUD_SIZE) &&
+            end - addr >= PUD_SIZE) {
+            *pud = addr | prot;
+            nr_pages_1g++;
+            addr += PUD_SIZE;
+            continue;
+        }
+
+        pmd = alloc_next_table(pud) + pmd_index(vaddr);
+        if (!entry_present(*pmd)) {
+            *pmd = addr | prot;
+            nr_pages_2m++;
+        }
+        addr += PMD_SIZE;
+    }
+}
+
+static void probe_page_sizes(void)
+{
+    u32 eax, ebx, ecx, edx;
+
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    if (edx & X86_FEATURE_PGE) {
+        write_cr4(read_cr4() | X86_CR4_PGE);
+        page_global = _PAGE_GLOBAL;
+    }
+
+    cpuid(0x80000000, 0, &eax, &ebx, &ecx, &edx);
+    if (eax >= 0x80000001) {
+        cpuid(0x80000001, 0, &eax, &ebx, &ecx, &edx);
+        direct_gbpages = (edx & X86_FEATURE_GBPAGES) != 0;
+    }
+}
+
+void init_mem_mapping(void)
+{
+    struct memblock_region *rgn;
+    phys_addr_t start = 0, end = 0, rstart, rend;
+    pgd_t *pgd;
+    unsigned long i;
+
+    probe_page_sizes();
+
+    pgd = alloc_low_table();
+
+    /* The kernel image where it runs; low memory below it comes along */
+    map_range(pgd, 0, 0, ALIGN_UP((unsigned long)__kernel_end, PMD_SIZE),
+              false);
+    nr_pages_2m = 0;
+
+    /*
+     * RAM ranges rounded out to 2MB, and merged where that makes them
+     * touch: holes under 2MB, like the one below 1MB, do not keep a
+     * gigabyte from being mapped with one page
+     */
+    for (i = 0; i < memblock.memory.cnt; i++) {
+        rgn = &memblock.memory.regions[i];
+        rstart = ALIGN_DOWN(rgn->base, PMD_SIZE);
+        rend = ALIGN_UP(rgn->base + rgn->size, PMD_SIZE);
+
+        if (end != 0 && rstart <= end) {
+            end = MAX(end, rend);
+            continue;
+        }
+
+        if (end != 0)
+            map_range(pgd, KERNEL_VIRTUAL_BASE, start, end, direct_gbpages);
+        start = rstart;
+        end = rend;
+    }
+    if (end != 0)
+        map_range(pgd, KERNEL_VIRTUAL_BASE, start, end, direct_gbpages);
+
+    write_cr3(__pa(pgd));
+
+    /* Early allocations may now come from anywhere */
+    memblock.current_limit = end;
+
+    printk("Direct map: RAM up to %lu MB, %lu 1GB and %lu 2MB pages%s\n",
+           (unsigned long)(end >> 20), nr_pages_1g, nr_pages_2m,
+           page_global ? ", global" : "");
+}
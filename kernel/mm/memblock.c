@@ -0,0 +1,320 @@
+/*
+ * MicroKernel Early Boot Memory Allocator
+ *
+ * A memblock-style allocator: two sorted tables of physical ranges, one
+ * for RAM and one for reserved memory. Allocation searches top-down for
+ * a gap in the reserved table and reserves it. Once mem_map is in place
+ * the free ranges are released to the buddy allocator.
+ */
+
+#include "../include/memblock.h"
+#include "../include/mm.h"
+#include "../include/types.h"
+
+/* External declarations */
+extern int printk(const char *fmt, ...);
+
+struct memblock memblock = {
+    .current_limit = BOOT_DIRECT_MAP_SIZE,
+    .memory.name = "memory",
+    .reserved.name = "reserved",
+};
+
+/* Set once the free ranges have been handed to buddy */
+static bool memblock_retired = false;
+
+/*
+ * Insert a range keeping the table sorted, then coalesce overlapping
+ * and adjacent entries
+ */
+static int memblock_add_range(struct memblock_type *type,
+                              phys_addr_t base, phys_addr_t size)
+{
+    struct memblock_region *rgn = type->regions;
+    unsigned long i, j;
+
+    if (size == 0)
+        return 0;
+
+    if (type->cnt >= MEMBLOCK_MAX_REGIONS) {
+        printk("memblock: %s table full, dropping 0x%lx-0x%lx\n",
+               type->name, base, base + size);
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < type->cnt; i++)
+        if (rgn[i].base > base)
+            break;
+
+    for (j = type->cnt; j > i; j--)
+        rgn[j] = rgn[j - 1];
+
+    rgn[i].base = base;
+    rgn[i].size = size;
+    type->cnt++;
+
+    /* Coalesce */
+    type->total_size = 0;
+    for (i = 0, j = 0; i < type->cnt; i++) {
+        if (j > 0 && rgn[i].base <= rgn[j - 1].base + rgn[j - 1].size) {
+            phys_addr_t end = MAX(rgn[j - 1].base + rgn[j - 1].size,
+                                  rgn[i].base + rgn[i].size);
+            rgn[j - 1].size = end - rgn[j - 1].base;
+            continue;
+        }
+        rgn[j++] = rgn[i];
+    }
+    type->cnt = j;
+
+    for (i = 0; i < type->cnt; i++)
+        type->total_size += rgn[i].size;
+
+    return 0;
+}
+
+int memblock_add(phys_addr_t base, phys_addr_t size)
+{
+    return memblock_add_range(&memblock.memory, base, size);
+}
+
+int memblock_reserve(phys_addr_t base, phys_addr_t size)
+{
+    return memblock_add_range(&memblock.reserved, base, size);
+}
+
+/*
+ * Trim the memory table so nothing above limit is used
+ */
+void memblock_enforce_memory_limit(phys_addr_t limit)
+{
+    struct memblock_type *type = &memblock.memory;
+    unsigned long i;
+
+    type->total_size = 0;
+    for (i = 0; i < type->cnt; i++) {
+        struct memblock_region *rgn = &type->regions[i];
+
+        if (rgn->base >= limit) {
+            type->cnt = i;
+            break;
+        }
+
+        if (rgn->base + rgn->size > limit)
+            rgn->size = limit - rgn->base;
+
+        type->total_size += rgn->size;
+    }
+}
+
+/*
+ * Lowest reserved region overlapping [base, end), or NULL
+ */
+static struct memblock_region *memblock_find_reserved(phys_addr_t base,
+                                                      phys_addr_t end)
+{
+    struct memblock_type *type = &memblock.reserved;
+    unsigned long i;
+
+    for (i = 0; i < type->cnt; i++) {
+        struct memblock_region *rgn = &type->regions[i];
+
+        if (rgn->base >= end)
+            break;
+        if (rgn->base + rgn->size > base)
+            return rgn;
+    }
+
+    return NULL;
+}
+
+/*
+ * Top-down search for a free, aligned range below current_limit
+ */
+static phys_addr_t memblock_find_in_range(phys_addr_t size, phys_addr_t align)
+{
+    struct memblock_type *type = &memblock.memory;
+    struct memblock_region *rsv;
+    phys_addr_t start, end, cand;
+    unsigned long i;
+
+    for (i = type->cnt; i-- > 0; ) {
+        start = type->regions[i].base;
+        end = MIN(start + type->regions[i].size, memblock.current_limit);
+
+        while (end > start && end - start >= size) {
+            cand = ALIGN_DOWN(end - size, align);
+            if (cand < start)
+                break;
+
+            rsv = memblock_find_reserved(cand, cand + size);
+            if (rsv == NULL)
+                return cand;
+
+            /* Retry below the lowest conflicting reservation */
+            end = rsv->base;
+        }
+    }
+
+    return 0;
+}
+
+static phys_addr_t memblock_alloc_range(phys_addr_t size, phys_addr_t align,
+                                        bool zero)
+{
+    phys_addr_t base;
+
+    if (memblock_retired) {
+        printk("memblock: allocation after hand-off to buddy\n");
+        return 0;
+    }
+
+    if (align == 0)
+        align = PAGE_SIZE;
+    size = ALIGN_UP(size, PAGE_SIZE);
+
+    base = memblock_find_in_range(size, align);
+    if (base == 0)
+        return 0;
+
+    if (memblock_reserve(base, size) < 0)
+        return 0;
+
+    if (zero)
+        memset(__va(base), 0, size);
+
+    return base;
+}
+
+phys_addr_t memblock_phys_alloc(phys_addr_t size, phys_addr_t align)
+{
+    return memblock_alloc_range(size, align, true);
+}
+
+void *memblock_alloc(phys_addr_t size, phys_addr_t align)
+{
+    phys_addr_t base = memblock_alloc_range(size, align, true);
+
+    return base ? __va(base) : NULL;
+}
+
+void *memblock_alloc_raw(phys_addr_t size, phys_addr_t align)
+{
+    phys_addr_t base = memblock_alloc_range(size, align, false);
+
+    return base ? __va(base) : NULL;
+}
+
+phys_addr_t memblock_start_of_DRAM(void)
+{
+    if (memblock.memory.cnt == 0)
+        return 0;
+
+    return memblock.memory.regions[0].base;
+}
+
+phys_addr_t memblock_end_of_DRAM(void)
+{
+    struct memblock_type *type = &memblock.memory;
+
+    if (type->cnt == 0)
+        return 0;
+
+    return type->regions[type->cnt - 1].base +
+           type->regions[type->cnt - 1].size;
+}
+
+phys_addr_t memblock_phys_mem_size(void)
+{
+    return memblock.memory.total_size;
+}
+
+/*
+ * Release one free range to buddy, limited to the pfn window being
+ * initialized and to memory the kernel can address through the
+ * direct map
+ */
+static unsigned long memblock_free_range(phys_addr_t start, phys_addr_t end,
+                                         unsigned long win_start,
+                                         unsigned long win_end)
+{
+    unsigned long start_pfn, end_pfn, limit_pfn;
+
+    start_pfn = MAX(ALIGN_UP(start, PAGE_SIZE) >> PAGE_SHIFT, win_start);
+    end_pfn = MIN(ALIGN_DOWN(end, PAGE_SIZE) >> PAGE_SHIFT, win_end);
+    limit_pfn = memblock.current_limit >> PAGE_SHIFT;
+
+    if (start_pfn >= end_pfn)
+        return 0;
+
+    if (end_pfn > limit_pfn) {
+        memblock.unmapped_pages += end_pfn - MAX(start_pfn, limit_pfn);
+        end_pfn = limit_pfn;
+        if (start_pfn >= end_pfn)
+            return 0;
+    }
+
+    free_area_init(start_pfn, end_pfn);
+
+    return end_pfn - start_pfn;
+}
+
+/*
+ * Walk memory minus reserved within [start_pfn, end_pfn) and free
+ * every gap. The tables stay intact so that later windows can be
+ * released as their struct pages are initialized.
+ */
+unsigned long memblock_free_pfn_range(unsigned long start_pfn,
+                                      unsigned long end_pfn)
+{
+    struct memblock_type *mem = &memblock.memory;
+    struct memblock_type *rsv = &memblock.reserved;
+    phys_addr_t win_start = (phys_addr_t)start_pfn << PAGE_SHIFT;
+    phys_addr_t win_end = (phys_addr_t)end_pfn << PAGE_SHIFT;
+    phys_addr_t start, end, rend;
+    unsigned long pages = 0;
+    unsigned long i, j;
+
+    memblock_retired = true;
+
+    for (i = 0; i < mem->cnt; i++) {
+        start = MAX(mem->regions[i].base, win_start);
+        end = MIN(mem->regions[i].base + mem->regions[i].size, win_end);
+
+        for (j = 0; j < rsv->cnt && start < end; j++) {
+            rend = rsv->regions[j].base + rsv->regions[j].size;
+
+            if (rend <= start)
+                continue;
+            if (rsv->regions[j].base >= end)
+                break;
+
+            if (rsv->regions[j].base > start)
+                pages += memblock_free_range(start, rsv->regions[j].base,
+                                             start_pfn, end_pfn);
+            start = rend;
+        }
+
+        if (start < end)
+            pages += memblock_free_range(start, end, start_pfn, end_pfn);
+    }
+
+    return pages;
+}
+
+void memblock_dump(void)
+{
+    struct memblock_type *types[] = { &memblock.memory, &memblock.reserved };
+    struct memblock_region *rgn;
+    unsigned long i, t;
+
+    for (t = 0; t < ARRAY_SIZE(types); t++) {
+        printk(" %s: %lu regions, %lu KB\n", types[t]->name,
+               types[t]->cnt, types[t]->total_size >> 10);
+
+        for (i = 0; i < types[t]->cnt; i++) {
+            rgn = &types[t]->regions[i];
+            printk("  [0x%lx-0x%lx] %lu KB\n", rgn->base,
+                   rgn->base + rgn->size - 1, rgn->size >> 10);
+        }
+    }
+}
@@ -0,0 +1,994 @@
+/*
+ * MicroKernel User Page Tables
+ *
+ * Building and tearing down the page tables of user address spaces.
+ * Every user PGD starts as a copy of the kernel's top-level entries, so
+ * the kernel stays mapped whichever address space is loaded; the tables
+ * below user addresses belong to the mm and are freed with it.
+ *
+ * Anonymous pages are put in on the first fault, or up front a page
+ * table at a time, and go on the LRU for reclaim to swap out. Unmapping
+ * and protection changes go through an mmu_gather, which flushes the
+ * TLB once for the whole operation before anything is freed.
+ */
+
+#include "../include/pgtable.h"
+#include "../include/hugetlb.h"
+#include "../include/swap.h"
+#include "../include/sched.h"
+#include "../include/mm.h"
+#include "../include/types.h"
+#include "../include/list.h"
+
+/* External declarations */
+extern int printk(const char *fmt, ...);
+extern void panic(const char *fmt, ...);
+
+/* Page tables are unmovable kernel memory */
+#define GFP_PGTABLE     (GFP_KERNEL | GFP_ZERO)
+
+/* Anonymous user memory is grouped with movable pages */
+#define GFP_USER_PAGE   (GFP_USER | GFP_MOVABLE | GFP_ZERO)
+
+/* Copy-on-write targets are overwritten whole */
+#define GFP_USER_COPY   (GFP_USER | GFP_MOVABLE)
+
+/* Pages mapped by a fault in a VM_SEQ_READ VMA, counting its own */
+#define FAULT_AROUND_PAGES  16
+
+/* Physical address of the kernel's PGD */
+static phys_addr_t kernel_pgd;
+
+struct page *zero_page;
+
+void pgtable_init(void)
+{
+    kernel_pgd = read_cr3() & PTE_PFN_MASK;
+
+    zero_page = alloc_pages(GFP_KERNEL | GFP_ZERO, 0);
+    if (zero_page == NULL)
+        panic("pgtable_init: no memory for the zero page");
+}
+
+pgd_t *pgd_offset_k(unsigned long addr)
+{
+    return (pgd_t *)__va(kernel_pgd) + pgd_index(addr);
+}
+
+int pgd_alloc(struct mm_struct *mm)
+{
+    pgd_t *pgd, *kpgd;
+    int i;
+
+    pgd = (pgd_t *)get_zeroed_page(GFP_PGTABLE);
+    if (pgd == NULL)
+        return -ENOMEM;
+
+    kpgd = __va(kernel_pgd);
+    for (i = 0; i < PTRS_PER_TABLE; i++)
+        pgd[i] = kpgd[i];
+
+    mm->pgd = __pa(pgd);
+    return 0;
+}
+
+/*
+ * Everything mapped must have been zapped: only the tables are left,
+ * some of them empty
+ */
+void pgd_free(struct mm_struct *mm)
+{
+    pgd_t *pgd;
+    pud_t *pud;
+    pmd_t *pmd;
+    int i, j, k;
+
+    if (mm->pgd == 0)
+        return;
+
+    pgd = __va(mm->pgd);
+    for (i = 0; i < PTRS_PER_TABLE; i++) {
+        if (!entry_present(pgd[i]) || !(pgd[i] & _PAGE_USER))
+            continue;
+
+        pud = entry_table(pgd[i]);
+        for (j = 0; j < PTRS_PER_TABLE; j++) {
+            if (!entry_present(pud[j]))
+                continue;
+
+            pmd = entry_table(pud[j]);
+            for (k = 0; k < PTRS_PER_TABLE; k++)
+                if (entry_present(pmd[k]) && !pmd_huge(pmd[k]))
+                    free_page_virt((unsigned long)entry_table(pmd[k]));
+            free_page_virt((unsigned long)pmd);
+        }
+        free_page_virt((unsigned long)pud);
+    }
+
+    free_page_virt((unsigned long)pgd);
+    mm->pgd = 0;
+}
+
+/*
+ * Table under an entry, allocated if missing and asked to
+ */
+static void *walk_next(u64 *entry, bool alloc)
+{
+    unsigned long table;
+
+    if (entry_present(*entry))
+        return entry_table(*entry);
+
+    if (!alloc)
+        return NULL;
+
+    table = get_zeroed_page(GFP_PGTABLE);
+    if (table == 0)
+        return NULL;
+
+    *entry = __pa(table) | _PAGE_TABLE;
+    return (void *)table;
+}
+
+pmd_t *walk_pmd(struct mm_struct *mm, unsigned long addr, bool alloc)
+{
+    pgd_t *pgd;
+    pud_t *pud;
+    pmd_t *pmd;
+
+    if (mm->pgd == 0)
+        return NULL;
+
+    pgd = (pgd_t *)__va(mm->pgd) + pgd_index(addr);
+
+    /* Kernel entries are shared by every mm and never extended */
+    if (entry_present(*pgd) && !(*pgd & _PAGE_USER))
+        return NULL;
+
+    pud = walk_next(pgd, alloc);
+    if (pud == NULL)
+        return NULL;
+
+    pmd = walk_next(&pud[pud_index(addr)], alloc);
+    if (pmd == NULL)
+        return NULL;
+
+    return &pmd[pmd_index(addr)];
+}
+
+pte_t *walk_pte(struct mm_struct *mm, unsigned long addr, bool alloc)
+{
+    pmd_t *pmd;
+    pte_t *pte;
+
+    pmd = walk_pmd(mm, addr, alloc);
+    if (pmd == NULL || pmd_huge(*pmd))
+        return NULL;
+
+    pte = walk_next(pmd, alloc);
+    if (pte == NULL)
+        return NULL;
+
+    return &pte[pte_index(addr)];
+}
+
+void flush_tlb_mm_range(struct mm_struct *mm, unsigned long start,
+                        unsigned long end)
+{
+    unsigned long addr;
+
+    /* Other address spaces have nothing cached: CR3 loads flush */
+    if (mm->pgd == 0 || (read_cr3() & PTE_PFN_MASK) != mm->pgd)
+        return;
+
+    if (((end - start) >> PAGE_SHIFT) > TLB_FLUSH_ALL_THRESHOLD) {
+        flush_tlb_local();
+        return;
+    }
+
+    for (addr = start; addr < end; addr += PAGE_SIZE)
+        flush_tlb_one(addr);
+}
+
+void tlb_gather_mmu(struct mmu_gather *tlb, struct mm_struct *mm)
+{
+    tlb->mm = mm;
+    tlb->start = ~0UL;
+    tlb->end = 0;
+    INIT_LIST_HEAD(&tlb->pages);
+    INIT_LIST_HEAD(&tlb->thp);
+    INIT_LIST_HEAD(&tlb->huge);
+}
+
+static inline void tlb_add_range(struct mmu_gather *tlb, unsigned long start,
+                                 unsigned long end)
+{
+    tlb->start = MIN(tlb->start, start);
+    tlb->end = MAX(tlb->end, end);
+}
+
+void tlb_finish_mmu(struct mmu_gather *tlb)
+{
+    struct page *page, *tmp;
+
+    if (tlb->start < tlb->end)
+        flush_tlb_mm_range(tlb->mm, tlb->start, tlb->end);
+
+    free_pages_bulk_list(&tlb->pages);
+
+    list_for_each_entry_safe(page, tmp, &tlb->thp, lru) {
+        list_del(&page->lru);
+        free_transhuge_page(page);
+    }
+    list_for_each_entry_safe(page, tmp, &tlb->huge, lru) {
+        list_del(&page->lru);
+        free_huge_page(page);
+    }
+
+    tlb->start = ~0UL;
+    tlb->end = 0;
+}
+
+/*
+ * Anonymous pages are mapped by _mapcount + 1 page table entries, in
+ * one or more address spaces after fork. A page mapped once and with no
+ * other reference can be written in place; a shared one is copied.
+ * Only a page mapped once has an owner for reclaim to find it by.
+ */
+static inline void page_dup_anon(struct page *page)
+{
+    atomic_inc(&page->_mapcount);
+    page->mapping = NULL;
+}
+
+/* A new page, mapped once at addr */
+static inline void page_add_new_anon(struct page *page,
+                                     struct vm_area_struct *vma,
+                                     unsigned long addr)
+{
+    atomic_set(&page->_mapcount, 0);
+    page_set_owner(page, vma->vm_mm, addr);
+    lru_cache_add(page, vma);
+}
+
+/* Drop one mapping; true if that was the last */
+static inline bool page_remove_anon(struct page *page)
+{
+    return atomic_dec_return(&page->_mapcount) < 0;
+}
+
+static inline bool page_exclusive(struct page *page)
+{
+    return page_mapcount(page) == 1 && page_count(page) == 1;
+}
+
+/* Write faults on shared pages: copied, or written in place */
+static unsigned long nr_cow_copy;
+static unsigned long nr_cow_reuse;
+
+void cow_stats(unsigned long *copied, unsigned long *reused)
+{
+    *copied = nr_cow_copy;
+    *reused = nr_cow_reuse;
+}
+
+/* Faults on swap entries */
+static unsigned long nr_swapin;
+static u64 swapin_cycles;
+
+void swapin_stats(unsigned long *faults, u64 *cycles)
+{
+    *faults = nr_swapin;
+    *cycles = swapin_cycles;
+}
+
+/* A transparent huge page may back [haddr, haddr + HPAGE_SIZE) */
+static bool thp_vma_suitable(struct vm_area_struct *vma, unsigned long haddr)
+{
+    return transparent_hugepage == THP_ALWAYS &&
+           !(vma->vm_flags & VM_HUGETLB) &&
+           haddr >= vma->vm_start && haddr + HPAGE_SIZE <= vma->vm_end;
+}
+
+/*
+ * Install a huge page at an aligned address. Returns 1 if it did, 0 if
+ * the PMD is already in use or no transparent huge page is free.
+ */
+static int do_huge_pmd_anonymous_page(struct vm_area_struct *vma,
+                                      unsigned long haddr, pmd_t *pmd)
+{
+    struct page *page;
+
+    if (entry_mapped(*pmd))
+        return 0;
+
+    if (vma->vm_flags & VM_HUGETLB) {
+        page = alloc_huge_page();
+        if (page == NULL)
+            return -ENOMEM;
+    } else {
+        page = alloc_transhuge_page();
+        if (page == NULL)
+            return 0;
+    }
+
+    atomic_set(&page->_mapcount, 0);
+    *pmd = mk_entry(page, vm_get_page_prot(vma->vm_flags) | _PAGE_PSE);
+    return 1;
+}
+
+/*
+ * First touch of a page. Reads of private memory share the zero page
+ * until something is written.
+ */
+static int do_anonymous_page(struct vm_area_struct *vma, unsigned long addr,
+                             pte_t *pte, unsigned int flags)
+{
+    u64 prot = vm_get_page_prot(vma->vm_flags);
+    struct page *page;
+
+    if (!(flags & FAULT_FLAG_WRITE) && !(vma->vm_flags & VM_SHARED)) {
+        *pte = mk_entry(zero_page, prot & ~_PAGE_RW);
+        return 0;
+    }
+
+    page = alloc_pages(GFP_USER_PAGE, 0);
+    if (page == NULL)
+        return VM_FAULT_OOM;
+
+    page_add_new_anon(page, vma, addr);
+    *pte = mk_entry(page, prot);
+    return 0;
+}
+
+/*
+ * Fault on a swapped-out page: decompress it into a new page, which
+ * this entry maps alone.
+ */
+static int do_swap_page(struct vm_area_struct *vma, unsigned long addr,
+                        pte_t *pte)
+{
+    swp_entry_t swp = pte_to_swp_entry(*pte);
+    u64 start = rdtsc();
+    struct page *page;
+
+    page = alloc_pages(GFP_USER_COPY, 0);
+    if (page == NULL)
+        return VM_FAULT_OOM;
+
+    if (zswap_load(swp, page) < 0) {
+        free_page(page);
+        return VM_FAULT_SIGSEGV;
+    }
+    swap_free(swp);
+
+    page_add_new_anon(page, vma, addr);
+    *pte = mk_entry(page, vm_get_page_prot(vma->vm_flags));
+
+    nr_swapin++;
+    swapin_cycles += rdtsc() - start;
+    return VM_FAULT_MAJOR;
+}
+
+/*
+ * Fill the empty entries over [addr, end) of the page table pte, which
+ * covers one PMD, as do_anonymous_page would, but with the pages from a
+ * single bulk allocation. Best effort: whatever could not be allocated
+ * is left empty for the fault path.
+ */
+static void populate_pte_range(struct vm_area_struct *vma, pte_t *pte,
+                               unsigned long addr, unsigned long end,
+                               unsigned int flags)
+{
+    u64 prot = vm_get_page_prot(vma->vm_flags);
+    struct list_head pages;
+    struct page *page;
+    unsigned long a, nr = 0;
+
+    if (!(flags & FAULT_FLAG_WRITE) && !(vma->vm_flags & VM_SHARED)) {
+        for (a = addr; a < end; a += PAGE_SIZE)
+            if (pte_none(pte[pte_index(a)]))
+                pte[pte_index(a)] = mk_entry(zero_page, prot & ~_PAGE_RW);
+        return;
+    }
+
+    for (a = addr; a < end; a += PAGE_SIZE)
+        if (pte_none(pte[pte_index(a)]))
+            nr++;
+    if (nr == 0)
+        return;
+
+    INIT_LIST_HEAD(&pages);
+    alloc_pages_bulk_list(GFP_USER_PAGE, nr, &pages);
+
+    for (a = addr; a < end && !list_empty(&pages); a += PAGE_SIZE) {
+        if (!pte_none(pte[pte_index(a)]))
+            continue;
+        page = list_first_entry(&pages, struct page, lru);
+        list_del(&page->lru);
+        page_add_new_anon(page, vma, a);
+        pte[pte_index(a)] = mk_entry(page, prot);
+    }
+}
+
+/*
+ * Write to a present page mapped read-only in a writable VMA: the zero
+ * page, a page shared with another address space since fork, or one
+ * whose sharers have all gone. A MAP_SHARED page is written in place
+ * whoever else maps it.
+ */
+static int do_wp_page(struct vm_area_struct *vma, unsigned long addr,
+                      pte_t *pte)
+{
+    struct page *old = NULL, *page;
+
+    if (!is_zero_entry(*pte)) {
+        old = entry_page(*pte);
+        if (vma->vm_flags & VM_SHARED) {
+            *pte |= _PAGE_RW;
+            nr_cow_reuse++;
+            goto flush;
+        }
+        if (page_exclusive(old)) {
+            *pte |= _PAGE_RW;
+            page_set_owner(old, vma->vm_mm, addr);
+            nr_cow_reuse++;
+            goto flush;
+        }
+    }
+
+    page = alloc_pages(old ? GFP_USER_COPY : GFP_USER_PAGE, 0);
+    if (page == NULL)
+        return VM_FAULT_OOM;
+
+    if (old) {
+        copy_page(page_to_virt(page), page_to_virt(old));
+        nr_cow_copy++;
+    }
+
+    page_add_new_anon(page, vma, addr);
+    *pte = mk_entry(page, vm_get_page_prot(vma->vm_flags));
+
+    /* The other mappers may have gone since the fault was taken */
+    if (old && page_remove_anon(old)) {
+        lru_cache_del(old);
+        free_page(old);
+    }
+
+flush:
+    flush_tlb_mm_range(vma->vm_mm, addr, addr + PAGE_SIZE);
+    return 0;
+}
+
+/*
+ * Replace a huge PMD with a table of private 4KB copies of its pages.
+ * The huge page loses one mapping and is freed if that was the last.
+ */
+static int copy_huge_pmd_to_ptes(struct vm_area_struct *vma,
+                                 unsigned long haddr, pmd_t *pmd)
+{
+    struct page *huge = entry_page(*pmd), *page;
+    u64 prot = *pmd & ~(PTE_PFN_MASK | _PAGE_PSE);
+    struct list_head pages;
+    pte_t *pte;
+    int i;
+
+    pte = (pte_t *)get_zeroed_page(GFP_PGTABLE);
+    if (pte == NULL)
+        return -ENOMEM;
+
+    INIT_LIST_HEAD(&pages);
+    if (alloc_pages_bulk_list(GFP_USER_COPY, PTRS_PER_TABLE, &pages) <
+        PTRS_PER_TABLE) {
+        free_pages_bulk_list(&pages);
+        free_page_virt((unsigned long)pte);
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < PTRS_PER_TABLE; i++) {
+        page = list_first_entry(&pages, struct page, lru);
+        list_del(&page->lru);
+        copy_page(page_to_virt(page), page_to_virt(&huge[i]));
+        page_add_new_anon(page, vma, haddr + i * PAGE_SIZE);
+        pte[i] = mk_entry(page, prot);
+    }
+
+    *pmd = __pa(pte) | _PAGE_TABLE;
+    flush_tlb_mm_range(vma->vm_mm, haddr, haddr + HPAGE_SIZE);
+
+    if (page_remove_anon(huge))
+        free_transhuge_page(huge);
+    return 0;
+}
+
+/* do_wp_page for a huge PMD */
+static int do_huge_pmd_wp_page(struct vm_area_struct *vma,
+                               unsigned long haddr, pmd_t *pmd)
+{
+    struct page *old = entry_page(*pmd), *page;
+    int i;
+
+    if ((vma->vm_flags & VM_SHARED) || page_exclusive(old)) {
+        *pmd |= _PAGE_RW;
+        nr_cow_reuse++;
+        goto flush;
+    }
+
+    if (vma->vm_flags & VM_HUGETLB)
+        page = alloc_huge_page();
+    else
+        page = alloc_transhuge_page();
+
+    /* No huge page to copy to: copy to 4KB pages instead */
+    if (page == NULL) {
+        if ((vma->vm_flags & VM_HUGETLB) ||
+            copy_huge_pmd_to_ptes(vma, haddr, pmd) < 0)
+            return VM_FAULT_OOM;
+        nr_cow_copy++;
+        return 0;
+    }
+
+    for (i = 0; i < PTRS_PER_TABLE; i++)
+        copy_page(page_to_virt(&page[i]), page_to_virt(&old[i]));
+    nr_cow_copy++;
+
+    atomic_set(&page->_mapcount, 0);
+    *pmd = mk_entry(page, vm_get_page_prot(vma->vm_flags) | _PAGE_PSE);
+
+    if (page_remove_anon(old)) {
+        if (vma->vm_flags & VM_HUGETLB)
+            free_huge_page(old);
+        else
+            free_transhuge_page(old);
+    }
+
+flush:
+    flush_tlb_mm_range(vma->vm_mm, haddr, haddr + HPAGE_SIZE);
+    return 0;
+}
+
+int handle_mm_fault(struct vm_area_struct *vma, unsigned long addr,
+                    unsigned int flags)
+{
+    unsigned long haddr = addr & PMD_MASK;
+    pmd_t *pmd;
+    pte_t *pte;
+    int ret;
+
+    pmd = walk_pmd(vma->vm_mm, addr, true);
+    if (pmd == NULL)
+        return VM_FAULT_OOM;
+
+    if ((vma->vm_flags & VM_HUGETLB) || thp_vma_suitable(vma, haddr)) {
+        ret = do_huge_pmd_anonymous_page(vma, haddr, pmd);
+        if (ret < 0)
+            return VM_FAULT_OOM;
+        if (ret)
+            return 0;
+    }
+
+    if (pmd_huge(*pmd)) {
+        if ((flags & FAULT_FLAG_WRITE) && !(*pmd & _PAGE_RW))
+            return do_huge_pmd_wp_page(vma, haddr, pmd);
+        return 0;
+    }
+
+    /* Pool mappings are huge-aligned: never mapped with PTEs */
+    if (vma->vm_flags & VM_HUGETLB)
+        return VM_FAULT_SIGSEGV;
+
+    pte = walk_pte(vma->vm_mm, addr, true);
+    if (pte == NULL)
+        return VM_FAULT_OOM;
+
+    if (is_swap_pte(*pte))
+        return do_swap_page(vma, addr & PAGE_MASK, pte);
+
+    /* Sequential access: map the pages after this one while here */
+    if (pte_none(*pte) && (vma->vm_flags & VM_SEQ_READ)) {
+        addr &= PAGE_MASK;
+        populate_pte_range(vma, pte - pte_index(addr), addr,
+                           MIN(MIN(haddr + PMD_SIZE, vma->vm_end),
+                               addr + FAULT_AROUND_PAGES * PAGE_SIZE),
+                           flags);
+    }
+
+    if (!entry_mapped(*pte))
+        return do_anonymous_page(vma, addr & PAGE_MASK, pte, flags);
+
+    if ((flags & FAULT_FLAG_WRITE) && !(*pte & _PAGE_RW))
+        return do_wp_page(vma, addr & PAGE_MASK, pte);
+
+    /* Already there: the fault dropped the stale TLB entry */
+    return 0;
+}
+
+static int fault_errno(int fault)
+{
+    return (fault & VM_FAULT_OOM) ? -ENOMEM : -EFAULT;
+}
+
+/*
+ * Each PMD of the range gets a huge page if the fault path would give it
+ * one. Otherwise its page table is filled in one go, and only what that
+ * leaves, copy-on-write or pages it could not get, goes through the
+ * fault path page by page.
+ */
+int populate_vma_range(struct vm_area_struct *vma, unsigned long start,
+                       unsigned long end)
+{
+    unsigned int flags = 0;
+    unsigned long addr, next, a;
+    pmd_t *pmd;
+    pte_t *pte;
+    u64 entry;
+    int ret;
+
+    /* PROT_NONE reserves the range without backing it */
+    if (!(vma->vm_flags & VM_ACCESS_FLAGS))
+        return 0;
+
+    if (vma->vm_flags & VM_WRITE)
+        flags |= FAULT_FLAG_WRITE;
+
+    for (addr = start; addr < end; addr = next) {
+        next = MIN((addr & PMD_MASK) + PMD_SIZE, end);
+
+        pmd = walk_pmd(vma->vm_mm, addr, true);
+        if (pmd == NULL)
+            return -ENOMEM;
+
+        if (pmd_huge(*pmd) || (vma->vm_flags & VM_HUGETLB) ||
+            thp_vma_suitable(vma, addr & PMD_MASK)) {
+            ret = handle_mm_fault(vma, addr, flags);
+            if (ret & VM_FAULT_ERROR)
+                return fault_errno(ret);
+            if (pmd_huge(*pmd))
+                continue;
+        }
+
+        pte = walk_pte(vma->vm_mm, addr, true);
+        if (pte == NULL)
+            return -ENOMEM;
+        pte -= pte_index(addr);
+
+        populate_pte_range(vma, pte, addr, next, flags);
+
+        for (a = addr; a < next; a += PAGE_SIZE) {
+            entry = pte[pte_index(a)];
+            if (entry_mapped(entry) &&
+                (!(flags & FAULT_FLAG_WRITE) || (entry & _PAGE_RW)))
+                continue;
+            ret = handle_mm_fault(vma, a, flags);
+            if (ret & VM_FAULT_ERROR)
+                return fault_errno(ret);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Replace a huge PMD with a table of PTEs mapping its 4KB pages, or
+ * private copies of them if the huge page is shared
+ */
+static int __split_huge_pmd(struct vm_area_struct *vma, pmd_t *pmd,
+                            unsigned long haddr)
+{
+    struct page *page;
+    pte_t *pte;
+    u64 prot;
+    int i;
+
+    page = entry_page(*pmd);
+    if (!page_exclusive(page))
+        return copy_huge_pmd_to_ptes(vma, haddr, pmd);
+
+    pte = (pte_t *)get_zeroed_page(GFP_PGTABLE);
+    if (pte == NULL)
+        return -ENOMEM;
+
+    prot = *pmd & ~(PTE_PFN_MASK | _PAGE_PSE);
+
+    /* Each 4KB page now stands alone, with its own reference */
+    for (i = 0; i < PTRS_PER_TABLE; i++) {
+        atomic_set(&page[i]._refcount, 1);
+        page_add_new_anon(&page[i], vma, haddr + i * PAGE_SIZE);
+        pte[i] = mk_entry(&page[i], prot);
+    }
+
+    *pmd = __pa(pte) | _PAGE_TABLE;
+    flush_tlb_mm_range(vma->vm_mm, haddr, haddr + HPAGE_SIZE);
+    count_thp_split();
+
+    return 0;
+}
+
+/*
+ * Map a transparent huge page that addr falls inside with 512 PTEs, so
+ * that part of it can be unmapped. Nothing to do for aligned addresses
+ * or ranges not mapped huge. A huge page still shared with another
+ * address space is not split under it: this one gets its own copies.
+ */
+int split_huge_pmd_address(struct vm_area_struct *vma, unsigned long addr)
+{
+    pmd_t *pmd;
+
+    if (IS_ALIGNED(addr, HPAGE_SIZE))
+        return 0;
+
+    pmd = walk_pmd(vma->vm_mm, addr, false);
+    if (pmd == NULL || !pmd_huge(*pmd))
+        return 0;
+
+    /* Pool pages are only ever mapped and unmapped whole */
+    if (vma->vm_flags & VM_HUGETLB)
+        return -EINVAL;
+
+    return __split_huge_pmd(vma, pmd, addr & PMD_MASK);
+}
+
+/*
+ * Clear the entries and gather the pages that lost their last mapping,
+ * and any PTE table left covering nothing. Huge PMDs inside the range
+ * must be mapped whole: callers split the ones at the edges first.
+ */
+void zap_page_range(struct mmu_gather *tlb, struct vm_area_struct *vma,
+                    unsigned long start, unsigned long end)
+{
+    struct mm_struct *mm = vma->vm_mm;
+    unsigned long addr, next, a;
+    struct page *page;
+    pmd_t *pmd;
+    pte_t *pte;
+
+    tlb_add_range(tlb, start, end);
+
+    for (addr = start; addr < end; addr = next) {
+        next = MIN((addr & PMD_MASK) + PMD_SIZE, end);
+
+        pmd = walk_pmd(mm, addr, false);
+        if (pmd == NULL || !entry_mapped(*pmd))
+            continue;
+
+        if (pmd_huge(*pmd)) {
+            if (!IS_ALIGNED(addr, HPAGE_SIZE) || next - addr != HPAGE_SIZE) {
+                printk("zap: huge page at 0x%lx only partly unmapped\n",
+                       addr & PMD_MASK);
+                continue;
+            }
+            page = entry_page(*pmd);
+            *pmd = 0;
+            if (!page_remove_anon(page))
+                continue;
+            if (vma->vm_flags & VM_HUGETLB)
+                list_add_tail(&page->lru, &tlb->huge);
+            else
+                list_add_tail(&page->lru, &tlb->thp);
+            continue;
+        }
+
+        pte = entry_table(*pmd);
+        for (a = addr; a < next; a += PAGE_SIZE) {
+            if (is_swap_pte(pte[pte_index(a)])) {
+                swap_free(pte_to_swp_entry(pte[pte_index(a)]));
+                pte[pte_index(a)] = 0;
+                continue;
+            }
+            if (!entry_mapped(pte[pte_index(a)]))
+                continue;
+            if (is_zero_entry(pte[pte_index(a)])) {
+                pte[pte_index(a)] = 0;
+                continue;
+            }
+            page = entry_page(pte[pte_index(a)]);
+            pte[pte_index(a)] = 0;
+            if (page_remove_anon(page)) {
+                lru_cache_del(page);
+                list_add_tail(&page->lru, &tlb->pages);
+            }
+        }
+
+        /* The whole table is unmapped: it goes too, after the flush */
+        if (next - addr == PMD_SIZE) {
+            *pmd = 0;
+            page = virt_to_page(pte);
+            list_add_tail(&page->lru, &tlb->pages);
+        }
+    }
+}
+
+void change_protection(struct mmu_gather *tlb, struct vm_area_struct *vma,
+                       unsigned long start, unsigned long end)
+{
+    u64 prot = vm_get_page_prot(vma->vm_flags);
+    bool shared = vma->vm_flags & VM_SHARED;
+    unsigned long addr, next, a;
+    pmd_t *pmd;
+    pte_t *pte;
+    u64 entry;
+
+    tlb_add_range(tlb, start, end);
+
+    for (addr = start; addr < end; addr = next) {
+        next = MIN((addr & PMD_MASK) + PMD_SIZE, end);
+
+        pmd = walk_pmd(vma->vm_mm, addr, false);
+        if (pmd == NULL || !entry_mapped(*pmd))
+            continue;
+
+        if (pmd_huge(*pmd)) {
+            entry = (*pmd & ~_PAGE_PROT_MASK) | prot;
+            if (!shared && !page_exclusive(entry_page(*pmd)))
+                entry &= ~_PAGE_RW;
+            *pmd = entry;
+            continue;
+        }
+
+        pte = entry_table(*pmd);
+        for (a = addr; a < next; a += PAGE_SIZE) {
+            entry = pte[pte_index(a)];
+            if (!entry_mapped(entry))
+                continue;
+            entry = (entry & ~_PAGE_PROT_MASK) | prot;
+            if (is_zero_entry(entry) ||
+                (!shared && !page_exclusive(entry_page(entry))))
+                entry &= ~_PAGE_RW;
+            pte[pte_index(a)] = entry;
+        }
+    }
+}
+
+/* A page this mm owns, now mapped at addr */
+static void move_page_owner(struct mm_struct *mm, pte_t entry,
+                            unsigned long addr)
+{
+    struct page *page;
+
+    if (!entry_mapped(entry) || is_zero_entry(entry))
+        return;
+
+    page = entry_page(entry);
+    if (page_owner(page) == mm)
+        page_set_owner(page, mm, addr);
+}
+
+/*
+ * Move the entries of [old_addr, old_addr + len) in vma's mm to
+ * new_addr, where nothing is mapped yet. The pages stay where they are,
+ * with the same counts: only the entries pointing at them move. Where a
+ * whole PMD moves to an empty one, its PTE table or huge page moves as
+ * that one entry; huge pages cut by the ends of a chunk are split first.
+ *
+ * Returns the bytes moved, from the start; less than len if a page
+ * table could not be had. Moving them back takes no new tables.
+ */
+unsigned long move_page_tables(struct vm_area_struct *vma,
+                               unsigned long old_addr, unsigned long new_addr,
+                               unsigned long len)
+{
+    struct mm_struct *mm = vma->vm_mm;
+    unsigned long done, extent, old, new, a;
+    pmd_t *old_pmd, *new_pmd;
+    pte_t *old_pte, *new_pte;
+
+    for (done = 0; done < len; done += extent) {
+        old = old_addr + done;
+        new = new_addr + done;
+
+        /* Up to the next PMD boundary on either side */
+        extent = MIN(PMD_SIZE - (old & ~PMD_MASK),
+                     PMD_SIZE - (new & ~PMD_MASK));
+        extent = MIN(extent, len - done);
+
+        old_pmd = walk_pmd(mm, old, false);
+        if (old_pmd == NULL || !entry_mapped(*old_pmd))
+            continue;
+
+        new_pmd = walk_pmd(mm, new, true);
+        if (new_pmd == NULL)
+            break;
+
+        if (extent == PMD_SIZE && !entry_mapped(*new_pmd)) {
+            *new_pmd = *old_pmd;
+            *old_pmd = 0;
+            if (!pmd_huge(*new_pmd)) {
+                new_pte = entry_table(*new_pmd);
+                for (a = 0; a < PTRS_PER_TABLE; a++)
+                    move_page_owner(mm, new_pte[a], new + a * PAGE_SIZE);
+            }
+            continue;
+        }
+
+        if (pmd_huge(*old_pmd) &&
+            __split_huge_pmd(vma, old_pmd, old & PMD_MASK) < 0)
+            break;
+
+        new_pte = walk_pte(mm, new, true);
+        if (new_pte == NULL)
+            break;
+        old_pte = entry_table(*old_pmd);
+        old_pte += pte_index(old);
+
+        for (a = 0; a < extent >> PAGE_SHIFT; a++) {
+            if (pte_none(old_pte[a]))
+                continue;
+            new_pte[a] = old_pte[a];
+            old_pte[a] = 0;
+            move_page_owner(mm, new_pte[a], new + a * PAGE_SIZE);
+        }
+    }
+
+    if (done)
+        flush_tlb_mm_range(mm, old_addr, old_addr + done);
+    return done;
+}
+
+/*
+ * Copy the page table entries of src_vma into dst_vma, its copy in a
+ * forked address space. Private pages end up read-only on both sides,
+ * for do_wp_page to copy or reuse on the first write; shared ones stay
+ * as they are. Only tables the parent has are copied: ranges it never
+ * touched get their tables from faults in the child.
+ */
+int copy_page_range(struct mmu_gather *tlb, struct vm_area_struct *dst_vma,
+                    struct vm_area_struct *src_vma)
+{
+    struct mm_struct *dst_mm = dst_vma->vm_mm, *src_mm = src_vma->vm_mm;
+    bool cow = !(src_vma->vm_flags & VM_SHARED);
+    unsigned long addr, next, a;
+    pmd_t *src_pmd, *dst_pmd;
+    pte_t *src_pte, *dst_pte;
+    u64 entry;
+
+    for (addr = src_vma->vm_start; addr < src_vma->vm_end; addr = next) {
+        next = MIN((addr & PMD_MASK) + PMD_SIZE, src_vma->vm_end);
+
+        src_pmd = walk_pmd(src_mm, addr, false);
+        if (src_pmd == NULL || !entry_mapped(*src_pmd))
+            continue;
+
+        dst_pmd = walk_pmd(dst_mm, addr, true);
+        if (dst_pmd == NULL)
+            return -ENOMEM;
+
+        if (pmd_huge(*src_pmd)) {
+            page_dup_anon(entry_page(*src_pmd));
+            if (cow && (*src_pmd & _PAGE_RW)) {
+                *src_pmd &= ~_PAGE_RW;
+                tlb_add_range(tlb, addr, next);
+            }
+            *dst_pmd = *src_pmd;
+            continue;
+        }
+
+        src_pte = entry_table(*src_pmd);
+        dst_pte = walk_pte(dst_mm, addr, true);
+        if (dst_pte == NULL)
+            return -ENOMEM;
+        dst_pte -= pte_index(addr);
+
+        for (a = addr; a < next; a += PAGE_SIZE) {
+            entry = src_pte[pte_index(a)];
+            if (is_swap_pte(entry)) {
+                swap_duplicate(pte_to_swp_entry(entry));
+                dst_pte[pte_index(a)] = entry;
+                continue;
+            }
+            if (!entry_mapped(entry))
+                continue;
+
+            if (!is_zero_entry(entry)) {
+                page_dup_anon(entry_page(entry));
+                if (cow && (entry & _PAGE_RW)) {
+                    entry &= ~_PAGE_RW;
+                    src_pte[pte_index(a)] = entry;
+                    tlb_add_range(tlb, a, a + PAGE_SIZE);
+                }
+            }
+            dst_pte[pte_index(a)] = entry;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,1478 @@
+/*
+ * MicroKernel Memory Mapping
+ *
+ * Anonymous mmap, munmap, mremap, mprotect, madvise, mlock and brk. The VMAs
+ * of an address space are in a maple tree by address (lib/maple_tree.c),
+ * which also finds the free ranges new mappings go in. Page faults look up their
+ * VMA in it under RCU, without mmap_lock (mmap_lock.h), so a VMA is
+ * freed only after a grace period. Lookups try the task's VMA cache
+ * (vmacache.c) before the tree. The page tables under them are built
+ * by memory.c.
+ */
+
+#include "../include/pgtable.h"
+#include "../include/hugetlb.h"
+#include "../include/vmacache.h"
+#include "../include/swap.h"
+#include "../include/mmap_lock.h"
+#include "../include/maple_tree.h"
+#include "../include/rcupdate.h"
+#include "../include/sched.h"
+#include "../include/slab.h"
+#include "../include/mm.h"
+#include "../include/types.h"
+#include "../include/list.h"
+#include "../include/spinlock.h"
+
+/* External declarations */
+extern int printk(const char *fmt, ...);
+
+/*
+ * Lowest user mapping. The first PGD slot holds the mapping of the
+ * kernel image at its load address, so user mappings start above it.
+ */
+#define MMAP_MIN_ADDR   PGDIR_SIZE
+
+static struct kmem_cache *vm_area_cachep;
+
+void mmap_init(void)
+{
+    maple_tree_init();
+
+    vm_area_cachep = kmem_cache_create("vm_area_struct",
+                                       sizeof(struct vm_area_struct), 0,
+                                       SLAB_HWCACHE_ALIGN, NULL);
+    if (vm_area_cachep == NULL)
+        printk("Warning: vm_area_struct cache not created (no memory)\n");
+
+    pgtable_init();
+}
+
+static struct vm_area_struct *vm_area_alloc(struct mm_struct *mm)
+{
+    struct vm_area_struct *vma;
+
+    if (vm_area_cachep == NULL)
+        return NULL;
+
+    vma = kmem_cache_zalloc(vm_area_cachep, GFP_KERNEL);
+    if (vma == NULL)
+        return NULL;
+
+    vma->vm_mm = mm;
+    spin_lock_init(&vma->vm_lock);
+    vma->vm_lock_seq = -1;
+    vma->detached = true;
+    return vma;
+}
+
+static void vm_area_free_rcu(struct rcu_head *head)
+{
+    kmem_cache_free(vm_area_cachep,
+                    container_of(head, struct vm_area_struct, vm_rcu));
+}
+
+/* A fault under RCU may still be looking at it */
+static void vm_area_free(struct vm_area_struct *vma)
+{
+    call_rcu(&vma->vm_rcu, vm_area_free_rcu);
+}
+
+/* From the tree alone */
+static struct vm_area_struct *__find_vma(struct mm_struct *mm,
+                                         unsigned long addr)
+{
+    return mt_find(&mm->mm_mt, &addr, ULONG_MAX);
+}
+
+struct vm_area_struct *find_vma(struct mm_struct *mm, unsigned long addr)
+{
+    struct vm_area_struct *vma;
+
+    vma = vmacache_find(mm, addr);
+    if (vma)
+        return vma;
+
+    vma = __find_vma(mm, addr);
+    if (vma)
+        vmacache_update(addr, vma);
+    return vma;
+}
+
+struct vm_area_struct *vma_next(struct mm_struct *mm,
+                                struct vm_area_struct *vma)
+{
+    unsigned long index = vma->vm_end;
+
+    return mt_find(&mm->mm_mt, &index, ULONG_MAX);
+}
+
+struct vm_area_struct *lock_vma_under_rcu(struct mm_struct *mm,
+                                          unsigned long address)
+{
+    struct vm_area_struct *vma;
+
+    rcu_read_lock();
+
+    vma = vmacache_find(mm, address);
+    if (vma == NULL)
+        vma = mtree_load(&mm->mm_mt, address);
+    if (vma == NULL || !vma_start_read(vma))
+        goto fail;
+
+    /* Unmapped, or moved, before it was locked */
+    if (vma->detached || address < vma->vm_start || address >= vma->vm_end) {
+        vma_end_read(vma);
+        goto fail;
+    }
+
+    rcu_read_unlock();
+    vmacache_update(address, vma);
+    return vma;
+
+fail:
+    rcu_read_unlock();
+    return NULL;
+}
+
+static void update_highest_vm_end(struct mm_struct *mm)
+{
+    struct vm_area_struct *vma = mt_prev(&mm->mm_mt, ULONG_MAX);
+
+    mm->highest_vm_end = vma ? vma->vm_end : 0;
+}
+
+/* Insert a VMA that overlaps nothing */
+static int vma_link(struct mm_struct *mm, struct vm_area_struct *vma)
+{
+    int ret;
+
+    /* Faults wait until it is all set up */
+    vma_start_write(vma);
+    vma->detached = false;
+
+    ret = mtree_insert_range(&mm->mm_mt, vma->vm_start, vma->vm_end - 1, vma);
+    if (ret < 0) {
+        vma->detached = true;
+        return ret;
+    }
+
+    mm->map_count++;
+    update_highest_vm_end(mm);
+    return 0;
+}
+
+/*
+ * Cut vma at addr: new, allocated by the caller, takes the part above.
+ * Both ranges change in one write, so nothing changes if it fails.
+ */
+static int __split_vma(struct mm_struct *mm, struct vm_area_struct *vma,
+                       struct vm_area_struct *new, unsigned long addr)
+{
+    struct maple_tree *mt = &mm->mm_mt;
+    int ret;
+
+    vma_start_write(vma);
+    vma_start_write(new);
+
+    new->vm_start = addr;
+    new->vm_end = vma->vm_end;
+    new->vm_flags = vma->vm_flags;
+    new->detached = false;
+
+    mt_write_begin(mt);
+    ret = mtree_adjust(mt, vma->vm_start, vma->vm_start, addr - 1);
+    if (ret == 0)
+        ret = mtree_insert_range(mt, addr, new->vm_end - 1, new);
+    if (ret < 0) {
+        mt_write_abort(mt);
+        new->detached = true;
+        return ret;
+    }
+    vma->vm_end = addr;
+    mt_write_commit(mt);
+
+    mm->map_count++;
+    return 0;
+}
+
+static struct vm_area_struct *split_vma(struct mm_struct *mm,
+                                        struct vm_area_struct *vma,
+                                        unsigned long addr)
+{
+    struct vm_area_struct *new;
+
+    new = vm_area_alloc(mm);
+    if (new && __split_vma(mm, vma, new, addr) < 0) {
+        vm_area_free(new);
+        new = NULL;
+    }
+    return new;
+}
+
+/*
+ * Split the VMAs that start or end falls inside, so that [start, end)
+ * covers whole VMAs. Huge pages the edges fall inside are remapped with
+ * PTEs. A split left by a failure changes nothing anyone can see.
+ */
+static int split_vma_range(struct mm_struct *mm, unsigned long start,
+                           unsigned long end)
+{
+    struct vm_area_struct *vma;
+    int ret;
+
+    vma = find_vma(mm, start);
+    if (vma && vma->vm_start < start) {
+        ret = split_huge_pmd_address(vma, start);
+        if (ret < 0)
+            return ret;
+        if (split_vma(mm, vma, start) == NULL)
+            return -ENOMEM;
+    }
+
+    vma = find_vma(mm, end);
+    if (vma && vma->vm_start < end) {
+        ret = split_huge_pmd_address(vma, end);
+        if (ret < 0)
+            return ret;
+        if (split_vma(mm, vma, end) == NULL)
+            return -ENOMEM;
+    }
+
+    return 0;
+}
+
+/* No holes in [start, end), and pool pages only whole */
+static int check_vma_range(struct mm_struct *mm, unsigned long start,
+                           unsigned long end)
+{
+    struct vm_area_struct *vma;
+    unsigned long addr;
+
+    for (vma = find_vma(mm, start), addr = start; addr < end;
+         addr = vma->vm_end, vma = vma_next(mm, vma)) {
+        if (vma == NULL || vma->vm_start > addr)
+            return -ENOMEM;
+        if ((vma->vm_flags & VM_HUGETLB) &&
+            ((vma->vm_start < start && !IS_ALIGNED(start, HPAGE_SIZE)) ||
+             (vma->vm_end > end && !IS_ALIGNED(end, HPAGE_SIZE))))
+            return -EINVAL;
+    }
+
+    return 0;
+}
+
+/* Add npages mapped with vm_flags to the counts, or take them away */
+static void vm_stat_account(struct mm_struct *mm, unsigned long vm_flags,
+                            long npages)
+{
+    mm->total_vm += npages;
+    if (vm_flags & VM_LOCKED)
+        mm->locked_vm += npages;
+    if (vm_flags & VM_HUGETLB)
+        mm->pinned_vm += npages;
+}
+
+static inline long vma_pages(struct vm_area_struct *vma)
+{
+    return (vma->vm_end - vma->vm_start) >> PAGE_SHIFT;
+}
+
+static unsigned long calc_vm_prot_bits(unsigned long prot)
+{
+    unsigned long vm_flags = 0;
+
+    if (prot & PROT_READ)
+        vm_flags |= VM_READ;
+    if (prot & PROT_WRITE)
+        vm_flags |= VM_WRITE;
+    if (prot & PROT_EXEC)
+        vm_flags |= VM_EXEC;
+    return vm_flags;
+}
+
+/*
+ * Lowest free range of len bytes at an align boundary above mmap_base,
+ * if the hint is taken. The gaps recorded in the tree lead the search
+ * straight to it.
+ */
+static long get_unmapped_area(struct mm_struct *mm, unsigned long hint,
+                              unsigned long len, unsigned long align)
+{
+    struct vm_area_struct *vma;
+    unsigned long addr;
+
+    if (hint >= MMAP_MIN_ADDR && IS_ALIGNED(hint, align) &&
+        hint <= mm->task_size - len) {
+        vma = find_vma(mm, hint);
+        if (vma == NULL || vma->vm_start >= hint + len)
+            return hint;
+    }
+
+    if (mt_empty_area(&mm->mm_mt, MAX(mm->mmap_base, MMAP_MIN_ADDR),
+                      mm->task_size - 1, len, align, &addr) < 0)
+        return -ENOMEM;
+    return addr;
+}
+
+static int do_vm_munmap(struct mm_struct *mm, unsigned long start,
+                        unsigned long len);
+
+long vm_mmap(struct mm_struct *mm, unsigned long addr, unsigned long len,
+             unsigned long prot, unsigned long flags)
+{
+    unsigned long align = PAGE_SIZE;
+    unsigned long vm_flags;
+    struct vm_area_struct *vma;
+    struct mmu_gather tlb;
+    long ret;
+
+    if (!(flags & MAP_ANONYMOUS))
+        return -ENODEV;
+    if ((flags & (MAP_SHARED | MAP_PRIVATE)) == 0 ||
+        (flags & (MAP_SHARED | MAP_PRIVATE)) == (MAP_SHARED | MAP_PRIVATE))
+        return -EINVAL;
+    if (len == 0 || len > mm->task_size)
+        return -EINVAL;
+
+    len = ALIGN_UP(len, PAGE_SIZE);
+
+    vm_flags = calc_vm_prot_bits(prot);
+    if (flags & MAP_SHARED)
+        vm_flags |= VM_SHARED;
+    if (flags & MAP_LOCKED)
+        vm_flags |= VM_LOCKED;
+
+    if (flags & MAP_HUGETLB) {
+        len = ALIGN_UP(len, HPAGE_SIZE);
+        align = HPAGE_SIZE;
+        vm_flags |= VM_HUGETLB;
+        if (hugetlb_free_pages() < len / HPAGE_SIZE)
+            return -ENOMEM;
+    } else if (transparent_hugepage == THP_ALWAYS && len >= HPAGE_SIZE) {
+        /* So that the middle of the mapping can be mapped huge */
+        align = HPAGE_SIZE;
+    }
+
+    if (flags & MAP_FIXED) {
+        if (!IS_ALIGNED(addr, align) || addr < MMAP_MIN_ADDR ||
+            addr > mm->task_size - len)
+            return -EINVAL;
+    }
+
+    vma = vm_area_alloc(mm);
+    if (vma == NULL)
+        return -ENOMEM;
+
+    mmap_write_lock(mm);
+
+    if (mm->pgd == 0) {
+        ret = pgd_alloc(mm);
+        if (ret < 0)
+            goto out;
+    }
+
+    if (flags & MAP_FIXED) {
+        ret = do_vm_munmap(mm, addr, len);
+        if (ret < 0)
+            goto out;
+    } else {
+        ret = get_unmapped_area(mm, addr, len, align);
+        if (ret < 0)
+            goto out;
+        addr = ret;
+    }
+
+    vm_flags |= mm->def_flags;
+    vma->vm_start = addr;
+    vma->vm_end = addr + len;
+    vma->vm_flags = vm_flags;
+
+    /*
+     * Everything else waits for the first touch. Pool pages are taken
+     * now: there is no reservation to hold them for later faults. They
+     * go in before the VMA, which can then fail to go in the tree.
+     */
+    if (vm_flags & VM_HUGETLB) {
+        ret = populate_vma_range(vma, vma->vm_start, vma->vm_end);
+        if (ret < 0)
+            goto out_zap;
+    }
+
+    ret = vma_link(mm, vma);
+    if (ret < 0)
+        goto out_zap;
+
+    vm_stat_account(mm, vm_flags, len >> PAGE_SHIFT);
+
+    /* Best effort: whatever cannot be had now comes in on faults */
+    if (((flags & MAP_POPULATE) || (vm_flags & VM_LOCKED)) &&
+        !(vm_flags & VM_HUGETLB))
+        populate_vma_range(vma, vma->vm_start, vma->vm_end);
+
+    mmap_write_unlock(mm);
+    return addr;
+
+out_zap:
+    if (vm_flags & VM_HUGETLB) {
+        tlb_gather_mmu(&tlb, mm);
+        zap_page_range(&tlb, vma, vma->vm_start, vma->vm_end);
+        tlb_finish_mmu(&tlb);
+    }
+out:
+    mmap_write_unlock(mm);
+    vm_area_free(vma);
+    return ret;
+}
+
+/*
+ * Unmap [start, start + len) with mmap_lock held. Nothing is unmapped
+ * if an error is returned, though a VMA the range ends inside may have
+ * been split.
+ */
+static int do_vm_munmap(struct mm_struct *mm, unsigned long start,
+                        unsigned long len)
+{
+    struct maple_tree *mt = &mm->mm_mt;
+    struct vm_area_struct *vma, *next;
+    struct rcu_head *dead = NULL;
+    struct mmu_gather tlb;
+    unsigned long end;
+    int ret;
+
+    if (!IS_ALIGNED(start, PAGE_SIZE) || len == 0 || start > mm->task_size ||
+        len > mm->task_size - start)
+        return -EINVAL;
+
+    len = ALIGN_UP(len, PAGE_SIZE);
+    end = start + len;
+
+    vma = find_vma(mm, start);
+    if (vma == NULL || vma->vm_start >= end)
+        return 0;
+
+    /* Pool pages can only be unmapped whole */
+    for (next = vma; next && next->vm_start < end;
+         next = vma_next(mm, next)) {
+        if (!(next->vm_flags & VM_HUGETLB))
+            continue;
+        if ((next->vm_start < start && !IS_ALIGNED(start, HPAGE_SIZE)) ||
+            (next->vm_end > end && !IS_ALIGNED(end, HPAGE_SIZE)))
+            return -EINVAL;
+    }
+
+    ret = split_vma_range(mm, start, end);
+    if (ret < 0)
+        return ret;
+    vma = find_vma(mm, start);
+
+    /* Take them from faults, then out of the tree in one write */
+    for (next = vma; next && next->vm_start < end; next = vma_next(mm, next))
+        vma_start_write(next);
+
+    mt_write_begin(mt);
+    for (next = vma; next && next->vm_start < end;
+         next = vma_next(mm, next)) {
+        if (mtree_erase(mt, next->vm_start) == NULL) {
+            mt_write_abort(mt);
+            return -ENOMEM;
+        }
+    }
+
+    /*
+     * Readers see the old tree until the commit, but cannot lock these.
+     * Pages are freed after the flush, the VMAs after a grace period;
+     * until then they are chained through vm_rcu.
+     */
+    tlb_gather_mmu(&tlb, mm);
+    while (vma && vma->vm_start < end) {
+        next = vma_next(mm, vma);
+        zap_page_range(&tlb, vma, vma->vm_start, vma->vm_end);
+        vm_stat_account(mm, vma->vm_flags, -vma_pages(vma));
+        mm->map_count--;
+        vma->detached = true;
+        vma->vm_rcu.next = dead;
+        dead = &vma->vm_rcu;
+        vma = next;
+    }
+    mt_write_commit(mt);
+    vmacache_invalidate(mm);
+    tlb_finish_mmu(&tlb);
+
+    while (dead) {
+        vma = container_of(dead, struct vm_area_struct, vm_rcu);
+        dead = dead->next;
+        vm_area_free(vma);
+    }
+
+    update_highest_vm_end(mm);
+    return 0;
+}
+
+int vm_munmap(struct mm_struct *mm, unsigned long addr, unsigned long len)
+{
+    int ret;
+
+    mmap_write_lock(mm);
+    ret = do_vm_munmap(mm, addr, len);
+    mmap_write_unlock(mm);
+
+    return ret;
+}
+
+/*
+ * Change the protection of [start, start + len), which must be mapped
+ * throughout. VMAs are split where the range ends inside them.
+ */
+int vm_mprotect(struct mm_struct *mm, unsigned long start, unsigned long len,
+                unsigned long prot)
+{
+    struct vm_area_struct *vma;
+    struct mmu_gather tlb;
+    unsigned long end;
+    int ret = 0;
+
+    if (!IS_ALIGNED(start, PAGE_SIZE) || start > mm->task_size ||
+        (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)))
+        return -EINVAL;
+
+    len = ALIGN_UP(len, PAGE_SIZE);
+    if (len > mm->task_size - start)
+        return -ENOMEM;
+    if (len == 0)
+        return 0;
+    end = start + len;
+
+    mmap_write_lock(mm);
+
+    ret = check_vma_range(mm, start, end);
+    if (ret == 0)
+        ret = split_vma_range(mm, start, end);
+    if (ret < 0)
+        goto out;
+
+    tlb_gather_mmu(&tlb, mm);
+    for (vma = find_vma(mm, start); vma && vma->vm_start < end;
+         vma = vma_next(mm, vma)) {
+        vma_start_write(vma);
+        vma->vm_flags = (vma->vm_flags & ~VM_ACCESS_FLAGS) |
+                        calc_vm_prot_bits(prot);
+        change_protection(&tlb, vma, vma->vm_start, vma->vm_end);
+    }
+    tlb_finish_mmu(&tlb);
+
+    /* Locked memory made writable takes no copy-on-write faults later */
+    if (prot & PROT_WRITE) {
+        for (vma = find_vma(mm, start); vma && vma->vm_start < end;
+             vma = vma_next(mm, vma))
+            if (vma->vm_flags & VM_LOCKED)
+                populate_vma_range(vma, vma->vm_start, vma->vm_end);
+    }
+
+out:
+    mmap_write_unlock(mm);
+    return ret;
+}
+
+/* mm_populate with mmap_lock held */
+static int __mm_populate(struct mm_struct *mm, unsigned long start,
+                         unsigned long end)
+{
+    struct vm_area_struct *vma;
+    int ret;
+
+    for (vma = find_vma(mm, start); vma && vma->vm_start < end;
+         vma = vma_next(mm, vma)) {
+        ret = populate_vma_range(vma, MAX(vma->vm_start, start),
+                                 MIN(vma->vm_end, end));
+        if (ret < 0)
+            return ret;
+    }
+
+    return 0;
+}
+
+int mm_populate(struct mm_struct *mm, unsigned long start, unsigned long len)
+{
+    int ret;
+
+    mmap_write_lock(mm);
+    ret = __mm_populate(mm, start, start + len);
+    mmap_write_unlock(mm);
+
+    return ret;
+}
+
+/* Drop the pages of [start, end), which must be mapped throughout */
+static int madvise_dontneed(struct mm_struct *mm, unsigned long start,
+                            unsigned long end)
+{
+    struct vm_area_struct *vma;
+    struct mmu_gather tlb;
+    int ret;
+
+    /* Locked pages stay; pool pages are only ever unmapped whole */
+    for (vma = find_vma(mm, start); vma && vma->vm_start < end;
+         vma = vma_next(mm, vma))
+        if (vma->vm_flags & (VM_LOCKED | VM_HUGETLB))
+            return -EINVAL;
+
+    vma = find_vma(mm, start);
+    ret = split_huge_pmd_address(vma, start);
+    if (ret == 0)
+        ret = split_huge_pmd_address(find_vma(mm, end - 1), end);
+    if (ret < 0)
+        return ret;
+
+    tlb_gather_mmu(&tlb, mm);
+    for (; vma && vma->vm_start < end; vma = vma_next(mm, vma)) {
+        vma_start_write(vma);
+        zap_page_range(&tlb, vma, MAX(vma->vm_start, start),
+                       MIN(vma->vm_end, end));
+    }
+    tlb_finish_mmu(&tlb);
+
+    return 0;
+}
+
+/*
+ * Advice on how [start, start + len), which must be mapped throughout,
+ * will be used. Sequential access makes faults map the pages after
+ * theirs too; WILLNEED populates the range now, and DONTNEED frees its
+ * pages, so that it reads as zeroes again.
+ */
+int vm_madvise(struct mm_struct *mm, unsigned long start, unsigned long len,
+               int advice)
+{
+    struct vm_area_struct *vma;
+    unsigned long end, set;
+    int ret;
+
+    if (!IS_ALIGNED(start, PAGE_SIZE) || start > mm->task_size)
+        return -EINVAL;
+
+    len = ALIGN_UP(len, PAGE_SIZE);
+    if (len > mm->task_size - start)
+        return -EINVAL;
+    if (len == 0)
+        return 0;
+    end = start + len;
+
+    switch (advice) {
+    case MADV_NORMAL:
+        set = 0;
+        break;
+    case MADV_RANDOM:
+        set = VM_RAND_READ;
+        break;
+    case MADV_SEQUENTIAL:
+        set = VM_SEQ_READ;
+        break;
+    case MADV_WILLNEED:
+    case MADV_DONTNEED:
+        set = 0;
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    mmap_write_lock(mm);
+
+    ret = check_vma_range(mm, start, end);
+    if (ret < 0)
+        goto out;
+
+    switch (advice) {
+    case MADV_WILLNEED:
+        /* Only advice: what cannot be had now comes in on faults */
+        __mm_populate(mm, start, end);
+        break;
+    case MADV_DONTNEED:
+        ret = madvise_dontneed(mm, start, end);
+        break;
+    default:
+        ret = split_vma_range(mm, start, end);
+        if (ret < 0)
+            break;
+        for (vma = find_vma(mm, start); vma && vma->vm_start < end;
+             vma = vma_next(mm, vma)) {
+            vma_start_write(vma);
+            vma->vm_flags = (vma->vm_flags & ~(VM_SEQ_READ | VM_RAND_READ)) |
+                            set;
+        }
+        break;
+    }
+
+out:
+    mmap_write_unlock(mm);
+    return ret;
+}
+
+static void mlock_fixup(struct mm_struct *mm, struct vm_area_struct *vma,
+                        bool lock)
+{
+    if (!!(vma->vm_flags & VM_LOCKED) == lock)
+        return;
+
+    vma_start_write(vma);
+    if (lock) {
+        vma->vm_flags |= VM_LOCKED;
+        mm->locked_vm += vma_pages(vma);
+    } else {
+        vma->vm_flags &= ~VM_LOCKED;
+        mm->locked_vm -= vma_pages(vma);
+        munlock_vma_pages_range(vma, vma->vm_start, vma->vm_end);
+    }
+}
+
+/*
+ * Lock or unlock [start, start + len), which must be mapped throughout.
+ * Locking faults it all in; -ENOMEM if that fails, with the range left
+ * locked and whatever could be had in.
+ */
+static int apply_mlock(struct mm_struct *mm, unsigned long start,
+                       unsigned long len, bool lock)
+{
+    struct vm_area_struct *vma;
+    unsigned long end;
+    int ret;
+
+    len = ALIGN_UP(len + (start & ~PAGE_MASK), PAGE_SIZE);
+    start &= PAGE_MASK;
+    if (start > mm->task_size || len > mm->task_size - start)
+        return -ENOMEM;
+    if (len == 0)
+        return 0;
+    end = start + len;
+
+    mmap_write_lock(mm);
+
+    ret = check_vma_range(mm, start, end);
+    if (ret == 0)
+        ret = split_vma_range(mm, start, end);
+    if (ret < 0)
+        goto out;
+
+    for (vma = find_vma(mm, start); vma && vma->vm_start < end;
+         vma = vma_next(mm, vma))
+        mlock_fixup(mm, vma, lock);
+
+    if (lock && __mm_populate(mm, start, end) < 0)
+        ret = -ENOMEM;
+
+out:
+    mmap_write_unlock(mm);
+    return ret;
+}
+
+int vm_mlock(struct mm_struct *mm, unsigned long start, unsigned long len)
+{
+    return apply_mlock(mm, start, len, true);
+}
+
+int vm_munlock(struct mm_struct *mm, unsigned long start, unsigned long len)
+{
+    return apply_mlock(mm, start, len, false);
+}
+
+/*
+ * MCL_CURRENT locks everything mapped now, MCL_FUTURE everything mapped
+ * from now on
+ */
+int vm_mlockall(struct mm_struct *mm, int flags)
+{
+    struct vm_area_struct *vma;
+    int ret = 0;
+
+    if (flags == 0 || (flags & ~(MCL_CURRENT | MCL_FUTURE)))
+        return -EINVAL;
+
+    mmap_write_lock(mm);
+
+    mm->def_flags = (flags & MCL_FUTURE) ? VM_LOCKED : 0;
+
+    if (flags & MCL_CURRENT) {
+        for_each_vma(mm, vma)
+            mlock_fixup(mm, vma, true);
+        if (__mm_populate(mm, 0, mm->task_size) < 0)
+            ret = -ENOMEM;
+    }
+
+    mmap_write_unlock(mm);
+    return ret;
+}
+
+int vm_munlockall(struct mm_struct *mm)
+{
+    struct vm_area_struct *vma;
+
+    mmap_write_lock(mm);
+
+    mm->def_flags = 0;
+    for_each_vma(mm, vma)
+        mlock_fixup(mm, vma, false);
+
+    mmap_write_unlock(mm);
+    return 0;
+}
+
+/*
+ * Move vma, a whole VMA, to [new_addr, new_addr + new_len), which is
+ * free and no shorter. Its page table entries move with it; whatever it
+ * grows by is left to faults. On failure nothing has moved.
+ */
+static long move_vma(struct mm_struct *mm, struct vm_area_struct *vma,
+                     unsigned long new_addr, unsigned long new_len)
+{
+    unsigned long old_addr = vma->vm_start;
+    unsigned long old_len = vma->vm_end - vma->vm_start;
+    struct maple_tree *mt = &mm->mm_mt;
+    struct vm_area_struct *new_vma;
+    struct mmu_gather tlb;
+    unsigned long moved;
+    int ret = 0;
+
+    new_vma = vm_area_alloc(mm);
+    if (new_vma == NULL)
+        return -ENOMEM;
+
+    new_vma->vm_start = new_addr;
+    new_vma->vm_end = new_addr + new_len;
+    new_vma->vm_flags = vma->vm_flags;
+    new_vma->vm_pgoff = vma->vm_pgoff;
+
+    vma_start_write(vma);
+    vma_start_write(new_vma);
+    new_vma->detached = false;
+
+    /* Readers see the old tree until the entries have moved */
+    mt_write_begin(mt);
+    if (mtree_erase(mt, old_addr) == NULL)
+        ret = -ENOMEM;
+    if (ret == 0)
+        ret = mtree_insert_range(mt, new_addr, new_vma->vm_end - 1, new_vma);
+    if (ret == 0) {
+        moved = move_page_tables(vma, old_addr, new_addr, old_len);
+        if (moved < old_len) {
+            move_page_tables(vma, new_addr, old_addr, moved);
+            ret = -ENOMEM;
+        }
+    }
+    if (ret < 0) {
+        mt_write_abort(mt);
+        new_vma->detached = true;
+        vm_area_free(new_vma);
+        return ret;
+    }
+    vma->detached = true;
+    mt_write_commit(mt);
+    vmacache_invalidate(mm);
+
+    /* Only page tables emptied by the move are left to free */
+    tlb_gather_mmu(&tlb, mm);
+    zap_page_range(&tlb, vma, old_addr, old_addr + old_len);
+    tlb_finish_mmu(&tlb);
+
+    vm_stat_account(mm, vma->vm_flags, (long)(new_len - old_len) >> PAGE_SHIFT);
+    update_highest_vm_end(mm);
+    vm_area_free(vma);
+
+    if (new_vma->vm_flags & VM_LOCKED)
+        populate_vma_range(new_vma, new_addr + old_len, new_addr + new_len);
+
+    return new_addr;
+}
+
+/*
+ * Where to move a mapping at old_addr that will be len bytes: at the
+ * same offset into a PMD, so that whole page tables can move
+ */
+static long mremap_area(struct mm_struct *mm, unsigned long old_addr,
+                        unsigned long len)
+{
+    unsigned long offset = old_addr & ~PMD_MASK;
+    long addr;
+
+    if (len >= PMD_SIZE) {
+        addr = get_unmapped_area(mm, 0, len + offset, PMD_SIZE);
+        if (addr >= 0)
+            return addr + offset;
+    }
+
+    return get_unmapped_area(mm, 0, len, PAGE_SIZE);
+}
+
+/*
+ * Resize [addr, addr + old_len), which must lie within one VMA, to
+ * new_len. Shrinking unmaps the tail. Growing extends the VMA in place
+ * if the range ends it and nothing is mapped after; otherwise, with
+ * MREMAP_MAYMOVE, the range moves to where it fits, or to new_addr with
+ * MREMAP_FIXED, taking its page table entries: the pages are not copied.
+ * Returns the new address or -errno.
+ */
+long vm_mremap(struct mm_struct *mm, unsigned long addr, unsigned long old_len,
+               unsigned long new_len, unsigned long flags,
+               unsigned long new_addr)
+{
+    struct vm_area_struct *vma, *next;
+    unsigned long end;
+    long ret;
+
+    if (flags & ~(MREMAP_MAYMOVE | MREMAP_FIXED))
+        return -EINVAL;
+    if ((flags & MREMAP_FIXED) && !(flags & MREMAP_MAYMOVE))
+        return -EINVAL;
+    if (!IS_ALIGNED(addr, PAGE_SIZE))
+        return -EINVAL;
+
+    old_len = ALIGN_UP(old_len, PAGE_SIZE);
+    new_len = ALIGN_UP(new_len, PAGE_SIZE);
+    if (old_len == 0 || new_len == 0 || old_len > mm->task_size ||
+        new_len > mm->task_size)
+        return -EINVAL;
+
+    if (flags & MREMAP_FIXED) {
+        if (!IS_ALIGNED(new_addr, PAGE_SIZE) || new_addr < MMAP_MIN_ADDR ||
+            new_addr > mm->task_size - new_len)
+            return -EINVAL;
+        /* The old and new ranges may not overlap */
+        if (new_addr < addr + old_len && addr < new_addr + new_len)
+            return -EINVAL;
+    }
+
+    mmap_write_lock(mm);
+
+    vma = find_vma(mm, addr);
+    if (vma == NULL || vma->vm_start > addr ||
+        old_len > vma->vm_end - addr) {
+        ret = -EFAULT;
+        goto out;
+    }
+
+    /* Pool pages are only ever mapped and unmapped whole */
+    if (vma->vm_flags & VM_HUGETLB) {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    if (flags & MREMAP_FIXED) {
+        ret = do_vm_munmap(mm, new_addr, new_len);
+        if (ret == 0 && new_len < old_len) {
+            ret = do_vm_munmap(mm, addr + new_len, old_len - new_len);
+            old_len = new_len;
+        }
+        if (ret < 0)
+            goto out;
+        goto move;
+    }
+
+    /* Shrinking always happens in place */
+    if (new_len <= old_len) {
+        ret = addr;
+        if (new_len < old_len) {
+            ret = do_vm_munmap(mm, addr + new_len, old_len - new_len);
+            if (ret == 0)
+                ret = addr;
+        }
+        goto out;
+    }
+
+    /* Growing in place, over free space after the VMA */
+    end = addr + new_len;
+    next = vma_next(mm, vma);
+    if (addr + old_len == vma->vm_end && end <= mm->task_size &&
+        (next == NULL || next->vm_start >= end)) {
+        vma_start_write(vma);
+        ret = mtree_adjust(&mm->mm_mt, vma->vm_start, vma->vm_start, end - 1);
+        if (ret < 0)
+            goto out;
+        vma->vm_end = end;
+        vm_stat_account(mm, vma->vm_flags, (new_len - old_len) >> PAGE_SHIFT);
+        update_highest_vm_end(mm);
+        if (vma->vm_flags & VM_LOCKED)
+            populate_vma_range(vma, addr + old_len, end);
+        ret = addr;
+        goto out;
+    }
+
+    if (!(flags & MREMAP_MAYMOVE)) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    ret = mremap_area(mm, addr, new_len);
+    if (ret < 0)
+        goto out;
+    new_addr = ret;
+
+move:
+    /* The range moves as a VMA of its own */
+    ret = split_vma_range(mm, addr, addr + old_len);
+    if (ret < 0)
+        goto out;
+    ret = move_vma(mm, find_vma(mm, addr), new_addr, new_len);
+
+out:
+    mmap_write_unlock(mm);
+    return ret;
+}
+
+int dup_mmap(struct mm_struct *mm, struct mm_struct *oldmm)
+{
+    struct vm_area_struct *vma, *new;
+    struct mmu_gather tlb;
+    int ret = 0;
+
+    mmap_write_lock(oldmm);
+    mmap_write_lock(mm);
+
+    if (oldmm->pgd == 0)
+        goto out;
+
+    ret = pgd_alloc(mm);
+    if (ret < 0)
+        goto out;
+
+    /* The parent's write-protected entries are flushed together */
+    tlb_gather_mmu(&tlb, oldmm);
+
+    /* The child's tree is built in one write */
+    mt_write_begin(&mm->mm_mt);
+
+    for_each_vma(oldmm, vma) {
+        /* No faults may make entries writable while they are copied */
+        vma_start_write(vma);
+
+        new = vm_area_alloc(mm);
+        if (new == NULL) {
+            ret = -ENOMEM;
+            break;
+        }
+
+        new->vm_start = vma->vm_start;
+        new->vm_end = vma->vm_end;
+        new->vm_flags = vma->vm_flags & ~VM_LOCKED;
+        new->vm_pgoff = vma->vm_pgoff;
+        ret = vma_link(mm, new);
+        if (ret < 0) {
+            vm_area_free(new);
+            break;
+        }
+
+        ret = copy_page_range(&tlb, new, vma);
+        if (ret < 0)
+            break;
+    }
+
+    /* What was copied before a failure is torn down with the child */
+    mt_write_commit(&mm->mm_mt);
+    update_highest_vm_end(mm);
+    tlb_finish_mmu(&tlb);
+
+out:
+    mmap_write_unlock(mm);
+    mmap_write_unlock(oldmm);
+    return ret;
+}
+
+void exit_mmap(struct mm_struct *mm)
+{
+    struct vm_area_struct *vma, *next;
+    struct mmu_gather tlb;
+
+    tlb_gather_mmu(&tlb, mm);
+    for_each_vma(mm, vma)
+        zap_page_range(&tlb, vma, vma->vm_start, vma->vm_end);
+    tlb_finish_mmu(&tlb);
+
+    /* Freeing may end a grace period: step off each VMA first */
+    for (vma = __find_vma(mm, 0); vma; vma = next) {
+        next = vma_next(mm, vma);
+        vm_area_free(vma);
+    }
+    mtree_destroy(&mm->mm_mt);
+
+    pgd_free(mm);
+    vmacache_invalidate(mm);
+
+    mm->map_count = 0;
+    mm->total_vm = 0;
+    mm->locked_vm = 0;
+    mm->pinned_vm = 0;
+    mm->highest_vm_end = 0;
+}
+
+/*
+ * VMA lookup benchmark
+ *
+ * Map nr small VMAs and look up each page of each one in turn, as a run
+ * of faults over them would, through the cache and from the maple tree
+ * alone.
+ */
+#define VMA_LOOKUP_PAGES    16
+
+void bench_vma_lookup(unsigned long nr)
+{
+    unsigned long len = VMA_LOOKUP_PAGES * PAGE_SIZE;
+    unsigned long i, a, lookups = 0, wrong = 0;
+    unsigned long calls, hits, c0, h0;
+    struct vm_area_struct *vma;
+    struct mm_struct *mm;
+    u64 start, cached, tree;
+    long *addrs;
+
+    if (current == NULL || current->mm == NULL) {
+        printk("bench vmacache: no address space\n");
+        return;
+    }
+    mm = current->mm;
+
+    addrs = kmalloc(nr * sizeof(*addrs), GFP_KERNEL);
+    if (addrs == NULL) {
+        printk("bench vmacache: no memory\n");
+        return;
+    }
+
+    for (i = 0; i < nr; i++) {
+        addrs[i] = vm_mmap(mm, 0, len, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS);
+        if (addrs[i] < 0) {
+            printk("bench vmacache: mmap failed after %lu VMAs\n", i);
+            nr = i;
+            goto out;
+        }
+    }
+
+    mmap_write_lock(mm);
+
+    start = rdtsc();
+    for (i = 0; i < nr; i++) {
+        for (a = addrs[i]; a < addrs[i] + len; a += PAGE_SIZE) {
+            vma = __find_vma(mm, a);
+            if (vma == NULL || vma->vm_start != (unsigned long)addrs[i])
+                wrong++;
+            lookups++;
+        }
+    }
+    tree = rdtsc() - start;
+
+    vmacache_stats(&c0, &h0);
+    start = rdtsc();
+    for (i = 0; i < nr; i++) {
+        for (a = addrs[i]; a < addrs[i] + len; a += PAGE_SIZE) {
+            vma = find_vma(mm, a);
+            if (vma == NULL || vma->vm_start != (unsigned long)addrs[i])
+                wrong++;
+        }
+    }
+    cached = rdtsc() - start;
+    vmacache_stats(&calls, &hits);
+
+    mmap_write_unlock(mm);
+
+    calls -= c0;
+    hits -= h0;
+    printk("VMA lookup over %u VMAs, %lu lookups:\n", mm->map_count, lookups);
+    printk("  tree:      %lu cycles each\n", (unsigned long)(tree / lookups));
+    printk("  cached:    %lu cycles each, %lu of %lu hits (%lu%%)\n",
+           (unsigned long)(cached / lookups), hits, calls,
+           calls ? hits * 100 / calls : 0);
+    if (wrong)
+        printk("  %lu lookups found the wrong VMA\n", wrong);
+
+out:
+    for (i = 0; i < nr; i++)
+        vm_munmap(mm, addrs[i], len);
+    kfree(addrs);
+}
+
+/*
+ * mremap benchmark
+ *
+ * Grow a buffer from 4KB to max_mb by doubling it and writing the new
+ * half, as realloc would: with mremap, in place or by moving page
+ * tables, against mapping the new size, copying and unmapping the old,
+ * whose copy also faults in its destination. In a second mremap run a
+ * page is mapped after the buffer before each step, so that every step
+ * has to move it. 4KB pages throughout.
+ */
+#define MREMAP_BENCH_STEPS  32
+
+enum {
+    GROW_MREMAP,
+    GROW_MREMAP_MOVE,
+    GROW_COPY,
+};
+
+/* Copy len bytes from src to dst in mm, through the direct map */
+static void copy_user_pages(struct mm_struct *mm, unsigned long dst,
+                            unsigned long src, unsigned long len)
+{
+    unsigned long a;
+    pte_t *from, *to;
+
+    for (a = 0; a < len; a += PAGE_SIZE) {
+        from = walk_pte(mm, src + a, false);
+        to = walk_pte(mm, dst + a, false);
+        if (from && to && entry_present(*from) && entry_present(*to))
+            copy_page(page_to_virt(entry_page(*to)),
+                      page_to_virt(entry_page(*from)));
+    }
+}
+
+/* One run up to size; cycles spent resizing, or 0 if it failed */
+static u64 bench_grow(struct mm_struct *mm, unsigned long size, int how,
+                      unsigned long *moves)
+{
+    long guards[MREMAP_BENCH_STEPS];
+    unsigned long len, i, nr_guards = 0;
+    u64 start, cycles = 0;
+    long addr, new;
+
+    *moves = 0;
+    addr = vm_mmap(mm, 0, PAGE_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS);
+    if (addr < 0)
+        return 0;
+    touch_user_range(current, addr, PAGE_SIZE, true);
+
+    for (len = PAGE_SIZE; len < size; len *= 2) {
+        if (how == GROW_MREMAP_MOVE && nr_guards < MREMAP_BENCH_STEPS) {
+            new = vm_mmap(mm, addr + len, PAGE_SIZE, PROT_READ,
+                          MAP_PRIVATE | MAP_ANONYMOUS);
+            if (new >= 0)
+                guards[nr_guards++] = new;
+        }
+
+        start = rdtsc();
+        if (how == GROW_COPY) {
+            new = vm_mmap(mm, 0, 2 * len, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS);
+            if (new >= 0) {
+                touch_user_range(current, new, len, true);
+                copy_user_pages(mm, new, addr, len);
+                vm_munmap(mm, addr, len);
+            }
+        } else {
+            new = vm_mremap(mm, addr, len, 2 * len, MREMAP_MAYMOVE, 0);
+        }
+        cycles += rdtsc() - start;
+
+        if (new < 0) {
+            printk("  resize to %lu KB failed (%ld)\n", (2 * len) >> 10, new);
+            cycles = 0;
+            break;
+        }
+        if (new != addr)
+            (*moves)++;
+        addr = new;
+
+        touch_user_range(current, addr + len, len, true);
+    }
+
+    vm_munmap(mm, addr, len);
+    for (i = 0; i < nr_guards; i++)
+        vm_munmap(mm, guards[i], PAGE_SIZE);
+    return cycles;
+}
+
+void bench_mremap(unsigned long max_mb)
+{
+    int saved_thp = transparent_hugepage;
+    unsigned long size, cap, steps, moves;
+    struct mm_struct *mm;
+    u64 cycles;
+
+    if (current == NULL || current->mm == NULL) {
+        printk("bench mremap: no address space\n");
+        return;
+    }
+    mm = current->mm;
+
+    /* Copying needs the old buffer and the new one at once */
+    cap = (nr_free_pages() / 2) << PAGE_SHIFT;
+    for (size = PAGE_SIZE, steps = 0;
+         size * 2 <= (max_mb << 20) && size * 2 <= cap; size *= 2)
+        steps++;
+
+    printk("Growing a buffer from 4 KB to %lu KB, %lu doublings:\n",
+           size >> 10, steps);
+    if (size < (max_mb << 20))
+        printk("  (%lu MB asked for; limited by free memory)\n", max_mb);
+
+    transparent_hugepage = THP_NEVER;
+
+    cycles = bench_grow(mm, size, GROW_MREMAP, &moves);
+    printk("  mremap:             %lu us resizing, %lu moved\n",
+           (unsigned long)tsc_to_us(cycles), moves);
+
+    cycles = bench_grow(mm, size, GROW_MREMAP_MOVE, &moves);
+    printk("  mremap, blocked:    %lu us resizing, %lu moved\n",
+           (unsigned long)tsc_to_us(cycles), moves);
+
+    cycles = bench_grow(mm, size, GROW_COPY, &moves);
+    printk("  mmap+copy+munmap:   %lu us resizing\n",
+           (unsigned long)tsc_to_us(cycles));
+
+    transparent_hugepage = saved_thp;
+}
+
+/*
+ * System call entry points, on the current address space. Only
+ * anonymous memory can be mapped: there are no files to map yet.
+ */
+long do_mmap(unsigned long addr, unsigned long len, unsigned long prot,
+             unsigned long flags, unsigned long fd, unsigned long off)
+{
+    (void)fd;
+    (void)off;
+
+    if (current == NULL || current->mm == NULL)
+        return -EINVAL;
+
+    return vm_mmap(current->mm, addr, len, prot, flags);
+}
+
+long do_munmap(unsigned long addr, size_t len)
+{
+    if (current == NULL || current->mm == NULL)
+        return -EINVAL;
+
+    return vm_munmap(current->mm, addr, len);
+}
+
+long do_mremap(unsigned long addr, size_t old_len, size_t new_len,
+               unsigned long flags, unsigned long new_addr)
+{
+    if (current == NULL || current->mm == NULL)
+        return -EINVAL;
+
+    return vm_mremap(current->mm, addr, old_len, new_len, flags, new_addr);
+}
+
+long do_mprotect(unsigned long start, size_t len, unsigned long prot)
+{
+    if (current == NULL || current->mm == NULL)
+        return -EINVAL;
+
+    return vm_mprotect(current->mm, start, len, prot);
+}
+
+long do_madvise(unsigned long start, size_t len, int advice)
+{
+    if (current == NULL || current->mm == NULL)
+        return -EINVAL;
+
+    return vm_madvise(current->mm, start, len, advice);
+}
+
+long do_mlock(unsigned long start, size_t len)
+{
+    if (current == NULL || current->mm == NULL)
+        return -EINVAL;
+
+    return vm_mlock(current->mm, start, len);
+}
+
+long do_munlock(unsigned long start, size_t len)
+{
+    if (current == NULL || current->mm == NULL)
+        return -EINVAL;
+
+    return vm_munlock(current->mm, start, len);
+}
+
+long do_mlockall(int flags)
+{
+    if (current == NULL || current->mm == NULL)
+        return -EINVAL;
+
+    return vm_mlockall(current->mm, flags);
+}
+
+long do_munlockall(void)
+{
+    if (current == NULL || current->mm == NULL)
+        return -EINVAL;
+
+    return vm_munlockall(current->mm);
+}
+
+/*
+ * Move the program break. Returns the new break, or the old one if it
+ * cannot move. The heap is one VMA from start_brk up; with no program
+ * loader to place it after the data, it starts at the bottom of user
+ * space, well below mmap_base.
+ */
+long do_brk(unsigned long brk)
+{
+    struct mm_struct *mm;
+    struct vm_area_struct *vma, *new;
+    unsigned long oldbrk, newbrk, vm_flags;
+    long ret;
+
+    if (current == NULL || current->mm == NULL)
+        return -EINVAL;
+    mm = current->mm;
+
+    new = vm_area_alloc(mm);
+
+    mmap_write_lock(mm);
+
+    if (mm->start_brk == 0)
+        mm->start_brk = mm->brk = MMAP_MIN_ADDR;
+
+    if (brk < mm->start_brk || brk > mm->task_size)
+        goto out;
+
+    oldbrk = ALIGN_UP(mm->brk, PAGE_SIZE);
+    newbrk = ALIGN_UP(brk, PAGE_SIZE);
+
+    if (newbrk <= oldbrk) {
+        if (newbrk == oldbrk || do_vm_munmap(mm, newbrk, oldbrk - newbrk) == 0)
+            mm->brk = brk;
+        goto out;
+    }
+
+    /* Growing: the heap may not run into another mapping */
+    vma = find_vma(mm, oldbrk);
+    if (vma && vma->vm_start < newbrk)
+        goto out;
+
+    if (mm->pgd == 0 && pgd_alloc(mm) < 0)
+        goto out;
+
+    vm_flags = VM_READ | VM_WRITE | mm->def_flags;
+    vma = oldbrk > mm->start_brk ? find_vma(mm, oldbrk - 1) : NULL;
+    if (vma && vma->vm_end == oldbrk && vma->vm_flags == vm_flags) {
+        vma_start_write(vma);
+        if (mtree_adjust(&mm->mm_mt, vma->vm_start, vma->vm_start,
+                         newbrk - 1) < 0)
+            goto out;
+        vma->vm_end = newbrk;
+        update_highest_vm_end(mm);
+    } else if (new) {
+        new->vm_start = oldbrk;
+        new->vm_end = newbrk;
+        new->vm_flags = vm_flags;
+        if (vma_link(mm, new) < 0)
+            goto out;
+        vma = new;
+        new = NULL;
+    } else {
+        goto out;
+    }
+
+    vm_stat_account(mm, vm_flags, (newbrk - oldbrk) >> PAGE_SHIFT);
+    mm->brk = brk;
+
+    if (vm_flags & VM_LOCKED)
+        populate_vma_range(vma, oldbrk, newbrk);
+
+out:
+    ret = mm->brk;
+    mmap_write_unlock(mm);
+    if (new)
+        vm_area_free(new);
+    return ret;
+}
@@ -0,0 +1,800 @@
+/*
+ * MicroKernel Slab Allocator
+ *
+ * A SLUB-style object allocator. Objects of one size are carved out of
+ * buddy pages tagged PG_slab. Each CPU allocates from its own frozen
+ * slab through a private freelist without taking a lock; other slabs
+ * with free objects wait on the cache's partial list.
+ */
+
+#include "../include/slab.h"
+#include "../include/mm.h"
+#include "../include/types.h"
+#include "../include/list.h"
+#include "../include/spinlock.h"
+
+/* External declarations */
+extern int printk(const char *fmt, ...);
+extern void panic(const char *fmt, ...);
+
+/* All caches, for slabinfo and shrinking */
+static LIST_HEAD(slab_caches);
+static spinlock_t slab_caches_lock = SPIN_LOCK_INIT;
+
+/* Caches by id, for slab pages to find theirs */
+static struct kmem_cache *slab_cache_ids[SLAB_MAX_CACHES];
+
+/* Cache of kmem_cache descriptors, set up statically at boot */
+static struct kmem_cache kmem_cache_boot;
+
+/* kmalloc size classes: powers of two plus 96 and 192 */
+static const unsigned int kmalloc_sizes[] = {
+    8, 16, 32, 64, 96, 128, 192, 256, 512, 1024, 2048, 4096, 8192
+};
+
+static const char *const kmalloc_names[] = {
+    "kmalloc-8", "kmalloc-16", "kmalloc-32", "kmalloc-64",
+    "kmalloc-96", "kmalloc-128", "kmalloc-192", "kmalloc-256",
+    "kmalloc-512", "kmalloc-1k", "kmalloc-2k", "kmalloc-4k",
+    "kmalloc-8k"
+};
+
+#define NR_KMALLOC_CACHES   ARRAY_SIZE(kmalloc_sizes)
+#define KMALLOC_SMALL_MAX   192
+
+static struct kmem_cache kmalloc_caches[NR_KMALLOC_CACHES];
+
+/* Class index for requests up to 192 bytes, indexed by (size - 1) / 8 */
+static u8 size_index[KMALLOC_SMALL_MAX / 8];
+
+/*
+ * Free pointer access. Without a constructor the pointer overlays the
+ * start of the free object; with one it lives past the object so that
+ * constructed state survives free/alloc cycles.
+ */
+static inline void *get_freepointer(struct kmem_cache *s, void *object)
+{
+    return *(void **)((char *)object + s->offset);
+}
+
+static inline void set_freepointer(struct kmem_cache *s, void *object,
+                                   void *fp)
+{
+    *(void **)((char *)object + s->offset) = fp;
+}
+
+static inline struct kmem_cache *page_slab_cache(const struct page *page)
+{
+    return slab_cache_ids[page_field(page)];
+}
+
+/*
+ * Find the head page of the slab holding an object. Slabs are buddy
+ * blocks and therefore naturally aligned to their order.
+ */
+static inline struct page *virt_to_slab(const void *object)
+{
+    struct page *page = virt_to_page(object);
+    unsigned long pfn;
+
+    if (!PageSlab(page))
+        return NULL;
+
+    pfn = page_to_pfn(page);
+    pfn &= ~((1UL << page_slab_cache(page)->order) - 1);
+
+    return pfn_to_page(pfn);
+}
+
+/*
+ * Pick the smallest slab order that holds enough objects without
+ * wasting more than 1/8 of the slab
+ */
+static int calculate_order(unsigned int size)
+{
+    unsigned long slab_size;
+    unsigned int order;
+
+    for (order = 0; order <= SLAB_MAX_ORDER; order++) {
+        slab_size = PAGE_SIZE << order;
+
+        if (slab_size < size)
+            continue;
+
+        if (order == SLAB_MAX_ORDER)
+            return order;
+
+        if (slab_size / size < SLAB_MIN_OBJECTS)
+            continue;
+
+        if ((slab_size % size) * 8 > slab_size)
+            continue;
+
+        return order;
+    }
+
+    return -1;
+}
+
+/*
+ * Set up a cache descriptor
+ */
+static int kmem_cache_open(struct kmem_cache *s, const char *name,
+                           unsigned int size, unsigned int align,
+                           unsigned long flags, void (*ctor)(void *))
+{
+    unsigned int stride;
+    int order;
+
+    if (size == 0)
+        return -EINVAL;
+
+    if (flags & SLAB_HWCACHE_ALIGN) {
+        unsigned int ralign = L1_CACHE_BYTES;
+
+        /* Small objects share a cache line rather than pad it out */
+        while (size <= ralign / 2)
+            ralign /= 2;
+
+        if (ralign > align)
+            align = ralign;
+    }
+
+    if (align < sizeof(void *))
+        align = sizeof(void *);
+
+    if (align & (align - 1))
+        return -EINVAL;
+
+    stride = ALIGN_UP(size, sizeof(void *));
+
+    if (ctor) {
+        s->offset = stride;
+        stride += sizeof(void *);
+    } else {
+        s->offset = 0;
+    }
+
+    stride = ALIGN_UP(stride, align);
+
+    order = calculate_order(stride);
+    if (order < 0)
+        return -EINVAL;
+
+    s->name = name;
+    s->object_size = size;
+    s->size = stride;
+    s->align = align;
+    s->order = order;
+    s->objects = (PAGE_SIZE << order) / stride;
+    s->flags = flags;
+    s->ctor = ctor;
+
+    spin_lock_init(&s->lock);
+    init_pfn_list(&s->partial);
+    s->nr_partial = 0;
+    s->min_partial = SLAB_MIN_PARTIAL;
+    s->nr_slabs = 0;
+
+    memset(s->cpu_slab, 0, sizeof(s->cpu_slab));
+
+    spin_lock(&slab_caches_lock);
+    for (s->id = 0; s->id < SLAB_MAX_CACHES; s->id++)
+        if (slab_cache_ids[s->id] == NULL)
+            break;
+    if (s->id == SLAB_MAX_CACHES) {
+        spin_unlock(&slab_caches_lock);
+        return -ENOMEM;
+    }
+    slab_cache_ids[s->id] = s;
+    list_add_tail(&s->list, &slab_caches);
+    spin_unlock(&slab_caches_lock);
+
+    return 0;
+}
+
+/*
+ * Allocate a fresh slab and thread all of its objects onto a freelist
+ */
+static struct page *allocate_slab(struct kmem_cache *s, gfp_t flags)
+{
+    struct page *page;
+    unsigned long nr_pages = 1UL << s->order;
+    unsigned long i;
+    char *start, *object;
+
+    if (s->flags & SLAB_RECLAIM_ACCOUNT)
+        flags |= GFP_RECLAIMABLE;
+
+    page = alloc_pages(flags & ~(GFP_ZERO | GFP_COLD), s->order);
+    if (page == NULL)
+        return NULL;
+
+    for (i = 0; i < nr_pages; i++) {
+        SetPageSlab(&page[i]);
+        set_page_field(&page[i], s->id);
+    }
+
+    start = page_to_virt(page);
+
+    for (i = 0; i < s->objects; i++) {
+        object = start + i * s->size;
+
+        if (s->ctor)
+            s->ctor(object);
+
+        set_freepointer(s, object,
+                        i + 1 < s->objects ? object + s->size : NULL);
+    }
+
+    page->freelist = start;
+    page->inuse = 0;
+    page->objects = s->objects;
+    page->frozen = 0;
+
+    __sync_add_and_fetch(&s->nr_slabs, 1);
+
+    return page;
+}
+
+/*
+ * Return an empty slab to the page allocator
+ */
+static void free_slab(struct kmem_cache *s, struct page *page)
+{
+    unsigned long nr_pages = 1UL << s->order;
+    unsigned long i;
+
+    for (i = 0; i < nr_pages; i++) {
+        ClearPageSlab(&page[i]);
+        set_page_field(&page[i], 0);
+    }
+
+    page->freelist = NULL;
+    atomic_set(&page->_mapcount, -1);
+
+    __sync_sub_and_fetch(&s->nr_slabs, 1);
+
+    free_pages(page, s->order);
+}
+
+/* Partial list management, called with s->lock held */
+static inline void add_partial(struct kmem_cache *s, struct page *page)
+{
+    pfn_list_add_tail(&s->partial, page);
+    s->nr_partial++;
+}
+
+static inline void remove_partial(struct kmem_cache *s, struct page *page)
+{
+    pfn_list_del(&s->partial, page);
+    s->nr_partial--;
+}
+
+/*
+ * Take a slab off the partial list and freeze it for this CPU.
+ * Returns the slab and hands its objects back through freelist.
+ */
+static struct page *get_partial(struct kmem_cache *s, void **freelist)
+{
+    struct page *page;
+
+    spin_lock(&s->lock);
+
+    page = pfn_list_first(&s->partial);
+    if (page == NULL) {
+        spin_unlock(&s->lock);
+        return NULL;
+    }
+
+    remove_partial(s, page);
+
+    *freelist = page->freelist;
+    page->freelist = NULL;
+    page->inuse = page->objects;
+    page->frozen = 1;
+
+    spin_unlock(&s->lock);
+
+    return page;
+}
+
+/*
+ * Unfreeze a CPU slab, giving the CPU's unused objects back to it and
+ * filing it on the partial list, or freeing it if it is empty.
+ * Called with local interrupts disabled.
+ */
+static void deactivate_slab(struct kmem_cache *s, struct page *page,
+                            void *freelist)
+{
+    void *tail = NULL;
+    unsigned int count = 0;
+    void *object;
+
+    for (object = freelist; object; object = get_freepointer(s, object)) {
+        tail = object;
+        count++;
+    }
+
+    spin_lock(&s->lock);
+
+    if (tail) {
+        set_freepointer(s, tail, page->freelist);
+        page->freelist = freelist;
+    }
+
+    page->inuse -= count;
+    page->frozen = 0;
+
+    if (page->inuse == 0 && s->nr_partial >= s->min_partial) {
+        spin_unlock(&s->lock);
+        free_slab(s, page);
+        return;
+    }
+
+    if (page->inuse < page->objects)
+        add_partial(s, page);
+
+    spin_unlock(&s->lock);
+}
+
+/*
+ * Slow path: refill the CPU freelist from the current slab's remote
+ * frees, a partial slab, or a new slab. Called with local interrupts
+ * disabled.
+ */
+static void *__slab_alloc(struct kmem_cache *s, gfp_t flags,
+                          struct kmem_cache_cpu *c)
+{
+    struct page *page;
+    void *freelist = NULL;
+    void *object;
+
+    c->alloc_slow++;
+
+    if (c->page) {
+        /* Objects other CPUs freed into our slab */
+        spin_lock(&s->lock);
+        freelist = c->page->freelist;
+        c->page->freelist = NULL;
+        c->page->inuse = c->page->objects;
+        spin_unlock(&s->lock);
+
+        if (freelist)
+            goto load_freelist;
+
+        deactivate_slab(s, c->page, NULL);
+        c->page = NULL;
+    }
+
+    page = get_partial(s, &freelist);
+    if (page == NULL) {
+        page = allocate_slab(s, flags);
+        if (page == NULL)
+            return NULL;
+
+        freelist = page->freelist;
+        page->freelist = NULL;
+        page->inuse = page->objects;
+        page->frozen = 1;
+    }
+
+    c->page = page;
+
+load_freelist:
+    object = freelist;
+    c->freelist = get_freepointer(s, object);
+
+    return object;
+}
+
+/*
+ * Allocate an object from a cache
+ */
+void *kmem_cache_alloc(struct kmem_cache *s, gfp_t flags)
+{
+    struct kmem_cache_cpu *c;
+    unsigned long irqflags;
+    void *object;
+
+    irqflags = local_irq_save();
+
+    c = &s->cpu_slab[smp_processor_id()];
+    object = c->freelist;
+
+    if (object) {
+        c->freelist = get_freepointer(s, object);
+        c->alloc_fast++;
+    } else {
+        object = __slab_alloc(s, flags, c);
+    }
+
+    local_irq_restore(irqflags);
+
+    if (object && (flags & GFP_ZERO))
+        memset(object, 0, s->object_size);
+
+    return object;
+}
+
+/*
+ * Slow path: free an object into a slab this CPU does not own.
+ * Called with local interrupts disabled.
+ */
+static void __slab_free(struct kmem_cache *s, struct page *page,
+                        void *object)
+{
+    int was_full;
+
+    spin_lock(&s->lock);
+
+    was_full = (page->inuse == page->objects);
+
+    set_freepointer(s, object, page->freelist);
+    page->freelist = object;
+    page->inuse--;
+
+    /* Frozen slabs belong to a CPU and are not on any list */
+    if (!page->frozen) {
+        if (page->inuse == 0 && s->nr_partial >= s->min_partial) {
+            if (!was_full)
+                remove_partial(s, page);
+            spin_unlock(&s->lock);
+            free_slab(s, page);
+            return;
+        }
+
+        if (was_full)
+            add_partial(s, page);
+    }
+
+    spin_unlock(&s->lock);
+}
+
+/*
+ * Free an object back to its cache
+ */
+void kmem_cache_free(struct kmem_cache *s, void *object)
+{
+    struct kmem_cache_cpu *c;
+    struct page *page;
+    unsigned long irqflags;
+
+    if (object == NULL)
+        return;
+
+    page = virt_to_slab(object);
+    if (page == NULL || page_slab_cache(page) != s) {
+        printk("kmem_cache_free: %p does not belong to %s\n",
+               object, s->name);
+        return;
+    }
+
+    irqflags = local_irq_save();
+
+    c = &s->cpu_slab[smp_processor_id()];
+
+    if (page == c->page) {
+        set_freepointer(s, object, c->freelist);
+        c->freelist = object;
+        c->free_fast++;
+    } else {
+        c->free_slow++;
+        __slab_free(s, page, object);
+    }
+
+    local_irq_restore(irqflags);
+}
+
+/*
+ * Flush all CPU slabs and release every empty slab. Only the boot CPU
+ * runs today, so remote CPU slabs are flushed directly.
+ */
+unsigned long kmem_cache_shrink(struct kmem_cache *s)
+{
+    struct kmem_cache_cpu *c;
+    struct page *page, *next;
+    struct pfn_list discard;
+    unsigned long irqflags;
+    unsigned long freed = 0;
+    int cpu;
+
+    irqflags = local_irq_save();
+
+    for (cpu = 0; cpu < NR_CPUS; cpu++) {
+        c = &s->cpu_slab[cpu];
+        if (c->page) {
+            deactivate_slab(s, c->page, c->freelist);
+            c->page = NULL;
+            c->freelist = NULL;
+        }
+    }
+
+    init_pfn_list(&discard);
+
+    spin_lock(&s->lock);
+    for (page = pfn_list_first(&s->partial); page; page = next) {
+        next = pfn_list_next(page);
+        if (page->inuse == 0) {
+            remove_partial(s, page);
+            pfn_list_add(&discard, page);
+        }
+    }
+    spin_unlock(&s->lock);
+
+    while ((page = pfn_list_first(&discard)) != NULL) {
+        pfn_list_del(&discard, page);
+        free_slab(s, page);
+        freed += 1UL << s->order;
+    }
+
+    local_irq_restore(irqflags);
+
+    return freed;
+}
+
+unsigned long kmem_cache_shrink_all(void)
+{
+    struct kmem_cache *s;
+    unsigned long freed = 0;
+
+    spin_lock(&slab_caches_lock);
+    list_for_each_entry(s, &slab_caches, list)
+        freed += kmem_cache_shrink(s);
+    spin_unlock(&slab_caches_lock);
+
+    return freed;
+}
+
+/*
+ * Create a named object cache
+ */
+struct kmem_cache *kmem_cache_create(const char *name, unsigned int size,
+                                     unsigned int align, unsigned long flags,
+                                     void (*ctor)(void *))
+{
+    struct kmem_cache *s;
+
+    s = kmem_cache_zalloc(&kmem_cache_boot, GFP_KERNEL);
+    if (s == NULL)
+        goto fail;
+
+    if (kmem_cache_open(s, name, size, align, flags, ctor) < 0) {
+        kmem_cache_free(&kmem_cache_boot, s);
+        goto fail;
+    }
+
+    return s;
+
+fail:
+    if (flags & SLAB_PANIC)
+        panic("Cannot create slab cache %s", name);
+    return NULL;
+}
+
+/*
+ * Destroy a cache. All objects must have been freed.
+ */
+void kmem_cache_destroy(struct kmem_cache *s)
+{
+    if (s == NULL)
+        return;
+
+    kmem_cache_shrink(s);
+
+    if (s->nr_slabs) {
+        printk("kmem_cache_destroy: %s still has %lu slabs in use\n",
+               s->name, s->nr_slabs);
+        return;
+    }
+
+    spin_lock(&slab_caches_lock);
+    list_del(&s->list);
+    slab_cache_ids[s->id] = NULL;
+    spin_unlock(&slab_caches_lock);
+
+    kmem_cache_free(&kmem_cache_boot, s);
+}
+
+/*
+ * Map a request size to its kmalloc cache
+ */
+static inline struct kmem_cache *kmalloc_slab(size_t size)
+{
+    unsigned int bits;
+
+    if (size <= KMALLOC_SMALL_MAX)
+        return &kmalloc_caches[size_index[(size - 1) / 8]];
+
+    /* 256 bytes and up are powers of two starting at index 7 */
+    bits = 64 - __builtin_clzl(size - 1);
+    return &kmalloc_caches[bits - 1];
+}
+
+/*
+ * Requests above the largest size class go straight to the buddy
+ * allocator as a compound block that records its own order
+ */
+static void *kmalloc_large(size_t size, gfp_t flags)
+{
+    unsigned int order = get_order(size);
+    struct page *page;
+
+    if (order >= MAX_ORDER)
+        return NULL;
+
+    page = alloc_pages(flags, order);
+    if (page == NULL)
+        return NULL;
+
+    SetPageCompound(page);
+    page->private = order;
+
+    return page_to_virt(page);
+}
+
+void *kmalloc(size_t size, gfp_t flags)
+{
+    if (size == 0)
+        return NULL;
+
+    if (size > KMALLOC_MAX_CACHE_SIZE)
+        return kmalloc_large(size, flags);
+
+    return kmem_cache_alloc(kmalloc_slab(size), flags);
+}
+
+void kfree(void *ptr)
+{
+    struct page *page;
+    unsigned int order;
+
+    if (ptr == NULL)
+        return;
+
+    page = virt_to_page(ptr);
+
+    if (PageSlab(page)) {
+        kmem_cache_free(page_slab_cache(page), ptr);
+    } else if (PageCompound(page)) {
+        order = page->private;
+        ClearPageCompound(page);
+        page->private = 0;
+        free_pages(page, order);
+    } else {
+        printk("kfree: %p was not allocated by kmalloc\n", ptr);
+    }
+}
+
+/*
+ * Usable size of a kmalloc allocation
+ */
+size_t ksize(const void *ptr)
+{
+    struct page *page;
+
+    if (ptr == NULL)
+        return 0;
+
+    page = virt_to_page(ptr);
+
+    if (PageSlab(page))
+        return page_slab_cache(page)->object_size;
+
+    if (PageCompound(page))
+        return PAGE_SIZE << page->private;
+
+    return 0;
+}
+
+void *kzalloc(size_t size, gfp_t flags)
+{
+    return kmalloc(size, flags | GFP_ZERO);
+}
+
+void *kcalloc(size_t n, size_t size, gfp_t flags)
+{
+    if (size != 0 && n > (size_t)-1 / size)
+        return NULL;
+
+    return kzalloc(n * size, flags);
+}
+
+void *krealloc(void *ptr, size_t new_size, gfp_t flags)
+{
+    void *new_ptr;
+    size_t old_size;
+
+    if (ptr == NULL)
+        return kmalloc(new_size, flags);
+
+    if (new_size == 0) {
+        kfree(ptr);
+        return NULL;
+    }
+
+    /* Still fits in the current size class: grow or shrink in place */
+    old_size = ksize(ptr);
+    if (new_size <= old_size)
+        return ptr;
+
+    new_ptr = kmalloc(new_size, flags);
+    if (new_ptr == NULL)
+        return NULL;
+
+    memcpy(new_ptr, ptr, old_size);
+    kfree(ptr);
+
+    return new_ptr;
+}
+
+/*
+ * Show statistics for every cache
+ */
+void show_slabinfo(void)
+{
+    struct kmem_cache *s;
+    struct kmem_cache_cpu *c;
+    unsigned long fast, slow, frees;
+    int cpu;
+
+    printk("Slab caches (name: objsize stride objs/slab order slabs partial):\n");
+
+    spin_lock(&slab_caches_lock);
+
+    list_for_each_entry(s, &slab_caches, list) {
+        fast = slow = frees = 0;
+
+        for (cpu = 0; cpu < NR_CPUS; cpu++) {
+            c = &s->cpu_slab[cpu];
+            fast += c->alloc_fast;
+            slow += c->alloc_slow;
+            frees += c->free_fast + c->free_slow;
+        }
+
+        printk("  %s: %lu %lu %lu %lu %lu %lu", s->name,
+               (unsigned long)s->object_size, (unsigned long)s->size,
+               (unsigned long)s->objects, (unsigned long)s->order,
+               s->nr_slabs, s->nr_partial);
+
+        if (fast + slow)
+            printk("  allocs %lu (%lu%% fast) frees %lu",
+                   fast + slow, (fast * 100) / (fast + slow), frees);
+
+        printk("\n");
+    }
+
+    spin_unlock(&slab_caches_lock);
+}
+
+/*
+ * Bootstrap the descriptor cache and the kmalloc caches
+ */
+void kmem_cache_init(void)
+{
+    unsigned int i, size, idx;
+
+    INIT_LIST_HEAD(&slab_caches);
+
+    if (kmem_cache_open(&kmem_cache_boot, "kmem_cache",
+                        sizeof(struct kmem_cache), 0,
+                        SLAB_HWCACHE_ALIGN, NULL) < 0)
+        panic("Cannot create kmem_cache cache");
+
+    for (i = 0; i < NR_KMALLOC_CACHES; i++) {
+        if (kmem_cache_open(&kmalloc_caches[i], kmalloc_names[i],
+                            kmalloc_sizes[i], 0, 0, NULL) < 0)
+            panic("Cannot create %s cache", kmalloc_names[i]);
+    }
+
+    for (i = 0; i < ARRAY_SIZE(size_index); i++) {
+        size = (i + 1) * 8;
+        idx = 0;
+        while (kmalloc_sizes[idx] < size)
+            idx++;
+        size_index[i] = idx;
+    }
+
+    printk("Slab allocator initialized (%lu kmalloc caches)\n",
+           (unsigned long)NR_KMALLOC_CACHES);
+}
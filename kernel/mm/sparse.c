@@ -0,0 +1,168 @@
+/*
+ * MicroKernel Sparse Memory Model
+ *
+ * mem_map is one virtual array indexed by pfn, at VMEMMAP_START, but
+ * only the struct pages of sections with RAM in them are backed: a
+ * section in a hole of the physical address space has no struct pages
+ * and no memory spent on them. Each present section gets the struct
+ * pages of all its frames, so that a buddy, which never lies outside
+ * its block's section, always has one.
+ *
+ * The backing comes from memblock before the buddy allocator exists.
+ * The struct pages of a section take 1MB; two present sections next to
+ * each other are mapped with a 2MB page, the edges of a run of present
+ * sections with 4KB pages.
+ */
+
+#include "../include/pgtable.h"
+#include "../include/memblock.h"
+#include "../include/mm.h"
+#include "../include/types.h"
+
+/* External declarations */
+extern int printk(const char *fmt, ...);
+
+struct mem_section *mem_section;
+unsigned long nr_mem_sections;
+unsigned long mem_map_size;
+
+static unsigned long nr_present_sections;
+static unsigned long vmemmap_pages_2m;
+static unsigned long vmemmap_pages_4k;
+
+static u64 *vmemmap_next_table(u64 *entry)
+{
+    void *table;
+
+    if (!entry_present(*entry)) {
+        table = memblock_alloc(PAGE_SIZE, PAGE_SIZE);
+        if (table == NULL)
+            return NULL;
+        *entry = __pa(table) | _KERNPG_TABLE;
+    }
+    return entry_table(*entry);
+}
+
+/*
+ * Back the part of mem_map in [start, end), both page aligned, with
+ * memory. Returns -ENOMEM if memblock runs out, leaving what was
+ * mapped so far in place.
+ */
+static int vmemmap_populate(unsigned long start, unsigned long end)
+{
+    pgd_t *pgd = __va(read_cr3() & PTE_PFN_MASK);
+    u64 global = (read_cr4() & X86_CR4_PGE) ? _PAGE_GLOBAL : 0;
+    unsigned long addr, next;
+    pud_t *pud;
+    pmd_t *pmd;
+    pte_t *pte;
+    void *p;
+
+    for (addr = start; addr < end; addr = next) {
+        next = MIN(ALIGN_DOWN(addr, PMD_SIZE) + PMD_SIZE, end);
+
+        pud = vmemmap_next_table(&pgd[pgd_index(addr)]);
+        if (pud == NULL)
+            return -ENOMEM;
+        pmd = vmemmap_next_table(&pud[pud_index(addr)]);
+        if (pmd == NULL)
+            return -ENOMEM;
+        pmd += pmd_index(addr);
+
+        if (next - addr == PMD_SIZE && !entry_present(*pmd)) {
+            p = memblock_alloc_raw(PMD_SIZE, PMD_SIZE);
+            if (p) {
+                *pmd = __pa(p) | PAGE_KERNEL_LARGE | global;
+                vmemmap_pages_2m++;
+                continue;
+            }
+        }
+
+        pte = vmemmap_next_table(pmd);
+        if (pte == NULL)
+            return -ENOMEM;
+        for (; addr < next; addr += PAGE_SIZE) {
+            if (entry_present(pte[pte_index(addr)]))
+                continue;
+            p = memblock_alloc_raw(PAGE_SIZE, PAGE_SIZE);
+            if (p == NULL)
+                return -ENOMEM;
+            pte[pte_index(addr)] = __pa(p) | PAGE_KERNEL | _PAGE_ACCESSED |
+                                   _PAGE_DIRTY | global;
+            vmemmap_pages_4k++;
+        }
+    }
+
+    return 0;
+}
+
+static void memory_present(phys_addr_t start, phys_addr_t end)
+{
+    unsigned long nr;
+
+    if (start >= end)
+        return;
+
+    for (nr = pfn_to_section_nr(start >> PAGE_SHIFT);
+         nr <= pfn_to_section_nr((end - 1) >> PAGE_SHIFT); nr++)
+        mem_section[nr].flags |= SECTION_MARKED_PRESENT;
+}
+
+static bool present_section_nr(unsigned long nr)
+{
+    return nr < nr_mem_sections &&
+           (mem_section[nr].flags & SECTION_MARKED_PRESENT);
+}
+
+unsigned long sparse_init(void)
+{
+    struct memblock_region *rgn;
+    unsigned long nr, end, i;
+
+    max_pfn = memblock_end_of_DRAM() >> PAGE_SHIFT;
+    if (max_pfn == 0) {
+        printk("Warning: no memory map from boot loader\n");
+        return 0;
+    }
+
+    nr_mem_sections = (max_pfn + PAGES_PER_SECTION - 1) / PAGES_PER_SECTION;
+    mem_section = memblock_alloc(nr_mem_sections * sizeof(*mem_section), 0);
+    if (mem_section == NULL) {
+        nr_mem_sections = 0;
+        printk("Warning: cannot allocate the section table\n");
+        return 0;
+    }
+
+    for (i = 0; i < memblock.memory.cnt; i++) {
+        rgn = &memblock.memory.regions[i];
+        memory_present(rgn->base, rgn->base + rgn->size);
+    }
+
+    /* A run of present sections at a time, for the 2MB pages */
+    for (nr = 0; nr < nr_mem_sections; nr = end) {
+        if (!present_section_nr(nr)) {
+            end = nr + 1;
+            continue;
+        }
+        for (end = nr + 1; present_section_nr(end); end++)
+            ;
+
+        if (vmemmap_populate((unsigned long)pfn_to_page(section_nr_to_pfn(nr)),
+                             (unsigned long)pfn_to_page(section_nr_to_pfn(end))) < 0) {
+            printk("Warning: no memory for the mem_map of %lu MB\n",
+                   ((end - nr) << SECTION_SIZE_BITS) >> 20);
+            break;
+        }
+
+        for (i = nr; i < end; i++)
+            mem_section[i].flags |= SECTION_HAS_MEM_MAP;
+        nr_present_sections += end - nr;
+        mem_map_size += (end - nr) * PAGES_PER_SECTION * sizeof(struct page);
+    }
+
+    printk("mem_map: %lu of %lu sections, %lu KB in %lu 2MB and %lu 4KB pages\n",
+           nr_present_sections, nr_mem_sections, mem_map_size >> 10,
+           vmemmap_pages_2m, vmemmap_pages_4k);
+
+    return nr_present_sections;
+}
@@ -0,0 +1,66 @@
+/*
+ * MicroKernel VMA Lookup Cache
+ *
+ * See vmacache.h. Only the current task's cache is used, and only for
+ * lookups in its own mm: other address spaces go to the tree.
+ */
+
+#include "../include/vmacache.h"
+#include "../include/sched.h"
+#include "../include/mm.h"
+#include "../include/types.h"
+
+static unsigned long nr_vmacache_find_calls;
+static unsigned long nr_vmacache_find_hits;
+
+/* Is the current task's cache usable for mm? Empties it if stale. */
+static bool vmacache_valid(struct mm_struct *mm)
+{
+    struct task_struct *tsk = current;
+
+    if (tsk == NULL || tsk->mm != mm)
+        return false;
+
+    if (tsk->vmacache.seqnum != mm->vmacache_seqnum) {
+        tsk->vmacache.seqnum = mm->vmacache_seqnum;
+        vmacache_flush(tsk);
+        return false;
+    }
+    return true;
+}
+
+void vmacache_update(unsigned long addr, struct vm_area_struct *vma)
+{
+    if (vmacache_valid(vma->vm_mm))
+        current->vmacache.vmas[VMACACHE_HASH(addr)] = vma;
+}
+
+struct vm_area_struct *vmacache_find(struct mm_struct *mm, unsigned long addr)
+{
+    unsigned int idx = VMACACHE_HASH(addr);
+    struct vm_area_struct *vma;
+    unsigned int i;
+
+    if (!vmacache_valid(mm))
+        return NULL;
+
+    nr_vmacache_find_calls++;
+
+    /* The slot of addr first, then the others */
+    for (i = 0; i < VMACACHE_SIZE; i++) {
+        vma = current->vmacache.vmas[idx];
+        if (vma && vma->vm_start <= addr && vma->vm_end > addr) {
+            nr_vmacache_find_hits++;
+            return vma;
+        }
+        idx = (idx + 1) & VMACACHE_MASK;
+    }
+
+    return NULL;
+}
+
+void vmacache_stats(unsigned long *calls, unsigned long *hits)
+{
+    *calls = nr_vmacache_find_calls;
+    *hits = nr_vmacache_find_hits;
+}
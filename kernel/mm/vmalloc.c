@@ -0,0 +1,550 @@
+/*
+ * MicroKernel vmalloc
+ *
+ * Virtually contiguous kernel allocations built from order-0 pages.
+ * See vmalloc.h for the free range index and lazy TLB flushing.
+ */
+
+#include "../include/vmalloc.h"
+#include "../include/pgtable.h"
+#include "../include/rbtree.h"
+#include "../include/slab.h"
+#include "../include/mm.h"
+#include "../include/types.h"
+#include "../include/list.h"
+#include "../include/spinlock.h"
+
+/* External declarations */
+extern int printk(const char *fmt, ...);
+
+/*
+ * A range of the vmalloc space. Busy areas are in busy_root by address.
+ * Free areas are in free_root by address and free_size_root by size.
+ * Freed areas waiting for a flush are only on purge_list.
+ */
+struct vmap_area {
+    unsigned long va_start;
+    unsigned long va_end;           /* Including the guard page */
+    unsigned long nr_pages;         /* Mapped pages, busy areas */
+    struct rb_node rb_node;
+    struct rb_node size_node;
+    struct list_head list;
+};
+
+#define va_size(va)     ((va)->va_end - (va)->va_start)
+
+static struct kmem_cache *vmap_area_cachep;
+
+static spinlock_t vmap_lock;
+static struct rb_root busy_root = RB_ROOT;
+static struct rb_root free_root = RB_ROOT;
+static struct rb_root free_size_root = RB_ROOT;
+static LIST_HEAD(purge_list);
+static unsigned long nr_lazy_pages;
+
+/* Flush on every vfree instead; for the benchmark */
+static bool vmap_lazy_flush = true;
+
+/* Statistics */
+static unsigned long nr_vmalloc_pages;
+static unsigned long nr_busy_areas;
+static unsigned long nr_vfree;
+static unsigned long nr_purges;
+
+static struct vmap_area *vmap_area_alloc(void)
+{
+    struct vmap_area *va;
+
+    va = kmem_cache_alloc(vmap_area_cachep, GFP_KERNEL);
+    if (va) {
+        RB_CLEAR_NODE(&va->rb_node);
+        RB_CLEAR_NODE(&va->size_node);
+        INIT_LIST_HEAD(&va->list);
+        va->nr_pages = 0;
+    }
+    return va;
+}
+
+static void insert_by_addr(struct rb_root *root, struct vmap_area *va)
+{
+    struct rb_node **link = &root->rb_node, *parent = NULL;
+
+    while (*link) {
+        parent = *link;
+        if (va->va_start < rb_entry(parent, struct vmap_area, rb_node)->va_start)
+            link = &parent->rb_left;
+        else
+            link = &parent->rb_right;
+    }
+
+    rb_link_node(&va->rb_node, parent, link);
+    rb_insert_color(&va->rb_node, root);
+}
+
+/* Ordered by size, then address, so equal sizes pack low */
+static void insert_by_size(struct vmap_area *va)
+{
+    struct rb_node **link = &free_size_root.rb_node, *parent = NULL;
+    struct vmap_area *tmp;
+
+    while (*link) {
+        parent = *link;
+        tmp = rb_entry(parent, struct vmap_area, size_node);
+        if (va_size(va) < va_size(tmp) ||
+            (va_size(va) == va_size(tmp) && va->va_start < tmp->va_start))
+            link = &parent->rb_left;
+        else
+            link = &parent->rb_right;
+    }
+
+    rb_link_node(&va->size_node, parent, link);
+    rb_insert_color(&va->size_node, &free_size_root);
+}
+
+static void free_area_remove(struct vmap_area *va)
+{
+    rb_erase(&va->rb_node, &free_root);
+    rb_erase(&va->size_node, &free_size_root);
+}
+
+/* Return a range to the free index, merged with free neighbours */
+static void free_area_add(struct vmap_area *va)
+{
+    struct rb_node *node;
+    struct vmap_area *prev = NULL, *next = NULL;
+
+    insert_by_addr(&free_root, va);
+
+    node = rb_prev(&va->rb_node);
+    if (node)
+        prev = rb_entry(node, struct vmap_area, rb_node);
+    node = rb_next(&va->rb_node);
+    if (node)
+        next = rb_entry(node, struct vmap_area, rb_node);
+
+    if (prev && prev->va_end == va->va_start) {
+        free_area_remove(prev);
+        va->va_start = prev->va_start;
+        kmem_cache_free(vmap_area_cachep, prev);
+    }
+    if (next && next->va_start == va->va_end) {
+        free_area_remove(next);
+        va->va_end = next->va_end;
+        kmem_cache_free(vmap_area_cachep, next);
+    }
+
+    insert_by_size(va);
+}
+
+/* Smallest free area of at least size bytes */
+static struct vmap_area *find_free_area(unsigned long size)
+{
+    struct rb_node *node = free_size_root.rb_node;
+    struct vmap_area *va, *best = NULL;
+
+    while (node) {
+        va = rb_entry(node, struct vmap_area, size_node);
+        if (va_size(va) >= size) {
+            best = va;
+            node = node->rb_left;
+        } else {
+            node = node->rb_right;
+        }
+    }
+    return best;
+}
+
+/*
+ * Flush the TLB once for everything on the purge list, then make those
+ * ranges allocatable again
+ */
+static void purge_vmap_areas_locked(void)
+{
+    struct vmap_area *va, *tmp;
+
+    if (list_empty(&purge_list))
+        return;
+
+    flush_tlb_local();
+
+    list_for_each_entry_safe(va, tmp, &purge_list, list) {
+        list_del_init(&va->list);
+        free_area_add(va);
+    }
+
+    nr_lazy_pages = 0;
+    nr_purges++;
+}
+
+/*
+ * Carve size bytes from the low end of the best-fitting free area. An
+ * area that fits exactly is handed over whole.
+ */
+static struct vmap_area *alloc_vmap_area(unsigned long size)
+{
+    struct vmap_area *va, *free;
+
+    va = vmap_area_alloc();
+    if (va == NULL)
+        return NULL;
+
+    spin_lock(&vmap_lock);
+
+    free = find_free_area(size);
+    if (free == NULL) {
+        purge_vmap_areas_locked();
+        free = find_free_area(size);
+    }
+    if (free == NULL) {
+        spin_unlock(&vmap_lock);
+        kmem_cache_free(vmap_area_cachep, va);
+        return NULL;
+    }
+
+    free_area_remove(free);
+    if (va_size(free) == size) {
+        kmem_cache_free(vmap_area_cachep, va);
+        va = free;
+        va->nr_pages = 0;
+        RB_CLEAR_NODE(&va->size_node);
+    } else {
+        va->va_start = free->va_start;
+        va->va_end = free->va_start + size;
+        free->va_start += size;
+        insert_by_addr(&free_root, free);
+        insert_by_size(free);
+    }
+
+    insert_by_addr(&busy_root, va);
+    nr_busy_areas++;
+
+    spin_unlock(&vmap_lock);
+    return va;
+}
+
+static struct vmap_area *find_busy_area(unsigned long addr)
+{
+    struct rb_node *node = busy_root.rb_node;
+    struct vmap_area *va;
+
+    while (node) {
+        va = rb_entry(node, struct vmap_area, rb_node);
+        if (addr < va->va_start)
+            node = node->rb_left;
+        else if (addr > va->va_start)
+            node = node->rb_right;
+        else
+            return va;
+    }
+    return NULL;
+}
+
+/*
+ * PTE for a vmalloc address. The PUD tables are all allocated at boot;
+ * PMD and PTE tables as needed, and kept.
+ */
+static pte_t *vmalloc_pte(unsigned long addr, bool alloc)
+{
+    u64 *entry, *table;
+    unsigned long page;
+    int level;
+
+    entry = pgd_offset_k(addr);
+
+    for (level = 0; level < 3; level++) {
+        if (!entry_present(*entry)) {
+            if (!alloc)
+                return NULL;
+            page = get_zeroed_page(GFP_KERNEL | GFP_ZERO);
+            if (page == 0)
+                return NULL;
+            *entry = __pa(page) | _KERNPG_TABLE;
+        }
+
+        table = entry_table(*entry);
+        switch (level) {
+        case 0:
+            entry = &table[pud_index(addr)];
+            break;
+        case 1:
+            entry = &table[pmd_index(addr)];
+            break;
+        default:
+            entry = &table[pte_index(addr)];
+            break;
+        }
+    }
+
+    return entry;
+}
+
+/* Clear the PTEs of an area and free its pages, without flushing */
+static void vunmap_area(struct vmap_area *va)
+{
+    struct list_head pages;
+    unsigned long addr, i;
+    struct page *page;
+    pte_t *pte;
+
+    INIT_LIST_HEAD(&pages);
+
+    for (i = 0, addr = va->va_start; i < va->nr_pages; i++, addr += PAGE_SIZE) {
+        pte = vmalloc_pte(addr, false);
+        if (pte == NULL || !entry_present(*pte))
+            continue;
+        page = entry_page(*pte);
+        *pte = 0;
+        list_add_tail(&page->lru, &pages);
+    }
+
+    free_pages_bulk_list(&pages);
+}
+
+/*
+ * The pages are gone and the area leaves the busy tree at once; its
+ * addresses are reused only after a TLB flush
+ */
+static void free_vmap_area_lazy(struct vmap_area *va)
+{
+    vunmap_area(va);
+
+    spin_lock(&vmap_lock);
+    rb_erase(&va->rb_node, &busy_root);
+    nr_busy_areas--;
+    nr_vmalloc_pages -= va->nr_pages;
+
+    list_add_tail(&va->list, &purge_list);
+    nr_lazy_pages += va_size(va) >> PAGE_SHIFT;
+    if (!vmap_lazy_flush || nr_lazy_pages > VMAP_LAZY_MAX_PAGES)
+        purge_vmap_areas_locked();
+    spin_unlock(&vmap_lock);
+}
+
+static void *__vmalloc(unsigned long size, gfp_t gfp_mask)
+{
+    unsigned long nr_pages, got, n, addr;
+    struct vmap_area *va;
+    struct list_head pages;
+    struct page *page, *tmp;
+    pte_t *pte;
+
+    size = ALIGN_UP(size, PAGE_SIZE);
+    nr_pages = size >> PAGE_SHIFT;
+    if (nr_pages == 0 || nr_pages > nr_free_pages())
+        return NULL;
+
+    va = alloc_vmap_area(size + VMAP_GUARD_SIZE);
+    if (va == NULL)
+        return NULL;
+
+    INIT_LIST_HEAD(&pages);
+    for (got = 0; got < nr_pages; got += n) {
+        n = alloc_pages_bulk_list(gfp_mask, nr_pages - got, &pages);
+        if (n == 0)
+            goto fail;
+    }
+
+    addr = va->va_start;
+    list_for_each_entry_safe(page, tmp, &pages, lru) {
+        pte = vmalloc_pte(addr, true);
+        if (pte == NULL)
+            goto fail;
+        list_del(&page->lru);
+        *pte = mk_entry(page, PAGE_KERNEL);
+        va->nr_pages++;
+        addr += PAGE_SIZE;
+    }
+
+    spin_lock(&vmap_lock);
+    nr_vmalloc_pages += nr_pages;
+    spin_unlock(&vmap_lock);
+
+    return (void *)va->va_start;
+
+fail:
+    free_pages_bulk_list(&pages);
+    spin_lock(&vmap_lock);
+    nr_vmalloc_pages += va->nr_pages;
+    spin_unlock(&vmap_lock);
+    free_vmap_area_lazy(va);
+    return NULL;
+}
+
+void *vmalloc(unsigned long size)
+{
+    return __vmalloc(size, GFP_KERNEL);
+}
+
+void *vzalloc(unsigned long size)
+{
+    return __vmalloc(size, GFP_KERNEL | GFP_ZERO);
+}
+
+void vfree(const void *addr)
+{
+    struct vmap_area *va;
+
+    if (addr == NULL)
+        return;
+
+    spin_lock(&vmap_lock);
+    va = find_busy_area((unsigned long)addr);
+    if (va)
+        nr_vfree++;
+    spin_unlock(&vmap_lock);
+
+    if (va == NULL) {
+        printk("vfree: bad address 0x%lx\n", (unsigned long)addr);
+        return;
+    }
+
+    free_vmap_area_lazy(va);
+}
+
+struct page *vmalloc_to_page(const void *addr)
+{
+    pte_t *pte;
+
+    if (!is_vmalloc_addr(addr))
+        return NULL;
+
+    pte = vmalloc_pte((unsigned long)addr, false);
+    if (pte == NULL || !entry_present(*pte))
+        return NULL;
+    return entry_page(*pte);
+}
+
+void *kvmalloc(size_t size, gfp_t flags)
+{
+    void *p;
+
+    /* Larger blocks are only tried while they come easily */
+    if (size <= PAGE_SIZE)
+        return kmalloc(size, flags);
+
+    p = kmalloc(size, flags | GFP_NOWAIT);
+    if (p)
+        return p;
+
+    return __vmalloc(size, flags);
+}
+
+void kvfree(const void *addr)
+{
+    if (is_vmalloc_addr(addr))
+        vfree(addr);
+    else
+        kfree((void *)addr);
+}
+
+/*
+ * The PUD tables for the whole range exist from the start, so the
+ * kernel PGD entries that user PGDs copy never change afterwards
+ */
+void vmalloc_init(void)
+{
+    struct vmap_area *va;
+    unsigned long addr;
+    unsigned long page;
+    pgd_t *pgd;
+
+    spin_lock_init(&vmap_lock);
+
+    vmap_area_cachep = kmem_cache_create("vmap_area", sizeof(struct vmap_area),
+                                         0, 0, NULL);
+    if (vmap_area_cachep == NULL) {
+        printk("Warning: vmalloc disabled (no memory)\n");
+        return;
+    }
+
+    for (addr = VMALLOC_START; addr < VMALLOC_END; addr += PGDIR_SIZE) {
+        pgd = pgd_offset_k(addr);
+        if (entry_present(*pgd))
+            continue;
+        page = get_zeroed_page(GFP_KERNEL | GFP_ZERO);
+        if (page == 0) {
+            printk("Warning: vmalloc disabled (no memory)\n");
+            return;
+        }
+        *pgd = __pa(page) | _KERNPG_TABLE;
+    }
+
+    va = vmap_area_alloc();
+    if (va == NULL)
+        return;
+    va->va_start = VMALLOC_START;
+    va->va_end = VMALLOC_END;
+    free_area_add(va);
+}
+
+void show_vmallocinfo(void)
+{
+    struct vmap_area *va;
+    struct rb_node *node;
+    unsigned long nr_free = 0, largest = 0;
+
+    spin_lock(&vmap_lock);
+
+    for (node = rb_first(&busy_root); node; node = rb_next(node)) {
+        va = rb_entry(node, struct vmap_area, rb_node);
+        printk("0x%lx-0x%lx %lu pages\n", va->va_start,
+               va->va_end - VMAP_GUARD_SIZE, va->nr_pages);
+    }
+
+    for (node = rb_first(&free_root); node; node = rb_next(node))
+        nr_free++;
+    node = rb_last(&free_size_root);
+    if (node)
+        largest = va_size(rb_entry(node, struct vmap_area, size_node));
+
+    printk("VmallocTotal: %lu kB\n", (VMALLOC_END - VMALLOC_START) >> 10);
+    printk("VmallocUsed:  %lu kB in %lu areas\n",
+           (nr_vmalloc_pages * PAGE_SIZE) >> 10, nr_busy_areas);
+    printk("VmallocChunk: %lu kB largest of %lu free ranges\n",
+           largest >> 10, nr_free);
+    printk("Lazy: %lu pages awaiting flush, %lu flushes for %lu frees\n",
+           nr_lazy_pages, nr_purges, nr_vfree);
+
+    spin_unlock(&vmap_lock);
+}
+
+/*
+ * Allocate, touch and free areas of a few sizes, with lazy and with
+ * per-free TLB flushing
+ */
+void bench_vmalloc(unsigned long iterations)
+{
+    static const unsigned long sizes[] = { 16UL << 10, 256UL << 10, 4UL << 20 };
+    unsigned long i, j, s, purges;
+    u64 start, cycles;
+    char *p;
+    int lazy;
+
+    for (lazy = 1; lazy >= 0; lazy--) {
+        printk("%s TLB flush:\n", lazy ? "Lazy" : "Per-free");
+        vmap_lazy_flush = lazy;
+
+        for (s = 0; s < ARRAY_SIZE(sizes); s++) {
+            purges = nr_purges;
+            start = rdtsc();
+            for (i = 0; i < iterations; i++) {
+                p = vmalloc(sizes[s]);
+                if (p == NULL) {
+                    printk("  vmalloc(%lu) failed\n", sizes[s]);
+                    break;
+                }
+                for (j = 0; j < sizes[s]; j += PAGE_SIZE)
+                    p[j] = 1;
+                vfree(p);
+            }
+            cycles = rdtsc() - start;
+
+            if (i)
+                printk("  %lu KB: %lu cycles per vmalloc+vfree, %lu flushes\n",
+                       sizes[s] >> 10, (unsigned long)(cycles / i),
+                       nr_purges - purges);
+        }
+    }
+
+    vmap_lazy_flush = true;
+}
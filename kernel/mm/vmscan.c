@@ -0,0 +1,922 @@
+/*
+ * MicroKernel Page Reclaim
+ *
+ * Anonymous pages are kept on an inactive and an active LRU list. New
+ * pages start inactive. Reclaim takes pages from the tail of the
+ * inactive list and looks at the accessed bit of the entry mapping
+ * each: a page used since it was last looked at moves to the active
+ * list with the bit cleared, any other is compressed into zswap and its
+ * entry replaced by a swap entry. The active list is kept no longer
+ * than the inactive one by moving pages from its tail back, so every
+ * page gets a second chance before it goes.
+ *
+ * Pages in VM_LOCKED or VM_SHARED VMAs are moved to the unevictable
+ * list when reclaim comes across them, and back when munlocked.
+ *
+ * Most reclaim should happen in the background. There are no kernel
+ * threads, so kswapd is stepped from the idle loop, as kcompactd is:
+ * an allocation that takes a zone below its low watermark wakes it, and
+ * each step frees a batch until the zone is above high. Only when that
+ * falls behind far enough for the zone to reach min does an allocation
+ * reclaim for itself, and such stalls are counted.
+ */
+
+#include "../include/swap.h"
+#include "../include/compaction.h"
+#include "../include/slab.h"
+#include "../include/mmap_lock.h"
+#include "../include/pgtable.h"
+#include "../include/maple_tree.h"
+#include "../include/rcupdate.h"
+#include "../include/hugetlb.h"
+#include "../include/sched.h"
+#include "../include/mm.h"
+#include "../include/types.h"
+#include "../include/list.h"
+
+/* External declarations */
+extern int printk(const char *fmt, ...);
+
+struct scan_control {
+    unsigned long nr_to_reclaim;
+    unsigned long nr_scanned;
+    unsigned long nr_reclaimed;
+};
+
+enum reclaim_result {
+    PAGE_KEEP,              /* Not now: back to the head of the list */
+    PAGE_ACTIVATE,          /* In use, or cannot be stored */
+    PAGE_CULL,              /* May not be reclaimed at all */
+    PAGE_RECLAIMED,         /* Swapped out and freed */
+};
+
+/* Statistics */
+static unsigned long reclaim_runs = 0;
+static unsigned long pgscan = 0;
+static unsigned long pgsteal = 0;
+static unsigned long pgactivate = 0;
+static unsigned long pgdeactivate = 0;
+static unsigned long pgcull = 0;
+static u64 reclaim_cycles = 0;
+static unsigned long allocstall = 0;
+static unsigned long pgsteal_direct = 0;
+static u64 stall_cycles = 0;
+static unsigned long kswapd_wake = 0;
+static unsigned long kswapd_steps = 0;
+static unsigned long pgsteal_kswapd = 0;
+static unsigned long kswapd_slab = 0;
+
+/* The zone kswapd is balancing, or NULL while it sleeps */
+static struct zone *kswapd_zone;
+static int kswapd_priority;
+static bool kswapd_slab_shrunk;
+
+/* Reclaim allocates for the store, which must not reclaim in turn */
+static bool in_reclaim;
+
+static inline struct lruvec *node_lruvec(void)
+{
+    return &NODE_DATA(0)->lruvec;
+}
+
+static inline enum lru_list page_lru(struct page *page)
+{
+    if (PageUnevictable(page))
+        return LRU_UNEVICTABLE;
+    return PageActive(page) ? LRU_ACTIVE_ANON : LRU_INACTIVE_ANON;
+}
+
+static void add_page_to_lru_list(struct lruvec *lruvec, struct page *page)
+{
+    enum lru_list lru = page_lru(page);
+
+    pfn_list_add(&lruvec->lists[lru], page);
+    lruvec->nr_pages[lru]++;
+    SetPageLRU(page);
+}
+
+static void del_page_from_lru_list(struct lruvec *lruvec, struct page *page)
+{
+    enum lru_list lru = page_lru(page);
+
+    pfn_list_del(&lruvec->lists[lru], page);
+    lruvec->nr_pages[lru]--;
+    ClearPageLRU(page);
+}
+
+void lru_cache_add(struct page *page, struct vm_area_struct *vma)
+{
+    struct lruvec *lruvec = node_lruvec();
+
+    spin_lock(&lruvec->lock);
+    if (vma->vm_flags & (VM_LOCKED | VM_SHARED))
+        SetPageUnevictable(page);
+    add_page_to_lru_list(lruvec, page);
+    spin_unlock(&lruvec->lock);
+}
+
+void lru_cache_del(struct page *page)
+{
+    struct lruvec *lruvec = node_lruvec();
+
+    if (!PageLRU(page))
+        return;
+
+    spin_lock(&lruvec->lock);
+    del_page_from_lru_list(lruvec, page);
+    ClearPageActive(page);
+    ClearPageUnevictable(page);
+    spin_unlock(&lruvec->lock);
+}
+
+void munlock_vma_pages_range(struct vm_area_struct *vma, unsigned long start,
+                             unsigned long end)
+{
+    struct lruvec *lruvec = node_lruvec();
+    unsigned long addr, next, a;
+    struct page *page;
+    pmd_t *pmd;
+    pte_t *pte;
+
+    if (vma->vm_flags & VM_SHARED)
+        return;
+
+    for (addr = start; addr < end; addr = next) {
+        next = MIN((addr & PMD_MASK) + PMD_SIZE, end);
+
+        pmd = walk_pmd(vma->vm_mm, addr, false);
+        if (pmd == NULL || !entry_present(*pmd) || pmd_huge(*pmd))
+            continue;
+
+        pte = entry_table(*pmd);
+        spin_lock(&lruvec->lock);
+        for (a = addr; a < next; a += PAGE_SIZE) {
+            if (!entry_mapped(pte[pte_index(a)]) ||
+                is_zero_entry(pte[pte_index(a)]))
+                continue;
+            page = entry_page(pte[pte_index(a)]);
+            if (!PageLRU(page) || !PageUnevictable(page))
+                continue;
+            del_page_from_lru_list(lruvec, page);
+            ClearPageUnevictable(page);
+            add_page_to_lru_list(lruvec, page);
+        }
+        spin_unlock(&lruvec->lock);
+    }
+}
+
+/* Take up to nr pages from the tail of a list onto dst */
+static unsigned long isolate_lru_pages(struct lruvec *lruvec,
+                                       enum lru_list lru, unsigned long nr,
+                                       struct pfn_list *dst)
+{
+    struct pfn_list *src = &lruvec->lists[lru];
+    struct page *page;
+    unsigned long n;
+
+    for (n = 0; n < nr && !pfn_list_empty(src); n++) {
+        page = pfn_list_last(src);
+        del_page_from_lru_list(lruvec, page);
+        pfn_list_add_tail(dst, page);
+    }
+    return n;
+}
+
+/*
+ * The VMA covering addr in mm, read-locked, or NULL if a writer has it.
+ * mm cannot go away: it still maps the page being looked at.
+ */
+static struct vm_area_struct *lock_owner_vma(struct mm_struct *mm,
+                                             unsigned long addr)
+{
+    struct vm_area_struct *vma;
+
+    rcu_read_lock();
+
+    vma = mtree_load(&mm->mm_mt, addr);
+    if (vma != NULL && !vma_start_read(vma))
+        vma = NULL;
+
+    if (vma != NULL &&
+        (vma->detached || addr < vma->vm_start || addr >= vma->vm_end)) {
+        vma_end_read(vma);
+        vma = NULL;
+    }
+
+    rcu_read_unlock();
+    return vma;
+}
+
+static enum reclaim_result reclaim_page(struct page *page)
+{
+    struct mm_struct *mm = page_owner(page);
+    unsigned long addr = page_owner_address(page);
+    enum reclaim_result ret = PAGE_KEEP;
+    struct vm_area_struct *vma;
+    swp_entry_t swp;
+    pte_t *pte;
+
+    /* Shared since fork: there is no one entry to replace */
+    if (mm == NULL || page_mapcount(page) != 1 || page_count(page) != 1)
+        return PAGE_ACTIVATE;
+
+    vma = lock_owner_vma(mm, addr);
+    if (vma == NULL)
+        return PAGE_KEEP;
+
+    if (vma->vm_flags & (VM_LOCKED | VM_SHARED)) {
+        ret = PAGE_CULL;
+        goto out;
+    }
+
+    pte = walk_pte(mm, addr, false);
+    if (pte == NULL || !entry_mapped(*pte) || entry_page(*pte) != page)
+        goto out;
+
+    /*
+     * Used since it was last looked at. The bit is cleared without a
+     * flush: a stale TLB entry only hides the next use for a while.
+     */
+    if (*pte & _PAGE_ACCESSED) {
+        *pte &= ~_PAGE_ACCESSED;
+        ret = PAGE_ACTIVATE;
+        goto out;
+    }
+
+    switch (zswap_store(page, &swp)) {
+    case 0:
+        break;
+    case -E2BIG:
+        ret = PAGE_ACTIVATE;
+        goto out;
+    default:
+        goto out;
+    }
+
+    *pte = swp_entry_to_pte(swp);
+    flush_tlb_mm_range(mm, addr, addr + PAGE_SIZE);
+
+    atomic_set(&page->_mapcount, -1);
+    page->mapping = NULL;
+    free_page(page);
+    ret = PAGE_RECLAIMED;
+
+out:
+    vma_end_read(vma);
+    return ret;
+}
+
+/*
+ * Compaction moves an anonymous page mapped once the way reclaim swaps
+ * it out: through the entry its owner maps it with.
+ */
+static bool anon_isolate_page(struct page *page)
+{
+    struct lruvec *lruvec = node_lruvec();
+    bool isolated = false;
+
+    if (page_owner(page) == NULL || page_mapcount(page) != 1)
+        return false;
+
+    spin_lock(&lruvec->lock);
+    if (PageLRU(page)) {
+        del_page_from_lru_list(lruvec, page);
+        isolated = true;
+    }
+    spin_unlock(&lruvec->lock);
+    return isolated;
+}
+
+static int anon_migrate_page(struct page *dst, struct page *src)
+{
+    struct mm_struct *mm = page_owner(src);
+    unsigned long addr = page_owner_address(src);
+    struct lruvec *lruvec = node_lruvec();
+    struct vm_area_struct *vma;
+    int ret = -EAGAIN;
+    pte_t *pte;
+
+    vma = lock_owner_vma(mm, addr);
+    if (vma == NULL)
+        return -EAGAIN;
+
+    pte = walk_pte(mm, addr, false);
+    if (pte == NULL || !entry_mapped(*pte) || entry_page(*pte) != src)
+        goto out;
+
+    copy_page(page_to_virt(dst), page_to_virt(src));
+    *pte = (*pte & ~PTE_PFN_MASK) | page_to_phys(dst);
+    flush_tlb_mm_range(mm, addr, addr + PAGE_SIZE);
+
+    atomic_set(&dst->_mapcount, 0);
+    page_set_owner(dst, mm, addr);
+    if (PageActive(src))
+        SetPageActive(dst);
+    if (PageUnevictable(src))
+        SetPageUnevictable(dst);
+
+    spin_lock(&lruvec->lock);
+    add_page_to_lru_list(lruvec, dst);
+    spin_unlock(&lruvec->lock);
+
+    atomic_set(&src->_mapcount, -1);
+    src->mapping = NULL;
+    ClearPageActive(src);
+    ClearPageUnevictable(src);
+    ret = 0;
+
+out:
+    vma_end_read(vma);
+    return ret;
+}
+
+static void anon_putback_page(struct page *page)
+{
+    struct lruvec *lruvec = node_lruvec();
+
+    spin_lock(&lruvec->lock);
+    add_page_to_lru_list(lruvec, page);
+    spin_unlock(&lruvec->lock);
+}
+
+const struct movable_operations anon_movable_ops = {
+    .isolate_page = anon_isolate_page,
+    .migrate_page = anon_migrate_page,
+    .putback_page = anon_putback_page,
+};
+
+static void shrink_inactive_list(struct lruvec *lruvec, unsigned long nr,
+                                 struct scan_control *sc)
+{
+    struct pfn_list page_list;
+    struct page *page;
+
+    init_pfn_list(&page_list);
+    spin_lock(&lruvec->lock);
+    isolate_lru_pages(lruvec, LRU_INACTIVE_ANON, nr, &page_list);
+    spin_unlock(&lruvec->lock);
+
+    while (!pfn_list_empty(&page_list)) {
+        page = pfn_list_first(&page_list);
+        pfn_list_del(&page_list, page);
+        sc->nr_scanned++;
+
+        switch (reclaim_page(page)) {
+        case PAGE_RECLAIMED:
+            sc->nr_reclaimed++;
+            continue;
+        case PAGE_ACTIVATE:
+            SetPageActive(page);
+            pgactivate++;
+            break;
+        case PAGE_CULL:
+            SetPageUnevictable(page);
+            pgcull++;
+            break;
+        case PAGE_KEEP:
+            break;
+        }
+
+        spin_lock(&lruvec->lock);
+        add_page_to_lru_list(lruvec, page);
+        spin_unlock(&lruvec->lock);
+    }
+}
+
+/*
+ * Active pages had their accessed bit cleared on the way in, so they
+ * are deactivated unseen: the inactive list finds the ones used since.
+ */
+static void shrink_active_list(struct lruvec *lruvec, unsigned long nr)
+{
+    struct pfn_list page_list;
+    struct page *page;
+
+    init_pfn_list(&page_list);
+    spin_lock(&lruvec->lock);
+    isolate_lru_pages(lruvec, LRU_ACTIVE_ANON, nr, &page_list);
+    while (!pfn_list_empty(&page_list)) {
+        page = pfn_list_first(&page_list);
+        pfn_list_del(&page_list, page);
+        ClearPageActive(page);
+        add_page_to_lru_list(lruvec, page);
+        pgdeactivate++;
+    }
+    spin_unlock(&lruvec->lock);
+}
+
+static bool inactive_is_low(struct lruvec *lruvec)
+{
+    return lruvec->nr_pages[LRU_INACTIVE_ANON] <
+           lruvec->nr_pages[LRU_ACTIVE_ANON];
+}
+
+/* Scan the evictable lists' size >> priority pages */
+static void shrink_lruvec(struct lruvec *lruvec, struct scan_control *sc,
+                          int priority)
+{
+    unsigned long nr_to_scan, nr;
+
+    nr_to_scan = (lruvec->nr_pages[LRU_INACTIVE_ANON] +
+                  lruvec->nr_pages[LRU_ACTIVE_ANON]) >> priority;
+
+    while (nr_to_scan && sc->nr_reclaimed < sc->nr_to_reclaim) {
+        nr = MIN(nr_to_scan, SWAP_CLUSTER_MAX);
+        nr_to_scan -= nr;
+
+        if (inactive_is_low(lruvec))
+            shrink_active_list(lruvec, nr);
+        shrink_inactive_list(lruvec, nr, sc);
+    }
+}
+
+static unsigned long do_try_to_free_pages(unsigned long nr_pages)
+{
+    struct scan_control sc = { .nr_to_reclaim = nr_pages };
+    struct lruvec *lruvec = node_lruvec();
+    int priority;
+    u64 start;
+
+    if (in_reclaim)
+        return 0;
+    in_reclaim = true;
+    start = rdtsc();
+
+    for (priority = DEF_PRIORITY; priority >= 0; priority--) {
+        shrink_lruvec(lruvec, &sc, priority);
+        if (sc.nr_reclaimed >= nr_pages)
+            break;
+    }
+
+    reclaim_runs++;
+    pgscan += sc.nr_scanned;
+    pgsteal += sc.nr_reclaimed;
+    reclaim_cycles += rdtsc() - start;
+    in_reclaim = false;
+
+    return sc.nr_reclaimed;
+}
+
+unsigned long try_to_free_pages(unsigned long nr_pages)
+{
+    unsigned long freed;
+    u64 start = rdtsc();
+
+    freed = do_try_to_free_pages(nr_pages);
+
+    allocstall++;
+    pgsteal_direct += freed;
+    stall_cycles += rdtsc() - start;
+
+    return freed;
+}
+
+unsigned long shrink_all_memory(unsigned long nr_pages)
+{
+    return do_try_to_free_pages(nr_pages);
+}
+
+void wakeup_kswapd(struct zone *zone)
+{
+    if (zone->managed_pages == 0)
+        return;
+
+    if (kswapd_zone == NULL) {
+        kswapd_wake++;
+        kswapd_priority = DEF_PRIORITY;
+        kswapd_slab_shrunk = false;
+    } else if (kswapd_zone->zone_type >= zone->zone_type) {
+        return;
+    }
+    kswapd_zone = zone;
+}
+
+/*
+ * One step of background reclaim: empty slabs once per wakeup, then a
+ * batch from the LRU lists at a time. A step that falls short of a
+ * batch looks further down the lists next time; one that finds nothing
+ * even looking at all of them puts kswapd back to sleep.
+ */
+int kswapd_idle_work(void)
+{
+    struct scan_control sc = { .nr_to_reclaim = SWAP_CLUSTER_MAX };
+    struct zone *zone = kswapd_zone;
+    u64 start;
+
+    if (zone == NULL || in_reclaim)
+        return 0;
+
+    /* What reclaim freed may still be on the per-CPU lists */
+    drain_all_pages();
+    if (zone_watermark_ok(zone, 0, WMARK_HIGH, 0)) {
+        kswapd_zone = NULL;
+        return 0;
+    }
+
+    kswapd_steps++;
+
+    if (!kswapd_slab_shrunk) {
+        kswapd_slab_shrunk = true;
+        kswapd_slab += kmem_cache_shrink_all();
+        return 1;
+    }
+
+    in_reclaim = true;
+    start = rdtsc();
+    shrink_lruvec(node_lruvec(), &sc, kswapd_priority);
+    pgscan += sc.nr_scanned;
+    pgsteal += sc.nr_reclaimed;
+    pgsteal_kswapd += sc.nr_reclaimed;
+    reclaim_cycles += rdtsc() - start;
+    in_reclaim = false;
+
+    if (sc.nr_reclaimed < SWAP_CLUSTER_MAX) {
+        if (kswapd_priority == 0) {
+            if (sc.nr_reclaimed == 0)
+                kswapd_zone = NULL;
+        } else {
+            kswapd_priority--;
+        }
+    }
+
+    return 1;
+}
+
+void reclaim_get_stats(struct reclaim_stats *stats)
+{
+    stats->runs = reclaim_runs;
+    stats->scanned = pgscan;
+    stats->reclaimed = pgsteal;
+    stats->activated = pgactivate;
+    stats->deactivated = pgdeactivate;
+    stats->culled = pgcull;
+    stats->cycles = reclaim_cycles;
+    stats->allocstall = allocstall;
+    stats->direct_reclaimed = pgsteal_direct;
+    stats->stall_cycles = stall_cycles;
+    stats->kswapd_wake = kswapd_wake;
+    stats->kswapd_steps = kswapd_steps;
+    stats->kswapd_reclaimed = pgsteal_kswapd;
+    stats->kswapd_slab = kswapd_slab;
+}
+
+void swap_init(void)
+{
+    struct lruvec *lruvec = node_lruvec();
+    int i;
+
+    spin_lock_init(&lruvec->lock);
+    for (i = 0; i < NR_LRU_LISTS; i++)
+        init_pfn_list(&lruvec->lists[i]);
+
+    zswap_init();
+}
+
+void show_swap_stats(void)
+{
+    struct lruvec *lruvec = node_lruvec();
+    struct zswap_stats zs;
+    unsigned long faults;
+    u64 cycles;
+
+    zswap_get_stats(&zs);
+    swapin_stats(&faults, &cycles);
+
+    printk("LRU: %lu inactive, %lu active, %lu unevictable pages\n",
+           lruvec->nr_pages[LRU_INACTIVE_ANON],
+           lruvec->nr_pages[LRU_ACTIVE_ANON],
+           lruvec->nr_pages[LRU_UNEVICTABLE]);
+    printk("Reclaim: %lu runs, %lu scanned, %lu swapped out in %lu us\n",
+           reclaim_runs, pgscan, pgsteal,
+           (unsigned long)tsc_to_us(reclaim_cycles));
+    printk("  %lu activated, %lu deactivated, %lu unevictable\n",
+           pgactivate, pgdeactivate, pgcull);
+    printk("  kswapd: %lu wakeups, %lu steps, %lu pages swapped out, "
+           "%lu slab pages\n",
+           kswapd_wake, kswapd_steps, pgsteal_kswapd, kswapd_slab);
+    printk("  Direct: %lu stalls, %lu pages swapped out in %lu us\n",
+           allocstall, pgsteal_direct,
+           (unsigned long)tsc_to_us(stall_cycles));
+    printk("zswap: %lu pages in %lu KB compressed, %lu KB of pool\n",
+           zs.stored_pages, zs.compressed_bytes >> 10,
+           zs.pool_pages << (PAGE_SHIFT - 10));
+    printk("  %lu stores, %lu loads, %lu incompressible, %lu no memory\n",
+           zs.stores, zs.loads, zs.rejects, zs.alloc_fails);
+    if (faults)
+        printk("  %lu swap-in faults, %lu cycles each\n",
+               faults, (unsigned long)(cycles / faults));
+}
+
+/*
+ * Swap benchmark
+ *
+ * Fill anonymous memory with a mix of contents through the direct map,
+ * swap it all out, and read it back through faults: how fast pages go,
+ * how small they get and what bringing one back costs. One page in
+ * eight is random, which does not compress and stays.
+ */
+enum {
+    FILL_ZERO,
+    FILL_TEXT,
+    FILL_RECORDS,
+    FILL_RANDOM,
+};
+
+static int fill_kind(unsigned long i)
+{
+    switch (i % 8) {
+    case 0:
+    case 1:
+        return FILL_ZERO;
+    case 2:
+    case 3:
+    case 4:
+        return FILL_TEXT;
+    case 5:
+    case 6:
+        return FILL_RECORDS;
+    default:
+        return FILL_RANDOM;
+    }
+}
+
+/* Contents of page i, which starts with i */
+static void fill_page(void *buf, unsigned long i)
+{
+    static const char text[] = "the quick brown fox jumps over the lazy dog ";
+    u64 *w = buf, x;
+    u8 *b = buf;
+    unsigned long k;
+
+    switch (fill_kind(i)) {
+    case FILL_ZERO:
+        memset(buf, 0, PAGE_SIZE);
+        break;
+    case FILL_TEXT:
+        for (k = 0; k < PAGE_SIZE; k++)
+            b[k] = text[(k + i) % (sizeof(text) - 1)];
+        break;
+    case FILL_RECORDS:
+        /* 32-byte records: an id, flags, a pointer and a counter */
+        for (k = 0; k < PAGE_SIZE / 8; k += 4) {
+            w[k] = i * 128 + k / 4;
+            w[k + 1] = (k / 4) % 3;
+            w[k + 2] = KERNEL_VIRTUAL_BASE + 0x100000 + (k / 4) * 64;
+            w[k + 3] = 0;
+        }
+        break;
+    default:
+        x = i * 0x9E3779B97F4A7C15UL + 1;
+        for (k = 0; k < PAGE_SIZE / 8; k++) {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            w[k] = x;
+        }
+        break;
+    }
+    w[0] = i;
+}
+
+/* Ratio of a to b in hundredths, as "x.yy" */
+static void print_ratio(const char *what, unsigned long a, unsigned long b)
+{
+    unsigned long r = b ? a * 100 / b : 0;
+
+    printk("%s%lu.%lu%lu\n", what, r / 100, (r / 10) % 10, r % 10);
+}
+
+void bench_swap(unsigned long mb)
+{
+    int saved_thp = transparent_hugepage;
+    unsigned long nr, i, stored, bytes, pool, faults, loads, ns;
+    unsigned long missing = 0, bad = 0, maj_flt;
+    struct zswap_stats before, after;
+    unsigned long faults0, faults1;
+    u64 cycles0, cycles1, start, evict, fault;
+    struct mm_struct *mm;
+    void *buf;
+    pte_t *pte;
+    long addr;
+
+    if (current == NULL || current->mm == NULL) {
+        printk("bench swap: no address space\n");
+        return;
+    }
+    mm = current->mm;
+
+    /* The pages and the store must fit at once */
+    nr = (mb << 20) >> PAGE_SHIFT;
+    if (nr > nr_free_pages() / 2) {
+        nr = nr_free_pages() / 2;
+        printk("bench swap: only %lu MB free, using %lu MB\n",
+               (nr_free_pages() << PAGE_SHIFT) >> 20,
+               (nr << PAGE_SHIFT) >> 20);
+    }
+
+    buf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+    if (buf == NULL)
+        return;
+
+    transparent_hugepage = THP_NEVER;
+    addr = vm_mmap(mm, 0, nr << PAGE_SHIFT, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE);
+    transparent_hugepage = saved_thp;
+    if (addr < 0) {
+        printk("bench swap: mmap failed (%ld)\n", addr);
+        kfree(buf);
+        return;
+    }
+
+    for (i = 0; i < nr; i++) {
+        pte = walk_pte(mm, addr + (i << PAGE_SHIFT), false);
+        if (pte == NULL || !entry_present(*pte)) {
+            missing++;
+            continue;
+        }
+        fill_page(page_to_virt(entry_page(*pte)), i);
+    }
+
+    zswap_get_stats(&before);
+    start = rdtsc();
+    shrink_all_memory(nr);
+    evict = rdtsc() - start;
+    zswap_get_stats(&after);
+
+    stored = after.stores - before.stores;
+    bytes = after.compressed_bytes - before.compressed_bytes;
+    pool = after.pool_pages > before.pool_pages ?
+           after.pool_pages - before.pool_pages : 0;
+
+    swapin_stats(&faults0, &cycles0);
+    maj_flt = current->maj_flt;
+    start = rdtsc();
+    touch_user_range(current, addr, nr << PAGE_SHIFT, false);
+    fault = rdtsc() - start;
+    swapin_stats(&faults1, &cycles1);
+    maj_flt = current->maj_flt - maj_flt;
+    faults = faults1 - faults0;
+
+    for (i = 0; i < nr; i++) {
+        pte = walk_pte(mm, addr + (i << PAGE_SHIFT), false);
+        if (pte == NULL || !entry_present(*pte)) {
+            missing++;
+            continue;
+        }
+        fill_page(buf, i);
+        if (memcmp(page_to_virt(entry_page(*pte)), buf, PAGE_SIZE) != 0)
+            bad++;
+    }
+
+    vm_munmap(mm, addr, nr << PAGE_SHIFT);
+    kfree(buf);
+
+    printk("Swapped out %lu of %lu pages (%lu MB) in %lu us\n",
+           stored, nr, (nr << PAGE_SHIFT) >> 20,
+           (unsigned long)tsc_to_us(evict));
+    printk("  %lu left: %lu incompressible, %lu with no memory for them\n",
+           nr - MIN(nr, stored), after.rejects - before.rejects,
+           after.alloc_fails - before.alloc_fails);
+    if (tsc_to_us(evict))
+        printk("  Eviction: %lu pages/s, %lu MB/s\n",
+               (unsigned long)(stored * 1000000 / tsc_to_us(evict)),
+               (unsigned long)((stored << PAGE_SHIFT) / tsc_to_us(evict)));
+    print_ratio("  Compression ratio: ", stored << PAGE_SHIFT, bytes);
+    print_ratio("  Memory saved, pages per pool page: ", stored, pool);
+
+    loads = after.loads;
+    zswap_get_stats(&after);
+    loads = after.loads - loads;
+    printk("Faulted back %lu pages in %lu us, %lu major faults\n",
+           faults, (unsigned long)tsc_to_us(fault), maj_flt);
+    if (faults) {
+        ns = tsc_to_us((cycles1 - cycles0) * 1000) / faults;
+        printk("  Fault latency: %lu cycles, %lu ns\n",
+               (unsigned long)((cycles1 - cycles0) / faults), ns);
+    }
+    if (loads)
+        printk("  Decompression: %lu cycles per page\n",
+               (unsigned long)((after.load_cycles - before.load_cycles) /
+                               loads));
+    printk("  Contents: %lu pages wrong, %lu missing\n", bad, missing);
+}
+
+/*
+ * Reclaim benchmark
+ *
+ * Fault in more anonymous memory than is free, in bursts the size of
+ * the gap kswapd keeps between low and high, twice: once with kswapd
+ * never getting to run, so that every shortage is met by direct
+ * reclaim, and once with it running to completion between bursts, as
+ * it would while the allocating task waits on something else. Counts
+ * how many page allocations stalled and how long the worst burst took.
+ */
+struct reclaim_run {
+    unsigned long allocs;
+    unsigned long stalls;
+    unsigned long direct;
+    unsigned long kswapd;
+    u64 cycles;
+    u64 worst;
+};
+
+static unsigned long nr_page_allocs(void)
+{
+    unsigned long n = 0;
+    int i;
+
+    for (i = 0; i < MAX_NR_ZONES; i++)
+        n += NODE_DATA(0)->zones[i].nr_alloc;
+    return n;
+}
+
+static int reclaim_run(struct mm_struct *mm, unsigned long nr,
+                       unsigned long burst, bool background,
+                       struct reclaim_run *run)
+{
+    struct reclaim_stats before, after;
+    unsigned long i, n, allocs;
+    u64 cycles;
+    long addr;
+
+    addr = vm_mmap(mm, 0, nr << PAGE_SHIFT, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS);
+    if (addr < 0) {
+        printk("bench reclaim: mmap failed (%ld)\n", addr);
+        return -ENOMEM;
+    }
+
+    /* Start from a sleeping kswapd */
+    while (kswapd_idle_work())
+        ;
+
+    reclaim_get_stats(&before);
+    allocs = nr_page_allocs();
+    run->cycles = 0;
+    run->worst = 0;
+
+    for (i = 0; i < nr; i += n) {
+        n = MIN(burst, nr - i);
+        cycles = touch_user_range(current, addr + (i << PAGE_SHIFT),
+                                  n << PAGE_SHIFT, true);
+        run->cycles += cycles;
+        run->worst = MAX(run->worst, cycles);
+
+        while (background && kswapd_idle_work())
+            ;
+    }
+
+    reclaim_get_stats(&after);
+    run->allocs = nr_page_allocs() - allocs;
+    run->stalls = after.allocstall - before.allocstall;
+    run->direct = after.direct_reclaimed - before.direct_reclaimed;
+    run->kswapd = after.kswapd_reclaimed - before.kswapd_reclaimed;
+
+    vm_munmap(mm, addr, nr << PAGE_SHIFT);
+    return 0;
+}
+
+static void print_reclaim_run(const char *what, struct reclaim_run *run)
+{
+    unsigned long r = run->allocs ? run->stalls * 10000 / run->allocs : 0;
+
+    printk("%s%lu us, worst burst %lu us\n", what,
+           (unsigned long)tsc_to_us(run->cycles),
+           (unsigned long)tsc_to_us(run->worst));
+    printk("    %lu stalls in %lu page allocations, %lu.%lu%lu%%\n",
+           run->stalls, run->allocs, r / 100, (r / 10) % 10, r % 10);
+    printk("    Swapped out: %lu pages by kswapd, %lu direct\n",
+           run->kswapd, run->direct);
+}
+
+void bench_reclaim(unsigned long mb)
+{
+    int saved_thp = transparent_hugepage;
+    struct zone *zone = &NODE_DATA(0)->zones[ZONE_NORMAL];
+    struct reclaim_run direct, background;
+    unsigned long nr, burst;
+
+    if (current == NULL || current->mm == NULL) {
+        printk("bench reclaim: no address space\n");
+        return;
+    }
+
+    /* A quarter more than is free, unless told otherwise */
+    nr = mb ? (mb << 20) >> PAGE_SHIFT : nr_free_pages() / 4 * 5;
+    burst = MAX(high_wmark_pages(zone) - low_wmark_pages(zone), 16UL);
+
+    printk("Faulting in %lu MB with %lu MB free, %lu-page bursts\n",
+           (nr << PAGE_SHIFT) >> 20, (nr_free_pages() << PAGE_SHIFT) >> 20,
+           burst);
+    printk("  Normal watermarks: min %lu, low %lu, high %lu pages\n",
+           min_wmark_pages(zone), low_wmark_pages(zone),
+           high_wmark_pages(zone));
+
+    transparent_hugepage = THP_NEVER;
+    if (reclaim_run(current->mm, nr, burst, false, &direct) == 0 &&
+        reclaim_run(current->mm, nr, burst, true, &background) == 0) {
+        print_reclaim_run("  Direct reclaim only: ", &direct);
+        print_reclaim_run("  With kswapd:         ", &background);
+    }
+    transparent_hugepage = saved_thp;
+}
@@ -0,0 +1,213 @@
+/*
+ * MicroKernel Compressed Swap
+ *
+ * Swapped-out pages are compressed with LZ4 and kept in memory. Each
+ * goes into the smallest of a range of slab size classes it fits, of
+ * 8KB / n bytes for n from 3 to 64, so that a class wastes little at
+ * the end of its slabs and no class needs more than four pages to a
+ * slab. A swap entry holds the physical address of the object.
+ *
+ * The store is filled by reclaim, when memory is short. Its
+ * allocations never reclaim in turn, and may take the zones below
+ * their min watermark: that reserve is there so reclaim can make a
+ * start.
+ */
+
+#include "../include/swap.h"
+#include "../include/lz4.h"
+#include "../include/slab.h"
+#include "../include/spinlock.h"
+#include "../include/mm.h"
+#include "../include/types.h"
+#include "../include/list.h"
+
+/* External declarations */
+extern int printk(const char *fmt, ...);
+
+#define ZSWAP_MIN_CLASS_DIV 3
+#define ZSWAP_MAX_CLASS_DIV 64
+#define ZSWAP_NR_CLASSES    (ZSWAP_MAX_CLASS_DIV - ZSWAP_MIN_CLASS_DIV + 1)
+
+/* Allocations made by reclaim must not reclaim themselves */
+#define GFP_ZSWAP           (GFP_KERNEL | GFP_NOWAIT | GFP_MEMALLOC)
+
+struct zswap_entry {
+    atomic_t refcount;              /* Swap entries pointing here */
+    u16 length;                     /* Compressed bytes in data */
+    u8 class;
+    u8 data[];
+};
+
+struct zswap_class {
+    unsigned int size;
+    struct kmem_cache *cache;
+    char name[16];
+};
+
+/* Smallest first */
+static struct zswap_class zswap_classes[ZSWAP_NR_CLASSES];
+
+static spinlock_t zswap_lock = SPIN_LOCK_INIT;
+static u8 zswap_buffer[ZSWAP_MAX_OBJECT];
+static u8 zswap_wrkmem[LZ4_MEM_COMPRESS];
+
+/* Statistics */
+static unsigned long zswap_stored_pages;
+static unsigned long zswap_compressed_bytes;
+static unsigned long zswap_stores;
+static unsigned long zswap_loads;
+static unsigned long zswap_rejects;
+static unsigned long zswap_alloc_fails;
+static u64 zswap_store_cycles;
+static u64 zswap_load_cycles;
+
+static struct zswap_entry *swp_to_zswap(swp_entry_t swp)
+{
+    return (struct zswap_entry *)__va(swp.val);
+}
+
+/* Smallest class holding size bytes */
+static int size_class(unsigned int size)
+{
+    int lo = 0, hi = ZSWAP_NR_CLASSES - 1, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (zswap_classes[mid].size < size)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+int zswap_store(struct page *page, swp_entry_t *swp)
+{
+    struct zswap_entry *entry;
+    u64 start = rdtsc();
+    int len, class;
+
+    spin_lock(&zswap_lock);
+
+    len = lz4_compress(page_to_virt(page), PAGE_SIZE, zswap_buffer,
+                       ZSWAP_MAX_OBJECT - sizeof(*entry), zswap_wrkmem);
+    if (len == 0) {
+        zswap_rejects++;
+        spin_unlock(&zswap_lock);
+        return -E2BIG;
+    }
+
+    class = size_class(sizeof(*entry) + len);
+    entry = kmem_cache_alloc(zswap_classes[class].cache, GFP_ZSWAP);
+    if (entry == NULL) {
+        zswap_alloc_fails++;
+        spin_unlock(&zswap_lock);
+        return -ENOMEM;
+    }
+
+    atomic_set(&entry->refcount, 1);
+    entry->length = len;
+    entry->class = class;
+    memcpy(entry->data, zswap_buffer, len);
+    swp->val = __pa(entry);
+
+    zswap_stored_pages++;
+    zswap_compressed_bytes += len;
+    zswap_stores++;
+    zswap_store_cycles += rdtsc() - start;
+
+    spin_unlock(&zswap_lock);
+    return 0;
+}
+
+int zswap_load(swp_entry_t swp, struct page *page)
+{
+    struct zswap_entry *entry = swp_to_zswap(swp);
+    u64 start = rdtsc();
+    int len;
+
+    len = lz4_decompress(entry->data, entry->length, page_to_virt(page),
+                         PAGE_SIZE);
+    if (len != PAGE_SIZE) {
+        printk("zswap: entry at 0x%lx is corrupt (%d)\n", swp.val, (long)len);
+        return -EIO;
+    }
+
+    spin_lock(&zswap_lock);
+    zswap_loads++;
+    zswap_load_cycles += rdtsc() - start;
+    spin_unlock(&zswap_lock);
+    return 0;
+}
+
+void swap_duplicate(swp_entry_t swp)
+{
+    atomic_inc(&swp_to_zswap(swp)->refcount);
+}
+
+void swap_free(swp_entry_t swp)
+{
+    struct zswap_entry *entry = swp_to_zswap(swp);
+
+    if (!atomic_dec_and_test(&entry->refcount))
+        return;
+
+    spin_lock(&zswap_lock);
+    zswap_stored_pages--;
+    zswap_compressed_bytes -= entry->length;
+    kmem_cache_free(zswap_classes[entry->class].cache, entry);
+    spin_unlock(&zswap_lock);
+}
+
+void zswap_get_stats(struct zswap_stats *stats)
+{
+    struct kmem_cache *cache;
+    int i;
+
+    spin_lock(&zswap_lock);
+    stats->stored_pages = zswap_stored_pages;
+    stats->compressed_bytes = zswap_compressed_bytes;
+    stats->pool_pages = 0;
+    for (i = 0; i < ZSWAP_NR_CLASSES; i++) {
+        cache = zswap_classes[i].cache;
+        stats->pool_pages += cache->nr_slabs << cache->order;
+    }
+    stats->stores = zswap_stores;
+    stats->loads = zswap_loads;
+    stats->rejects = zswap_rejects;
+    stats->alloc_fails = zswap_alloc_fails;
+    stats->store_cycles = zswap_store_cycles;
+    stats->load_cycles = zswap_load_cycles;
+    spin_unlock(&zswap_lock);
+}
+
+/* "zswap-<size>" */
+static void class_name(char *name, unsigned int size)
+{
+    char digits[10];
+    int n = 0;
+
+    memcpy(name, "zswap-", 6);
+    name += 6;
+    do {
+        digits[n++] = '0' + size % 10;
+        size /= 10;
+    } while (size);
+    while (n)
+        *name++ = digits[--n];
+    *name = '\0';
+}
+
+void zswap_init(void)
+{
+    struct zswap_class *zc;
+    unsigned int div;
+
+    for (div = ZSWAP_MAX_CLASS_DIV; div >= ZSWAP_MIN_CLASS_DIV; div--) {
+        zc = &zswap_classes[ZSWAP_MAX_CLASS_DIV - div];
+        zc->size = ALIGN_DOWN(2 * PAGE_SIZE / div, 8);
+        class_name(zc->name, zc->size);
+        zc->cache = kmem_cache_create(zc->name, zc->size, 8, SLAB_PANIC,
+                                      NULL);
+    }
+}
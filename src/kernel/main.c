@@ -7,9 +7,11 @@
 #include "../../kernel/include/types.h"
 #include "../../kernel/include/sched.h"
 #include "../../kernel/include/mm.h"
+#include "../../kernel/include/pgtable.h"
 #include "../../kernel/include/list.h"
 #include "../../kernel/include/spinlock.h"
 #include "../../kernel/include/shell.h"
+#include "../../kernel/include/multiboot.h"
 
 /* Kernel version information */
 #define KERNEL_VERSION "0.1.0"
@@ -76,6 +78,8 @@ long __attribute__((weak)) do_mmap(unsigned long addr, unsigned long len, unsign
     { (void)addr; (void)len; (void)prot; (void)flags; (void)fd; (void)off; return -ENOSYS; }
 long __attribute__((weak)) do_munmap(unsigned long addr, size_t len)
     { (void)addr; (void)len; return -ENOSYS; }
+long __attribute__((weak)) do_mprotect(unsigned long start, size_t len, unsigned long prot)
+    { (void)start; (void)len; (void)prot; return -ENOSYS; }
 
 /* NR_CPUS if not defined */
 #ifndef NR_CPUS
@@ -102,10 +106,17 @@ struct task_struct *current_task = NULL;
 #define __NR_kill       62
 #define __NR_uname      63
 #define __NR_sched_yield 24
+#define __NR_mremap     25
 #define __NR_brk        12
 #define __NR_mmap       9
+#define __NR_mprotect   10
 #define __NR_munmap     11
+#define __NR_madvise    28
 #define __NR_sysinfo    99
+#define __NR_mlock      149
+#define __NR_munlock    150
+#define __NR_mlockall   151
+#define __NR_munlockall 152
 
 #define NR_syscalls     256
 
@@ -415,6 +426,74 @@ static void update_jiffies_internal(void)
     jiffies_counter++;
 }
 
+/*
+ * TSC calibration against PIT channel 2
+ */
+#define PIT_TICK_RATE       1193182UL
+#define CALIBRATE_MS        10
+
+unsigned long tsc_khz = 0;
+
+static void tsc_calibrate(void)
+{
+    unsigned long latch = PIT_TICK_RATE * CALIBRATE_MS / 1000;
+    u64 start, now;
+
+    /* Gate channel 2 on, speaker off */
+    outb(0x61, (inb(0x61) & ~0x02) | 0x01);
+
+    /* Channel 2, lobyte/hibyte, mode 0: OUT goes high at terminal count */
+    outb(0x43, 0xB0);
+    outb(0x42, latch & 0xff);
+    outb(0x42, latch >> 8);
+
+    start = rdtsc();
+    do {
+        now = rdtsc();
+    } while ((inb(0x61) & 0x20) == 0 && now - start < (1UL << 36));
+
+    tsc_khz = (now - start) / CALIBRATE_MS;
+}
+
+/*
+ * Boot phase timing
+ */
+#define MAX_BOOT_PHASES     16
+
+struct boot_phase {
+    const char *name;
+    u64 tsc;                        /* TSC when the phase finished */
+};
+
+static struct boot_phase boot_phases[MAX_BOOT_PHASES];
+static int nr_boot_phases = 0;
+static u64 boot_tsc_start;
+
+static void boot_phase_done(const char *name)
+{
+    if (nr_boot_phases < MAX_BOOT_PHASES) {
+        boot_phases[nr_boot_phases].name = name;
+        boot_phases[nr_boot_phases].tsc = rdtsc();
+        nr_boot_phases++;
+    }
+}
+
+void show_boot_timings(void)
+{
+    u64 prev = boot_tsc_start;
+    int i;
+
+    printk("Boot timings (TSC %lu kHz):\n", tsc_khz);
+    for (i = 0; i < nr_boot_phases; i++) {
+        printk("  %s: %lu us\n", boot_phases[i].name,
+               (unsigned long)tsc_to_us(boot_phases[i].tsc - prev));
+        prev = boot_phases[i].tsc;
+    }
+    printk("  total: %lu us\n", (unsigned long)tsc_to_us(prev - boot_tsc_start));
+
+    show_deferred_init();
+}
+
 /*
  * CPU identification
  */
@@ -458,41 +537,11 @@ void local_bh_disable(void) { }
 void local_bh_enable(void) { }
 
 /*
- * Memory allocation stubs (simple version)
+ * Static storage for the init task and its address space. Everything
+ * forked later comes from the task_struct and mm_struct caches.
  */
-struct task_struct *alloc_task_struct(void)
-{
-    /* For now, return NULL - proper implementation needs working memory allocator */
-    static struct task_struct init_task_storage;
-    static int allocated = 0;
-    
-    if (!allocated) {
-        allocated = 1;
-        memset(&init_task_storage, 0, sizeof(init_task_storage));
-        return &init_task_storage;
-    }
-    
-    return NULL;
-}
-
-void free_task_struct(struct task_struct *tsk)
-{
-    (void)tsk;
-}
-
-struct mm_struct *mm_alloc(void)
-{
-    static struct mm_struct init_mm_storage;
-    static int allocated = 0;
-    
-    if (!allocated) {
-        allocated = 1;
-        memset(&init_mm_storage, 0, sizeof(init_mm_storage));
-        return &init_mm_storage;
-    }
-    
-    return NULL;
-}
+static struct task_struct init_task_storage;
+static struct mm_struct init_mm;
 
 /* set_current is defined as macro in sched.h, use directly */
 
@@ -504,16 +553,22 @@ static struct task_struct *create_init_process(void)
     struct task_struct *task;
     struct mm_struct *mm;
 
-    task = alloc_task_struct();
-    if (!task) {
-        panic("Cannot allocate init task");
-    }
-
-    mm = mm_alloc();
-    if (!mm) {
-        free_task_struct(task);
-        panic("Cannot allocate init mm");
-    }
+    task = &init_task_storage;
+    memset(task, 0, sizeof(*task));
+    INIT_LIST_HEAD(&task->children);
+    INIT_LIST_HEAD(&task->sibling);
+    INIT_LIST_HEAD(&task->tasks);
+    INIT_LIST_HEAD(&task->run_list);
+
+    mm = &init_mm;
+    memset(mm, 0, sizeof(*mm));
+    mt_init(&mm->mm_mt);
+    spin_lock_init(&mm->page_table_lock);
+    spin_lock_init(&mm->mmap_lock);
+    mm->mm_users = 1;
+    mm->mm_count = 1;
+    mm->task_size = USER_VIRTUAL_END;
+    mm->mmap_base = ALIGN_DOWN(USER_VIRTUAL_END / 3, PAGE_SIZE);
 
     /* Process IDs */
     task->pid = 1;
@@ -575,31 +630,39 @@ static void kernel_init(void)
     /* Initialize memory management */
     printk("  Initializing memory management...\n");
     mm_init();
-    buddy_init();
+    boot_phase_done("mm_init");
+    fork_init();
+    boot_phase_done("fork_init");
 
     /* Initialize scheduler */
     printk("  Initializing scheduler...\n");
     sched_init();
+    boot_phase_done("sched_init");
 
     /* Initialize IPC */
     printk("  Initializing IPC...\n");
     ipc_init();
+    boot_phase_done("ipc_init");
 
     /* Initialize VFS */
     printk("  Initializing VFS...\n");
     vfs_init();
+    boot_phase_done("vfs_init");
 
     /* Initialize networking */
     printk("  Initializing network...\n");
     net_init();
+    boot_phase_done("net_init");
 
     /* Initialize drivers */
     printk("  Initializing drivers...\n");
     driver_init();
+    boot_phase_done("driver_init");
 
     /* Create init process */
     printk("  Creating init process...\n");
     init_task = create_init_process();
+    boot_phase_done("init process");
 
     /* Set as current task */
     set_current(init_task);
@@ -614,12 +677,30 @@ static void kernel_init(void)
 
 /*
  * Kernel main entry point - called from assembly boot code
+ * with the boot loader magic and the boot information address
  */
-void kernel_main(void)
+void kernel_main(u32 magic, unsigned long info)
 {
+    boot_tsc_start = rdtsc();
+
+    /* Pick memcpy/memset for this CPU before anything uses them */
+    string_init();
+
+    /* Memory map and command line, before anything allocates */
+    multiboot_init(magic, info);
+    boot_phase_done("boot info");
+
+    /* Map all of RAM, so that everything after can use it */
+    init_mem_mapping();
+    boot_phase_done("direct map");
+
     /* Initialize the kernel */
     kernel_init();
 
+    /* Calibrate only now so that it does not count towards boot time */
+    tsc_calibrate();
+    show_boot_timings();
+
     /* Start the interactive shell */
     printk("Starting shell...\n");
     shell_run();
@@ -692,6 +773,42 @@ long sys_munmap(unsigned long addr, size_t len)
     return do_munmap(addr, len);
 }
 
+long sys_mprotect(unsigned long start, size_t len, unsigned long prot)
+{
+    return do_mprotect(start, len, prot);
+}
+
+long sys_mremap(unsigned long addr, size_t old_len, size_t new_len,
+               unsigned long flags, unsigned long new_addr)
+{
+    return do_mremap(addr, old_len, new_len, flags, new_addr);
+}
+
+long sys_madvise(unsigned long start, size_t len, int advice)
+{
+    return do_madvise(start, len, advice);
+}
+
+long sys_mlock(unsigned long start, size_t len)
+{
+    return do_mlock(start, len);
+}
+
+long sys_munlock(unsigned long start, size_t len)
+{
+    return do_munlock(start, len);
+}
+
+long sys_mlockall(int flags)
+{
+    return do_mlockall(flags);
+}
+
+long sys_munlockall(void)
+{
+    return do_munlockall();
+}
+
 long sys_sysinfo(struct sysinfo __user *info)
 {
     struct sysinfo val;
@@ -806,6 +923,20 @@ long do_syscall(unsigned long syscall_nr, unsigned long arg0,
         return sys_mmap(arg0, arg1, arg2, arg3, arg4, arg5);
     case __NR_munmap:
         return sys_munmap(arg0, (size_t)arg1);
+    case __NR_mprotect:
+        return sys_mprotect(arg0, (size_t)arg1, arg2);
+    case __NR_mremap:
+        return sys_mremap(arg0, (size_t)arg1, (size_t)arg2, arg3, arg4);
+    case __NR_madvise:
+        return sys_madvise(arg0, (size_t)arg1, (int)arg2);
+    case __NR_mlock:
+        return sys_mlock(arg0, (size_t)arg1);
+    case __NR_munlock:
+        return sys_munlock(arg0, (size_t)arg1);
+    case __NR_mlockall:
+        return sys_mlockall((int)arg0);
+    case __NR_munlockall:
+        return sys_munlockall();
     case __NR_sysinfo:
         return sys_sysinfo((struct sysinfo __user *)arg0);
     case __NR_uname:
@@ -880,9 +1011,7 @@ static void handle_page_fault(unsigned long error_code)
 
     __asm__ __volatile__("movq %%cr2, %0" : "=r"(address));
 
-    printk("Page fault at address 0x%lx, error code: 0x%lx\n",
-           address, error_code);
-
+    /* Demand paging: most faults are not errors */
     do_page_fault(address, error_code);
 }
 
@@ -891,5 +1020,5 @@ static void handle_page_fault(unsigned long error_code)
  */
 void start_kernel(void)
 {
-    kernel_main();
+    kernel_main(0, 0);
 }
\ No newline at end of file
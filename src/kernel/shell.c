@@ -6,6 +6,13 @@
 
 #include "../../kernel/include/types.h"
 #include "../../kernel/include/mm.h"
+#include "../../kernel/include/slab.h"
+#include "../../kernel/include/sched.h"
+#include "../../kernel/include/compaction.h"
+#include "../../kernel/include/hugetlb.h"
+#include "../../kernel/include/vmalloc.h"
+#include "../../kernel/include/rcupdate.h"
+#include "../../kernel/include/swap.h"
 
 /* ===========================================================================
  * Constants
@@ -55,6 +62,7 @@ extern int printk(const char *fmt, ...);
 extern void console_write(const char *buffer, size_t len);
 extern void serial_putc(char c);
 extern unsigned long nr_free_pages(void);
+extern void show_boot_timings(void);
 
 /* ===========================================================================
  * Port I/O
@@ -387,6 +395,17 @@ static void cmd_help(int argc, char *argv[])
     shell_puts("║  poke <addr> <val> - Write byte to address                   ║\r\n");
     shell_puts("║  reboot            - Reboot the system                       ║\r\n");
     shell_puts("║  shutdown          - Shutdown the system                     ║\r\n");
+    shell_puts("║  pcp [hi lo batch] - Per-CPU page cache stats/tune           ║\r\n");
+    shell_puts("║  slabinfo          - Show slab cache statistics              ║\r\n");
+    shell_puts("║  bench <name> [n]  - Run a kernel microbenchmark             ║\r\n");
+    shell_puts("║  buddyinfo         - Show buddy free blocks per order        ║\r\n");
+    shell_puts("║  boottime          - Show boot phase timings                 ║\r\n");
+    shell_puts("║  zeropool [pages]  - Show/size the pre-zeroed page pool      ║\r\n");
+    shell_puts("║  pagetypeinfo      - Show free blocks per migrate type       ║\r\n");
+    shell_puts("║  compact           - Compact memory, show counters           ║\r\n");
+    shell_puts("║  hugepages [n]     - Show/size the 2MB huge page pool        ║\r\n");
+    shell_puts("║  vmallocinfo       - Show vmalloc areas and free space       ║\r\n");
+    shell_puts("║  swapinfo [pages]  - Show LRU/swap stats, or swap out pages  ║\r\n");
     shell_puts("║  panic             - Trigger kernel panic (testing)          ║\r\n");
     shell_puts("╚══════════════════════════════════════════════════════════════╝\r\n");
 }
@@ -741,6 +760,187 @@ static void cmd_panic(int argc, char *argv[])
     }
 }
 
+static void cmd_pcp(int argc, char *argv[])
+{
+    if (argc == 4) {
+        if (pcp_set_watermarks(shell_atoi(argv[1]), shell_atoi(argv[2]),
+                               shell_atoi(argv[3])) < 0) {
+            shell_puts("\r\nError: need 0 <= low < high and 0 < batch <= high\r\n");
+            return;
+        }
+    } else if (argc != 1) {
+        shell_puts("\r\nUsage: pcp [high low batch]\r\n");
+        shell_puts("  Example: pcp 256 64 32\r\n");
+        return;
+    }
+    
+    shell_puts("\r\n");
+    show_pcp_stats();
+}
+
+static void cmd_slabinfo(int argc, char *argv[])
+{
+    (void)argc;
+    (void)argv;
+    
+    shell_puts("\r\n");
+    show_slabinfo();
+}
+
+static void cmd_bench(int argc, char *argv[])
+{
+    unsigned long n = 0;
+    
+    if (argc < 2) {
+        shell_puts("\r\nUsage: bench <name> [iterations]\r\n");
+        shell_puts("  fork    - task/stack/mm create and teardown\r\n");
+        shell_puts("  mem     - memcpy/memset throughput per size\r\n");
+        shell_puts("  frag    - order-9 allocations after mixed churn [pages]\r\n");
+        shell_puts("  compact - order-9 allocations before/after compaction [pages]\r\n");
+        shell_puts("  bulk    - looped vs bulk page alloc/free\r\n");
+        shell_puts("  huge    - random access over 4KB/huge mappings [MB]\r\n");
+        shell_puts("  vmalloc - vmalloc/vfree with lazy and eager TLB flush\r\n");
+        shell_puts("  fault   - demand paging faults against eager mmap [MB]\r\n");
+        shell_puts("  forkexec - COW fork+exec latency [MB]\r\n");
+        shell_puts("  vmacache - cached against tree VMA lookups [VMAs]\r\n");
+        shell_puts("  mremap  - buffer growth by mremap against copying [MB]\r\n");
+        shell_puts("  swap    - compressed swap out and fault back [MB]\r\n");
+        shell_puts("  reclaim - allocation stalls with and without kswapd [MB]\r\n");
+        shell_puts("  pagestruct - mem_map size, scan and buddy merges [pages]\r\n");
+        return;
+    }
+    
+    if (argc >= 3 && shell_atoi(argv[2]) > 0)
+        n = shell_atoi(argv[2]);
+    
+    shell_puts("\r\n");
+    
+    if (shell_strcmp(argv[1], "fork") == 0) {
+        bench_fork_exit(n ? n : 1000);
+    } else if (shell_strcmp(argv[1], "mem") == 0) {
+        bench_mem(n ? n : 100);
+    } else if (shell_strcmp(argv[1], "frag") == 0) {
+        bench_fragmentation(n);
+    } else if (shell_strcmp(argv[1], "compact") == 0) {
+        bench_compaction(n);
+    } else if (shell_strcmp(argv[1], "bulk") == 0) {
+        bench_page_bulk(n ? n : 1000);
+    } else if (shell_strcmp(argv[1], "huge") == 0) {
+        bench_hugepages(n ? n : 64);
+    } else if (shell_strcmp(argv[1], "vmalloc") == 0) {
+        bench_vmalloc(n ? n : 1000);
+    } else if (shell_strcmp(argv[1], "fault") == 0) {
+        bench_page_faults(n ? n : 64);
+    } else if (shell_strcmp(argv[1], "forkexec") == 0) {
+        bench_fork_exec(n ? n : 16);
+    } else if (shell_strcmp(argv[1], "vmacache") == 0) {
+        bench_vma_lookup(n ? n : 1000);
+    } else if (shell_strcmp(argv[1], "mremap") == 0) {
+        bench_mremap(n ? n : 1024);
+    } else if (shell_strcmp(argv[1], "swap") == 0) {
+        bench_swap(n ? n : 64);
+    } else if (shell_strcmp(argv[1], "reclaim") == 0) {
+        bench_reclaim(n);
+    } else if (shell_strcmp(argv[1], "pagestruct") == 0) {
+        bench_page_struct(n);
+    } else {
+        shell_puts("Unknown benchmark: ");
+        shell_puts(argv[1]);
+        shell_newline();
+    }
+}
+
+static void cmd_buddyinfo(int argc, char *argv[])
+{
+    (void)argc;
+    (void)argv;
+    shell_puts("\r\n");
+    show_buddyinfo();
+}
+
+static void cmd_boottime(int argc, char *argv[])
+{
+    (void)argc;
+    (void)argv;
+    shell_puts("\r\n");
+    show_boot_timings();
+}
+
+static void cmd_zeropool(int argc, char *argv[])
+{
+    if (argc == 2) {
+        if (zero_pool_set_target(shell_atoi(argv[1])) < 0) {
+            shell_puts("\r\nError: pool may use at most a quarter of memory\r\n");
+            return;
+        }
+    } else if (argc != 1) {
+        shell_puts("\r\nUsage: zeropool [pages]\r\n");
+        return;
+    }
+    
+    shell_puts("\r\n");
+    show_zero_pool();
+}
+
+static void cmd_pagetypeinfo(int argc, char *argv[])
+{
+    (void)argc;
+    (void)argv;
+    shell_puts("\r\n");
+    show_pagetypeinfo();
+}
+
+static void cmd_compact(int argc, char *argv[])
+{
+    unsigned long migrated;
+    
+    (void)argc;
+    (void)argv;
+    shell_puts("\r\n");
+    migrated = compact_node();
+    printk("Compacted memory: %lu pages migrated\n", migrated);
+    show_compaction_stats();
+}
+
+static void cmd_hugepages(int argc, char *argv[])
+{
+    if (argc == 2) {
+        set_max_huge_pages(shell_atoi(argv[1]));
+    } else if (argc != 1) {
+        shell_puts("\r\nUsage: hugepages [pages]\r\n");
+        return;
+    }
+    
+    shell_puts("\r\n");
+    show_hugepages();
+}
+
+static void cmd_vmallocinfo(int argc, char *argv[])
+{
+    (void)argc;
+    (void)argv;
+    shell_puts("\r\n");
+    show_vmallocinfo();
+}
+
+static void cmd_swapinfo(int argc, char *argv[])
+{
+    unsigned long freed;
+    
+    if (argc == 2) {
+        freed = shrink_all_memory(shell_atoi(argv[1]));
+        shell_puts("\r\n");
+        printk("Swapped out %lu pages\n", freed);
+    } else if (argc != 1) {
+        shell_puts("\r\nUsage: swapinfo [pages]\r\n");
+        return;
+    } else {
+        shell_puts("\r\n");
+    }
+    
+    show_swap_stats();
+}
+
 /* ===========================================================================
  * Command table
  * ===========================================================================*/
@@ -772,6 +972,17 @@ static struct shell_command shell_commands[] = {
     { "hexdump",  cmd_hexdump,  "Dump memory" },
     { "x",        cmd_hexdump,  "Dump memory" },
     { "poke",     cmd_poke,     "Write to memory" },
+    { "pcp",      cmd_pcp,      "Per-CPU page cache stats" },
+    { "slabinfo", cmd_slabinfo, "Show slab caches" },
+    { "bench",    cmd_bench,    "Run a microbenchmark" },
+    { "buddyinfo", cmd_buddyinfo, "Buddy free blocks per order" },
+    { "boottime", cmd_boottime, "Boot phase timings" },
+    { "zeropool", cmd_zeropool, "Pre-zeroed page pool" },
+    { "pagetypeinfo", cmd_pagetypeinfo, "Free blocks per migrate type" },
+    { "compact",  cmd_compact,  "Compact memory" },
+    { "hugepages", cmd_hugepages, "2MB huge page pool" },
+    { "vmallocinfo", cmd_vmallocinfo, "vmalloc areas" },
+    { "swapinfo", cmd_swapinfo, "LRU and compressed swap" },
     { "reboot",   cmd_reboot,   "Reboot system" },
     { "shutdown", cmd_shutdown, "Shutdown system" },
     { "halt",     cmd_shutdown, "Shutdown system" },
@@ -1008,9 +1219,14 @@ void shell_init(void)
         if (c >= 0) {
             shell_handle_char((char)c);
         } else {
-            /* No input, update tick counter and yield CPU */
+            /*
+             * No input: outside any RCU reader, so callbacks can run.
+             * Then background work, else yield the CPU.
+             */
             jiffies++;
-            __asm__ __volatile__("pause");
+            rcu_qs();
+            if (!mm_idle_work())
+                __asm__ __volatile__("pause");
         }
     }
 }